@@ -0,0 +1,5 @@
+#!/bin/sh
+
+# Build the crawler, run it with a job file (look at the top of wallhaven_crawl.c)
+
+gcc -O2 wallhaven_crawl.c wallhavenapi.c -o wallhaven-crawl -lcurl -lpthread
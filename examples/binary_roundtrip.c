@@ -0,0 +1,133 @@
+#include "wallhavenapi.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Encodes a search page to the binary encoding, reads it back and checks that nothing is lost.
+// Exits with 1 if any field differs.
+
+// Something like what wallhaven_search gives, with a few strings that need escaping
+static char *canned_search_page()
+{
+    size_t size = 0;
+    char *page = NULL;
+    FILE *f = open_memstream(&page, &size);
+    fprintf(f, "{\"data\":[");
+    for (int i = 0; i < 24; ++i)
+    {
+        char id[7];
+        snprintf(id, sizeof(id), "%06x", i * 7919);
+        fprintf(f,
+                "%s{\"id\":\"%s\",\"url\":\"https:\\/\\/wallhaven.cc\\/w\\/%s\",\"short_url\":\"https:\\/\\/whvn.cc\\/%s\","
+                "\"views\":%d,\"favorites\":%d,\"source\":\"%s\",\"purity\":\"sfw\",\"category\":\"general\","
+                "\"dimension_x\":1920,\"dimension_y\":1080,\"resolution\":\"1920x1080\",\"ratio\":\"1.78\","
+                "\"file_size\":%d,\"file_type\":\"image\\/jpeg\",\"created_at\":\"2024-05-18 10:00:00\","
+                "\"colors\":[\"#424153\",\"#66cccc\",\"#000000\"],"
+                "\"path\":\"https:\\/\\/w.wallhaven.cc\\/full\\/%.2s\\/wallhaven-%s.jpg\","
+                "\"thumbs\":{\"large\":\"https:\\/\\/th.wallhaven.cc\\/lg\\/%.2s\\/%s.jpg\","
+                "\"original\":\"https:\\/\\/th.wallhaven.cc\\/orig\\/%.2s\\/%s.jpg\","
+                "\"small\":\"https:\\/\\/th.wallhaven.cc\\/small\\/%.2s\\/%s.jpg\"}}",
+                i ? "," : "", id, id, id, i * 131, i * 7, i % 3 ? "" : "a \\\"quoted\\\" C:\\\\path \\u00e9", 1000000 + i, id, id,
+                id, id, id, id, id, id);
+    }
+    fprintf(f, "],\"meta\":{\"current_page\":1,\"last_page\":123,\"per_page\":\"24\",\"total\":2950,\"query\":null,\"seed\":null}}");
+    fclose(f);
+    return page;
+}
+
+static const char *string_fields[] = {"id",         "url",       "short_url",  "source",        "purity",          "category",
+                                      "resolution", "ratio",     "file_type",  "created_at",    "path",            "thumbs.large",
+                                      "thumbs.original", "thumbs.small", "colors[0]", "colors[2]"};
+static const char *number_fields[] = {"views", "favorites", "dimension_x", "dimension_y", "file_size"};
+
+// Compares every field of the wallpapers in the two JSON documents, returns the number of differences
+static int compare_pages(const Response *a, const Response *b)
+{
+    WallhavenJson ja, jb;
+    if (wallhaven_json_parse(&ja, a->value, a->size) != WALLHAVEN_OK)
+        return 1;
+    if (wallhaven_json_parse(&jb, b->value, b->size) != WALLHAVEN_OK)
+    {
+        wallhaven_json_free(&ja);
+        return 1;
+    }
+
+    int errors = 0;
+    size_t count = wallhaven_json_count(&ja, "data");
+    if (!count || count != wallhaven_json_count(&jb, "data"))
+    {
+        printf("Count differs: %zu and %zu\n", count, wallhaven_json_count(&jb, "data"));
+        ++errors;
+    }
+
+    char path[64], va[512], vb[512];
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (size_t f = 0; f < sizeof(string_fields) / sizeof(*string_fields); ++f)
+        {
+            snprintf(path, sizeof(path), "data[%zu].%s", i, string_fields[f]);
+            size_t na = wallhaven_json_string(&ja, path, va, sizeof(va)), nb = wallhaven_json_string(&jb, path, vb, sizeof(vb));
+            if (na != nb || strcmp(va, vb))
+            {
+                printf("%s differs: \"%s\" and \"%s\"\n", path, va, vb);
+                ++errors;
+            }
+        }
+        for (size_t f = 0; f < sizeof(number_fields) / sizeof(*number_fields); ++f)
+        {
+            long la, lb;
+            snprintf(path, sizeof(path), "data[%zu].%s", i, number_fields[f]);
+            if (!wallhaven_json_long(&ja, path, &la) || !wallhaven_json_long(&jb, path, &lb) || la != lb)
+            {
+                printf("%s differs\n", path);
+                ++errors;
+            }
+        }
+    }
+
+    wallhaven_json_free(&ja);
+    wallhaven_json_free(&jb);
+    return errors;
+}
+
+int main()
+{
+    Response page = {0}, encoded = {0}, decoded = {0}, again = {0};
+    page.value = canned_search_page();
+    page.size = strlen(page.value);
+
+    int errors = 0;
+    const BinaryHeader *h = NULL;
+    if (wallhaven_binary_encode(&page, BINARY_WALLPAPERS, &encoded) != WALLHAVEN_OK ||
+        !(h = wallhaven_binary_open(encoded.value, encoded.size)) || wallhaven_binary_to_json(h, &decoded) != WALLHAVEN_OK)
+    {
+        printf("Encoding or decoding failed\n");
+        errors = 1;
+    }
+    else
+    {
+        // Records read in place
+        const BinaryWallpaper *w = wallhaven_binary_wallpaper(h, 1);
+        if (h->count != 24 || !w || strcmp(wallhaven_binary_string(h, w->id), "001eef") || w->views != 131 ||
+            strcmp(wallhaven_binary_string(h, w->colors), "#424153,#66cccc,#000000"))
+        {
+            printf("Records differ from the page\n");
+            ++errors;
+        }
+
+        // JSON made from the encoding has the same values, and encodes to the same bytes
+        errors += compare_pages(&page, &decoded);
+        if (wallhaven_binary_encode(&decoded, BINARY_WALLPAPERS, &again) != WALLHAVEN_OK || again.size != encoded.size ||
+            memcmp(again.value, encoded.value, encoded.size))
+        {
+            printf("Encoding of the decoded JSON differs\n");
+            ++errors;
+        }
+    }
+
+    printf("Page of %zu bytes, binary of %zu bytes, %s\n", page.size, encoded.size, errors ? "round trip FAILED" : "round trip ok");
+    free(page.value);
+    free(encoded.value);
+    free(decoded.value);
+    free(again.value);
+    return errors ? 1 : 0;
+}
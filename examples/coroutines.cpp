@@ -0,0 +1,78 @@
+#include "wallhavenapi.hpp"
+#include <cstdio>
+#include <vector>
+
+// Searches a page and then gets the info of every wallpaper of the page at the same time,
+// everything on one thread. The executor keeps the calls within the api call limit.
+
+using wallhaven::Api;
+using wallhaven::Executor;
+using wallhaven::Result;
+using wallhaven::Task;
+
+static Task<> print_info(Executor &ex, Api &api, std::string id)
+{
+    Result r = co_await ex.info(api, id.c_str());
+    if (!r)
+    {
+        std::printf("%s: failed (code %d, status %ld)\n", id.c_str(), r.code, r.status);
+        co_return;
+    }
+
+    WallhavenJson j;
+    char path[512];
+    long favorites = 0;
+    wallhaven_json_parse(&j, r.body.view().data(), r.body.view().size());
+    wallhaven_json_string(&j, "data.path", path, sizeof(path));
+    wallhaven_json_long(&j, "data.favorites", &favorites);
+    wallhaven_json_free(&j);
+
+    std::printf("%s: %ld favorites, %s\n", id.c_str(), favorites, path);
+}
+
+static Task<std::vector<std::string>> search_ids(Executor &ex, Api &api, char *tags)
+{
+    Query q{};
+    q.tags = tags;
+    Parameters p{};
+    p.q = &q;
+
+    Result r = co_await ex.search(api, p);
+    std::vector<std::string> ids;
+    if (!r)
+        co_return ids;
+
+    WallhavenJson j;
+    char path[32], id[16];
+    wallhaven_json_parse(&j, r.body.view().data(), r.body.view().size());
+    size_t count = wallhaven_json_count(&j, "data");
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::snprintf(path, sizeof(path), "data[%zu].id", i);
+        if (wallhaven_json_string(&j, path, id, sizeof(id)))
+            ids.emplace_back(id);
+    }
+    wallhaven_json_free(&j);
+
+    co_return ids;
+}
+
+static char tags[] = "nature";
+
+static Task<> run(Executor &ex, Api &api)
+{
+    std::vector<std::string> ids = co_await search_ids(ex, api, tags);
+    std::printf("Found %zu wallpapers\n", ids.size());
+
+    for (std::string &id : ids)
+        ex.spawn(print_info(ex, api, id));
+}
+
+int main()
+{
+    Api api;
+    Executor ex;
+
+    ex.spawn(run(ex, api));
+    ex.run();
+}
@@ -0,0 +1,182 @@
+#include "wallhavenapi.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Compares reading a few fields with WallhavenJson against building the whole tree first,
+// which is what a conventional JSON parser does.
+
+#define ITERATIONS 20000
+
+// Minimal tree building parser to compare against
+typedef struct Node
+{
+    char type; // o: object, a: array, s: string, n: number or literal
+    char *key;
+    char *string;
+    struct Node *child, *next;
+} Node;
+
+static const char *skip(const char *p)
+{
+    while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')
+        ++p;
+    return p;
+}
+
+static const char *parse_string(const char *p, char **out)
+{
+    const char *start = ++p;
+    while (*p != '"')
+        p += *p == '\\' ? 2 : 1;
+
+    char *s = malloc(p - start + 1), *o = s;
+    for (const char *c = start; c < p; ++c)
+        *o++ = *c == '\\' ? *++c : *c;
+    *o = 0;
+    *out = s;
+    return p + 1;
+}
+
+static const char *parse_value(const char *p, Node *n)
+{
+    p = skip(p);
+    memset(n, 0, sizeof(Node));
+    if (*p == '{' || *p == '[')
+    {
+        char close = *p == '{' ? '}' : ']';
+        n->type = *p == '{' ? 'o' : 'a';
+        Node **tail = &n->child;
+        p = skip(p + 1);
+        while (*p != close)
+        {
+            Node *c = malloc(sizeof(Node));
+            char *key = NULL;
+            if (n->type == 'o')
+                p = skip(parse_string(skip(p), &key)) + 1; // skip ':'
+            p = skip(parse_value(p, c));
+            c->key = key;
+            *tail = c;
+            tail = &c->next;
+            if (*p == ',')
+                p = skip(p + 1);
+        }
+        return p + 1;
+    }
+    if (*p == '"')
+    {
+        n->type = 's';
+        return parse_string(p, &n->string);
+    }
+
+    const char *start = p;
+    while (*p && !strchr(",}] \n\r\t", *p))
+        ++p;
+    n->type = 'n';
+    n->string = strndup(start, p - start);
+    return p;
+}
+
+static void free_node(Node *n)
+{
+    for (Node *c = n->child, *next; c; c = next)
+    {
+        next = c->next;
+        free_node(c);
+        free(c);
+    }
+    free(n->key);
+    free(n->string);
+}
+
+static Node *member(Node *n, const char *key)
+{
+    for (Node *c = n->child; c; c = c->next)
+        if (!strcmp(c->key, key))
+            return c;
+    return NULL;
+}
+
+// Something like what wallhaven_search gives
+static char *canned_search_page()
+{
+    size_t size = 0;
+    char *page = NULL;
+    FILE *f = open_memstream(&page, &size);
+
+    fprintf(f, "{\"data\":[");
+    for (int i = 0; i < 24; ++i)
+    {
+        char id[7];
+        snprintf(id, sizeof(id), "%06x", i * 7919);
+        fprintf(f,
+                "%s{\"id\":\"%s\",\"url\":\"https:\\/\\/wallhaven.cc\\/w\\/%s\",\"short_url\":\"https:\\/\\/whvn.cc\\/%s\","
+                "\"views\":%d,\"favorites\":%d,\"source\":\"\",\"purity\":\"sfw\",\"category\":\"general\","
+                "\"dimension_x\":1920,\"dimension_y\":1080,\"resolution\":\"1920x1080\",\"ratio\":\"1.78\","
+                "\"file_size\":%d,\"file_type\":\"image\\/jpeg\",\"created_at\":\"2024-05-18 10:00:00\","
+                "\"colors\":[\"#424153\",\"#66cccc\",\"#000000\"],"
+                "\"path\":\"https:\\/\\/w.wallhaven.cc\\/full\\/%.2s\\/wallhaven-%s.jpg\","
+                "\"thumbs\":{\"large\":\"https:\\/\\/th.wallhaven.cc\\/lg\\/%.2s\\/%s.jpg\","
+                "\"original\":\"https:\\/\\/th.wallhaven.cc\\/orig\\/%.2s\\/%s.jpg\","
+                "\"small\":\"https:\\/\\/th.wallhaven.cc\\/small\\/%.2s\\/%s.jpg\"}}",
+                i ? "," : "", id, id, id, i * 131, i * 7, 1000000 + i, id, id, id, id, id, id, id, id);
+    }
+    fprintf(f, "],\"meta\":{\"current_page\":1,\"last_page\":123,\"per_page\":\"24\",\"total\":2950,\"query\":null,\"seed\":null}}");
+    fclose(f);
+
+    return page;
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+    char *page = canned_search_page();
+    size_t size = strlen(page);
+    size_t checksum = 0;
+
+    double start = seconds();
+    for (int it = 0; it < ITERATIONS; ++it)
+    {
+        Node root;
+        parse_value(page, &root);
+        int i = 0;
+        for (Node *w = member(&root, "data")->child; w; w = w->next, ++i)
+            checksum += strlen(member(w, "id")->string) + strlen(member(w, "path")->string);
+        checksum += atol(member(member(&root, "meta"), "last_page")->string);
+        free_node(&root);
+    }
+    double tree = seconds() - start;
+
+    start = seconds();
+    for (int it = 0; it < ITERATIONS; ++it)
+    {
+        WallhavenJson j;
+        wallhaven_json_parse(&j, page, size);
+        char path[32], value[256];
+        size_t count = wallhaven_json_count(&j, "data");
+        for (size_t i = 0; i < count; ++i)
+        {
+            snprintf(path, sizeof(path), "data[%zu].id", i);
+            checksum -= wallhaven_json_string(&j, path, value, sizeof(value));
+            snprintf(path, sizeof(path), "data[%zu].path", i);
+            checksum -= wallhaven_json_string(&j, path, value, sizeof(value));
+        }
+        long last_page;
+        wallhaven_json_long(&j, "meta.last_page", &last_page);
+        checksum -= last_page;
+        wallhaven_json_free(&j);
+    }
+    double lazy = seconds() - start;
+
+    printf("Page of %zu bytes, %d iterations\n", size, ITERATIONS);
+    printf("Tree:  %8.2f us per page, %7.1f MB/s\n", tree * 1e6 / ITERATIONS, size * ITERATIONS / tree / 1e6);
+    printf("Lazy:  %8.2f us per page, %7.1f MB/s\n", lazy * 1e6 / ITERATIONS, size * ITERATIONS / lazy / 1e6);
+    printf("Checksum (should be 0): %zu\n", checksum);
+
+    free(page);
+}
@@ -0,0 +1,163 @@
+#include "wallhavenapi.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Checks that wallhaven_resize_rgba (SSE2 or NEON when the library is built with them) gives the same bytes
+// as a plain scalar version of the same filter, and compares their speed. Exits with 1 if any byte differs.
+
+#define BITS 14 // Same fixed point as the library
+#define ONE (1 << BITS)
+
+typedef struct
+{
+    int *start;
+    int16_t *weights;
+    int taps;
+} Kernel;
+
+static int floor_int(double x)
+{
+    int i = (int)x;
+    return i > x ? i - 1 : i;
+}
+
+static double triangle(double distance, double support)
+{
+    double w = 1 - (distance < 0 ? -distance : distance) / support;
+    return w > 0 ? w : 0;
+}
+
+// Triangle filter stretched when shrinking, weights rounded so that they sum to ONE
+static void make_kernel(Kernel *k, int in_size, int out_size)
+{
+    double scale = (double)in_size / out_size, support = scale > 1 ? scale : 1;
+    k->taps = 2 * (int)support + 2;
+    if (k->taps > in_size)
+        k->taps = in_size;
+    k->start = malloc(out_size * sizeof(int));
+    k->weights = malloc((size_t)out_size * k->taps * sizeof(int16_t));
+
+    for (int o = 0; o < out_size; ++o)
+    {
+        double center = (o + 0.5) * scale - 0.5;
+        int start = floor_int(center - support) + 1;
+        if (start > in_size - k->taps)
+            start = in_size - k->taps;
+        if (start < 0)
+            start = 0;
+        k->start[o] = start;
+
+        double sum = 0;
+        for (int t = 0; t < k->taps; ++t)
+            sum += triangle(start + t - center, support);
+
+        int16_t *w = k->weights + (size_t)o * k->taps;
+        int total = 0, biggest = 0;
+        for (int t = 0; t < k->taps; ++t)
+        {
+            w[t] = (int16_t)floor_int(triangle(start + t - center, support) / sum * ONE + 0.5);
+            total += w[t];
+            if (w[t] > w[biggest])
+                biggest = t;
+        }
+        w[biggest] += ONE - total;
+    }
+}
+
+static unsigned char clamp(int32_t v)
+{
+    v = (v + ONE / 2) >> BITS;
+    return v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+}
+
+// Whole image along x, then along y, one byte at a time
+static void resize_scalar(const unsigned char *src, int sw, int sh, unsigned char *dst, int dw, int dh)
+{
+    Kernel kx, ky;
+    make_kernel(&kx, sw, dw);
+    make_kernel(&ky, sh, dh);
+    unsigned char *rows = malloc((size_t)dw * 4 * sh);
+
+    for (int y = 0; y < sh; ++y)
+        for (int o = 0; o < dw; ++o)
+            for (int c = 0; c < 4; ++c)
+            {
+                int32_t sum = 0;
+                for (int t = 0; t < kx.taps; ++t)
+                    sum += src[((size_t)y * sw + kx.start[o] + t) * 4 + c] * kx.weights[(size_t)o * kx.taps + t];
+                rows[((size_t)y * dw + o) * 4 + c] = clamp(sum);
+            }
+
+    for (int o = 0; o < dh; ++o)
+        for (size_t x = 0; x < (size_t)dw * 4; ++x)
+        {
+            int32_t sum = 0;
+            for (int t = 0; t < ky.taps; ++t)
+                sum += rows[(size_t)(ky.start[o] + t) * dw * 4 + x] * ky.weights[(size_t)o * ky.taps + t];
+            dst[(size_t)o * dw * 4 + x] = clamp(sum);
+        }
+
+    free(rows);
+    free(kx.start);
+    free(kx.weights);
+    free(ky.start);
+    free(ky.weights);
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+    // Shrinking, enlarging, odd sizes for the SIMD tails and a 12 MP photo to 1080p
+    static const int sizes[][4] = {{7, 5, 3, 2},         {1, 1, 9, 9},          {640, 480, 37, 23},   {33, 17, 130, 71},
+                                   {1000, 1, 999, 1},    {801, 601, 800, 600},  {1920, 1080, 1280, 720}, {4000, 3000, 1920, 1080}};
+#if defined(__SSE2__)
+    const char *path = "SSE2";
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const char *path = "NEON";
+#else
+    const char *path = "scalar";
+#endif
+    printf("Library path: %s\n", path);
+
+    int errors = 0;
+    srand(1);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s)
+    {
+        int sw = sizes[s][0], sh = sizes[s][1], dw = sizes[s][2], dh = sizes[s][3];
+        size_t in_size = (size_t)sw * sh * 4, out_size = (size_t)dw * dh * 4;
+        unsigned char *src = malloc(in_size), *a = malloc(out_size), *b = malloc(out_size);
+
+        // Noise with hard edges, so that overshoots get clamped too
+        for (size_t i = 0; i < in_size; ++i)
+            src[i] = i / 4 % 13 < 6 ? rand() & 255 : (i / 4 % 2) * 255;
+
+        double start = seconds();
+        WallhavenCode wc = wallhaven_resize_rgba(src, sw, sh, sw * 4, a, dw, dh);
+        double library = seconds() - start;
+        start = seconds();
+        resize_scalar(src, sw, sh, b, dw, dh);
+        double scalar = seconds() - start;
+
+        size_t diff = 0;
+        for (size_t i = 0; i < out_size; ++i)
+            diff += a[i] != b[i];
+        printf("%5dx%-5d -> %5dx%-5d  library %8.2f ms  scalar %8.2f ms  %s", sw, sh, dw, dh, library * 1e3, scalar * 1e3,
+               wc != WALLHAVEN_OK ? "FAILED\n" : diff ? "" : "identical\n");
+        if (wc == WALLHAVEN_OK && diff)
+            printf("%zu bytes differ\n", diff);
+        errors += wc != WALLHAVEN_OK || diff;
+
+        free(src);
+        free(a);
+        free(b);
+    }
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,776 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wallhavenapi.h"
+
+// Runs a crawl job described in a file with a number of workers sharing one call budget.
+//
+// Job file, one statement per line, # starts a comment:
+//
+//   apikey KEY                    API key (or set WALLHAVEN_APIKEY)
+//   out DIR                       Where the responses are written, one file per call (default crawl)
+//   progress FILE                 Calls done so far, a run with the same file skips them (default DIR/progress)
+//   workers N                     Calls made at the same time (default 4)
+//   rate N                        API calls per minute of all the workers together (default 45)
+//   shared NAME                   Share the rate with other processes using the same name
+//   base_url URL                  Call somewhere other than https://wallhaven.cc
+//   follow info|download          Also get the info or download the original of every wallpaper found by the searches
+//   search KEY=VALUE...           Search, keys are q user id like type categories purity sorting order
+//                                 toprange atleast resolutions ratios colors seed pages (like pages=1-5)
+//   collection USER ID [PURITY]   Wallpapers of a collection
+//   info ID...                    Wallpaper info
+//   tag ID...                     Tag info
+//
+// Progress is printed to stderr every second, Ctrl-C stops after the calls in flight.
+
+typedef enum
+{
+    TASK_SEARCH,
+    TASK_COLLECTION,
+    TASK_INFO,
+    TASK_TAG,
+    TASK_DOWNLOAD
+} TaskKind;
+
+// A search statement of the job, the strings are owned
+typedef struct
+{
+    Query q;
+    Parameters p;
+    int first_page, last_page;
+    uint64_t hash; // Of the statement without the pages, identifies the search in the keys of its pages
+    char *strings[16];
+    int string_count;
+} Search;
+
+typedef struct Task
+{
+    TaskKind kind;
+    char key[96]; // Name of the output file and the line in the progress file
+    Search *search;
+    int page;
+    char *a, *b; // Id, user and collection id, or the url of the download
+    int purity;
+    struct Task *next;
+} Task;
+
+#define LATENCY_BUCKETS 64
+
+typedef struct
+{
+    // Job
+    const char *apikey;
+    char out[512];
+    char progress_path[600];
+    int workers;
+    int rate;
+    char shared[64];
+    char base_url[256];
+    bool follow_info, follow_download;
+    Search *searches[256];
+    int search_count;
+
+    // Work, guarded by mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    Task *head, *tail;
+    int busy;
+    int alive; // Workers running, the crawl can't go on without any
+    char **seen; // Keys queued or done, open addressing
+    size_t seen_size, seen_count;
+    FILE *progress;
+
+    // Stats, guarded by mutex
+    double start;
+    size_t total, done, failed, skipped, calls, bytes, retries, rate_limited;
+    size_t latency[LATENCY_BUCKETS]; // Bucket i is up to 2^(i/4) ms
+} Crawl;
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t hash_key(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+    return h;
+}
+
+// Add the key to the seen set, returns false if it was there
+static bool see(Crawl *c, const char *key)
+{
+    if ((c->seen_count + 1) * 2 > c->seen_size)
+    {
+        size_t size = c->seen_size ? c->seen_size * 2 : 4096;
+        char **seen = calloc(size, sizeof(char *));
+        if (!seen)
+            return false;
+        for (size_t i = 0; i < c->seen_size; ++i)
+        {
+            if (!c->seen[i])
+                continue;
+            size_t j = hash_key(c->seen[i]) & (size - 1);
+            while (seen[j])
+                j = (j + 1) & (size - 1);
+            seen[j] = c->seen[i];
+        }
+        free(c->seen);
+        c->seen = seen;
+        c->seen_size = size;
+    }
+
+    size_t i = hash_key(key) & (c->seen_size - 1);
+    for (; c->seen[i]; i = (i + 1) & (c->seen_size - 1))
+        if (!strcmp(c->seen[i], key))
+            return false;
+    c->seen[i] = strdup(key);
+    ++c->seen_count;
+    return true;
+}
+
+// Called with the mutex held
+static void push(Crawl *c, Task *t)
+{
+    t->next = NULL;
+    if (c->tail)
+        c->tail->next = t;
+    else
+        c->head = t;
+    c->tail = t;
+    ++c->total;
+    pthread_cond_signal(&c->work);
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    Response r = {0};
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)))
+    {
+        char *value = realloc(r.value, r.size + n + 1);
+        if (!value)
+            break;
+        r.value = value;
+        memcpy(r.value + r.size, chunk, n);
+        r.size += n;
+        r.value[r.size] = 0;
+    }
+    fclose(f);
+    *size = r.size;
+    return r.value;
+}
+
+static void output_path(Crawl *c, const Task *t, char *path, size_t size)
+{
+    if (t->kind == TASK_DOWNLOAD)
+    {
+        const char *name = strrchr(t->b, '/');
+        snprintf(path, size, "%s/%s", c->out, name ? name + 1 : t->a);
+    }
+    else
+        snprintf(path, size, "%s/%s.json", c->out, t->key);
+}
+
+// Queue the task unless it was queued or done before, called with the mutex held
+static void add_task(Crawl *c, Task *t);
+
+// Queue the info calls or downloads of the wallpapers in a search response, called with the mutex held
+static void follow(Crawl *c, const char *json, size_t size)
+{
+    if (!c->follow_info && !c->follow_download)
+        return;
+
+    WallhavenJson j;
+    if (wallhaven_json_parse(&j, json, size) != WALLHAVEN_OK)
+        return;
+    size_t count = wallhaven_json_count(&j, "data");
+    for (size_t i = 0; i < count; ++i)
+    {
+        char path[32], id[16], url[512];
+        snprintf(path, sizeof(path), "data[%zu].id", i);
+        if (!wallhaven_json_string(&j, path, id, sizeof(id)))
+            continue;
+
+        if (c->follow_info)
+        {
+            Task *t = calloc(1, sizeof(Task));
+            if (t)
+            {
+                t->kind = TASK_INFO;
+                t->a = strdup(id);
+                add_task(c, t);
+            }
+        }
+        snprintf(path, sizeof(path), "data[%zu].path", i);
+        if (c->follow_download && wallhaven_json_string(&j, path, url, sizeof(url)))
+        {
+            Task *t = calloc(1, sizeof(Task));
+            if (t)
+            {
+                t->kind = TASK_DOWNLOAD;
+                t->a = strdup(id);
+                t->b = strdup(url);
+                add_task(c, t);
+            }
+        }
+    }
+    wallhaven_json_free(&j);
+}
+
+static void free_task(Task *t)
+{
+    free(t->a);
+    free(t->b);
+    free(t);
+}
+
+static void add_task(Crawl *c, Task *t)
+{
+    switch (t->kind)
+    {
+    case TASK_SEARCH:
+        snprintf(t->key, sizeof(t->key), "search-%016llx-%d", (unsigned long long)t->search->hash, t->page);
+        break;
+    case TASK_COLLECTION:
+        snprintf(t->key, sizeof(t->key), "collection-%s-%s", t->a, t->b);
+        break;
+    case TASK_INFO:
+        snprintf(t->key, sizeof(t->key), "info-%s", t->a);
+        break;
+    case TASK_TAG:
+        snprintf(t->key, sizeof(t->key), "tag-%s", t->a);
+        break;
+    case TASK_DOWNLOAD:
+        snprintf(t->key, sizeof(t->key), "download-%s", t->a);
+        break;
+    }
+
+    if (see(c, t->key))
+    {
+        push(c, t);
+        return;
+    }
+
+    // Done in an earlier run, the searches still give what they found to follow
+    if (t->kind == TASK_SEARCH)
+    {
+        char path[1024];
+        size_t size;
+        output_path(c, t, path, sizeof(path));
+        char *json = read_file(path, &size);
+        if (json)
+            follow(c, json, size);
+        free(json);
+    }
+    free_task(t);
+}
+
+static int parse_flags(const char *s, const char *const *names, int count)
+{
+    int flags = 0;
+    for (int i = 0; i < count; ++i)
+        if (strstr(s, names[i]))
+            flags |= 1 << i;
+    return flags;
+}
+
+static int parse_name(const char *s, const char *const *names, int count)
+{
+    for (int i = 0; i < count; ++i)
+        if (!strcmp(s, names[i]))
+            return i + 1;
+    return 0;
+}
+
+static char *keep(Search *s, const char *value)
+{
+    if (s->string_count == (int)(sizeof(s->strings) / sizeof(s->strings[0])))
+        return NULL;
+    return s->strings[s->string_count++] = strdup(value);
+}
+
+// Split the line at spaces, "quoted" words can have spaces
+static int split(char *line, char **words, int max)
+{
+    int count = 0;
+    for (char *p = line; *p && count < max;)
+    {
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (!*p)
+            break;
+        words[count++] = p;
+        char *o = p;
+        bool quoted = false;
+        for (; *p && (quoted || (*p != ' ' && *p != '\t')); ++p)
+            if (*p == '"')
+                quoted = !quoted;
+            else
+                *o++ = *p;
+        if (*p)
+            ++p;
+        *o = 0;
+    }
+    return count;
+}
+
+static bool parse_search(Crawl *c, char **words, int count)
+{
+    static const char *const categories[] = {"people", "anime", "general"};
+    static const char *const purities[] = {"nsfw", "sketchy", "sfw"};
+    static const char *const sortings[] = {"date_added", "relevance", "random", "views", "favorites", "toplist"};
+    static const char *const orders[] = {"desc", "asc"};
+    static const char *const ranges[] = {"1d", "3d", "1w", "1M", "3M", "6M", "1y"};
+
+    if (c->search_count == (int)(sizeof(c->searches) / sizeof(c->searches[0])))
+        return false;
+    Search *s = calloc(1, sizeof(Search));
+    if (!s)
+        return false;
+    c->searches[c->search_count++] = s;
+    s->p.q = &s->q;
+    s->first_page = s->last_page = 1;
+    s->hash = hash_key("");
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (strncmp(words[i], "pages=", 6))
+            s->hash = hash_key(words[i]) ^ s->hash * 31;
+        char *value = strchr(words[i], '=');
+        if (!value)
+            return false;
+        *value++ = 0;
+        const char *key = words[i];
+
+        if (!strcmp(key, "q"))
+            s->q.tags = keep(s, value);
+        else if (!strcmp(key, "user"))
+            s->q.user_name = keep(s, value);
+        else if (!strcmp(key, "id"))
+            s->q.id = keep(s, value);
+        else if (!strcmp(key, "like"))
+            s->q.like = keep(s, value);
+        else if (!strcmp(key, "type"))
+            s->q.type = !strcmp(value, "png") ? PNG : JPEG;
+        else if (!strcmp(key, "categories"))
+            s->p.categories = parse_flags(value, categories, 3);
+        else if (!strcmp(key, "purity"))
+            s->p.purity = parse_flags(value, purities, 3);
+        else if (!strcmp(key, "sorting"))
+            s->p.sorting = (Sorting)parse_name(value, sortings, 6);
+        else if (!strcmp(key, "order"))
+            s->p.order = (Order)parse_name(value, orders, 2);
+        else if (!strcmp(key, "toprange"))
+            s->p.toprange = (TopRange)parse_name(value, ranges, 7);
+        else if (!strcmp(key, "atleast"))
+            s->p.atleast = keep(s, value);
+        else if (!strcmp(key, "resolutions"))
+            s->p.resolutions = keep(s, value);
+        else if (!strcmp(key, "ratios"))
+            s->p.ratios = keep(s, value);
+        else if (!strcmp(key, "colors"))
+            s->p.colors = keep(s, value);
+        else if (!strcmp(key, "seed"))
+            snprintf(s->p.seed, sizeof(s->p.seed), "%s", value);
+        else if (!strcmp(key, "pages"))
+        {
+            if (sscanf(value, "%d-%d", &s->first_page, &s->last_page) == 1)
+                s->last_page = s->first_page;
+            if (s->first_page < 1 || s->last_page < s->first_page)
+                return false;
+        }
+        else
+            return false;
+    }
+
+    // wallhaven_search needs a Query, even an empty one
+    if (!s->q.tags)
+        s->q.tags = keep(s, "");
+    return true;
+}
+
+// Read the settings into c and the tasks into tasks
+static bool parse_job(Crawl *c, const char *path, Task **tasks)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[4096], copy[4096], *words[64];
+    int number = 0;
+    bool ok = true;
+    Task **tail = tasks;
+    *tasks = NULL;
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        ++number;
+        line[strcspn(line, "\r\n#")] = 0;
+        strcpy(copy, line);
+        int count = split(line, words, 64);
+        if (!count)
+            continue;
+        const char *what = words[0];
+
+        if (!strcmp(what, "apikey") && count == 2)
+            c->apikey = strdup(words[1]);
+        else if (!strcmp(what, "out") && count == 2)
+            snprintf(c->out, sizeof(c->out), "%s", words[1]);
+        else if (!strcmp(what, "progress") && count == 2)
+            snprintf(c->progress_path, sizeof(c->progress_path), "%s", words[1]);
+        else if (!strcmp(what, "workers") && count == 2)
+            ok = (c->workers = atoi(words[1])) > 0;
+        else if (!strcmp(what, "rate") && count == 2)
+            ok = (c->rate = atoi(words[1])) > 0;
+        else if (!strcmp(what, "shared") && count == 2)
+            snprintf(c->shared, sizeof(c->shared), "%s%s", *words[1] == '/' ? "" : "/", words[1]);
+        else if (!strcmp(what, "base_url") && count == 2)
+            snprintf(c->base_url, sizeof(c->base_url), "%s", words[1]);
+        else if (!strcmp(what, "follow") && count == 2 && !strcmp(words[1], "info"))
+            c->follow_info = true;
+        else if (!strcmp(what, "follow") && count == 2 && !strcmp(words[1], "download"))
+            c->follow_download = true;
+        else if (!strcmp(what, "search"))
+        {
+            if ((ok = parse_search(c, words + 1, count - 1)))
+            {
+                Search *s = c->searches[c->search_count - 1];
+                for (int page = s->first_page; ok && page <= s->last_page; ++page)
+                {
+                    Task *t = calloc(1, sizeof(Task));
+                    ok = t != NULL;
+                    if (t)
+                    {
+                        t->kind = TASK_SEARCH;
+                        t->search = s;
+                        t->page = page;
+                        *tail = t;
+                        tail = &t->next;
+                    }
+                }
+            }
+        }
+        else if (!strcmp(what, "collection") && (count == 3 || count == 4))
+        {
+            Task *t = calloc(1, sizeof(Task));
+            if ((ok = t != NULL))
+            {
+                t->kind = TASK_COLLECTION;
+                t->a = strdup(words[1]);
+                t->b = strdup(words[2]);
+                t->purity = count == 4 ? atoi(words[3]) : 0;
+                *tail = t;
+                tail = &t->next;
+            }
+        }
+        else if ((!strcmp(what, "info") || !strcmp(what, "tag")) && count > 1)
+        {
+            for (int i = 1; ok && i < count; ++i)
+            {
+                Task *t = calloc(1, sizeof(Task));
+                if ((ok = t != NULL))
+                {
+                    t->kind = *what == 'i' ? TASK_INFO : TASK_TAG;
+                    t->a = strdup(words[i]);
+                    *tail = t;
+                    tail = &t->next;
+                }
+            }
+        }
+        else
+            ok = false;
+
+        if (!ok)
+            fprintf(stderr, "%s:%d: can't understand \"%s\"\n", path, number, copy);
+    }
+    fclose(f);
+    return ok;
+}
+
+// Mark the keys in the progress file as done
+static bool load_progress(Crawl *c)
+{
+    size_t size;
+    char *done = read_file(c->progress_path, &size);
+    for (char *line = done, *end; line && *line; line = end + 1)
+    {
+        if (!(end = strchr(line, '\n')))
+            break; // Cut short by a crash, do it again
+        *end = 0;
+        see(c, line);
+        ++c->skipped;
+    }
+    free(done);
+
+    return (c->progress = fopen(c->progress_path, "a")) != NULL;
+}
+
+static void add_latency(Crawl *c, double seconds)
+{
+    int bucket = 0;
+    for (double limit = 1; bucket < LATENCY_BUCKETS - 1 && seconds * 1000 > limit; limit *= 1.189207115) // 2^(1/4)
+        ++bucket;
+    ++c->latency[bucket];
+}
+
+static double percentile(const Crawl *c, double p)
+{
+    size_t count = 0, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+        count += c->latency[i];
+    if (!count)
+        return 0;
+    double limit = 1;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i, limit *= 1.189207115)
+        if ((seen += c->latency[i]) >= p * count)
+            return limit;
+    return limit;
+}
+
+static void print_stats(Crawl *c, bool last)
+{
+    pthread_mutex_lock(&c->mutex);
+    double elapsed = now() - c->start;
+    fprintf(stderr,
+            "\r[%5.0fs] %zu/%zu done, %zu failed, %zu skipped | %.2f calls/s, %.1f MB at %.2f MB/s | "
+            "latency p50 %.0f ms p95 %.0f ms p99 %.0f ms | %zu retries, %zu rate limited%s",
+            elapsed, c->done, c->total, c->failed, c->skipped, c->calls / elapsed, c->bytes / 1e6,
+            c->bytes / 1e6 / elapsed, percentile(c, 0.5), percentile(c, 0.95), percentile(c, 0.99), c->retries,
+            c->rate_limited, last ? "\n" : "  ");
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static WallhavenCode run_task(WallhavenAPI *wa, Task *t, Response *r)
+{
+    r->size = 0;
+    WallhavenCode code = wallhaven_write_to_response(wa, r);
+    if (code != WALLHAVEN_OK)
+        return code;
+
+    switch (t->kind)
+    {
+    case TASK_SEARCH:
+    {
+        Parameters p = t->search->p;
+        p.page = t->page;
+        return wallhaven_search(wa, &p);
+    }
+    case TASK_COLLECTION:
+        return wallhaven_wallpapers_of_collections(wa, t->a, t->b, t->purity);
+    case TASK_INFO:
+        return wallhaven_wallpaper_info(wa, t->a);
+    case TASK_TAG:
+        return wallhaven_tag_info(wa, t->a);
+    case TASK_DOWNLOAD:
+        return wallhaven_download(wa, t->b);
+    }
+    return WALLHAVEN_UNKNOW_PATH;
+}
+
+static void *worker(void *arg)
+{
+    Crawl *c = (Crawl *)arg;
+    WallhavenAPI *wa = wallhaven_init();
+    Response r = {0};
+    bool ready = wa && wallhaven_shared_limit_attach(wa, c->shared, c->rate) == WALLHAVEN_OK &&
+                 (!*c->base_url || wallhaven_base_url(wa, c->base_url) == WALLHAVEN_OK);
+    if (ready)
+        wallhaven_apikey(wa, c->apikey);
+    else
+        fprintf(stderr, "Worker could not start\n");
+
+    pthread_mutex_lock(&c->mutex);
+    while (ready)
+    {
+        while (!c->head && c->busy && !stopping)
+            pthread_cond_wait(&c->work, &c->mutex);
+        if (!c->head || stopping)
+            break;
+
+        Task *t = c->head;
+        if (!(c->head = t->next))
+            c->tail = NULL;
+        ++c->busy;
+        pthread_mutex_unlock(&c->mutex);
+
+        WallhavenStats before = wa->stats;
+        double start = now();
+        WallhavenCode code = run_task(wa, t, &r);
+        double latency = now() - start;
+        bool ok = code == WALLHAVEN_OK && wa->stats.last_status == 200;
+
+        char path[1024];
+        output_path(c, t, path, sizeof(path));
+        FILE *f = ok ? fopen(path, "wb") : NULL;
+        ok = f && fwrite(r.value, 1, r.size, f) == r.size;
+        if (f)
+            ok = !fclose(f) && ok;
+
+        pthread_mutex_lock(&c->mutex);
+        c->calls += wa->stats.calls - before.calls;
+        c->retries += wa->stats.retries - before.retries;
+        c->rate_limited += wa->stats.rate_limited - before.rate_limited;
+        c->bytes += r.size;
+        add_latency(c, latency);
+        if (ok)
+        {
+            ++c->done;
+            fprintf(c->progress, "%s\n", t->key);
+            fflush(c->progress);
+            if (t->kind == TASK_SEARCH)
+                follow(c, r.value, r.size);
+        }
+        else
+        {
+            ++c->failed;
+            fprintf(stderr, "\n%s failed (code %d, status %ld)\n", t->key, code, wa->stats.last_status);
+        }
+        --c->busy;
+        pthread_cond_broadcast(&c->work);
+        free_task(t);
+    }
+    --c->alive;
+    pthread_cond_broadcast(&c->work);
+    pthread_mutex_unlock(&c->mutex);
+
+    free(r.value);
+    if (wa)
+        wallhaven_free(wa);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s JOB_FILE\n", argv[0]);
+        return 2;
+    }
+
+    static Crawl c;
+    c.workers = 4;
+    c.rate = WALLHAVEN_CALLS_PER_MINUTE;
+    c.apikey = getenv("WALLHAVEN_APIKEY");
+    strcpy(c.out, "crawl");
+    pthread_mutex_init(&c.mutex, NULL);
+    pthread_cond_init(&c.work, NULL);
+
+    Task *tasks;
+    bool ok = parse_job(&c, argv[1], &tasks);
+    if (!*c.progress_path)
+        snprintf(c.progress_path, sizeof(c.progress_path), "%s/progress", c.out);
+
+    if (ok && mkdir(c.out, 0755) && errno != EEXIST)
+    {
+        fprintf(stderr, "Can't create %s: %s\n", c.out, strerror(errno));
+        ok = false;
+    }
+    if (ok && !load_progress(&c))
+    {
+        fprintf(stderr, "Can't open %s: %s\n", c.progress_path, strerror(errno));
+        ok = false;
+    }
+    for (Task *t = tasks, *next; t; t = next)
+    {
+        next = t->next;
+        if (ok)
+            add_task(&c, t);
+        else
+            free_task(t);
+    }
+    if (!ok)
+        return 2;
+
+    // One budget for all the workers, and for other processes when shared
+    bool own_limit = !*c.shared;
+    if (own_limit)
+        snprintf(c.shared, sizeof(c.shared), "/wallhaven-crawl-%ld", (long)getpid());
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    c.start = now();
+
+    pthread_t *threads = calloc(c.workers, sizeof(pthread_t));
+    int started = 0;
+    for (; threads && started < c.workers; ++started)
+    {
+        pthread_mutex_lock(&c.mutex);
+        ++c.alive;
+        pthread_mutex_unlock(&c.mutex);
+        if (pthread_create(&threads[started], NULL, worker, &c))
+        {
+            pthread_mutex_lock(&c.mutex);
+            --c.alive;
+            pthread_mutex_unlock(&c.mutex);
+            break;
+        }
+    }
+
+    bool stranded = false;
+    while (true)
+    {
+        pthread_mutex_lock(&c.mutex);
+        stranded = c.head && !c.alive;
+        bool finished = (!c.head && !c.busy) || stopping || stranded;
+        pthread_mutex_unlock(&c.mutex);
+        if (finished)
+            break;
+        print_stats(&c, false);
+        sleep(1);
+    }
+    pthread_mutex_lock(&c.mutex);
+    pthread_cond_broadcast(&c.work);
+    pthread_mutex_unlock(&c.mutex);
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    print_stats(&c, true);
+    if (stranded)
+        fprintf(stderr, "No worker is running, stopping with calls left\n");
+
+    if (own_limit)
+        wallhaven_shared_limit_remove(c.shared);
+    fclose(c.progress);
+    free(threads);
+    for (Task *t = c.head, *next; t; t = next)
+    {
+        next = t->next;
+        free_task(t);
+    }
+    for (size_t i = 0; i < c.seen_size; ++i)
+        free(c.seen[i]);
+    free(c.seen);
+    for (int i = 0; i < c.search_count; ++i)
+    {
+        for (int j = 0; j < c.searches[i]->string_count; ++j)
+            free(c.searches[i]->strings[j]);
+        free(c.searches[i]);
+    }
+
+    return c.failed || stopping || stranded ? 1 : 0;
+}
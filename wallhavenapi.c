@@ -23,8 +23,10 @@ Copyright(c) 2024 K Shreekrishna Upadhyaya
 
 #include "wallhavenapi.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 // NOTE: Haven't checked the portablility of this code.
 #if defined(_WIN32) | defined(_WIN64)
@@ -40,9 +42,30 @@ Copyright(c) 2024 K Shreekrishna Upadhyaya
 #ifdef WALLHAVEN_PLATFORM_WINDOWS
 #include <windows.h>
 #define sleep_ms(ms) Sleep(ms)
+#define now_seconds() (GetTickCount64() / 1000.0)
 #elif defined(WALLHAVEN_PLATFORM_MACOS) | defined(WALLHAVEN_PLATFORM_LINUX)
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #define sleep_ms(ms) usleep((ms) * 1000)
+// Monotonic clock in seconds, used for rate budgets
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+#ifdef WALLHAVEN_PLATFORM_LINUX
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
 #endif
 
 #define WALLPAPER_INFO_PATH "/api/v1/w/"
@@ -101,6 +124,149 @@ static size_t write_function_tofile(void *data, size_t size, size_t nmemb, void
     return fwrite(data, size, nmemb, fp);
 }
 
+// Memory
+
+static void *default_malloc(size_t size, void *userdata)
+{
+    (void)userdata;
+    return malloc(size);
+}
+
+static void default_free(void *ptr, void *userdata)
+{
+    (void)userdata;
+    free(ptr);
+}
+
+// Size of an allocation is kept in front of it so that free can account for it
+#define ALLOCATION_HEADER 16
+
+static void *wa_malloc(WallhavenAPI *wa, size_t size)
+{
+    WallhavenMemory *m = &wa->memory;
+    if (m->limit && m->in_use + size > m->limit)
+    {
+        ++m->refused;
+        return NULL;
+    }
+
+    size_t *p = (size_t *)wa->allocator.malloc(size + ALLOCATION_HEADER, wa->allocator.userdata);
+    checkp_return(p, NULL);
+    *p = size;
+
+    m->in_use += size;
+    if (m->in_use > m->peak)
+        m->peak = m->in_use;
+    ++m->allocations;
+    return (char *)p + ALLOCATION_HEADER;
+}
+
+static void wa_free(WallhavenAPI *wa, void *ptr)
+{
+    checkp_return(ptr, );
+    size_t *p = (size_t *)((char *)ptr - ALLOCATION_HEADER);
+    wa->memory.in_use -= *p;
+    wa->allocator.free(p, wa->allocator.userdata);
+}
+
+// Allocator has no realloc, so move to a new allocation
+static void *wa_realloc(WallhavenAPI *wa, void *ptr, size_t size)
+{
+    void *n;
+    checkp_return(n = wa_malloc(wa, size), NULL);
+    if (ptr)
+    {
+        size_t old = *(size_t *)((char *)ptr - ALLOCATION_HEADER);
+        memcpy(n, ptr, old < size ? old : size);
+        wa_free(wa, ptr);
+    }
+    return n;
+}
+
+// Response whose value is from the allocator of wa, for the buffers the library keeps to itself
+typedef struct
+{
+    WallhavenAPI *wa;
+    Response r;
+} WaResponse;
+
+// Like write_function, growing to at least twice the size so that the copies of wa_realloc add up to linear time
+static size_t write_function_wa(void *data, size_t size, size_t nmemb, void *clientp)
+{
+    size_t realsize = size * nmemb;
+    WaResponse *w = (WaResponse *)clientp;
+    size_t capacity = w->r.value ? *(size_t *)(w->r.value - ALLOCATION_HEADER) : 0;
+
+    if (w->r.size + realsize + 1 > capacity)
+    {
+        size_t grown = capacity * 2 > w->r.size + realsize + 1 ? capacity * 2 : w->r.size + realsize + 1;
+        char *ptr = (char *)wa_realloc(w->wa, w->r.value, grown);
+        checkp_return(ptr, 0);
+        w->r.value = ptr;
+    }
+
+    memcpy(&(w->r.value[w->r.size]), data, realsize);
+    w->r.size += realsize;
+    w->r.value[w->r.size] = 0;
+    return realsize;
+}
+
+// Scratch memory of a request, all of it is given back at once by arena_reset
+struct ArenaBlock
+{
+    struct ArenaBlock *next; // Older block
+    size_t size;
+    size_t used;
+    size_t reserved; // Keeps the data 16 byte aligned
+};
+
+#define ARENA_BLOCK_SIZE 1024
+
+static void *arena_alloc(WallhavenAPI *wa, size_t size)
+{
+    struct ArenaBlock *b = wa->arena;
+    size = (size + 15) & ~(size_t)15;
+
+    if (!b || b->used + size > b->size)
+    {
+        // Each block is twice the last one, so a request needing more settles on one block after the reset
+        size_t block_size = b ? b->size * 2 : ARENA_BLOCK_SIZE;
+        while (block_size < size)
+            block_size *= 2;
+
+        struct ArenaBlock *n = (struct ArenaBlock *)wa_malloc(wa, sizeof(struct ArenaBlock) + block_size);
+        checkp_return(n, NULL);
+        *n = (struct ArenaBlock){.next = b, .size = block_size};
+        wa->arena = b = n;
+    }
+
+    void *p = (char *)(b + 1) + b->used;
+    b->used += size;
+    return p;
+}
+
+// Keep only the newest (biggest) block
+static void arena_reset(WallhavenAPI *wa)
+{
+    struct ArenaBlock *b = wa->arena;
+    checkp_return(b, );
+
+    for (struct ArenaBlock *old = b->next, *next; old; old = next)
+    {
+        next = old->next;
+        wa_free(wa, old);
+    }
+    b->next = NULL;
+    b->used = 0;
+}
+
+static void arena_free(WallhavenAPI *wa)
+{
+    arena_reset(wa);
+    wa_free(wa, wa->arena);
+    wa->arena = NULL;
+}
+
 // Append query as key=value
 static WallhavenCode append_query(WallhavenAPI *wa, const char *key, const char *value)
 {
@@ -111,57 +277,42 @@ static WallhavenCode append_query(WallhavenAPI *wa, const char *key, const char
         wa->api_key_set = true;
 
     size_t size = strlen(key) + 1 + strlen(value) + 1;
-    char *query = (char *)malloc(size);
+    char *query = (char *)arena_alloc(wa, size);
+    checkp_return(query, WALLHAVEN_NO_MEMORY);
 
     snprintf(query, size, "%s=%s", key, value);
-    CURLUcode r = curl_url_set(wa->url, CURLUPART_QUERY, query, CURLU_APPENDQUERY | CURLU_URLENCODE);
-    free(query);
-
-    check_return(r, WALLHAVEN_CURL_FAIL);
+    check_return(curl_url_set(wa->url, CURLUPART_QUERY, query, CURLU_APPENDQUERY | CURLU_URLENCODE), WALLHAVEN_CURL_FAIL);
 
     return WALLHAVEN_OK;
 }
 
 static WallhavenCode format_q(WallhavenAPI *wa, Query *q)
 {
+    size_t capacity = 1 + (q->tags ? strlen(q->tags) + 1 : 0) + // tags
+                      (q->user_name ? strlen(q->user_name) + 2 : 0) + // @Username
+                      (q->type ? 9 : 0) + // type:{jpg|png}
+                      (q->like ? strlen(q->like) + 6 : 0) + // like:wallpaper id
+                      (q->id ? strlen(q->id) + 4 : 0); // id:id
     size_t size = 0;
-    size_t s;
-    char *c = (char *)calloc(1, size);
+    char *c = (char *)arena_alloc(wa, capacity);
+    checkp_return(c, WALLHAVEN_NO_MEMORY);
 
     if (q->tags)
-    {
-        s = strlen(q->tags) + 2; // tags
-        c = realloc(c, size + s);
-        size += snprintf(c + size, s, "%s ", q->tags);
-    }
+        size += snprintf(c + size, capacity - size, "%s ", q->tags);
 
     if (q->user_name)
-    {
-        s = strlen(q->user_name) + 3; // @Username
-        c = realloc(c, size + s);
-        size += snprintf(c + size, s, "@%s ", q->user_name);
-    }
+        size += snprintf(c + size, capacity - size, "@%s ", q->user_name);
 
     if (q->type)
-    {
-        s = 10; // type:{jpg|png}
-        c = realloc(c, size + s);
-        size += snprintf(c + size, s, "type:%s ", (q->type == PNG ? "png" : "jpg"));
-    }
+        size += snprintf(c + size, capacity - size, "type:%s ", (q->type == PNG ? "png" : "jpg"));
 
     if (q->like)
-    {
-        s = strlen(q->like) + 7; // like:wallpaper id
-        c = realloc(c, size + s);
-        size += snprintf(c + size, s, "like:%s ", q->like);
-    }
+        size += snprintf(c + size, capacity - size, "like:%s ", q->like);
 
     if (q->id)
     {
         check_return(size, WALLHAVEN_USING_ID_IN_COMBINATION);
-        s = strlen(q->id) + 5; // id:id
-        c = realloc(c, size + s);
-        size += snprintf(c + size, s, "id:%s ", q->id);
+        size += snprintf(c + size, capacity - size, "id:%s ", q->id);
     }
 
     c[size > 0 ? --(size) : size] = 0;
@@ -169,13 +320,10 @@ static WallhavenCode format_q(WallhavenAPI *wa, Query *q)
 #ifdef DEBUG
     printf("format_q\nSize=%d\nString='%s'\nstrlen=%d\n", size, c, strlen(c));
 #endif
-    WallhavenCode r = WALLHAVEN_OK;
     if (size > 0)
-        r = append_query(wa, "q", c);
-
-    free(c);
+        return append_query(wa, "q", c);
 
-    return r;
+    return WALLHAVEN_OK;
 }
 
 static WallhavenCode format_categories(WallhavenAPI *wa, int categories)
@@ -353,12 +501,11 @@ static WallhavenCode format_page(WallhavenAPI *wa, const int page)
         return WALLHAVEN_OK;
 
     size_t size = snprintf(NULL, 0, "%d", page) + 1;
-    char *s = (char *)malloc(size);
+    char *s = (char *)arena_alloc(wa, size);
+    checkp_return(s, WALLHAVEN_NO_MEMORY);
     snprintf(s, size, "%d", page);
 
-    WallhavenCode r = append_query(wa, "page", s);
-    free(s);
-    return r;
+    return append_query(wa, "page", s);
 }
 
 static WallhavenCode format_seed(WallhavenAPI *wa, const char *seed)
@@ -371,187 +518,9 @@ static WallhavenCode format_seed(WallhavenAPI *wa, const char *seed)
     return WALLHAVEN_OK;
 }
 
-static CURLUcode reset(WallhavenAPI *wa)
-{
-    // Reset the queries and options
-    curl_easy_reset(wa->curl);
-    wa->api_key_set = false;
-    return curl_url_set(wa->url, CURLUPART_QUERY, NULL, 0);
-}
-
-// API implementation
-WallhavenAPI *wallhaven_init()
-{
-    WallhavenAPI *wa;
-    checkp_return(wa = (WallhavenAPI *)malloc(sizeof(WallhavenAPI)), NULL);
-
-    checkp_return(wa->curl = curl_easy_init(), NULL);
-    checkp_return(wa->url = curl_url(), NULL);
-    check_return(curl_url_set(wa->url, CURLUPART_URL, "https://wallhaven.cc", CURLU_URLENCODE), NULL);
-
-    wa->api_call_limit_error = default_api_call_limit;
-    wa->api_key_set = false;
-    wa->apikey = NULL;
-    wa->start_time = -1;
-
-    return wa;
-}
-
-void wallhaven_free(WallhavenAPI *wa)
-{
-    curl_easy_cleanup(wa->curl);
-    curl_url_cleanup(wa->url);
-
-    free(wa);
-}
-
-void wallhaven_apikey(WallhavenAPI *wa, const char *apikey)
-{
-    wa->apikey = apikey;
-}
-
-WallhavenCode wallhaven_write_to_response(WallhavenAPI *wa, Response *response)
-{
-    check_return(reset(wa), WALLHAVEN_CURL_FAIL);
-
-    // Write curl output to response
-    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEFUNCTION, write_function), WALLHAVEN_CURL_FAIL);
-    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEDATA, (void *)response), WALLHAVEN_CURL_FAIL);
-
-    return WALLHAVEN_OK;
-}
-
-WallhavenCode wallhaven_write_to_file(WallhavenAPI *wa, FILE *file)
-{
-    check_return(reset(wa), WALLHAVEN_CURL_FAIL);
-
-    // Write curl ouput to a file
-    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEFUNCTION, write_function_tofile), WALLHAVEN_CURL_FAIL);
-    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEDATA, (void *)file), WALLHAVEN_CURL_FAIL);
-
-    return WALLHAVEN_OK;
-}
-
-WallhavenCode wallhaven_get_result(WallhavenAPI *wa, Path p, const char *id)
-{
-    size_t size;
-    char *path;
-
-    switch (p)
-    {
-    case WALLPAPER_INFO:
-        if (wa->apikey)
-            check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
-    case TAG_INFO:
-        size = 1 + strlen(id) + strlen(p == WALLPAPER_INFO ? WALLPAPER_INFO_PATH : TAG_INFO_PATH);
-        path = (char *)malloc(size);
-        snprintf(path, size, (p == WALLPAPER_INFO ? WALLPAPER_INFO_PATH "%s" : TAG_INFO_PATH "%s"), id);
-        break;
-    case SETTINGS:
-        checkp_return(wa->apikey, WALLHAVEN_NO_API_KEY);
-        check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
-        size = 1 + strlen(USER_SETTINGS_PATH);
-        path = (char *)malloc(size);
-        snprintf(path, size, USER_SETTINGS_PATH);
-        break;
-    case SEARCH:
-        if (wa->apikey)
-            check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
-        size = 1 + strlen(SEARCH_PATH);
-        path = (char *)malloc(size);
-        snprintf(path, size, SEARCH_PATH);
-        break;
-    case COLLECTIONS:
-        if (!id)
-        {
-            checkp_return(wa->apikey, WALLHAVEN_NO_API_KEY);
-            check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
-        }
-        size = 1 + strlen(COLLECTIONS_PATH) + (id ? strlen(id) + 1 /*For '/' */ : 0);
-        path = (char *)malloc(size);
-        snprintf(path, size, COLLECTIONS_PATH "/%s", id);
-        break;
-    default:
-        return WALLHAVEN_UNKNOW_PATH;
-    }
-
-    check_return(curl_url_set(wa->url, CURLUPART_PATH, path, CURLU_URLENCODE), WALLHAVEN_CURL_FAIL);
-    check_return(curl_easy_setopt(wa->curl, CURLOPT_CURLU, wa->url), WALLHAVEN_CURL_FAIL);
-
-    if (wa->start_time == -1)
-        time(&wa->start_time);
-
-    if (difftime(time(NULL), wa->start_time) > 60)
-        time(&wa->start_time);
-
-    CURLcode c = curl_easy_perform(wa->curl);
-
-    long response_code;
-    check_return(curl_easy_getinfo(wa->curl, CURLINFO_RESPONSE_CODE, &response_code), WALLHAVEN_CURL_FAIL);
-    if (response_code == 429)
-    {
-        if (wa->api_call_limit_error(&wa->start_time))
-            return wallhaven_get_result(wa, p, id);
-        else
-            return WALLHAVEN_TOO_MANY_REQUSTS_ERROR;
-    }
-    else if (response_code == 401)
-        return WALLHAVEN_UNAUTHORIZED_ERROR;
-
-#ifdef DEBUG
-    curl_url_get(wa->url, CURLUPART_URL, &path, 0);
-    printf("URL: %s\n", path);
-    printf("CURLcode: %d\n", c);
-    printf("Response code: %ld\n", response_code);
-#endif
-
-    check_return(c, WALLHAVEN_CURL_FAIL);
-
-    free(path);
-
-    return WALLHAVEN_OK;
-}
-
-WallhavenCode wallhaven_search(WallhavenAPI *wa, Parameters *p)
+// Add all the search parameters to the query
+static WallhavenCode format_search(WallhavenAPI *wa, Parameters *p)
 {
-#ifdef DEBUG
-    printf(
-        "Parameters:\n"
-        "\tQuery:\n"
-        "\t\tTags = %s\n"
-        "\t\tUser name = %s\n"
-        "\t\tId = %s\n"
-        "\t\tType = %d\n"
-        "\t\tlike = %s\n"
-        "\tCategories = %d\n"
-        "\tPurity = %d\n"
-        "\tSorting = %d\n"
-        "\tOrder = %d\n"
-        "\tTopRange = %d\n"
-        "\tAtleast = %s\n"
-        "\tResolutions = %s\n"
-        "\tratios = %s\n"
-        "\tColors = %s\n"
-        "\tPage = %d\n"
-        "\tSeed = %s\n",
-        p->q->tags,
-        p->q->user_name,
-        p->q->id,
-        p->q->type,
-        p->q->like,
-        p->categories,
-        p->purity,
-        p->sorting,
-        p->order,
-        p->toprange,
-        p->atleast,
-        p->resolutions,
-        p->ratios,
-        p->colors,
-        p->page,
-        p->seed);
-#endif
-
     WallhavenCode wc;
 
     wc = format_q(wa, p->q);
@@ -593,22 +562,9368 @@ WallhavenCode wallhaven_search(WallhavenAPI *wa, Parameters *p)
     wc = format_seed(wa, p->seed);
     check_return(wc, wc);
 
-    return wallhaven_get_result(wa, SEARCH, NULL);
+    return WALLHAVEN_OK;
 }
 
-WallhavenCode wallhaven_wallpapers_of_collections(WallhavenAPI *wa, const char *user, const char *id, int purity)
+static void prewarm_attach(WallhavenAPI *wa);
+static void prewarm_free(WallhavenAPI *wa);
+
+static CURLUcode reset(WallhavenAPI *wa)
 {
-    size_t size = snprintf(NULL, 0, "%s/%s", user, id) + 1;
-    char *concat = (char *)malloc(size);
-    snprintf(concat, size, "%s/%s", user, id);
+    // Reset the queries and options
+    curl_easy_reset(wa->curl);
+    arena_reset(wa);
+    prewarm_attach(wa);
+    wa->api_key_set = false;
+    wa->response = NULL;
+    wa->file = NULL;
+    wa->sink_file = NULL;
+    return curl_url_set(wa->url, CURLUPART_QUERY, NULL, 0);
+}
 
-    WallhavenCode wc = format_purity(wa, purity);
-    check_return(wc, wc);
+// Rate limits
 
-    return wallhaven_get_result(wa, COLLECTIONS, concat);
+#define LIMIT_BURST 3 // Calls that can be made back to back
+
+// Small burst with the steady rate lowered by it, so no window of a minute gets more than calls_per_minute.
+// Every limiter (shared limit, RateBudget) takes its burst from here and its rate as (calls_per_minute - burst + 1) a minute.
+static int limit_burst(int calls_per_minute)
+{
+    return calls_per_minute > 2 * LIMIT_BURST ? LIMIT_BURST : 1;
 }
 
-void wallhaven_set_on_api_call_limit_error(WallhavenAPI *wa, onMaxAPICallLimitError func)
+void wallhaven_budget_init(RateBudget *b, int calls_per_minute)
 {
-    wa->api_call_limit_error = func;
+    if (calls_per_minute <= 0)
+        calls_per_minute = WALLHAVEN_CALLS_PER_MINUTE;
+    int burst = limit_burst(calls_per_minute);
+    *b = (RateBudget){
+        .tokens = burst,
+        .capacity = burst,
+        .rate = (calls_per_minute - burst + 1) / 60.0,
+        .last = now_seconds(),
+    };
 }
+
+double wallhaven_budget_wait(RateBudget *b)
+{
+    double now = now_seconds();
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->capacity)
+        b->tokens = b->capacity;
+    b->last = now;
+    return b->tokens >= 1 ? 0 : (1 - b->tokens) / b->rate;
+}
+
+bool wallhaven_budget_take(RateBudget *b)
+{
+    checkp_return(wallhaven_budget_wait(b) == 0, false);
+    b->tokens -= 1;
+    return true;
+}
+
+// Shared rate limit
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+#define SHARED_LIMIT_MAGIC 0x5748534cu // "WHSL"
+#define SHARED_LIMIT_WINDOW_US 60000000LL // Window of the API call limit
+
+// Layout of the shared memory segment.
+// Uses GCRA (a token bucket storing only the theoretical arrival time) so the whole state is a single
+// atomic which is updated with compare and swap. No locks are held while calling, so a process dying
+// anywhere can't wedge the others, at most the slot it reserved is lost.
+typedef struct
+{
+    _Atomic uint32_t magic; // Set last under flock, segment is ready when this is SHARED_LIMIT_MAGIC
+    uint32_t burst;         // Calls that can be made back to back
+    int64_t interval_us;    // Time between two calls at the steady rate
+    _Atomic int64_t tat_us; // Theoretical arrival time of the next call
+} SharedLimitState;
+
+struct SharedRateLimit
+{
+    SharedLimitState *state;
+};
+
+static int64_t now_us()
+{
+    return (int64_t)(now_seconds() * 1e6);
+}
+
+// Reserve a slot for one call and wait till the slot comes
+static void shared_limit_acquire(struct SharedRateLimit *l)
+{
+    SharedLimitState *st = l->state;
+    int64_t tolerance = (st->burst - 1) * st->interval_us;
+    int64_t now, tat, base;
+
+    do
+    {
+        now = now_us();
+        tat = atomic_load(&st->tat_us);
+        base = tat > now ? tat : now;
+    } while (!atomic_compare_exchange_weak(&st->tat_us, &tat, base + st->interval_us));
+
+    int64_t wait = base - tolerance - now;
+    if (wait > 0)
+    {
+#ifdef DEBUG
+        printf("shared limit: waiting for %lld ms\n", (long long)(wait / 1000));
+#endif
+        sleep_ms(wait / 1000 + 1);
+    }
+}
+
+// Take a slot only if one is free right now, for calls which are fine not being made
+static bool shared_limit_try_acquire(struct SharedRateLimit *l)
+{
+    SharedLimitState *st = l->state;
+    int64_t tolerance = (st->burst - 1) * st->interval_us;
+    int64_t now, tat, base;
+
+    do
+    {
+        now = now_us();
+        tat = atomic_load(&st->tat_us);
+        base = tat > now ? tat : now;
+        if (base - tolerance > now)
+            return false;
+    } while (!atomic_compare_exchange_weak(&st->tat_us, &tat, base + st->interval_us));
+
+    return true;
+}
+
+// Server says we are over the limit, push every process back by a full window
+static void shared_limit_penalize(struct SharedRateLimit *l)
+{
+    SharedLimitState *st = l->state;
+    int64_t until = now_us() + SHARED_LIMIT_WINDOW_US;
+    int64_t tat = atomic_load(&st->tat_us);
+
+    while (tat < until && !atomic_compare_exchange_weak(&st->tat_us, &tat, until))
+        ;
+}
+
+#endif
+
+// Tracing
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+#include <pthread.h>
+
+typedef struct
+{
+    const char *name; // Static string
+    const char *category;
+    int64_t start_us;
+    int64_t duration_us;
+    long long arg;
+} TraceEvent;
+
+// Events of one thread, written only by that thread
+struct TraceRing
+{
+    TraceEvent *events;
+    size_t mask;
+    _Atomic size_t head;  // Events written so far
+    _Atomic size_t clear; // Head when cleared, only written by wallhaven_trace_clear
+    atomic_bool in_use;   // Taken by a running thread
+    int tid;
+    struct TraceRing *next;
+};
+
+static atomic_bool trace_enabled;
+static _Atomic size_t trace_capacity = 4096;
+static _Atomic(struct TraceRing *) trace_rings;
+static atomic_int trace_next_tid;
+static _Thread_local struct TraceRing *trace_ring;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+// Hand the ring of an exiting thread over to the next thread, its events stay till they are overwritten
+static void trace_release(void *ring)
+{
+    atomic_store(&((struct TraceRing *)ring)->in_use, false);
+}
+
+static void trace_key_init()
+{
+    pthread_key_create(&trace_key, trace_release);
+}
+
+static struct TraceRing *trace_thread_ring()
+{
+    if (trace_ring)
+        return trace_ring;
+
+    pthread_once(&trace_key_once, trace_key_init);
+    for (struct TraceRing *r = atomic_load(&trace_rings); r; r = r->next)
+    {
+        bool in_use = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &in_use, true))
+        {
+            pthread_setspecific(trace_key, r);
+            return trace_ring = r;
+        }
+    }
+
+    struct TraceRing *r = (struct TraceRing *)calloc(1, sizeof(struct TraceRing));
+    checkp_return(r, NULL);
+    size_t capacity = atomic_load(&trace_capacity);
+    if (!(r->events = (TraceEvent *)calloc(capacity, sizeof(TraceEvent))))
+    {
+        free(r);
+        return NULL;
+    }
+    r->mask = capacity - 1;
+    r->tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+    atomic_store(&r->in_use, true);
+    pthread_setspecific(trace_key, r);
+
+    // Rings are never freed so that the dump can read them without locks, there are as many as threads tracing at once
+    r->next = atomic_load(&trace_rings);
+    while (!atomic_compare_exchange_weak(&trace_rings, &r->next, r))
+        ;
+    return trace_ring = r;
+}
+
+// Start of a span, 0 when not tracing so that the end is skipped
+static int64_t trace_begin()
+{
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed) ? now_us() : 0;
+}
+
+static void trace_event(const char *category, const char *name, int64_t start_us, int64_t end_us, long long arg)
+{
+    struct TraceRing *r;
+    checkp_return(start_us && (r = trace_thread_ring()), );
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    r->events[head & r->mask] = (TraceEvent){name, category, start_us, end_us - start_us, arg};
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static void trace_end(const char *category, const char *name, int64_t start_us, long long arg)
+{
+    if (start_us)
+        trace_event(category, name, start_us, now_us(), arg);
+}
+
+// Split an attempt into the phases curl measured, times are from the start of the transfer
+static void trace_transfer(CURL *curl, int64_t start_us)
+{
+    checkp_return(start_us, );
+
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    if (dns > 0)
+        trace_event("net", "dns", start_us, start_us + dns, 0);
+    if (connect > dns)
+        trace_event("net", "tcp", start_us + dns, start_us + connect, 0);
+    if (tls > connect)
+        trace_event("net", "tls", start_us + connect, start_us + tls, 0);
+    if (first_byte > pretransfer)
+        trace_event("net", "wait", start_us + pretransfer, start_us + first_byte, 0);
+    if (total > first_byte)
+    {
+        curl_off_t bytes = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        trace_event("net", "transfer", start_us + first_byte, start_us + total, (long long)bytes);
+    }
+}
+
+void wallhaven_trace_start(size_t events_per_thread)
+{
+    size_t capacity = 16;
+    while (capacity < events_per_thread)
+        capacity *= 2;
+    atomic_store(&trace_capacity, capacity);
+    atomic_store(&trace_enabled, true);
+}
+
+void wallhaven_trace_stop()
+{
+    atomic_store(&trace_enabled, false);
+}
+
+void wallhaven_trace_clear()
+{
+    // The head belongs to the thread writing, so only mark where the dump starts
+    for (struct TraceRing *r = atomic_load(&trace_rings); r; r = r->next)
+        atomic_store(&r->clear, atomic_load_explicit(&r->head, memory_order_acquire));
+}
+
+WallhavenCode wallhaven_trace_dump(FILE *out)
+{
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    bool first = true;
+    for (struct TraceRing *r = atomic_load(&trace_rings); r; r = r->next)
+    {
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        size_t count = head - atomic_load(&r->clear);
+        if (count > r->mask + 1)
+            count = r->mask + 1;
+
+        fprintf(out, "%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"wallhaven %d\"}}", first ? "" : ",", r->tid, r->tid);
+        first = false;
+
+        for (size_t i = head - count; i < head; ++i)
+        {
+            const TraceEvent *e = &r->events[i & r->mask];
+            fprintf(out, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"cat\":\"%s\",\"name\":\"%s\",\"ts\":%lld,\"dur\":%lld,\"args\":{\"value\":%lld}}",
+                    r->tid, e->category, e->name, (long long)e->start_us, (long long)e->duration_us, e->arg);
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    return ferror(out) ? WALLHAVEN_IO_FAIL : WALLHAVEN_OK;
+}
+
+#else
+
+#define trace_begin() 0
+#define trace_end(category, name, start_us, arg)
+#define trace_transfer(curl, start_us)
+
+void wallhaven_trace_start(size_t events_per_thread)
+{
+}
+
+void wallhaven_trace_stop()
+{
+}
+
+void wallhaven_trace_clear()
+{
+}
+
+WallhavenCode wallhaven_trace_dump(FILE *out)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+#endif
+
+// Retry policy
+
+// Position of the output before the call, to undo the writes of a failed attempt
+typedef struct
+{
+    size_t size;
+    long offset;
+    int64_t sink_offset;
+} SinkMark;
+
+static void sink_file_rewind(WallhavenSinkFile *f, int64_t offset);
+
+static void sink_mark(WallhavenAPI *wa, SinkMark *m)
+{
+    m->size = wa->response ? wa->response->size : 0;
+    m->offset = wa->file ? ftell(wa->file) : -1;
+    m->sink_offset = wa->sink_file ? wa->sink_file->offset : -1;
+}
+
+static void sink_rewind(WallhavenAPI *wa, SinkMark *m)
+{
+    if (wa->response)
+    {
+        wa->response->size = m->size;
+        if (wa->response->value)
+            wa->response->value[m->size] = 0;
+    }
+    else if (wa->file && m->offset != -1)
+    {
+        fflush(wa->file);
+        fseek(wa->file, m->offset, SEEK_SET);
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+        if (ftruncate(fileno(wa->file), m->offset) == -1)
+            return;
+#endif
+    }
+    else if (wa->sink_file && m->sink_offset != -1)
+        sink_file_rewind(wa->sink_file, m->sink_offset);
+}
+
+// Errors which might go away by trying again
+static bool transient_curl_error(CURLcode c)
+{
+    switch (c)
+    {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Read the Retry-After and the rate limit headers of the last response
+static void read_limit_headers(WallhavenAPI *wa, CURL *curl)
+{
+    curl_off_t retry_after = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after) != CURLE_OK)
+        retry_after = 0;
+    wa->stats.retry_after_ms = (long)retry_after * 1000;
+
+#if LIBCURL_VERSION_NUM >= 0x075300
+    struct curl_header *h;
+    if (curl_easy_header(curl, "X-RateLimit-Remaining", 0, CURLH_HEADER, -1, &h) == CURLHE_OK)
+        wa->stats.ratelimit_remaining = atol(h->value);
+    if (curl_easy_header(curl, "X-RateLimit-Limit", 0, CURLH_HEADER, -1, &h) == CURLHE_OK)
+        wa->stats.ratelimit_limit = atol(h->value);
+#endif
+}
+
+// Whether a duplicate transfer can be started now
+static bool hedge_allowed(WallhavenAPI *wa, bool api_call)
+{
+    checkp_return(api_call, true);
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+    return wa->shared_limit && shared_limit_try_acquire(wa->shared_limit);
+#else
+    return false;
+#endif
+}
+
+// Make the transfer, starting a duplicate transfer if the first one takes longer than hedge_after_ms.
+// Only used when writing to a Response, the writes of the loser are thrown away.
+// The duplicate of an API call is another call, so it is only started if the shared limit has a slot free.
+static CURLcode perform_hedged(WallhavenAPI *wa, bool api_call, CURL **winner)
+{
+    CURLM *m;
+    *winner = wa->curl;
+    checkp_return(m = curl_multi_init(), curl_easy_perform(wa->curl));
+    curl_multi_add_handle(m, wa->curl);
+
+    size_t start_size = wa->response->size;
+    WaResponse hedge_response = {.wa = wa};
+    CURL *hedge = NULL;
+    CURLcode result = CURLE_OK;
+    int64_t hedge_start = 0;
+    double hedge_at = now_seconds() + wa->retry.hedge_after_ms / 1000.0;
+    int running, started = 1, finished = 0;
+    bool hedging = true;
+
+    *winner = NULL;
+    while (!*winner)
+    {
+        curl_multi_perform(m, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while (!*winner && (msg = curl_multi_info_read(m, &queued)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            ++finished;
+            result = msg->data.result;
+            // A failed transfer wins only if there is nothing else to wait for
+            if (result == CURLE_OK || finished == started)
+                *winner = msg->easy_handle;
+        }
+        if (*winner)
+            break;
+
+        double now = now_seconds();
+        if (hedging && !hedge && now >= hedge_at)
+        {
+            if (hedge_allowed(wa, api_call) && (hedge = curl_easy_duphandle(wa->curl)))
+            {
+                curl_easy_setopt(hedge, CURLOPT_WRITEFUNCTION, write_function_wa);
+                curl_easy_setopt(hedge, CURLOPT_WRITEDATA, (void *)&hedge_response);
+                curl_multi_add_handle(m, hedge);
+                hedge_start = trace_begin();
+                ++wa->stats.hedged;
+                ++started;
+                continue;
+            }
+            hedging = false; // No slot for it, let the first transfer finish
+        }
+
+        int timeout = hedging && !hedge ? (int)((hedge_at - now) * 1000) + 1 : 1000;
+        curl_multi_poll(m, NULL, 0, timeout, NULL);
+    }
+
+    curl_multi_remove_handle(m, wa->curl);
+    if (hedge)
+        curl_multi_remove_handle(m, hedge);
+    curl_multi_cleanup(m);
+
+    if (hedge && *winner == hedge)
+    {
+        // Replace what the primary wrote with the hedged response
+        ++wa->stats.hedge_wins;
+        wa->response->size = start_size;
+        if (wa->response->value)
+            wa->response->value[start_size] = 0;
+        if (hedge_response.r.size)
+            write_function(hedge_response.r.value, 1, hedge_response.r.size, wa->response);
+
+        // Hedge handle is cleaned up here, so keep what caller needs from it
+        wa->hedge_response_code = 0;
+        curl_easy_getinfo(hedge, CURLINFO_RESPONSE_CODE, &wa->hedge_response_code);
+        read_limit_headers(wa, hedge);
+        trace_transfer(hedge, hedge_start);
+    }
+
+    if (hedge)
+        curl_easy_cleanup(hedge);
+    wa_free(wa, hedge_response.r.value);
+
+    return result;
+}
+
+static long backoff_ms(RetryPolicy *rp, int attempt)
+{
+    double delay = rp->base_delay_ms;
+    for (int i = 0; i < attempt && delay < rp->max_delay_ms; ++i)
+        delay *= 2;
+    if (delay > rp->max_delay_ms)
+        delay = rp->max_delay_ms;
+
+    // Spread the retries of different clients
+    delay -= delay * rp->jitter * ((double)rand() / RAND_MAX);
+    return (long)delay;
+}
+
+static void breaker_record(WallhavenAPI *wa, bool failed)
+{
+    if (!failed)
+    {
+        wa->consecutive_failures = 0;
+        wa->breaker_open_until = 0;
+        return;
+    }
+
+    ++wa->consecutive_failures;
+    if (wa->retry.breaker_threshold > 0 && wa->consecutive_failures >= wa->retry.breaker_threshold)
+    {
+        if (wa->consecutive_failures == wa->retry.breaker_threshold || wa->breaker_open_until)
+            ++wa->stats.breaker_opened;
+        wa->breaker_open_until = now_seconds() + wa->retry.breaker_cooldown_ms / 1000.0;
+    }
+}
+
+// Book the outcome of an attempt (breaker, retry budget, 429 penalty), WALLHAVEN_OK if the server answered below 500
+static WallhavenCode call_outcome(WallhavenAPI *wa, CURLcode result, long response_code, bool *retryable)
+{
+    *retryable = false;
+    if (result == CURLE_OK && response_code == 429)
+    {
+        ++wa->stats.rate_limited;
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+        if (wa->shared_limit)
+            shared_limit_penalize(wa->shared_limit);
+#endif
+        *retryable = true;
+        return WALLHAVEN_TOO_MANY_REQUSTS_ERROR;
+    }
+    if (result == CURLE_OK && response_code == 401)
+    {
+        breaker_record(wa, false);
+        return WALLHAVEN_UNAUTHORIZED_ERROR;
+    }
+    if (result == CURLE_OK && response_code < 500)
+    {
+        breaker_record(wa, false);
+        wa->retry_tokens += wa->retry.retry_budget_ratio;
+        if (wa->retry_tokens > wa->retry.retry_budget)
+            wa->retry_tokens = wa->retry.retry_budget;
+        return WALLHAVEN_OK;
+    }
+
+    // Curl failure or a server error
+    breaker_record(wa, true);
+    *retryable = result == CURLE_OK || transient_curl_error(result);
+    return WALLHAVEN_CURL_FAIL;
+}
+
+// Whether the failed attempt (0 for the first) is retried, and in how many ms. Used by every loop making calls.
+// Gives up after max_retries, while the breaker is open or when the retry budget is spent, counting a failure.
+// A 429 without Retry-After, or no calls left in the minute, waits for the next minute window,
+// with ask_handler the 429 goes to api_call_limit_error instead, which does it's own waiting.
+static bool call_retry(WallhavenAPI *wa, WallhavenCode *wc, bool retryable, int attempt, bool api_call, bool ask_handler, long *delay)
+{
+    RetryPolicy *rp = &wa->retry;
+    WallhavenStats *st = &wa->stats;
+
+    if (!retryable || attempt >= rp->max_retries)
+    {
+        ++st->failures;
+        return false;
+    }
+    if (wa->breaker_open_until && now_seconds() < wa->breaker_open_until)
+    {
+        ++st->breaker_rejected;
+        ++st->failures;
+        *wc = WALLHAVEN_CIRCUIT_OPEN;
+        return false;
+    }
+    if (wa->retry_tokens < 1)
+    {
+        ++st->budget_exhausted;
+        ++st->failures;
+        return false;
+    }
+
+    bool limited = *wc == WALLHAVEN_TOO_MANY_REQUSTS_ERROR;
+    *delay = backoff_ms(rp, attempt);
+    if (st->retry_after_ms > 0)
+    {
+        ++st->retry_after_waits;
+        *delay = st->retry_after_ms;
+    }
+    else if (limited && ask_handler)
+    {
+        *delay = 0;
+        int64_t callback_start = trace_begin();
+        bool go_on = wa->api_call_limit_error(&wa->start_time);
+        trace_end("callback", "api_call_limit_error", callback_start, 0);
+        if (!go_on)
+        {
+            ++st->failures;
+            return false;
+        }
+    }
+    else if (api_call && (limited || st->ratelimit_remaining == 0) && wa->start_time != -1)
+    {
+        // Retrying before the minute ends only gets another 429
+        long window = (long)(60 - difftime(time(NULL), wa->start_time) + 1) * 1000;
+        if (window > *delay)
+            *delay = window;
+    }
+
+    // Spent only once the retry is sure to be made
+    wa->retry_tokens -= 1;
+    ++st->retries;
+    st->backoff_ms += *delay;
+    return true;
+}
+
+static void bandwidth_begin(WallhavenAPI *wa, bool api_call);
+static void bandwidth_end(WallhavenAPI *wa);
+
+// Make the call set up in wa->curl, retrying as told by wa->retry
+static WallhavenCode perform(WallhavenAPI *wa, bool api_call)
+{
+    RetryPolicy *rp = &wa->retry;
+    WallhavenStats *st = &wa->stats;
+    ++st->calls;
+
+    if (wa->breaker_open_until)
+    {
+        if (now_seconds() < wa->breaker_open_until)
+        {
+            ++st->breaker_rejected;
+            return WALLHAVEN_CIRCUIT_OPEN;
+        }
+        // Cooldown is over, let this call through as a trial
+    }
+
+    SinkMark mark;
+    sink_mark(wa, &mark);
+
+    for (int attempt = 0;; ++attempt)
+    {
+        if (api_call)
+        {
+            if (wa->start_time == -1)
+                time(&wa->start_time);
+
+            if (difftime(time(NULL), wa->start_time) > 60)
+                time(&wa->start_time);
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+            if (wa->shared_limit)
+            {
+                int64_t wait_start = trace_begin();
+                shared_limit_acquire(wa->shared_limit);
+                trace_end("limit", "rate_limit_wait", wait_start, 0);
+            }
+#endif
+        }
+
+        ++st->attempts;
+        CURL *handle = wa->curl;
+        CURLcode c;
+        int64_t attempt_start = trace_begin();
+        if (wa->bandwidth)
+            bandwidth_begin(wa, api_call);
+        if (rp->hedge_after_ms > 0 && wa->response)
+            c = perform_hedged(wa, api_call, &handle);
+        else
+            c = curl_easy_perform(wa->curl);
+        if (wa->bandwidth)
+            bandwidth_end(wa);
+        if (handle == wa->curl)
+            trace_transfer(handle, attempt_start); // A winning hedge was traced before its handle was cleaned up
+        trace_end("call", "attempt", attempt_start, attempt);
+
+        long response_code = 0;
+        if (handle == wa->curl)
+        {
+            check_return(curl_easy_getinfo(wa->curl, CURLINFO_RESPONSE_CODE, &response_code), WALLHAVEN_CURL_FAIL);
+            read_limit_headers(wa, wa->curl);
+        }
+        else
+            response_code = wa->hedge_response_code;
+        st->last_status = response_code;
+
+#ifdef DEBUG
+        printf("Attempt: %d\n", attempt + 1);
+        printf("CURLcode: %d\n", c);
+        printf("Response code: %ld\n", response_code);
+#endif
+
+        bool retryable;
+        WallhavenCode wc = call_outcome(wa, c, response_code, &retryable);
+        if (wc == WALLHAVEN_OK || wc == WALLHAVEN_UNAUTHORIZED_ERROR)
+            return wc;
+
+        long delay;
+        if (!call_retry(wa, &wc, retryable, attempt, api_call, true, &delay))
+            return wc;
+
+#ifdef DEBUG
+        printf("Retrying in %ld ms\n", delay);
+#endif
+        if (delay > 0)
+        {
+            int64_t backoff_start = trace_begin();
+            sleep_ms(delay);
+            trace_end("limit", "backoff", backoff_start, delay);
+        }
+
+        sink_rewind(wa, &mark);
+    }
+}
+
+// API implementation
+WallhavenAPI *wallhaven_init()
+{
+    return wallhaven_init_with_allocator(NULL);
+}
+
+WallhavenAPI *wallhaven_init_with_allocator(const WallhavenAllocator *allocator)
+{
+    WallhavenAllocator a = allocator ? *allocator : (WallhavenAllocator){default_malloc, default_free, NULL};
+    WallhavenAPI *wa;
+    checkp_return(wa = (WallhavenAPI *)a.malloc(sizeof(WallhavenAPI), a.userdata), NULL);
+    wa->allocator = a;
+    wa->memory = (WallhavenMemory){0};
+    wa->arena = NULL;
+
+    checkp_return(wa->curl = curl_easy_init(), NULL);
+    checkp_return(wa->url = curl_url(), NULL);
+    check_return(curl_url_set(wa->url, CURLUPART_URL, "https://wallhaven.cc", CURLU_URLENCODE), NULL);
+
+    wa->api_call_limit_error = default_api_call_limit;
+    wa->api_key_set = false;
+    wa->apikey = NULL;
+    wa->start_time = -1;
+    wa->shared_limit = NULL;
+    wa->response = NULL;
+    wa->file = NULL;
+    wa->sink_file = NULL;
+    wa->prewarm = NULL;
+    wa->cache = NULL;
+    wa->recorder = NULL;
+    wa->bandwidth = NULL;
+
+    wallhaven_set_retry_policy(wa, NULL);
+    wa->stats = (WallhavenStats){.ratelimit_remaining = -1, .ratelimit_limit = -1};
+    wa->consecutive_failures = 0;
+    wa->breaker_open_until = 0;
+    wa->hedge_response_code = -1;
+
+    return wa;
+}
+
+void wallhaven_free(WallhavenAPI *wa)
+{
+    wallhaven_shared_limit_detach(wa);
+    curl_easy_cleanup(wa->curl);
+    curl_url_cleanup(wa->url);
+    prewarm_free(wa);
+    arena_free(wa);
+
+    wa->allocator.free(wa, wa->allocator.userdata);
+}
+
+void wallhaven_apikey(WallhavenAPI *wa, const char *apikey)
+{
+    wa->apikey = apikey;
+}
+
+WallhavenCode wallhaven_write_to_response(WallhavenAPI *wa, Response *response)
+{
+    check_return(reset(wa), WALLHAVEN_CURL_FAIL);
+
+    // Write curl output to response
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEFUNCTION, write_function), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEDATA, (void *)response), WALLHAVEN_CURL_FAIL);
+    wa->response = response;
+
+    return WALLHAVEN_OK;
+}
+
+WallhavenCode wallhaven_write_to_file(WallhavenAPI *wa, FILE *file)
+{
+    check_return(reset(wa), WALLHAVEN_CURL_FAIL);
+
+    // Write curl ouput to a file
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEFUNCTION, write_function_tofile), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEDATA, (void *)file), WALLHAVEN_CURL_FAIL);
+    wa->file = file;
+
+    return WALLHAVEN_OK;
+}
+
+// Set the path of the url and add the api key when needed
+static WallhavenCode set_path(WallhavenAPI *wa, Path p, const char *id)
+{
+    size_t size;
+    char *path;
+
+    switch (p)
+    {
+    case WALLPAPER_INFO:
+        if (wa->apikey)
+            check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
+    case TAG_INFO:
+        size = 1 + strlen(id) + strlen(p == WALLPAPER_INFO ? WALLPAPER_INFO_PATH : TAG_INFO_PATH);
+        checkp_return(path = (char *)arena_alloc(wa, size), WALLHAVEN_NO_MEMORY);
+        snprintf(path, size, (p == WALLPAPER_INFO ? WALLPAPER_INFO_PATH "%s" : TAG_INFO_PATH "%s"), id);
+        break;
+    case SETTINGS:
+        checkp_return(wa->apikey, WALLHAVEN_NO_API_KEY);
+        check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
+        size = 1 + strlen(USER_SETTINGS_PATH);
+        checkp_return(path = (char *)arena_alloc(wa, size), WALLHAVEN_NO_MEMORY);
+        snprintf(path, size, USER_SETTINGS_PATH);
+        break;
+    case SEARCH:
+        if (wa->apikey)
+            check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
+        size = 1 + strlen(SEARCH_PATH);
+        checkp_return(path = (char *)arena_alloc(wa, size), WALLHAVEN_NO_MEMORY);
+        snprintf(path, size, SEARCH_PATH);
+        break;
+    case COLLECTIONS:
+        if (!id)
+        {
+            checkp_return(wa->apikey, WALLHAVEN_NO_API_KEY);
+            check_return(append_query(wa, "apikey", wa->apikey), WALLHAVEN_CURL_FAIL);
+        }
+        size = 1 + strlen(COLLECTIONS_PATH) + (id ? strlen(id) + 1 /*For '/' */ : 0);
+        checkp_return(path = (char *)arena_alloc(wa, size), WALLHAVEN_NO_MEMORY);
+        snprintf(path, size, COLLECTIONS_PATH "/%s", id);
+        break;
+    default:
+        return WALLHAVEN_UNKNOW_PATH;
+    }
+
+    check_return(curl_url_set(wa->url, CURLUPART_PATH, path, CURLU_URLENCODE), WALLHAVEN_CURL_FAIL);
+
+    return WALLHAVEN_OK;
+}
+
+static bool cache_serve(WallhavenAPI *wa, Path p, const char *id);
+static void cache_store(WallhavenAPI *wa, Path p, const char *id, size_t start_size);
+static void record_call(WallhavenAPI *wa, Path p, const char *id, double started, size_t start_size);
+
+WallhavenCode wallhaven_get_result(WallhavenAPI *wa, Path p, const char *id)
+{
+    int64_t request_start = trace_begin();
+    if (cache_serve(wa, p, id))
+    {
+        trace_end("call", "cache_hit", request_start, p);
+        return WALLHAVEN_OK;
+    }
+    size_t start_size = wa->response ? wa->response->size : 0;
+
+    WallhavenCode wc = set_path(wa, p, id);
+    check_return(wc, wc);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_CURLU, wa->url), WALLHAVEN_CURL_FAIL);
+
+#ifdef DEBUG
+    char *url;
+    curl_url_get(wa->url, CURLUPART_URL, &url, 0);
+    printf("URL: %s\n", url);
+    curl_free(url);
+#endif
+
+    double started = now_seconds();
+    wc = perform(wa, true);
+    if (wc == WALLHAVEN_OK)
+        cache_store(wa, p, id, start_size);
+    if (wa->recorder)
+        record_call(wa, p, id, started, start_size);
+    trace_end("call", "request", request_start, p);
+
+    // Query and path are copied by curl, the scratch memory of this request is no longer needed
+    arena_reset(wa);
+    return wc;
+}
+
+WallhavenCode wallhaven_download(WallhavenAPI *wa, const char *url)
+{
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_CURLU, NULL), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_URL, url), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_FOLLOWLOCATION, 1L), WALLHAVEN_CURL_FAIL);
+
+    int64_t download_start = trace_begin();
+    WallhavenCode wc = perform(wa, false);
+    trace_end("call", "download", download_start, wc);
+    return wc;
+}
+
+WallhavenCode wallhaven_search(WallhavenAPI *wa, Parameters *p)
+{
+#ifdef DEBUG
+    printf(
+        "Parameters:\n"
+        "\tQuery:\n"
+        "\t\tTags = %s\n"
+        "\t\tUser name = %s\n"
+        "\t\tId = %s\n"
+        "\t\tType = %d\n"
+        "\t\tlike = %s\n"
+        "\tCategories = %d\n"
+        "\tPurity = %d\n"
+        "\tSorting = %d\n"
+        "\tOrder = %d\n"
+        "\tTopRange = %d\n"
+        "\tAtleast = %s\n"
+        "\tResolutions = %s\n"
+        "\tratios = %s\n"
+        "\tColors = %s\n"
+        "\tPage = %d\n"
+        "\tSeed = %s\n",
+        p->q->tags,
+        p->q->user_name,
+        p->q->id,
+        p->q->type,
+        p->q->like,
+        p->categories,
+        p->purity,
+        p->sorting,
+        p->order,
+        p->toprange,
+        p->atleast,
+        p->resolutions,
+        p->ratios,
+        p->colors,
+        p->page,
+        p->seed);
+#endif
+
+    int64_t format_start = trace_begin();
+    WallhavenCode wc = format_search(wa, p);
+    trace_end("query", "format", format_start, 0);
+    check_return(wc, wc);
+
+    return wallhaven_get_result(wa, SEARCH, NULL);
+}
+
+WallhavenCode wallhaven_wallpapers_of_collections(WallhavenAPI *wa, const char *user, const char *id, int purity)
+{
+    size_t size = snprintf(NULL, 0, "%s/%s", user, id) + 1;
+    char *concat = (char *)arena_alloc(wa, size);
+    checkp_return(concat, WALLHAVEN_NO_MEMORY);
+    snprintf(concat, size, "%s/%s", user, id);
+
+    WallhavenCode wc = format_purity(wa, purity);
+    check_return(wc, wc);
+
+    return wallhaven_get_result(wa, COLLECTIONS, concat);
+}
+
+void wallhaven_set_on_api_call_limit_error(WallhavenAPI *wa, onMaxAPICallLimitError func)
+{
+    wa->api_call_limit_error = func;
+}
+
+void wallhaven_set_retry_policy(WallhavenAPI *wa, const RetryPolicy *policy)
+{
+    if (policy)
+        wa->retry = *policy;
+    else
+        wa->retry = (RetryPolicy){
+            .max_retries = 3,
+            .base_delay_ms = 500,
+            .max_delay_ms = 30000,
+            .jitter = 0.5,
+            .retry_budget = 10,
+            .retry_budget_ratio = 0.1,
+        };
+
+    wa->retry_tokens = wa->retry.retry_budget;
+}
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+WallhavenCode wallhaven_shared_limit_attach(WallhavenAPI *wa, const char *name, int calls_per_minute)
+{
+    checkp_return(!wa->shared_limit, WALLHAVEN_OK);
+
+    if (calls_per_minute <= 0)
+        calls_per_minute = WALLHAVEN_CALLS_PER_MINUTE;
+
+    struct SharedRateLimit *l;
+    checkp_return(l = (struct SharedRateLimit *)wa_malloc(wa, sizeof(struct SharedRateLimit)), WALLHAVEN_SHARED_LIMIT_FAIL);
+
+    // Segment is set up under flock, which is dropped if the process dies, so a process dying while
+    // setting it up leaves it without the magic and the next one to attach sets it up again
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+    {
+        wa_free(wa, l);
+        return WALLHAVEN_SHARED_LIMIT_FAIL;
+    }
+
+    struct stat st;
+    if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1 ||
+        (st.st_size < (off_t)sizeof(SharedLimitState) && ftruncate(fd, sizeof(SharedLimitState)) == -1))
+    {
+        close(fd);
+        wa_free(wa, l);
+        return WALLHAVEN_SHARED_LIMIT_FAIL;
+    }
+
+    l->state = (SharedLimitState *)mmap(NULL, sizeof(SharedLimitState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (l->state != MAP_FAILED && atomic_load(&l->state->magic) != SHARED_LIMIT_MAGIC)
+    {
+        l->state->burst = limit_burst(calls_per_minute);
+        l->state->interval_us = SHARED_LIMIT_WINDOW_US / (calls_per_minute - l->state->burst + 1);
+        atomic_store(&l->state->tat_us, 0);
+        atomic_store(&l->state->magic, SHARED_LIMIT_MAGIC);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (l->state == MAP_FAILED)
+    {
+        wa_free(wa, l);
+        return WALLHAVEN_SHARED_LIMIT_FAIL;
+    }
+
+    wa->shared_limit = l;
+    return WALLHAVEN_OK;
+}
+
+void wallhaven_shared_limit_detach(WallhavenAPI *wa)
+{
+    checkp_return(wa->shared_limit, );
+
+    munmap(wa->shared_limit->state, sizeof(SharedLimitState));
+    wa_free(wa, wa->shared_limit);
+    wa->shared_limit = NULL;
+}
+
+WallhavenCode wallhaven_shared_limit_remove(const char *name)
+{
+    check_return(shm_unlink(name), WALLHAVEN_SHARED_LIMIT_FAIL);
+    return WALLHAVEN_OK;
+}
+#else
+WallhavenCode wallhaven_shared_limit_attach(WallhavenAPI *wa, const char *name, int calls_per_minute)
+{
+    return WALLHAVEN_SHARED_LIMIT_FAIL;
+}
+
+void wallhaven_shared_limit_detach(WallhavenAPI *wa)
+{
+}
+
+WallhavenCode wallhaven_shared_limit_remove(const char *name)
+{
+    return WALLHAVEN_SHARED_LIMIT_FAIL;
+}
+#endif
+
+// Scheduler
+
+// Given to the WallhavenAPIs of the scheduler so that the scheduler gets to handle the limit
+static bool scheduler_api_call_limit(time_t *start_time)
+{
+    (void)start_time;
+    return false;
+}
+
+static bool request_needs_apikey(ScheduledRequest *r)
+{
+    switch (r->path)
+    {
+    case SETTINGS:
+        return true;
+    case COLLECTIONS:
+        return !r->id;
+    case SEARCH:
+        return r->parameters && (r->parameters->purity & NSFW);
+    default:
+        return false;
+    }
+}
+
+static void scheduler_push_front(WallhavenScheduler *s, ScheduledRequest *r)
+{
+    r->next = s->head[r->priority];
+    s->head[r->priority] = r;
+    if (!s->tail[r->priority])
+        s->tail[r->priority] = r;
+}
+
+// Pick the class to dispatch from using weighted round robin
+static ScheduledRequest *scheduler_pop(WallhavenScheduler *s)
+{
+    for (int round = 0; round < 2; ++round)
+    {
+        for (int p = 0; p < PRIORITY_COUNT; ++p)
+        {
+            if (!s->head[p] || s->credits[p] <= 0)
+                continue;
+
+            ScheduledRequest *r = s->head[p];
+            s->head[p] = r->next;
+            if (!s->head[p])
+                s->tail[p] = NULL;
+            r->next = NULL;
+            --s->credits[p];
+            return r;
+        }
+
+        // Every class with requests has used it's credits, start a new round
+        for (int p = 0; p < PRIORITY_COUNT; ++p)
+            s->credits[p] = s->weights[p];
+    }
+
+    return NULL;
+}
+
+// Find a key which can make the request, waits till a key gets budget
+static SchedulerKey *scheduler_pick_key(WallhavenScheduler *s, bool needs_apikey)
+{
+    for (;;)
+    {
+        double wait = -1;
+
+        for (size_t i = 0; i < s->key_count; ++i)
+        {
+            size_t k = (s->next_key + i) % s->key_count;
+            SchedulerKey *key = &s->keys[k];
+            if (needs_apikey && !key->wa->apikey)
+                continue;
+
+            double w = wallhaven_budget_wait(&key->budget);
+            if (w == 0)
+            {
+                s->next_key = (k + 1) % s->key_count;
+                return key;
+            }
+            if (wait < 0 || w < wait)
+                wait = w;
+        }
+
+        // No key can make this request
+        if (wait < 0)
+            return NULL;
+
+#ifdef DEBUG
+        printf("scheduler: no budget left, waiting for %.2f seconds\n", wait);
+#endif
+        sleep_ms((unsigned int)(wait * 1000) + 1);
+    }
+}
+
+static WallhavenCode scheduler_perform(WallhavenAPI *wa, ScheduledRequest *r)
+{
+    WallhavenCode wc;
+    if (r->response)
+        wc = wallhaven_write_to_response(wa, r->response);
+    else if (r->file)
+        wc = wallhaven_write_to_file(wa, r->file);
+    else
+        wc = reset(wa) == CURLUE_OK ? WALLHAVEN_OK : WALLHAVEN_CURL_FAIL;
+    check_return(wc, wc);
+
+    if (r->path == SEARCH)
+        return wallhaven_search(wa, r->parameters);
+
+    return wallhaven_get_result(wa, r->path, r->id);
+}
+
+WallhavenScheduler *wallhaven_scheduler_init()
+{
+    WallhavenScheduler *s;
+    checkp_return(s = (WallhavenScheduler *)calloc(1, sizeof(WallhavenScheduler)), NULL);
+
+    s->weights[INTERACTIVE] = 8;
+    s->weights[BULK] = 1;
+    for (int p = 0; p < PRIORITY_COUNT; ++p)
+        s->credits[p] = s->weights[p];
+
+    return s;
+}
+
+void wallhaven_scheduler_free(WallhavenScheduler *s)
+{
+    for (size_t i = 0; i < s->key_count; ++i)
+        wallhaven_free(s->keys[i].wa);
+
+    free(s->keys);
+    free(s);
+}
+
+WallhavenCode wallhaven_scheduler_add_key(WallhavenScheduler *s, const char *apikey, int calls_per_minute)
+{
+    SchedulerKey *keys = (SchedulerKey *)realloc(s->keys, (s->key_count + 1) * sizeof(SchedulerKey));
+    checkp_return(keys, WALLHAVEN_NO_MEMORY);
+    s->keys = keys;
+
+    WallhavenAPI *wa;
+    checkp_return(wa = wallhaven_init(), WALLHAVEN_NO_MEMORY);
+    wallhaven_apikey(wa, apikey);
+    wallhaven_set_on_api_call_limit_error(wa, scheduler_api_call_limit);
+
+    s->keys[s->key_count] = (SchedulerKey){.wa = wa};
+    wallhaven_budget_init(&s->keys[s->key_count++].budget, calls_per_minute);
+
+    return WALLHAVEN_OK;
+}
+
+void wallhaven_scheduler_set_weight(WallhavenScheduler *s, Priority priority, int weight)
+{
+    s->weights[priority] = weight < 1 ? 1 : weight;
+    if (s->credits[priority] > s->weights[priority])
+        s->credits[priority] = s->weights[priority];
+}
+
+void wallhaven_scheduler_submit(WallhavenScheduler *s, ScheduledRequest *request)
+{
+    request->next = NULL;
+    if (s->tail[request->priority])
+        s->tail[request->priority]->next = request;
+    else
+        s->head[request->priority] = request;
+    s->tail[request->priority] = request;
+}
+
+bool wallhaven_scheduler_dispatch(WallhavenScheduler *s)
+{
+    ScheduledRequest *r;
+    checkp_return(r = scheduler_pop(s), false);
+
+    SchedulerKey *key = scheduler_pick_key(s, request_needs_apikey(r));
+    if (!key)
+    {
+        r->code = WALLHAVEN_NO_API_KEY;
+        if (r->done)
+            r->done(r, r->userdata);
+        return true;
+    }
+
+    wallhaven_budget_take(&key->budget);
+    ++key->dispatched;
+
+    r->code = scheduler_perform(key->wa, r);
+    if (r->code == WALLHAVEN_TOO_MANY_REQUSTS_ERROR)
+    {
+        // Our budget was out of sync with the server, wait for the key to regain it's budget and retry
+        key->budget.tokens = 0;
+        ++key->rate_limited;
+        scheduler_push_front(s, r);
+        return true;
+    }
+
+    if (r->done)
+    {
+        int64_t callback_start = trace_begin();
+        r->done(r, r->userdata);
+        trace_end("callback", "done", callback_start, r->code);
+    }
+
+    return true;
+}
+
+void wallhaven_scheduler_run(WallhavenScheduler *s)
+{
+    while (wallhaven_scheduler_dispatch(s))
+        ;
+}
+
+// Content addressed store
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+#define STORE_MAGIC 0x57485349u // "WHSI"
+#define STORE_VERSION 1
+#define STORE_INITIAL_CAPACITY 4096
+#define STORE_ENTRY_EMPTY 0
+#define STORE_ENTRY_USED 1
+#define STORE_ENTRY_DELETED 2
+
+// Header of the index file, followed by capacity entries
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t total_bytes; // Size of all the objects (each content counted once)
+    uint64_t clock;       // Incremented on every use, for LRU
+} StoreHeader;
+
+// Wallpaper id -> content hash, open addressing with linear probing
+typedef struct
+{
+    char id[16];
+    uint64_t hash;
+    uint64_t size;
+    uint64_t last_used;
+    uint32_t state;
+    uint32_t reserved;
+} StoreEntry;
+
+#define store_entries(s) ((StoreEntry *)((StoreHeader *)(s)->index + 1))
+
+// FNV-1a
+static uint64_t hash_bytes(const void *data, size_t size, uint64_t h)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+static size_t store_index_size(uint64_t capacity)
+{
+    return sizeof(StoreHeader) + capacity * sizeof(StoreEntry);
+}
+
+static bool store_map(WallhavenStore *s, uint64_t capacity)
+{
+    size_t size = store_index_size(capacity);
+    checkp_return(ftruncate(s->index_fd, size) == 0, false);
+
+    void *index = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->index_fd, 0);
+    checkp_return(index != MAP_FAILED, false);
+
+    s->index = index;
+    s->index_size = size;
+    return true;
+}
+
+static StoreEntry *store_find(WallhavenStore *s, const char *id, bool insert)
+{
+    StoreHeader *h = (StoreHeader *)s->index;
+    StoreEntry *e = store_entries(s);
+    uint64_t mask = h->capacity - 1;
+    StoreEntry *tombstone = NULL;
+
+    // Bounded so that a table without empty entries can't loop forever
+    uint64_t i = hash_bytes(id, strlen(id), HASH_SEED) & mask;
+    for (uint64_t probes = 0; probes < h->capacity; ++probes, i = (i + 1) & mask)
+    {
+        if (e[i].state == STORE_ENTRY_EMPTY)
+            return insert ? (tombstone ? tombstone : &e[i]) : NULL;
+        if (e[i].state == STORE_ENTRY_DELETED)
+        {
+            if (!tombstone)
+                tombstone = &e[i];
+            continue;
+        }
+        if (!strncmp(e[i].id, id, sizeof(e[i].id)))
+            return &e[i];
+    }
+    return insert ? tombstone : NULL;
+}
+
+// Count the removed entries, they take up the table like used ones till it's rehashed
+static void store_count_deleted(WallhavenStore *s)
+{
+    StoreHeader *h = (StoreHeader *)s->index;
+    StoreEntry *e = store_entries(s);
+    s->deleted = 0;
+    for (uint64_t i = 0; i < h->capacity; ++i)
+        s->deleted += e[i].state == STORE_ENTRY_DELETED;
+}
+
+// Mark an entry as removed
+static void store_remove(WallhavenStore *s, StoreEntry *e)
+{
+    e->state = STORE_ENTRY_DELETED;
+    --((StoreHeader *)s->index)->count;
+    ++s->deleted;
+}
+
+// Remove every id of the object and take its size off the total
+static void store_drop_object(WallhavenStore *s, uint64_t hash, uint64_t size)
+{
+    StoreHeader *h = (StoreHeader *)s->index;
+    StoreEntry *e = store_entries(s);
+    for (uint64_t i = 0; i < h->capacity; ++i)
+        if (e[i].state == STORE_ENTRY_USED && e[i].hash == hash)
+            store_remove(s, &e[i]);
+    h->total_bytes -= size < h->total_bytes ? size : h->total_bytes;
+}
+
+// Rebuild the index with the given capacity, dropping the removed entries
+static bool store_rehash(WallhavenStore *s, uint64_t capacity)
+{
+    StoreHeader old = *(StoreHeader *)s->index;
+    size_t old_size = old.capacity * sizeof(StoreEntry);
+    StoreEntry *copy;
+    checkp_return(copy = (StoreEntry *)malloc(old_size), false);
+    memcpy(copy, store_entries(s), old_size);
+
+    munmap(s->index, s->index_size);
+    if (!store_map(s, capacity))
+    {
+        free(copy);
+        return false;
+    }
+
+    StoreHeader *h = (StoreHeader *)s->index;
+    *h = old;
+    h->capacity = capacity;
+    h->count = 0;
+    memset(store_entries(s), 0, h->capacity * sizeof(StoreEntry));
+
+    for (uint64_t i = 0; i < old.capacity; ++i)
+    {
+        if (copy[i].state != STORE_ENTRY_USED)
+            continue;
+        *store_find(s, copy[i].id, true) = copy[i];
+        ++h->count;
+    }
+    s->deleted = 0;
+
+    free(copy);
+    return true;
+}
+
+static void store_object_path(WallhavenStore *s, uint64_t hash, char *path, size_t size)
+{
+    snprintf(path, size, "%s/objects/%016llx", s->dir, (unsigned long long)hash);
+}
+
+// Hash the content of the file
+static bool hash_file(const char *path, uint64_t *hash, uint64_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    checkp_return(fd != -1, false);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return false;
+    }
+
+    *size = st.st_size;
+    *hash = hash_bytes(&st.st_size, sizeof(st.st_size), HASH_SEED);
+    if (st.st_size)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        *hash = hash_bytes(data, st.st_size, *hash);
+        munmap(data, st.st_size);
+    }
+
+    close(fd);
+    return true;
+}
+
+// Whether the two files hold the same bytes
+static bool same_content(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    bool same = fa && fb;
+    char x[1 << 15], y[1 << 15];
+    while (same)
+    {
+        size_t n = fread(x, 1, sizeof(x), fa);
+        same = fread(y, 1, sizeof(y), fb) == n && !memcmp(x, y, n);
+        if (n < sizeof(x))
+        {
+            same = same && !ferror(fa) && !ferror(fb);
+            break;
+        }
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return same;
+}
+
+// Make the object appear at dest without copying if possible
+static bool store_materialize(const char *object, const char *dest)
+{
+    unlink(dest);
+    if (link(object, dest) == 0)
+        return true;
+
+    int in = open(object, O_RDONLY);
+    checkp_return(in != -1, false);
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1)
+    {
+        close(in);
+        return false;
+    }
+
+    bool ok = false;
+#if defined(WALLHAVEN_PLATFORM_LINUX) && defined(FICLONE)
+    // Different directory or file system doesn't allow hard links, try sharing the blocks
+    ok = ioctl(out, FICLONE, in) == 0;
+#endif
+
+    char buffer[1 << 16];
+    ssize_t n = 0;
+    while (!ok && (n = read(in, buffer, sizeof(buffer))) > 0)
+        if (write(out, buffer, n) != n)
+            break;
+    if (!ok)
+        ok = n == 0;
+
+    close(in);
+    close(out);
+    return ok;
+}
+
+// An object of the store, used by one or more ids
+typedef struct
+{
+    uint64_t hash;
+    uint64_t size;
+    uint64_t last_used; // Latest use through any of its ids
+} StoreObject;
+
+static int store_object_by_hash(const void *a, const void *b)
+{
+    uint64_t x = ((const StoreObject *)a)->hash, y = ((const StoreObject *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static int store_object_by_use(const void *a, const void *b)
+{
+    uint64_t x = ((const StoreObject *)a)->last_used, y = ((const StoreObject *)b)->last_used;
+    return x < y ? -1 : x > y;
+}
+
+// Remove least recently used objects till the store fits in max_bytes
+static void store_evict(WallhavenStore *s, uint64_t keep_hash)
+{
+    StoreHeader *h = (StoreHeader *)s->index;
+    StoreEntry *e = store_entries(s);
+    checkp_return(s->max_bytes && h->total_bytes > s->max_bytes, );
+
+    // One pass over the index gathers the objects, an object is as recent as the most recent of its ids
+    StoreObject *objects = (StoreObject *)malloc((h->count ? h->count : 1) * sizeof(StoreObject));
+    checkp_return(objects, );
+    size_t count = 0;
+    for (uint64_t i = 0; i < h->capacity && count < h->count; ++i)
+        if (e[i].state == STORE_ENTRY_USED && e[i].hash != keep_hash)
+            objects[count++] = (StoreObject){e[i].hash, e[i].size, e[i].last_used};
+
+    qsort(objects, count, sizeof(StoreObject), store_object_by_hash);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (unique && objects[unique - 1].hash == objects[i].hash)
+        {
+            if (objects[i].last_used > objects[unique - 1].last_used)
+                objects[unique - 1].last_used = objects[i].last_used;
+        }
+        else
+            objects[unique++] = objects[i];
+    }
+    qsort(objects, unique, sizeof(StoreObject), store_object_by_use);
+
+    size_t evicted = 0;
+    while (evicted < unique && h->total_bytes > s->max_bytes)
+    {
+        char path[4096];
+        store_object_path(s, objects[evicted].hash, path, sizeof(path));
+        unlink(path);
+        h->total_bytes -= objects[evicted].size;
+        ++s->evictions;
+        ++evicted;
+    }
+
+    // All the ids having the same content go with the object
+    qsort(objects, evicted, sizeof(StoreObject), store_object_by_hash);
+    for (uint64_t i = 0; evicted && i < h->capacity; ++i)
+    {
+        StoreObject key = {.hash = e[i].hash};
+        if (e[i].state == STORE_ENTRY_USED && bsearch(&key, objects, evicted, sizeof(StoreObject), store_object_by_hash))
+            store_remove(s, &e[i]);
+    }
+    free(objects);
+}
+
+WallhavenStore *wallhaven_store_open(const char *dir, size_t max_bytes)
+{
+    WallhavenStore *s;
+    checkp_return(s = (WallhavenStore *)calloc(1, sizeof(WallhavenStore)), NULL);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/objects", dir);
+    mkdir(dir, 0755);
+    mkdir(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    s->index_fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (!(s->dir = strdup(dir)) || s->index_fd == -1 || fstat(s->index_fd, &st) == -1)
+        goto fail;
+
+    s->max_bytes = max_bytes;
+    if (st.st_size >= (off_t)sizeof(StoreHeader))
+    {
+        StoreHeader h;
+        if (pread(s->index_fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != STORE_MAGIC || h.version != STORE_VERSION ||
+            (off_t)store_index_size(h.capacity) > st.st_size || !store_map(s, h.capacity))
+            goto fail;
+        store_count_deleted(s);
+    }
+    else
+    {
+        if (!store_map(s, STORE_INITIAL_CAPACITY))
+            goto fail;
+        *(StoreHeader *)s->index = (StoreHeader){
+            .magic = STORE_MAGIC,
+            .version = STORE_VERSION,
+            .capacity = STORE_INITIAL_CAPACITY,
+        };
+    }
+
+    return s;
+
+fail:
+    if (s->index_fd != -1)
+        close(s->index_fd);
+    free(s->dir);
+    free(s);
+    return NULL;
+}
+
+void wallhaven_store_close(WallhavenStore *s)
+{
+    msync(s->index, s->index_size, MS_ASYNC);
+    munmap(s->index, s->index_size);
+    close(s->index_fd);
+    free(s->dir);
+    free(s);
+}
+
+bool wallhaven_store_has(WallhavenStore *s, const char *id)
+{
+    return store_find(s, id, false) != NULL;
+}
+
+WallhavenCode wallhaven_store_get(WallhavenStore *s, WallhavenAPI *wa, const char *id, const char *url, const char *dest)
+{
+    char object[4096];
+    StoreEntry *e = store_find(s, id, false);
+
+    if (e)
+    {
+        store_object_path(s, e->hash, object, sizeof(object));
+        if (access(object, F_OK) == 0)
+        {
+            ++s->hits;
+            e->last_used = ++((StoreHeader *)s->index)->clock;
+            if (dest && !store_materialize(object, dest))
+                return WALLHAVEN_IO_FAIL;
+            return WALLHAVEN_OK;
+        }
+
+        // Object was removed from outside, it no longer takes space and none of its ids can be served
+        store_drop_object(s, e->hash, e->size);
+    }
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s/objects/tmp.XXXXXX", s->dir);
+    int fd = mkstemp(tmp);
+    checkp_return(fd != -1, WALLHAVEN_IO_FAIL);
+    fchmod(fd, 0644);
+    FILE *file = fdopen(fd, "w");
+    if (!file)
+    {
+        close(fd);
+        unlink(tmp);
+        return WALLHAVEN_IO_FAIL;
+    }
+
+    WallhavenCode wc = wallhaven_write_to_file(wa, file);
+    if (wc == WALLHAVEN_OK && (wc = wallhaven_download(wa, url)) == WALLHAVEN_OK && wa->stats.last_status != 200)
+        wc = WALLHAVEN_CURL_FAIL; // Error page, not the wallpaper
+    reset(wa);
+    if (fclose(file) != 0 && wc == WALLHAVEN_OK)
+        wc = WALLHAVEN_IO_FAIL;
+
+    uint64_t hash, size;
+    if (wc == WALLHAVEN_OK && !hash_file(tmp, &hash, &size))
+        wc = WALLHAVEN_IO_FAIL;
+    if (wc != WALLHAVEN_OK)
+    {
+        unlink(tmp);
+        return wc;
+    }
+    ++s->downloads;
+
+    // The hash only picks the object, a different content under it (a collision) moves on to the next hash
+    bool exists;
+    for (;; ++hash)
+    {
+        store_object_path(s, hash, object, sizeof(object));
+        if (!(exists = access(object, F_OK) == 0) || same_content(tmp, object))
+            break;
+    }
+    if (exists)
+    {
+        // Same content under another id
+        ++s->dedup_hits;
+        unlink(tmp);
+    }
+    else if (rename(tmp, object) == -1)
+    {
+        unlink(tmp);
+        return WALLHAVEN_IO_FAIL;
+    }
+
+    // Removed entries count towards the load, rehash in place when they are most of it
+    StoreHeader *h = (StoreHeader *)s->index;
+    if ((h->count + s->deleted + 1) * 10 > h->capacity * 7 &&
+        !store_rehash(s, s->deleted > h->count ? h->capacity : h->capacity * 2))
+        return WALLHAVEN_IO_FAIL;
+    h = (StoreHeader *)s->index;
+
+    e = store_find(s, id, true);
+    if (e->state == STORE_ENTRY_DELETED)
+        --s->deleted;
+    *e = (StoreEntry){
+        .hash = hash,
+        .size = size,
+        .last_used = ++h->clock,
+        .state = STORE_ENTRY_USED,
+    };
+    strncpy(e->id, id, sizeof(e->id) - 1);
+    ++h->count;
+    if (!exists)
+        h->total_bytes += size;
+
+    store_evict(s, hash);
+
+    if (dest && !store_materialize(object, dest))
+        return WALLHAVEN_IO_FAIL;
+
+    return WALLHAVEN_OK;
+}
+
+#else
+WallhavenStore *wallhaven_store_open(const char *dir, size_t max_bytes)
+{
+    return NULL;
+}
+
+void wallhaven_store_close(WallhavenStore *s)
+{
+}
+
+bool wallhaven_store_has(WallhavenStore *s, const char *id)
+{
+    return false;
+}
+
+WallhavenCode wallhaven_store_get(WallhavenStore *s, WallhavenAPI *wa, const char *id, const char *url, const char *dest)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+#endif
+
+// Thumbnails
+
+#define THUMB_BUCKETS 1024
+
+struct ThumbEntry
+{
+    char id[16];
+    ThumbSize size;
+    Response data;
+    struct ThumbEntry *prev, *next; // LRU list, most recently used first
+    struct ThumbEntry *chain;       // Hash bucket
+};
+
+static size_t thumb_bucket(const char *id, ThumbSize size)
+{
+    return hash_bytes(id, strlen(id), HASH_SEED + size) % THUMB_BUCKETS;
+}
+
+static struct ThumbEntry *thumbs_find(WallhavenThumbs *t, const char *id, ThumbSize size)
+{
+    for (struct ThumbEntry *e = t->buckets[thumb_bucket(id, size)]; e; e = e->chain)
+        if (e->size == size && !strcmp(e->id, id))
+            return e;
+    return NULL;
+}
+
+static void thumbs_unlink(WallhavenThumbs *t, struct ThumbEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        t->lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        t->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void thumbs_push_front(WallhavenThumbs *t, struct ThumbEntry *e)
+{
+    e->prev = NULL;
+    e->next = t->lru_head;
+    if (t->lru_head)
+        t->lru_head->prev = e;
+    t->lru_head = e;
+    if (!t->lru_tail)
+        t->lru_tail = e;
+}
+
+static void thumbs_remove(WallhavenThumbs *t, struct ThumbEntry *e)
+{
+    struct ThumbEntry **p = &t->buckets[thumb_bucket(e->id, e->size)];
+    while (*p != e)
+        p = &(*p)->chain;
+    *p = e->chain;
+
+    thumbs_unlink(t, e);
+    t->bytes -= e->data.size;
+    free(e->data.value);
+    free(e);
+}
+
+static void thumbs_evict(WallhavenThumbs *t)
+{
+    while (t->bytes > t->max_bytes && t->lru_tail)
+    {
+        thumbs_remove(t, t->lru_tail);
+        ++t->evictions;
+    }
+}
+
+static const char *thumb_key(ThumbSize size)
+{
+    switch (size)
+    {
+    case LARGE_THUMB:
+        return "large";
+    case ORIGINAL_THUMB:
+        return "original";
+    default:
+        return "small";
+    }
+}
+
+WallhavenThumbs *wallhaven_thumbs_init(size_t max_bytes)
+{
+    WallhavenThumbs *t;
+    checkp_return(t = (WallhavenThumbs *)calloc(1, sizeof(WallhavenThumbs)), NULL);
+
+    t->buckets = (struct ThumbEntry **)calloc(THUMB_BUCKETS, sizeof(struct ThumbEntry *));
+    t->multi = curl_multi_init();
+    if (!t->buckets || !t->multi)
+    {
+        wallhaven_thumbs_free(t);
+        return NULL;
+    }
+
+    // Send all the requests over one HTTP/2 connection when possible
+    curl_multi_setopt(t->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(t->multi, CURLMOPT_MAX_HOST_CONNECTIONS, 6L);
+    t->max_bytes = max_bytes;
+
+    return t;
+}
+
+void wallhaven_thumbs_free(WallhavenThumbs *t)
+{
+    while (t->lru_head)
+        thumbs_remove(t, t->lru_head);
+    if (t->multi)
+        curl_multi_cleanup(t->multi);
+    free(t->buckets);
+    free(t);
+}
+
+WallhavenCode wallhaven_thumbs_fetch_page(WallhavenThumbs *t, const Response *page, ThumbSize size)
+{
+    checkp_return(page->value, WALLHAVEN_OK);
+
+    WallhavenJson j;
+    WallhavenCode wc = wallhaven_json_parse(&j, page->value, page->size);
+    check_return(wc, wc);
+
+    size_t count = wallhaven_json_count(&j, "data");
+    char id[16], url[512], path[64];
+    int running = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        snprintf(path, sizeof(path), "data[%zu].id", i);
+        if (!wallhaven_json_string(&j, path, id, sizeof(id)))
+            continue;
+        snprintf(path, sizeof(path), "data[%zu].thumbs.%s", i, thumb_key(size));
+        if (!wallhaven_json_string(&j, path, url, sizeof(url)))
+            continue;
+
+        struct ThumbEntry *e = thumbs_find(t, id, size);
+        if (e)
+        {
+            ++t->hits;
+            thumbs_unlink(t, e);
+            thumbs_push_front(t, e);
+            continue;
+        }
+
+        CURL *curl = NULL;
+        if (!(e = (struct ThumbEntry *)calloc(1, sizeof(struct ThumbEntry))) || !(curl = curl_easy_init()))
+        {
+            free(e);
+            wc = WALLHAVEN_CURL_FAIL;
+            break;
+        }
+        strcpy(e->id, id);
+        e->size = size;
+
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_function);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&e->data);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)e);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_multi_add_handle(t->multi, curl);
+        ++running;
+        ++t->misses;
+
+        // Insert now so that the same id appearing twice in the page is fetched once
+        size_t b = thumb_bucket(id, size);
+        e->chain = t->buckets[b];
+        t->buckets[b] = e;
+        thumbs_push_front(t, e);
+    }
+
+    wallhaven_json_free(&j);
+
+    while (running)
+    {
+        curl_multi_perform(t->multi, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(t->multi, &queued)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            struct ThumbEntry *e;
+            long code = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&e);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+
+            if (msg->data.result == CURLE_OK && code == 200)
+            {
+                t->bytes += e->data.size;
+                ++t->fetched;
+            }
+            else
+            {
+                e->data.size = 0;
+                thumbs_remove(t, e);
+                ++t->failed;
+                wc = WALLHAVEN_CURL_FAIL;
+            }
+
+            curl_multi_remove_handle(t->multi, msg->easy_handle);
+            curl_easy_cleanup(msg->easy_handle);
+        }
+
+        if (running)
+            curl_multi_poll(t->multi, NULL, 0, 1000, NULL);
+    }
+
+    thumbs_evict(t);
+    return wc;
+}
+
+bool wallhaven_thumbs_get(WallhavenThumbs *t, const char *id, ThumbSize size, Span *span)
+{
+    struct ThumbEntry *e = thumbs_find(t, id, size);
+    checkp_return(e, false);
+
+    thumbs_unlink(t, e);
+    thumbs_push_front(t, e);
+    span->data = (const unsigned char *)e->data.value;
+    span->size = e->data.size;
+    return true;
+}
+
+// JSON
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static int ctz64(uint64_t x)
+{
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+}
+#else
+#define ctz64(x) __builtin_ctzll(x)
+#endif
+
+#define JSON_BLOCK 64
+#define JSON_ROOT UINT32_MAX // Delimiter before the root value
+
+typedef struct
+{
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t structural; // {}[]:,
+} JsonMasks;
+
+#if defined(__SSE2__)
+static uint64_t json_eq_mask(const char *p, char c)
+{
+    __m128i v = _mm_set1_epi8(c);
+    uint64_t m = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i * 16));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, v)) << (i * 16);
+    }
+    return m;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static uint64_t json_eq_mask(const char *p, char c)
+{
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t b = vld1q_u8(bits), v = vdupq_n_u8((uint8_t)c);
+    uint64_t m = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)p + i * 16), v), b);
+        uint8x8_t lo = vget_low_u8(eq), hi = vget_high_u8(eq);
+        uint64_t l = vaddv_u8(lo), h = vaddv_u8(hi);
+        m |= (l | h << 8) << (i * 16);
+    }
+    return m;
+}
+#endif
+
+static void json_block_masks(const char *p, JsonMasks *m)
+{
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    m->quote = json_eq_mask(p, '"');
+    m->backslash = json_eq_mask(p, '\\');
+    m->structural = json_eq_mask(p, '{') | json_eq_mask(p, '}') | json_eq_mask(p, '[') | json_eq_mask(p, ']') |
+                    json_eq_mask(p, ':') | json_eq_mask(p, ',');
+#else
+    *m = (JsonMasks){0};
+    for (int i = 0; i < JSON_BLOCK; ++i)
+    {
+        uint64_t bit = 1ULL << i;
+        switch (p[i])
+        {
+        case '"':
+            m->quote |= bit;
+            break;
+        case '\\':
+            m->backslash |= bit;
+            break;
+        case '{':
+        case '}':
+        case '[':
+        case ']':
+        case ':':
+        case ',':
+            m->structural |= bit;
+            break;
+        }
+    }
+#endif
+}
+
+// Bit i of result is xor of bits 0..i of x
+static uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static bool json_reserve(WallhavenJson *j, size_t n)
+{
+    if (j->count + n <= j->capacity)
+        return true;
+
+    size_t capacity = j->capacity ? j->capacity * 2 : 1024;
+    while (capacity < j->count + n)
+        capacity *= 2;
+
+    uint32_t *positions = (uint32_t *)realloc(j->positions, capacity * sizeof(uint32_t));
+    checkp_return(positions, false);
+    j->positions = positions;
+    j->capacity = capacity;
+    return true;
+}
+
+static size_t json_skip_ws(const WallhavenJson *j, size_t i)
+{
+    while (i < j->size && (j->text[i] == ' ' || j->text[i] == '\n' || j->text[i] == '\r' || j->text[i] == '\t'))
+        ++i;
+    return i;
+}
+
+// Offset of the value which follows the delimiter d
+static size_t json_value_start(const WallhavenJson *j, uint32_t d)
+{
+    return json_skip_ws(j, d == JSON_ROOT ? 0 : j->positions[d] + 1);
+}
+
+// Whether the value starting at start opens with the delimiter after d, in malformed text it can be another one
+static bool json_opens(const WallhavenJson *j, uint32_t d, size_t start)
+{
+    return d + 1 < j->count && j->positions[d + 1] == start;
+}
+
+// Index of the delimiter (',' or the closing bracket) which follows the value after the delimiter d
+static uint32_t json_value_end(const WallhavenJson *j, uint32_t d)
+{
+    size_t start = json_value_start(j, d);
+    char c = start < j->size ? j->text[start] : 0;
+    if ((c == '{' || c == '[' || c == '"') && !json_opens(j, d, start))
+        return (uint32_t)j->count; // No delimiter there, so the walk stops
+    if (c == '{' || c == '[')
+        return j->matches[d + 1] + 1;
+    if (c == '"')
+        return d + 3;
+    return d + 1;
+}
+
+static char json_char(const WallhavenJson *j, uint32_t i)
+{
+    return i < j->count ? j->text[j->positions[i]] : 0;
+}
+
+// Find the value of the key in the object following the delimiter d, returns the delimiter (':') before the value
+static bool json_member(const WallhavenJson *j, uint32_t d, const char *key, size_t key_size, uint32_t *out)
+{
+    size_t start = json_value_start(j, d);
+    checkp_return(start < j->size && j->text[start] == '{' && json_opens(j, d, start), false);
+
+    uint32_t k = d + 1 + 1; // Opening quote of the first key
+    while (json_char(j, k) == '"')
+    {
+        checkp_return(json_char(j, k + 1) == '"' && json_char(j, k + 2) == ':', false);
+        uint32_t open = j->positions[k], close = j->positions[k + 1];
+        if (close - open - 1 == key_size && !memcmp(j->text + open + 1, key, key_size))
+        {
+            *out = k + 2;
+            return true;
+        }
+
+        uint32_t t = json_value_end(j, k + 2);
+        checkp_return(json_char(j, t) == ',', false);
+        k = t + 1;
+    }
+
+    return false;
+}
+
+// Find the n-th element of the array following the delimiter d, returns the delimiter before the element
+static bool json_element(const WallhavenJson *j, uint32_t d, size_t n, uint32_t *out)
+{
+    size_t start = json_value_start(j, d);
+    checkp_return(start < j->size && j->text[start] == '[' && json_opens(j, d, start), false);
+    checkp_return(j->text[json_skip_ws(j, start + 1)] != ']', false);
+
+    uint32_t e = d + 1; // The '['
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint32_t t = json_value_end(j, e);
+        checkp_return(json_char(j, t) == ',', false);
+        e = t;
+    }
+
+    *out = e;
+    return true;
+}
+
+// Follow the path like data[2].thumbs.small, returns the delimiter before the value
+static bool json_walk(const WallhavenJson *j, const char *path, uint32_t *out)
+{
+    uint32_t d = JSON_ROOT;
+    const char *p = path;
+
+    while (*p)
+    {
+        if (*p == '.')
+            ++p;
+        if (*p == '[')
+        {
+            char *end;
+            unsigned long n = strtoul(p + 1, &end, 10);
+            checkp_return(*end == ']', false);
+            checkp_return(json_element(j, d, n, &d), false);
+            p = end + 1;
+        }
+        else
+        {
+            size_t len = strcspn(p, ".[");
+            checkp_return(len, false);
+            checkp_return(json_member(j, d, p, len, &d), false);
+            p += len;
+        }
+    }
+
+    *out = d;
+    return true;
+}
+
+WallhavenCode wallhaven_json_parse(WallhavenJson *j, const char *text, size_t size)
+{
+    *j = (WallhavenJson){.text = text, .size = size};
+
+    uint64_t escape_carry = 0, string_carry = 0;
+    char tail[JSON_BLOCK];
+
+    for (size_t base = 0; base < size; base += JSON_BLOCK)
+    {
+        const char *block = text + base;
+        if (size - base < JSON_BLOCK)
+        {
+            memset(tail, ' ', JSON_BLOCK);
+            memcpy(tail, block, size - base);
+            block = tail;
+        }
+
+        JsonMasks m;
+        json_block_masks(block, &m);
+
+        // Characters escaped by a backslash, a backslash escaped by another one doesn't escape
+        uint64_t escaped = escape_carry, b = m.backslash & ~escape_carry;
+        escape_carry = 0;
+        while (b)
+        {
+            int i = ctz64(b);
+            b &= b - 1;
+            if (i == JSON_BLOCK - 1)
+                escape_carry = 1;
+            else
+            {
+                escaped |= 1ULL << (i + 1);
+                b &= ~(1ULL << (i + 1));
+            }
+        }
+
+        uint64_t quotes = m.quote & ~escaped;
+        uint64_t in_string = prefix_xor(quotes) ^ string_carry;
+        string_carry = (in_string >> 63) ? ~0ULL : 0;
+
+        uint64_t s = (m.structural & ~in_string) | quotes;
+        checkp_return(json_reserve(j, JSON_BLOCK), WALLHAVEN_JSON_ERROR);
+        while (s)
+        {
+            j->positions[j->count++] = (uint32_t)(base + ctz64(s));
+            s &= s - 1;
+        }
+    }
+
+    if (string_carry)
+    {
+        wallhaven_json_free(j);
+        return WALLHAVEN_JSON_ERROR;
+    }
+
+    // Match the brackets so that skipping a value is a lookup
+    uint32_t *stack = NULL;
+    size_t depth = 0;
+    if (!(j->matches = (uint32_t *)malloc((j->count + 1) * sizeof(uint32_t))) ||
+        !(stack = (uint32_t *)malloc((j->count + 1) * sizeof(uint32_t))))
+    {
+        free(stack);
+        wallhaven_json_free(j);
+        return WALLHAVEN_JSON_ERROR;
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; i < j->count && ok; ++i)
+    {
+        char c = text[j->positions[i]];
+        if (c == '{' || c == '[')
+            stack[depth++] = i;
+        else if (c == '}' || c == ']')
+        {
+            ok = depth && text[j->positions[stack[depth - 1]]] == (c == '}' ? '{' : '[');
+            if (ok)
+                j->matches[stack[--depth]] = i;
+        }
+    }
+    free(stack);
+
+    if (!ok || depth)
+    {
+        wallhaven_json_free(j);
+        return WALLHAVEN_JSON_ERROR;
+    }
+
+    return WALLHAVEN_OK;
+}
+
+void wallhaven_json_free(WallhavenJson *j)
+{
+    free(j->positions);
+    free(j->matches);
+    j->positions = j->matches = NULL;
+    j->count = j->capacity = 0;
+}
+
+bool wallhaven_json_raw(const WallhavenJson *j, const char *path, Span *value)
+{
+    uint32_t d;
+    checkp_return(json_walk(j, path, &d), false);
+
+    size_t start = json_value_start(j, d);
+    checkp_return(start < j->size, false);
+
+    size_t end;
+    char c = j->text[start];
+    checkp_return((c != '{' && c != '[' && c != '"') || json_opens(j, d, start), false);
+    if (c == '{' || c == '[')
+        end = j->positions[j->matches[d + 1]] + 1;
+    else if (c == '"')
+    {
+        ++start;
+        end = j->positions[d + 2];
+    }
+    else
+    {
+        end = d + 1 < j->count ? j->positions[d + 1] : j->size;
+        while (end > start && strchr(" \n\r\t", j->text[end - 1]))
+            --end;
+    }
+
+    value->data = (const unsigned char *)j->text + start;
+    value->size = end - start;
+    return true;
+}
+
+// Append code point as UTF-8
+static size_t utf8_encode(unsigned long cp, char *out)
+{
+    if (cp < 0x80)
+        return out[0] = (char)cp, 1;
+    if (cp < 0x800)
+        return out[0] = (char)(0xc0 | cp >> 6), out[1] = (char)(0x80 | (cp & 0x3f)), 2;
+    if (cp < 0x10000)
+        return out[0] = (char)(0xe0 | cp >> 12), out[1] = (char)(0x80 | ((cp >> 6) & 0x3f)),
+               out[2] = (char)(0x80 | (cp & 0x3f)), 3;
+    return out[0] = (char)(0xf0 | cp >> 18), out[1] = (char)(0x80 | ((cp >> 12) & 0x3f)),
+           out[2] = (char)(0x80 | ((cp >> 6) & 0x3f)), out[3] = (char)(0x80 | (cp & 0x3f)), 4;
+}
+
+static unsigned long hex4(const unsigned char *p)
+{
+    char h[5] = {(char)p[0], (char)p[1], (char)p[2], (char)p[3], 0};
+    return strtoul(h, NULL, 16);
+}
+
+size_t wallhaven_json_string(const WallhavenJson *j, const char *path, char *out, size_t size)
+{
+    if (size)
+        out[0] = 0;
+
+    // Only strings, the text of a string starts after its quote
+    Span v;
+    checkp_return(wallhaven_json_raw(j, path, &v), 0);
+    checkp_return((const char *)v.data > j->text && v.data[-1] == '"', 0);
+
+    size_t n = 0;
+    char utf8[4];
+    for (size_t i = 0; i < v.size; ++i)
+    {
+        size_t len = 1;
+        utf8[0] = v.data[i];
+        if (v.data[i] == '\\' && i + 1 < v.size)
+        {
+            switch (v.data[++i])
+            {
+            case 'n':
+                utf8[0] = '\n';
+                break;
+            case 't':
+                utf8[0] = '\t';
+                break;
+            case 'r':
+                utf8[0] = '\r';
+                break;
+            case 'b':
+                utf8[0] = '\b';
+                break;
+            case 'f':
+                utf8[0] = '\f';
+                break;
+            case 'u':
+                if (i + 4 < v.size)
+                {
+                    unsigned long cp = hex4(v.data + i + 1);
+                    i += 4;
+                    // Surrogate pair
+                    if (cp >= 0xd800 && cp < 0xdc00 && i + 6 < v.size && v.data[i + 1] == '\\' && v.data[i + 2] == 'u')
+                    {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (hex4(v.data + i + 3) - 0xdc00);
+                        i += 6;
+                    }
+                    len = utf8_encode(cp, utf8);
+                }
+                break;
+            default:
+                utf8[0] = v.data[i];
+            }
+        }
+
+        if (n + len < size)
+            memcpy(out + n, utf8, len);
+        n += len;
+    }
+
+    if (size)
+        out[n < size ? n : size - 1] = 0;
+    return n;
+}
+
+bool wallhaven_json_long(const WallhavenJson *j, const char *path, long *value)
+{
+    Span v;
+    checkp_return(wallhaven_json_raw(j, path, &v), false);
+
+    // The span isn't NUL terminated, so no strtol
+    size_t i = v.size && v.data[0] == '-';
+    checkp_return(i < v.size && v.data[i] >= '0' && v.data[i] <= '9', false);
+    unsigned long n = 0, max = i ? (unsigned long)LONG_MAX + 1 : LONG_MAX;
+    for (; i < v.size && v.data[i] >= '0' && v.data[i] <= '9'; ++i)
+    {
+        checkp_return(n <= (max - (v.data[i] - '0')) / 10, false);
+        n = n * 10 + (v.data[i] - '0');
+    }
+
+    *value = v.data[0] == '-' ? (long)(0 - n) : (long)n;
+    return true;
+}
+
+size_t wallhaven_json_count(const WallhavenJson *j, const char *path)
+{
+    uint32_t d;
+    checkp_return(json_walk(j, path, &d), 0);
+
+    size_t start = json_value_start(j, d);
+    checkp_return(start < j->size, 0);
+
+    char c = j->text[start];
+    checkp_return((c == '[' || c == '{') && json_opens(j, d, start), 0);
+    checkp_return(j->text[json_skip_ws(j, start + 1)] != (c == '[' ? ']' : '}'), 0);
+
+    // Skip over the elements or members, key of a member is 3 past the delimiter before it
+    size_t n = 0;
+    uint32_t t = d + 1;
+    do
+    {
+        checkp_return(c == '[' || (json_char(j, t + 1) == '"' && json_char(j, t + 2) == '"' && json_char(j, t + 3) == ':'), 0);
+        t = json_value_end(j, c == '[' ? t : t + 3);
+        ++n;
+    } while (json_char(j, t) == ',');
+
+    return n;
+}
+
+// Binary encoding
+
+#define BINARY_MAGIC 0x42564857u // "WHVB"
+#define BINARY_VERSION 1
+
+// Layout must not depend on the compiler
+_Static_assert(sizeof(BinaryHeader) == 32, "BinaryHeader layout changed");
+_Static_assert(sizeof(BinaryWallpaper) == 160, "BinaryWallpaper layout changed");
+_Static_assert(sizeof(BinaryTag) == 56, "BinaryTag layout changed");
+_Static_assert(sizeof(BinaryCollection) == 40, "BinaryCollection layout changed");
+
+typedef enum
+{
+    FIELD_NUMBER,
+    FIELD_STRING,
+    FIELD_LIST // Array of strings, stored joined by ','
+} BinaryFieldType;
+
+typedef struct
+{
+    const char *key;
+    size_t offset;
+    BinaryFieldType type;
+} BinaryField;
+
+#define FIELD(record, member, key, type) {key, offsetof(record, member), type}
+
+static const BinaryField wallpaper_fields[] = {
+    FIELD(BinaryWallpaper, id, "id", FIELD_STRING),
+    FIELD(BinaryWallpaper, url, "url", FIELD_STRING),
+    FIELD(BinaryWallpaper, short_url, "short_url", FIELD_STRING),
+    FIELD(BinaryWallpaper, views, "views", FIELD_NUMBER),
+    FIELD(BinaryWallpaper, favorites, "favorites", FIELD_NUMBER),
+    FIELD(BinaryWallpaper, source, "source", FIELD_STRING),
+    FIELD(BinaryWallpaper, purity, "purity", FIELD_STRING),
+    FIELD(BinaryWallpaper, category, "category", FIELD_STRING),
+    FIELD(BinaryWallpaper, dimension_x, "dimension_x", FIELD_NUMBER),
+    FIELD(BinaryWallpaper, dimension_y, "dimension_y", FIELD_NUMBER),
+    FIELD(BinaryWallpaper, resolution, "resolution", FIELD_STRING),
+    FIELD(BinaryWallpaper, ratio, "ratio", FIELD_STRING),
+    FIELD(BinaryWallpaper, file_size, "file_size", FIELD_NUMBER),
+    FIELD(BinaryWallpaper, file_type, "file_type", FIELD_STRING),
+    FIELD(BinaryWallpaper, created_at, "created_at", FIELD_STRING),
+    FIELD(BinaryWallpaper, colors, "colors", FIELD_LIST),
+    FIELD(BinaryWallpaper, path, "path", FIELD_STRING),
+    FIELD(BinaryWallpaper, thumb_large, "thumbs.large", FIELD_STRING),
+    FIELD(BinaryWallpaper, thumb_original, "thumbs.original", FIELD_STRING),
+    FIELD(BinaryWallpaper, thumb_small, "thumbs.small", FIELD_STRING),
+};
+
+static const BinaryField tag_fields[] = {
+    FIELD(BinaryTag, id, "id", FIELD_NUMBER),
+    FIELD(BinaryTag, name, "name", FIELD_STRING),
+    FIELD(BinaryTag, alias, "alias", FIELD_STRING),
+    FIELD(BinaryTag, category_id, "category_id", FIELD_NUMBER),
+    FIELD(BinaryTag, category, "category", FIELD_STRING),
+    FIELD(BinaryTag, purity, "purity", FIELD_STRING),
+    FIELD(BinaryTag, created_at, "created_at", FIELD_STRING),
+};
+
+static const BinaryField collection_fields[] = {
+    FIELD(BinaryCollection, id, "id", FIELD_NUMBER),
+    FIELD(BinaryCollection, label, "label", FIELD_STRING),
+    FIELD(BinaryCollection, views, "views", FIELD_NUMBER),
+    FIELD(BinaryCollection, public_, "public", FIELD_NUMBER),
+    FIELD(BinaryCollection, count, "count", FIELD_NUMBER),
+};
+
+static const BinaryField *binary_fields(BinaryKind kind, size_t *count, size_t *record_size)
+{
+    switch (kind)
+    {
+    case BINARY_WALLPAPERS:
+        *count = sizeof(wallpaper_fields) / sizeof(BinaryField);
+        *record_size = sizeof(BinaryWallpaper);
+        return wallpaper_fields;
+    case BINARY_TAGS:
+        *count = sizeof(tag_fields) / sizeof(BinaryField);
+        *record_size = sizeof(BinaryTag);
+        return tag_fields;
+    case BINARY_COLLECTIONS:
+        *count = sizeof(collection_fields) / sizeof(BinaryField);
+        *record_size = sizeof(BinaryCollection);
+        return collection_fields;
+    default:
+        return NULL;
+    }
+}
+
+// Decode the whole string into buffer, or into a malloc'd one when it doesn't fit (free *out if it isn't buffer)
+static bool json_string_full(const WallhavenJson *j, const char *path, char *buffer, size_t size, char **out, size_t *n)
+{
+    *out = buffer;
+    *n = wallhaven_json_string(j, path, buffer, size);
+    if (*n >= size)
+    {
+        checkp_return(*out = (char *)malloc(*n + 1), false);
+        wallhaven_json_string(j, path, *out, *n + 1);
+    }
+    return true;
+}
+
+// Append the decoded string to the string table
+static bool binary_append_string(Response *strings, const WallhavenJson *j, const char *path)
+{
+    char value[4096], *p;
+    size_t n;
+    checkp_return(json_string_full(j, path, value, sizeof(value), &p, &n), false);
+
+    bool ok = write_function(p, 1, n, strings) == n;
+    if (p != value)
+        free(p);
+    return ok;
+}
+
+WallhavenCode wallhaven_binary_encode(const Response *json, BinaryKind kind, Response *out)
+{
+    size_t field_count, record_size;
+    const BinaryField *fields = binary_fields(kind, &field_count, &record_size);
+    checkp_return(fields, WALLHAVEN_JSON_ERROR);
+
+    WallhavenJson j;
+    WallhavenCode wc = wallhaven_json_parse(&j, json->value, json->size);
+    check_return(wc, wc);
+
+    // Info responses have one object in data, others an array
+    Span data;
+    if (!wallhaven_json_raw(&j, "data", &data))
+    {
+        wallhaven_json_free(&j);
+        return WALLHAVEN_JSON_ERROR;
+    }
+    bool single = data.data[0] == '{';
+    size_t count = single ? 1 : wallhaven_json_count(&j, "data");
+
+    unsigned char *records = (unsigned char *)calloc(count ? count : 1, record_size);
+    Response strings = {0};
+    char path[64];
+    bool ok = records != NULL;
+
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        unsigned char *record = records + i * record_size;
+        for (size_t f = 0; ok && f < field_count; ++f)
+        {
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), single ? "data" : "data[%zu]", i);
+            snprintf(path, sizeof(path), "%s.%s", prefix, fields[f].key);
+
+            if (fields[f].type == FIELD_NUMBER)
+            {
+                long v = 0;
+                wallhaven_json_long(&j, path, &v);
+                *(int64_t *)(record + fields[f].offset) = v;
+            }
+            else
+            {
+                BinaryString *s = (BinaryString *)(record + fields[f].offset);
+                s->offset = (uint32_t)strings.size;
+                if (fields[f].type == FIELD_STRING)
+                    ok = binary_append_string(&strings, &j, path);
+                else
+                {
+                    size_t items = wallhaven_json_count(&j, path);
+                    for (size_t k = 0; ok && k < items; ++k)
+                    {
+                        char item[sizeof(path) + 24];
+                        snprintf(item, sizeof(item), "%s[%zu]", path, k);
+                        ok = (!k || write_function(",", 1, 1, &strings) == 1) && binary_append_string(&strings, &j, item);
+                    }
+                }
+                s->size = (uint32_t)(strings.size - s->offset);
+                ok = ok && write_function("", 1, 1, &strings) == 1;
+            }
+        }
+    }
+    wallhaven_json_free(&j);
+
+    if (ok)
+    {
+        BinaryHeader h = {
+            .magic = BINARY_MAGIC,
+            .version = BINARY_VERSION,
+            .flags = single ? BINARY_OBJECT : 0,
+            .kind = (uint16_t)kind,
+            .count = (uint32_t)count,
+            .record_size = (uint32_t)record_size,
+            .strings_offset = sizeof(BinaryHeader) + count * record_size,
+            .strings_size = strings.size,
+        };
+        ok = write_function(&h, 1, sizeof(h), out) == sizeof(h) &&
+             write_function(records, record_size, count, out) == record_size * count &&
+             write_function(strings.value ? strings.value : "", 1, strings.size, out) == strings.size;
+    }
+
+    free(records);
+    free(strings.value);
+    return ok ? WALLHAVEN_OK : WALLHAVEN_JSON_ERROR;
+}
+
+const BinaryHeader *wallhaven_binary_open(const void *data, size_t size)
+{
+    const BinaryHeader *h = (const BinaryHeader *)data;
+    checkp_return(size >= sizeof(BinaryHeader), NULL);
+    checkp_return(h->magic == BINARY_MAGIC && h->version == BINARY_VERSION, NULL);
+    checkp_return(!(h->flags & ~BINARY_OBJECT) && (!(h->flags & BINARY_OBJECT) || h->count == 1), NULL);
+
+    size_t field_count, record_size;
+    const BinaryField *fields = binary_fields((BinaryKind)h->kind, &field_count, &record_size);
+    checkp_return(fields && h->record_size >= record_size && h->record_size % 8 == 0, NULL);
+    checkp_return(h->count <= (size - sizeof(BinaryHeader)) / h->record_size, NULL);
+    checkp_return(h->strings_offset == sizeof(BinaryHeader) + (uint64_t)h->count * h->record_size, NULL);
+    checkp_return(h->strings_size <= size - h->strings_offset, NULL);
+
+    // Check every string once so that the readers don't have to
+    const char *strings = (const char *)data + h->strings_offset;
+    for (uint32_t i = 0; i < h->count; ++i)
+    {
+        const unsigned char *record = (const unsigned char *)data + sizeof(BinaryHeader) + (size_t)i * h->record_size;
+        for (size_t f = 0; f < field_count; ++f)
+        {
+            if (fields[f].type == FIELD_NUMBER)
+                continue;
+            const BinaryString *s = (const BinaryString *)(record + fields[f].offset);
+            checkp_return((uint64_t)s->offset + s->size < h->strings_size && !strings[s->offset + s->size], NULL);
+        }
+    }
+
+    return h;
+}
+
+static const void *binary_record(const BinaryHeader *h, BinaryKind kind, size_t i)
+{
+    checkp_return(h->kind == kind && i < h->count, NULL);
+    return (const unsigned char *)h + sizeof(BinaryHeader) + i * h->record_size;
+}
+
+const BinaryWallpaper *wallhaven_binary_wallpaper(const BinaryHeader *h, size_t i)
+{
+    return (const BinaryWallpaper *)binary_record(h, BINARY_WALLPAPERS, i);
+}
+
+const BinaryTag *wallhaven_binary_tag(const BinaryHeader *h, size_t i)
+{
+    return (const BinaryTag *)binary_record(h, BINARY_TAGS, i);
+}
+
+const BinaryCollection *wallhaven_binary_collection(const BinaryHeader *h, size_t i)
+{
+    return (const BinaryCollection *)binary_record(h, BINARY_COLLECTIONS, i);
+}
+
+const char *wallhaven_binary_string(const BinaryHeader *h, BinaryString s)
+{
+    return (const char *)h + h->strings_offset + s.offset;
+}
+
+// Append the string as JSON string
+static bool json_write_string(Response *out, const char *s, size_t size)
+{
+    checkp_return(write_function("\"", 1, 1, out), false);
+    for (size_t i = 0; i < size; ++i)
+    {
+        unsigned char c = (unsigned char)s[i];
+        char escape[8];
+        size_t n = 0;
+        if (c == '"' || c == '\\')
+            n = snprintf(escape, sizeof(escape), "\\%c", c);
+        else if (c < 0x20)
+            n = snprintf(escape, sizeof(escape), "\\u%04x", c);
+
+        const char *p = n ? escape : &s[i];
+        n = n ? n : 1;
+        checkp_return(write_function((void *)p, 1, n, out) == n, false);
+    }
+    return write_function("\"", 1, 1, out) == 1;
+}
+
+WallhavenCode wallhaven_binary_to_json(const BinaryHeader *h, Response *out)
+{
+    size_t field_count, record_size;
+    const BinaryField *fields = binary_fields((BinaryKind)h->kind, &field_count, &record_size);
+    checkp_return(fields, WALLHAVEN_JSON_ERROR);
+
+#define put(s) checkp_return(write_function((void *)(s), 1, strlen(s), out) == strlen(s), WALLHAVEN_JSON_ERROR)
+
+    bool single = h->flags & BINARY_OBJECT;
+    put(single ? "{\"data\":" : "{\"data\":[");
+    for (uint32_t i = 0; i < h->count; ++i)
+    {
+        const unsigned char *record = (const unsigned char *)binary_record(h, (BinaryKind)h->kind, i);
+        put(i ? ",{" : "{");
+
+        const char *parent = NULL;
+        size_t parent_len = 0;
+        for (size_t f = 0; f < field_count; ++f)
+        {
+            // Fields like thumbs.small go into the nested object
+            const char *key = fields[f].key, *dot = strchr(key, '.');
+            if (parent && (!dot || (size_t)(dot - key) != parent_len || strncmp(key, parent, parent_len)))
+            {
+                put("}");
+                parent = NULL;
+            }
+            if (f)
+                put(",");
+            if (dot && !parent)
+            {
+                parent = key;
+                parent_len = dot - key;
+                checkp_return(json_write_string(out, key, parent_len), WALLHAVEN_JSON_ERROR);
+                put(":{");
+            }
+            if (dot)
+                key = dot + 1;
+
+            checkp_return(json_write_string(out, key, strlen(key)), WALLHAVEN_JSON_ERROR);
+            put(":");
+
+            if (fields[f].type == FIELD_NUMBER)
+            {
+                char number[32];
+                snprintf(number, sizeof(number), "%lld", (long long)*(const int64_t *)(record + fields[f].offset));
+                put(number);
+                continue;
+            }
+
+            BinaryString s = *(const BinaryString *)(record + fields[f].offset);
+            const char *v = wallhaven_binary_string(h, s);
+            if (fields[f].type == FIELD_STRING)
+            {
+                checkp_return(json_write_string(out, v, s.size), WALLHAVEN_JSON_ERROR);
+                continue;
+            }
+
+            put("[");
+            for (size_t start = 0, k = 0; s.size && start <= s.size; ++k)
+            {
+                const char *comma = memchr(v + start, ',', s.size - start);
+                size_t end = comma ? (size_t)(comma - v) : s.size;
+                if (k)
+                    put(",");
+                checkp_return(json_write_string(out, v + start, end - start), WALLHAVEN_JSON_ERROR);
+                start = end + 1;
+            }
+            put("]");
+        }
+        if (parent)
+            put("}");
+        put("}");
+    }
+    put(single ? "}" : "]}");
+
+#undef put
+    return WALLHAVEN_OK;
+}
+
+// Export
+
+typedef enum
+{
+    PAGE_EMPTY,
+    PAGE_RUNNING,
+    PAGE_WAITING, // For a retry
+    PAGE_DONE
+} PageState;
+
+typedef struct
+{
+    PageState state;
+    int page;
+    int attempts;
+    double retry_at;
+    CURL *curl;
+    Response body;
+} ExportPage;
+
+// Url of the search for the page, free with curl_free
+static char *search_url(WallhavenAPI *wa, Parameters *p, int page)
+{
+    char *url = NULL;
+    int saved = p->page;
+    p->page = page;
+
+    wa->api_key_set = false;
+    if (curl_url_set(wa->url, CURLUPART_QUERY, NULL, 0) == CURLUE_OK && format_search(wa, p) == WALLHAVEN_OK &&
+        set_path(wa, SEARCH, NULL) == WALLHAVEN_OK)
+        curl_url_get(wa->url, CURLUPART_URL, &url, 0);
+
+    p->page = saved;
+    arena_reset(wa);
+    return url;
+}
+
+static bool export_start(WallhavenAPI *wa, CURLM *m, ExportPage *slot, Parameters *p)
+{
+    char *url;
+    checkp_return(url = search_url(wa, p, slot->page), false);
+    if (!slot->curl && !(slot->curl = curl_easy_init()))
+    {
+        curl_free(url);
+        return false;
+    }
+
+    // Same minute window as the calls made by perform
+    if (wa->start_time == -1 || difftime(time(NULL), wa->start_time) > 60)
+        time(&wa->start_time);
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+    if (wa->shared_limit)
+        shared_limit_acquire(wa->shared_limit);
+#endif
+
+    slot->body.size = 0;
+    curl_easy_reset(slot->curl);
+    curl_easy_setopt(slot->curl, CURLOPT_URL, url);
+    curl_easy_setopt(slot->curl, CURLOPT_WRITEFUNCTION, write_function);
+    curl_easy_setopt(slot->curl, CURLOPT_WRITEDATA, (void *)&slot->body);
+    curl_easy_setopt(slot->curl, CURLOPT_PRIVATE, (void *)slot);
+    curl_multi_add_handle(m, slot->curl);
+    curl_free(url);
+
+    slot->state = PAGE_RUNNING;
+    ++slot->attempts;
+    ++wa->stats.attempts;
+    return true;
+}
+
+static bool export_csv_value(Response *row, const char *v, size_t size)
+{
+    bool quote = false;
+    for (size_t i = 0; i < size && !quote; ++i)
+        quote = v[i] == ',' || v[i] == '"' || v[i] == '\n' || v[i] == '\r';
+    if (!quote)
+        return write_function((void *)v, 1, size, row) == size;
+
+    checkp_return(write_function("\"", 1, 1, row), false);
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (v[i] == '"')
+            checkp_return(write_function("\"", 1, 1, row), false);
+        checkp_return(write_function((void *)&v[i], 1, 1, row), false);
+    }
+    return write_function("\"", 1, 1, row) == 1;
+}
+
+// Write every wallpaper of the page as a row
+static WallhavenCode export_rows(const Response *page, ExportFormat format, FILE *out, size_t *rows, int *last_page)
+{
+    WallhavenJson j;
+    WallhavenCode wc = wallhaven_json_parse(&j, page->value, page->size);
+    check_return(wc, wc);
+
+    long last;
+    if (wallhaven_json_long(&j, "meta.last_page", &last))
+        *last_page = (int)last;
+
+    size_t count = wallhaven_json_count(&j, "data");
+    size_t field_count = sizeof(wallpaper_fields) / sizeof(BinaryField);
+    Response buffer = {0};
+    char path[64], value[4096];
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        if (format == NDJSON)
+            ok = write_function("{", 1, 1, &buffer);
+
+        for (size_t f = 0; ok && f < field_count; ++f)
+        {
+            const BinaryField *field = &wallpaper_fields[f];
+            snprintf(path, sizeof(path), "data[%zu].%s", i, field->key);
+
+            if (format == NDJSON)
+            {
+                // Nested keys are flattened as thumbs_small
+                char key[32];
+                snprintf(key, sizeof(key), "%s", field->key);
+                for (char *c = key; *c; ++c)
+                    if (*c == '.')
+                        *c = '_';
+                ok = (!f || write_function(",", 1, 1, &buffer)) && json_write_string(&buffer, key, strlen(key)) &&
+                     write_function(":", 1, 1, &buffer);
+            }
+            else if (f)
+                ok = write_function(",", 1, 1, &buffer);
+
+            if (!ok)
+                break;
+
+            if (field->type == FIELD_NUMBER)
+            {
+                long v = 0;
+                wallhaven_json_long(&j, path, &v);
+                int n = snprintf(value, sizeof(value), "%ld", v);
+                ok = write_function(value, 1, n, &buffer) == (size_t)n;
+            }
+            else if (field->type == FIELD_STRING)
+            {
+                char *v;
+                size_t n;
+                ok = json_string_full(&j, path, value, sizeof(value), &v, &n) &&
+                     (format == NDJSON ? json_write_string(&buffer, v, n) : export_csv_value(&buffer, v, n));
+                if (v != value)
+                    free(v);
+            }
+            else
+            {
+                // Lists stay arrays in NDJSON and are joined by spaces in CSV
+                Span raw;
+                if (format == NDJSON)
+                    ok = wallhaven_json_raw(&j, path, &raw) ? write_function((void *)raw.data, 1, raw.size, &buffer) == raw.size
+                                                             : write_function("[]", 1, 2, &buffer) == 2;
+                else
+                {
+                    size_t items = wallhaven_json_count(&j, path);
+                    for (size_t k = 0; ok && k < items; ++k)
+                    {
+                        char item[sizeof(path) + 24]; // Room for the largest index
+                        snprintf(item, sizeof(item), "%s[%zu]", path, k);
+                        char *v;
+                        size_t n;
+                        ok = json_string_full(&j, item, value, sizeof(value), &v, &n) &&
+                             (!k || write_function(" ", 1, 1, &buffer)) && export_csv_value(&buffer, v, n);
+                        if (v != value)
+                            free(v);
+                    }
+                }
+            }
+        }
+
+        if (ok)
+            ok = format == NDJSON ? write_function("}\n", 1, 2, &buffer) == 2 : write_function("\n", 1, 1, &buffer) == 1;
+    }
+    wallhaven_json_free(&j);
+
+    if (ok && buffer.size)
+        ok = fwrite(buffer.value, 1, buffer.size, out) == buffer.size;
+    free(buffer.value);
+
+    checkp_return(ok, WALLHAVEN_IO_FAIL);
+    *rows += count;
+    return WALLHAVEN_OK;
+}
+
+WallhavenCode wallhaven_export(WallhavenAPI *wa, Parameters *p, const ExportOptions *o, FILE *out, size_t *rows)
+{
+    int concurrency = o->concurrency > 0 ? o->concurrency : 1;
+    int first = o->first_page > 0 ? o->first_page : 1;
+    int last = o->last_page; // 0 till known from the first page
+    size_t exported = 0;
+
+    if (wa->breaker_open_until && now_seconds() < wa->breaker_open_until)
+    {
+        ++wa->stats.breaker_rejected;
+        return WALLHAVEN_CIRCUIT_OPEN;
+    }
+
+    ExportPage *slots = (ExportPage *)calloc(concurrency, sizeof(ExportPage));
+    CURLM *m = curl_multi_init();
+    if (!slots || !m)
+    {
+        free(slots);
+        if (m)
+            curl_multi_cleanup(m);
+        return WALLHAVEN_CURL_FAIL;
+    }
+
+    if (o->format == CSV)
+    {
+        // Nested keys are flattened as thumbs_small like in the rows
+        size_t field_count = sizeof(wallpaper_fields) / sizeof(BinaryField);
+        char header[1024];
+        size_t n = 0;
+        for (size_t f = 0; f < field_count && n < sizeof(header); ++f)
+            n += snprintf(header + n, sizeof(header) - n, "%s%c", wallpaper_fields[f].key, f + 1 < field_count ? ',' : '\n');
+        bool ok = n < sizeof(header);
+        for (size_t i = 0; ok && i < n; ++i)
+            if (header[i] == '.')
+                header[i] = '_';
+        if (!ok || fwrite(header, 1, n, out) != n)
+        {
+            free(slots);
+            curl_multi_cleanup(m);
+            return WALLHAVEN_IO_FAIL;
+        }
+    }
+
+    WallhavenCode wc = WALLHAVEN_OK;
+    int next_start = first, next_write = first, running = 0;
+
+    for (;;)
+    {
+        // Keep the window full, only the first page is fetched till we know the number of pages
+        while (wc == WALLHAVEN_OK && (last ? next_start <= last : next_start == first) &&
+               next_start < next_write + concurrency)
+        {
+            ExportPage *slot = &slots[(next_start - first) % concurrency];
+            slot->page = next_start;
+            slot->attempts = 0;
+            if (!export_start(wa, m, slot, p))
+            {
+                wc = WALLHAVEN_CURL_FAIL;
+                break;
+            }
+            ++wa->stats.calls;
+            ++next_start;
+            ++running;
+        }
+
+        // Write the pages which are done in order
+        ExportPage *slot;
+        while (wc == WALLHAVEN_OK && (slot = &slots[(next_write - first) % concurrency])->state == PAGE_DONE &&
+               slot->page == next_write)
+        {
+            int last_page = 0;
+            wc = export_rows(&slot->body, o->format, out, &exported, &last_page);
+            if (!last)
+                last = last_page > first ? last_page : first;
+            slot->state = PAGE_EMPTY;
+            ++next_write;
+        }
+
+        if (!running)
+        {
+            // First page just told us how many pages there are
+            if (wc == WALLHAVEN_OK && next_start <= last)
+                continue;
+            break;
+        }
+
+        int still_running;
+        curl_multi_perform(m, &still_running);
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(m, &queued)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            long code = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            read_limit_headers(wa, msg->easy_handle);
+            curl_multi_remove_handle(m, msg->easy_handle);
+            CURLcode c = msg->data.result;
+
+            bool retryable;
+            WallhavenCode failed = call_outcome(wa, c, code, &retryable);
+            if (failed == WALLHAVEN_OK && code == 200)
+            {
+                slot->state = PAGE_DONE;
+                --running;
+                continue;
+            }
+
+            // Other pages keep going on while this one waits
+            long delay;
+            if (failed == WALLHAVEN_OK)
+                failed = WALLHAVEN_CURL_FAIL; // Answered, but not with a page
+            if (wc != WALLHAVEN_OK || !call_retry(wa, &failed, retryable, slot->attempts - 1, true, false, &delay))
+            {
+                if (wc != WALLHAVEN_OK)
+                    ++wa->stats.failures;
+                slot->state = PAGE_EMPTY;
+                --running;
+                if (wc == WALLHAVEN_OK)
+                    wc = failed;
+                continue;
+            }
+            slot->retry_at = now_seconds() + delay / 1000.0;
+            slot->state = PAGE_WAITING;
+        }
+
+        // Start the retries which are due, and sleep no longer than till the next one
+        double now = now_seconds(), next_retry = 0;
+        for (int i = 0; i < concurrency; ++i)
+        {
+            ExportPage *waiting = &slots[i];
+            if (waiting->state != PAGE_WAITING)
+                continue;
+            if (wc != WALLHAVEN_OK)
+            {
+                waiting->state = PAGE_EMPTY;
+                --running;
+            }
+            else if (waiting->retry_at <= now)
+            {
+                if (!export_start(wa, m, waiting, p))
+                {
+                    waiting->state = PAGE_EMPTY;
+                    --running;
+                    wc = WALLHAVEN_CURL_FAIL;
+                }
+            }
+            else if (!next_retry || waiting->retry_at < next_retry)
+                next_retry = waiting->retry_at;
+        }
+
+        if (running)
+        {
+            int timeout = 1000;
+            if (next_retry && (next_retry - now) * 1000 < timeout)
+                timeout = (int)((next_retry - now) * 1000) + 1;
+            curl_multi_poll(m, NULL, 0, timeout, NULL);
+        }
+    }
+
+    for (int i = 0; i < concurrency; ++i)
+    {
+        if (slots[i].curl)
+        {
+            curl_multi_remove_handle(m, slots[i].curl);
+            curl_easy_cleanup(slots[i].curl);
+        }
+        free(slots[i].body.value);
+    }
+    free(slots);
+    curl_multi_cleanup(m);
+
+    // Don't leave the query of the last page behind
+    wa->api_key_set = false;
+    curl_url_set(wa->url, CURLUPART_QUERY, NULL, 0);
+
+    if (fflush(out) != 0 && wc == WALLHAVEN_OK)
+        wc = WALLHAVEN_IO_FAIL;
+    if (rows)
+        *rows = exported;
+    return wc;
+}
+
+// Tag autocompletion
+
+#define TAGS_MAGIC 0x54474857u // "WHGT"
+#define TAGS_VERSION 1
+
+// Layout of the index (in memory and in the file): header, nodes, tags, strings
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t tag_count;
+    uint64_t strings_size;
+} TagsHeader;
+
+// Node of the radix trie, children of a node are next to each other sorted by max_weight
+typedef struct
+{
+    uint32_t label;       // Offset of the label in strings
+    uint16_t label_size;  // Length of the label
+    uint16_t child_count; // Number of children
+    uint32_t first_child; // Index of the first child
+    uint32_t max_weight;  // Highest weight in the subtree
+    int32_t tag;          // Index of the tag ending here, -1 if none
+    uint32_t reserved;
+} TagNode;
+
+typedef struct
+{
+    uint32_t name; // Offset of the null terminated name in strings
+    uint32_t weight;
+    int64_t id;
+} TagRecord;
+
+// Tag collected before building the index
+struct TagSlot
+{
+    char *key; // Lower case name, used for matching
+    char *name;
+    int64_t id;
+    uint32_t weight;
+};
+
+#define tags_header(t) ((const TagsHeader *)(t)->index)
+#define tags_nodes(t) ((const TagNode *)(tags_header(t) + 1))
+#define tags_records(t) ((const TagRecord *)(tags_nodes(t) + tags_header(t)->node_count))
+#define tags_strings(t) ((const char *)(tags_records(t) + tags_header(t)->tag_count))
+
+static char *lower_dup(const char *s)
+{
+    char *l = strdup(s);
+    checkp_return(l, NULL);
+    for (char *c = l; *c; ++c)
+        if (*c >= 'A' && *c <= 'Z')
+            *c += 'a' - 'A';
+    return l;
+}
+
+static struct TagSlot *tags_slot(WallhavenTags *t, const char *key)
+{
+    size_t mask = t->slot_capacity - 1;
+    for (size_t i = hash_bytes(key, strlen(key), HASH_SEED) & mask;; i = (i + 1) & mask)
+        if (!t->slots[i].key || !strcmp(t->slots[i].key, key))
+            return &t->slots[i];
+}
+
+static bool tags_grow(WallhavenTags *t)
+{
+    size_t old_capacity = t->slot_capacity;
+    struct TagSlot *old = t->slots;
+
+    t->slot_capacity = old_capacity ? old_capacity * 2 : 1024;
+    if (!(t->slots = (struct TagSlot *)calloc(t->slot_capacity, sizeof(struct TagSlot))))
+    {
+        t->slots = old;
+        t->slot_capacity = old_capacity;
+        return false;
+    }
+
+    for (size_t i = 0; i < old_capacity; ++i)
+        if (old[i].key)
+            *tags_slot(t, old[i].key) = old[i];
+    free(old);
+    return true;
+}
+
+WallhavenTags *wallhaven_tags_init()
+{
+    WallhavenTags *t;
+    checkp_return(t = (WallhavenTags *)calloc(1, sizeof(WallhavenTags)), NULL);
+    if (!tags_grow(t))
+    {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void tags_drop_index(WallhavenTags *t)
+{
+    if (!t->index)
+        return;
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+    if (t->mapped)
+        munmap(t->index, t->index_size);
+    else
+#endif
+        free(t->index);
+    t->index = NULL;
+    t->index_size = 0;
+    t->mapped = false;
+}
+
+void wallhaven_tags_free(WallhavenTags *t)
+{
+    for (size_t i = 0; i < t->slot_capacity; ++i)
+    {
+        free(t->slots[i].key);
+        free(t->slots[i].name);
+    }
+    free(t->slots);
+    tags_drop_index(t);
+    free(t);
+}
+
+WallhavenCode wallhaven_tags_add(WallhavenTags *t, const char *name, int64_t id, uint32_t weight)
+{
+    checkp_return(name && name[0], WALLHAVEN_OK);
+    if ((t->tag_count + 1) * 10 > t->slot_capacity * 7)
+        checkp_return(tags_grow(t), WALLHAVEN_IO_FAIL);
+
+    char *key;
+    checkp_return(key = lower_dup(name), WALLHAVEN_IO_FAIL);
+
+    struct TagSlot *slot = tags_slot(t, key);
+    if (slot->key)
+    {
+        free(key);
+        slot->weight += weight;
+        if (id)
+            slot->id = id;
+        return WALLHAVEN_OK;
+    }
+
+    if (!(slot->name = strdup(name)))
+    {
+        free(key);
+        return WALLHAVEN_IO_FAIL;
+    }
+    slot->key = key;
+    slot->id = id;
+    slot->weight = weight;
+    ++t->tag_count;
+    return WALLHAVEN_OK;
+}
+
+static WallhavenCode tags_add_json(WallhavenTags *t, const WallhavenJson *j, const char *prefix)
+{
+    char path[96], name[256];
+    long id = 0;
+
+    snprintf(path, sizeof(path), "%s.name", prefix);
+    if (!wallhaven_json_string(j, path, name, sizeof(name)))
+        return WALLHAVEN_OK;
+    snprintf(path, sizeof(path), "%s.id", prefix);
+    wallhaven_json_long(j, path, &id);
+
+    return wallhaven_tags_add(t, name, id, 1);
+}
+
+WallhavenCode wallhaven_tags_add_response(WallhavenTags *t, const Response *response)
+{
+    WallhavenJson j;
+    WallhavenCode wc = wallhaven_json_parse(&j, response->value, response->size);
+    check_return(wc, wc);
+
+    char path[96];
+    Span data;
+    if (wallhaven_json_raw(&j, "data", &data) && data.data[0] == '{')
+    {
+        // Tag info, or wallpaper info having the tags of the wallpaper
+        wc = tags_add_json(t, &j, "data");
+        size_t count = wallhaven_json_count(&j, "data.tags");
+        for (size_t i = 0; wc == WALLHAVEN_OK && i < count; ++i)
+        {
+            snprintf(path, sizeof(path), "data.tags[%zu]", i);
+            wc = tags_add_json(t, &j, path);
+        }
+    }
+    else
+    {
+        // Search results, tags are there only when searching by tag id
+        size_t count = wallhaven_json_count(&j, "data");
+        for (size_t i = 0; wc == WALLHAVEN_OK && i < count; ++i)
+        {
+            snprintf(path, sizeof(path), "data[%zu].tags", i);
+            size_t tags = wallhaven_json_count(&j, path);
+            for (size_t k = 0; wc == WALLHAVEN_OK && k < tags; ++k)
+            {
+                snprintf(path, sizeof(path), "data[%zu].tags[%zu]", i, k);
+                wc = tags_add_json(t, &j, path);
+            }
+        }
+
+        char tag[256];
+        long id = 0;
+        if (wc == WALLHAVEN_OK && wallhaven_json_string(&j, "meta.query.tag", tag, sizeof(tag)))
+        {
+            wallhaven_json_long(&j, "meta.query.id", &id);
+            wc = wallhaven_tags_add(t, tag, id, 1);
+        }
+    }
+
+    wallhaven_json_free(&j);
+    return wc;
+}
+
+// Index being built
+typedef struct
+{
+    struct TagSlot **sorted;
+    TagNode *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint32_t *tag_of_slot; // Tag record index of each sorted slot
+} TagsBuild;
+
+static int compare_slots(const void *a, const void *b)
+{
+    return strcmp((*(struct TagSlot *const *)a)->key, (*(struct TagSlot *const *)b)->key);
+}
+
+static int compare_nodes(const void *a, const void *b)
+{
+    uint32_t x = ((const TagNode *)a)->max_weight, y = ((const TagNode *)b)->max_weight;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static bool tags_reserve_nodes(TagsBuild *b, uint32_t n)
+{
+    if (b->node_count + n <= b->node_capacity)
+        return true;
+    uint32_t capacity = b->node_capacity * 2 + n;
+    TagNode *nodes = (TagNode *)realloc(b->nodes, capacity * sizeof(TagNode));
+    checkp_return(nodes, false);
+    b->nodes = nodes;
+    b->node_capacity = capacity;
+    return true;
+}
+
+// Fill node for the keys [lo, hi) which share the first depth characters
+static bool tags_build_node(TagsBuild *b, uint32_t node, size_t lo, size_t hi, size_t depth)
+{
+    TagNode *n = &b->nodes[node];
+    n->tag = -1;
+    n->max_weight = 0;
+
+    // Key ending here is the first as shorter keys sort first
+    if (!b->sorted[lo]->key[depth])
+    {
+        n->tag = (int32_t)b->tag_of_slot[lo];
+        n->max_weight = b->sorted[lo]->weight;
+        ++lo;
+    }
+
+    uint32_t groups = 0;
+    for (size_t i = lo; i < hi; ++groups)
+    {
+        char c = b->sorted[i]->key[depth];
+        while (i < hi && b->sorted[i]->key[depth] == c)
+            ++i;
+    }
+
+    checkp_return(tags_reserve_nodes(b, groups), false);
+    n = &b->nodes[node];
+    uint32_t first = b->node_count;
+    n->first_child = first;
+    n->child_count = (uint16_t)groups;
+    b->node_count += groups;
+
+    uint32_t child = first;
+    for (size_t i = lo; i < hi; ++child)
+    {
+        const char *key = b->sorted[i]->key;
+        size_t end = i;
+        while (end < hi && b->sorted[end]->key[depth] == key[depth])
+            ++end;
+
+        // Label is the prefix shared by the whole group
+        size_t lcp = strlen(key);
+        const char *last = b->sorted[end - 1]->key;
+        size_t common = depth;
+        while (common < lcp && last[common] == key[common])
+            ++common;
+
+        b->nodes[child].label_size = (uint16_t)(common - depth);
+        b->nodes[child].reserved = (uint32_t)i; // Slot whose key holds the label
+        b->nodes[child].label = (uint32_t)depth;
+        checkp_return(tags_build_node(b, child, i, end, common), false);
+
+        n = &b->nodes[node];
+        if (b->nodes[child].max_weight > n->max_weight)
+            n->max_weight = b->nodes[child].max_weight;
+        i = end;
+    }
+
+    // Most popular children first, so that the search can stop early
+    qsort(&b->nodes[first], groups, sizeof(TagNode), compare_nodes);
+    return true;
+}
+
+WallhavenCode wallhaven_tags_build(WallhavenTags *t)
+{
+    TagsBuild b = {0};
+    size_t count = 0;
+
+    b.sorted = (struct TagSlot **)malloc((t->tag_count + 1) * sizeof(struct TagSlot *));
+    b.tag_of_slot = (uint32_t *)malloc((t->tag_count + 1) * sizeof(uint32_t));
+    if (!b.sorted || !b.tag_of_slot || !tags_reserve_nodes(&b, 1))
+        goto fail;
+
+    for (size_t i = 0; i < t->slot_capacity; ++i)
+        if (t->slots[i].key)
+            b.sorted[count++] = &t->slots[i];
+    qsort(b.sorted, count, sizeof(struct TagSlot *), compare_slots);
+
+    // Strings are the names followed by the keys (labels point into the keys)
+    uint64_t strings_size = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        b.tag_of_slot[i] = (uint32_t)i;
+        strings_size += strlen(b.sorted[i]->name) + 1 + strlen(b.sorted[i]->key) + 1;
+    }
+
+    b.node_count = 1;
+    b.nodes[0] = (TagNode){.tag = -1};
+    if (count && !tags_build_node(&b, 0, 0, count, 0))
+        goto fail;
+
+    size_t size = sizeof(TagsHeader) + b.node_count * sizeof(TagNode) + count * sizeof(TagRecord) + strings_size;
+    unsigned char *index = (unsigned char *)malloc(size);
+    if (!index)
+        goto fail;
+
+    TagsHeader *h = (TagsHeader *)index;
+    *h = (TagsHeader){
+        .magic = TAGS_MAGIC,
+        .version = TAGS_VERSION,
+        .node_count = b.node_count,
+        .tag_count = (uint32_t)count,
+        .strings_size = strings_size,
+    };
+    TagNode *nodes = (TagNode *)(h + 1);
+    TagRecord *records = (TagRecord *)(nodes + b.node_count);
+    char *strings = (char *)(records + count);
+
+    uint32_t *key_offset = b.tag_of_slot; // Reused, tag index is the sorted index
+    size_t offset = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t len = strlen(b.sorted[i]->name) + 1;
+        memcpy(strings + offset, b.sorted[i]->name, len);
+        records[i] = (TagRecord){.name = (uint32_t)offset, .weight = b.sorted[i]->weight, .id = b.sorted[i]->id};
+        offset += len;
+
+        len = strlen(b.sorted[i]->key) + 1;
+        memcpy(strings + offset, b.sorted[i]->key, len);
+        key_offset[i] = (uint32_t)offset;
+        offset += len;
+    }
+
+    // Labels were kept as (slot, depth), point them into the strings
+    for (uint32_t i = 0; i < b.node_count; ++i)
+    {
+        nodes[i] = b.nodes[i];
+        if (i)
+            nodes[i].label = key_offset[b.nodes[i].reserved] + b.nodes[i].label;
+        nodes[i].reserved = 0;
+    }
+
+    tags_drop_index(t);
+    t->index = index;
+    t->index_size = size;
+
+    free(b.sorted);
+    free(b.nodes);
+    free(b.tag_of_slot);
+    return WALLHAVEN_OK;
+
+fail:
+    free(b.sorted);
+    free(b.nodes);
+    free(b.tag_of_slot);
+    return WALLHAVEN_IO_FAIL;
+}
+
+WallhavenCode wallhaven_tags_save(WallhavenTags *t, const char *path)
+{
+    if (!t->index)
+    {
+        WallhavenCode wc = wallhaven_tags_build(t);
+        check_return(wc, wc);
+    }
+
+    FILE *f = fopen(path, "wb");
+    checkp_return(f, WALLHAVEN_IO_FAIL);
+    bool ok = fwrite(t->index, 1, t->index_size, f) == t->index_size;
+    ok = fclose(f) == 0 && ok;
+    return ok ? WALLHAVEN_OK : WALLHAVEN_IO_FAIL;
+}
+
+static bool tags_valid(const void *index, size_t size)
+{
+    const TagsHeader *h = (const TagsHeader *)index;
+    checkp_return(size >= sizeof(TagsHeader) && h->magic == TAGS_MAGIC && h->version == TAGS_VERSION, false);
+    checkp_return(h->node_count >= 1, false);
+    uint64_t need = sizeof(TagsHeader) + (uint64_t)h->node_count * sizeof(TagNode) + (uint64_t)h->tag_count * sizeof(TagRecord) + h->strings_size;
+    checkp_return(need == size && h->strings_size && ((const char *)index)[size - 1] == 0, false);
+
+    const TagNode *nodes = (const TagNode *)(h + 1);
+    const TagRecord *records = (const TagRecord *)(nodes + h->node_count);
+    for (uint32_t i = 0; i < h->node_count; ++i)
+    {
+        checkp_return((uint64_t)nodes[i].first_child + nodes[i].child_count <= h->node_count, false);
+        checkp_return((uint64_t)nodes[i].label + nodes[i].label_size <= h->strings_size, false);
+        checkp_return(nodes[i].tag < (int32_t)h->tag_count, false);
+    }
+    for (uint32_t i = 0; i < h->tag_count; ++i)
+        checkp_return(records[i].name < h->strings_size, false);
+    return true;
+}
+
+WallhavenTags *wallhaven_tags_load(const char *path)
+{
+    WallhavenTags *t;
+    checkp_return(t = wallhaven_tags_init(), NULL);
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !st.st_size)
+    {
+        if (fd != -1)
+            close(fd);
+        wallhaven_tags_free(t);
+        return NULL;
+    }
+
+    void *index = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED)
+    {
+        wallhaven_tags_free(t);
+        return NULL;
+    }
+    t->index = index;
+    t->index_size = st.st_size;
+    t->mapped = true;
+#else
+    FILE *f = fopen(path, "rb");
+    long size = -1;
+    if (f && fseek(f, 0, SEEK_END) == 0)
+        size = ftell(f);
+    if (size > 0 && (t->index = malloc(size)))
+    {
+        rewind(f);
+        t->index_size = fread(t->index, 1, size, f);
+    }
+    if (f)
+        fclose(f);
+#endif
+
+    if (!t->index || !tags_valid(t->index, t->index_size))
+    {
+        wallhaven_tags_free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+WallhavenCode wallhaven_tags_merge_index(WallhavenTags *t)
+{
+    checkp_return(t->index, WALLHAVEN_OK);
+
+    const TagRecord *records = tags_records(t);
+    for (uint32_t i = 0; i < tags_header(t)->tag_count; ++i)
+    {
+        WallhavenCode wc = wallhaven_tags_add(t, tags_strings(t) + records[i].name, records[i].id, records[i].weight);
+        check_return(wc, wc);
+    }
+    return WALLHAVEN_OK;
+}
+
+// Item of the best first search, either a node or a tag found
+typedef struct
+{
+    uint32_t weight;
+    int32_t tag; // -1 for node
+    uint32_t node;
+} TagsQueueItem;
+
+static void tags_queue_push(TagsQueueItem *heap, size_t *size, TagsQueueItem item)
+{
+    size_t i = (*size)++;
+    while (i && heap[(i - 1) / 2].weight < item.weight)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = item;
+}
+
+static TagsQueueItem tags_queue_pop(TagsQueueItem *heap, size_t *size)
+{
+    TagsQueueItem top = heap[0], last = heap[--*size];
+    size_t i = 0;
+    for (;;)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= *size)
+            break;
+        if (c + 1 < *size && heap[c + 1].weight > heap[c].weight)
+            ++c;
+        if (heap[c].weight <= last.weight)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+size_t wallhaven_tags_complete(WallhavenTags *t, const char *prefix, TagCompletion *out, size_t k)
+{
+    checkp_return(t->index && k, 0);
+
+    const TagNode *nodes = tags_nodes(t);
+    const char *strings = tags_strings(t);
+
+    // Walk down the trie along the prefix
+    uint32_t node = 0;
+    size_t matched = 0, len = strlen(prefix);
+    while (matched < len)
+    {
+        const TagNode *n = &nodes[node];
+        bool found = false;
+        char c = prefix[matched];
+        c = (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+
+        for (uint32_t i = 0; i < n->child_count && !found; ++i)
+        {
+            const TagNode *child = &nodes[n->first_child + i];
+            if (!child->label_size || strings[child->label] != c)
+                continue;
+
+            // Rest of the prefix can end inside the label
+            size_t l = 0;
+            while (l < child->label_size && matched + l < len)
+            {
+                char p = prefix[matched + l];
+                p = (p >= 'A' && p <= 'Z') ? p + 'a' - 'A' : p;
+                if (strings[child->label + l] != p)
+                    return 0;
+                ++l;
+            }
+            matched += l;
+            node = n->first_child + i;
+            found = true;
+        }
+        if (!found)
+            return 0;
+    }
+
+    // Best first search, queue never holds more than the visited nodes and their children
+    size_t capacity = 64, size = 0, results = 0;
+    TagsQueueItem *heap = (TagsQueueItem *)malloc(capacity * sizeof(TagsQueueItem));
+    checkp_return(heap, 0);
+    tags_queue_push(heap, &size, (TagsQueueItem){.weight = nodes[node].max_weight, .tag = -1, .node = node});
+
+    const TagRecord *records = tags_records(t);
+    while (size && results < k)
+    {
+        TagsQueueItem item = tags_queue_pop(heap, &size);
+        if (item.tag >= 0)
+        {
+            out[results++] = (TagCompletion){
+                .name = strings + records[item.tag].name,
+                .id = records[item.tag].id,
+                .weight = records[item.tag].weight,
+            };
+            continue;
+        }
+
+        const TagNode *n = &nodes[item.node];
+        if (size + n->child_count + 1 > capacity)
+        {
+            capacity = (size + n->child_count + 1) * 2;
+            TagsQueueItem *h = (TagsQueueItem *)realloc(heap, capacity * sizeof(TagsQueueItem));
+            if (!h)
+                break;
+            heap = h;
+        }
+        if (n->tag >= 0)
+            tags_queue_push(heap, &size, (TagsQueueItem){.weight = records[n->tag].weight, .tag = n->tag});
+        for (uint32_t i = 0; i < n->child_count; ++i)
+            tags_queue_push(heap, &size, (TagsQueueItem){.weight = nodes[n->first_child + i].max_weight, .tag = -1, .node = n->first_child + i});
+    }
+
+    free(heap);
+    return results;
+}
+
+// Near duplicates
+
+#ifdef _MSC_VER
+#define popcount64(x) ((int)__popcnt64(x))
+#else
+#define popcount64(x) __builtin_popcountll(x)
+#endif
+
+#define DEDUP_CHUNKS 4
+#define DEDUP_NONE UINT32_MAX
+
+struct DedupEntry
+{
+    uint64_t hash;
+    char id[16];
+    uint32_t next[DEDUP_CHUNKS]; // Next entry having the same chunk
+};
+
+#define AREA_MAX_WIDTH 32 // Widest grid area_resize is asked for (the 32x32 of wallhaven_phash)
+
+// Mean of the pixels of each cell of a grid of out_w x out_h cells, out_w is at most AREA_MAX_WIDTH
+static void area_resize(const unsigned char *gray, int width, int height, int stride, float *out, int out_w, int out_h)
+{
+    float row[AREA_MAX_WIDTH];
+
+    for (int oy = 0; oy < out_h; ++oy)
+    {
+        int y0 = oy * height / out_h, y1 = (oy + 1) * height / out_h;
+        if (y1 == y0)
+            y1 = y0 + 1;
+
+        memset(row, 0, out_w * sizeof(float));
+        for (int y = y0; y < y1; ++y)
+        {
+            const unsigned char *p = gray + (size_t)y * stride;
+            for (int ox = 0; ox < out_w; ++ox)
+            {
+                int x0 = ox * width / out_w, x1 = (ox + 1) * width / out_w;
+                if (x1 == x0)
+                    x1 = x0 + 1;
+                unsigned sum = 0;
+                for (int x = x0; x < x1; ++x)
+                    sum += p[x];
+                row[ox] += (float)sum / (x1 - x0);
+            }
+        }
+        for (int ox = 0; ox < out_w; ++ox)
+            out[oy * out_w + ox] = row[ox] / (y1 - y0);
+    }
+}
+
+uint64_t wallhaven_dhash(const unsigned char *gray, int width, int height, int stride)
+{
+    float cells[8 * 9];
+    area_resize(gray, width, height, stride, cells, 9, 8);
+
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 8; ++x)
+            hash = hash << 1 | (cells[y * 9 + x] < cells[y * 9 + x + 1]);
+    return hash;
+}
+
+// cos(u * (2x + 1) * pi / 64) for the first 8 frequencies, built without libm
+static float dct_basis_table[8][32];
+
+static void dct_basis_init()
+{
+    double c[128], cs = 0.99879545620517239, sn = 0.049067674327418015, x = 1, y = 0;
+    for (int m = 0; m < 128; ++m)
+    {
+        c[m] = x;
+        double nx = x * cs - y * sn;
+        y = x * sn + y * cs;
+        x = nx;
+    }
+    for (int u = 0; u < 8; ++u)
+        for (int i = 0; i < 32; ++i)
+            dct_basis_table[u][i] = (float)c[(u * (2 * i + 1)) % 128];
+}
+
+#ifdef WALLHAVEN_PLATFORM_WINDOWS
+static INIT_ONCE dct_basis_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK dct_basis_init_once(PINIT_ONCE once, PVOID parameter, PVOID *context)
+{
+    (void)once, (void)parameter, (void)context;
+    dct_basis_init();
+    return TRUE;
+}
+#else
+static pthread_once_t dct_basis_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Built by the first caller, the others wait for it
+static const float (*dct_basis())[32]
+{
+#ifdef WALLHAVEN_PLATFORM_WINDOWS
+    InitOnceExecuteOnce(&dct_basis_once, dct_basis_init_once, NULL, NULL);
+#else
+    pthread_once(&dct_basis_once, dct_basis_init);
+#endif
+    return dct_basis_table;
+}
+
+uint64_t wallhaven_phash(const unsigned char *gray, int width, int height, int stride)
+{
+    float pixels[32 * 32], rows[32 * 8], coefficients[64];
+    const float(*basis)[32] = dct_basis();
+    area_resize(gray, width, height, stride, pixels, 32, 32);
+
+    // Only the lowest 8x8 frequencies are needed, done as two small matrix products
+    for (int y = 0; y < 32; ++y)
+        for (int u = 0; u < 8; ++u)
+        {
+            float sum = 0;
+            for (int x = 0; x < 32; ++x)
+                sum += pixels[y * 32 + x] * basis[u][x];
+            rows[y * 8 + u] = sum;
+        }
+    for (int v = 0; v < 8; ++v)
+        for (int u = 0; u < 8; ++u)
+        {
+            float sum = 0;
+            for (int y = 0; y < 32; ++y)
+                sum += rows[y * 8 + u] * basis[v][y];
+            coefficients[v * 8 + u] = sum;
+        }
+
+    // Compare to the median leaving out the DC term
+    float sorted[63];
+    memcpy(sorted, coefficients + 1, sizeof(sorted));
+    for (int i = 1; i < 63; ++i)
+    {
+        float f = sorted[i];
+        int k = i;
+        for (; k && sorted[k - 1] > f; --k)
+            sorted[k] = sorted[k - 1];
+        sorted[k] = f;
+    }
+    float median = sorted[31];
+
+    uint64_t hash = 0;
+    for (int i = 0; i < 64; ++i)
+        hash = hash << 1 | (coefficients[i] > median);
+    return hash;
+}
+
+WallhavenDedup *wallhaven_dedup_init(int radius, DecodeGray decode, void *userdata)
+{
+    // With 4 chunks, one of them differs by at most radius / 4 bits, only 0 and 1 are probed
+    checkp_return(radius >= 0 && radius <= WALLHAVEN_DEDUP_MAX_RADIUS, NULL);
+
+    WallhavenDedup *d;
+    checkp_return(d = (WallhavenDedup *)calloc(1, sizeof(WallhavenDedup)), NULL);
+    if (!(d->heads = (uint32_t *)malloc(DEDUP_CHUNKS * 65536 * sizeof(uint32_t))))
+    {
+        free(d);
+        return NULL;
+    }
+    memset(d->heads, 0xff, DEDUP_CHUNKS * 65536 * sizeof(uint32_t));
+
+    d->radius = radius;
+    d->decode = decode;
+    d->userdata = userdata;
+    return d;
+}
+
+void wallhaven_dedup_free(WallhavenDedup *d)
+{
+    free(d->entries);
+    free(d->heads);
+    free(d);
+}
+
+#define dedup_chunk(hash, c) ((uint32_t)((hash) >> (16 * (c))) & 0xffff)
+
+WallhavenCode wallhaven_dedup_add(WallhavenDedup *d, const char *id, uint64_t hash)
+{
+    if (d->count == d->capacity)
+    {
+        size_t capacity = d->capacity ? d->capacity * 2 : 256;
+        struct DedupEntry *entries = (struct DedupEntry *)realloc(d->entries, capacity * sizeof(struct DedupEntry));
+        checkp_return(entries, WALLHAVEN_NO_MEMORY);
+        d->entries = entries;
+        d->capacity = capacity;
+    }
+
+    uint32_t index = (uint32_t)d->count++;
+    struct DedupEntry *e = &d->entries[index];
+    e->hash = hash;
+    snprintf(e->id, sizeof(e->id), "%s", id);
+    for (int c = 0; c < DEDUP_CHUNKS; ++c)
+    {
+        uint32_t *head = &d->heads[c * 65536 + dedup_chunk(hash, c)];
+        e->next[c] = *head;
+        *head = index;
+    }
+    return WALLHAVEN_OK;
+}
+
+const char *wallhaven_dedup_find(WallhavenDedup *d, uint64_t hash, int *distance)
+{
+    const struct DedupEntry *best = NULL;
+    int best_distance = d->radius + 1;
+    int flips = d->radius / DEDUP_CHUNKS;
+
+    for (int c = 0; c < DEDUP_CHUNKS && best_distance; ++c)
+        for (int bit = -1; bit < (flips ? 16 : 0); ++bit)
+        {
+            uint32_t key = dedup_chunk(hash, c) ^ (bit < 0 ? 0 : 1u << bit);
+            for (uint32_t i = d->heads[c * 65536 + key]; i != DEDUP_NONE; i = d->entries[i].next[c])
+            {
+                int dist = popcount64(d->entries[i].hash ^ hash);
+                if (dist < best_distance)
+                {
+                    best_distance = dist;
+                    best = &d->entries[i];
+                }
+            }
+        }
+
+    if (best && distance)
+        *distance = best_distance;
+    return best ? best->id : NULL;
+}
+
+WallhavenCode wallhaven_dedup_hash_image(WallhavenDedup *d, const unsigned char *data, size_t size, uint64_t *hash)
+{
+    checkp_return(d->decode, WALLHAVEN_IO_FAIL);
+
+    int width, height;
+    unsigned char *gray = d->decode(data, size, &width, &height, d->userdata);
+    if (!gray || width <= 0 || height <= 0)
+    {
+        free(gray);
+        ++d->undecodable;
+        return WALLHAVEN_IO_FAIL;
+    }
+
+    *hash = wallhaven_phash(gray, width, height, width);
+    ++d->hashed;
+    free(gray);
+    return WALLHAVEN_OK;
+}
+
+WallhavenCode wallhaven_dedup_filter_page(WallhavenDedup *d, WallhavenThumbs *t, const Response *page, ThumbSize size, bool *keep, size_t capacity, size_t *count)
+{
+    WallhavenJson j;
+    WallhavenCode wc = wallhaven_json_parse(&j, page->value, page->size);
+    check_return(wc, wc);
+
+    size_t n = wallhaven_json_count(&j, "data");
+    if (n > capacity)
+        n = capacity;
+
+    char id[16], path[32];
+    for (size_t i = 0; i < n; ++i)
+    {
+        Span span;
+        uint64_t hash;
+        keep[i] = true;
+
+        // Wallpapers without a thumbnail to look at are kept
+        snprintf(path, sizeof(path), "data[%zu].id", i);
+        if (!wallhaven_json_string(&j, path, id, sizeof(id)) || !wallhaven_thumbs_get(t, id, size, &span))
+            continue;
+        if (wallhaven_dedup_hash_image(d, span.data, span.size, &hash) != WALLHAVEN_OK)
+            continue;
+
+        const char *original = wallhaven_dedup_find(d, hash, NULL);
+        if (original && strcmp(original, id))
+        {
+            keep[i] = false;
+            ++d->duplicates;
+        }
+        else if (!original)
+        {
+            wc = wallhaven_dedup_add(d, id, hash);
+            if (wc != WALLHAVEN_OK)
+                break;
+        }
+    }
+
+    if (count)
+        *count = n;
+    wallhaven_json_free(&j);
+    return wc;
+}
+
+// File sink
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(WALLHAVEN_PLATFORM_LINUX) && defined(__NR_io_uring_setup)
+#define WALLHAVEN_IO_URING
+#endif
+
+// One write of a chunk, owns the chunk
+struct SinkOp
+{
+    WallhavenSinkFile *file;
+    unsigned char *data;
+    size_t size;
+    size_t done;
+    int64_t offset;
+    struct SinkOp *next;
+};
+
+#ifdef WALLHAVEN_IO_URING
+struct SinkRing
+{
+    int fd;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_head, *sq_tail, *cq_head, *cq_tail;
+    unsigned *sq_array, sq_mask, cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+// Workers doing pwrite when io_uring is not there
+struct SinkPool
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+    struct SinkOp *head, *tail;
+    pthread_t *threads;
+    int thread_count;
+    bool stop;
+};
+
+#ifdef WALLHAVEN_IO_URING
+static void sink_ring_free(struct SinkRing *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_map_size);
+    if (r->fd != -1)
+        close(r->fd);
+    free(r);
+}
+
+static struct SinkRing *sink_ring_init(unsigned entries)
+{
+    struct SinkRing *r = (struct SinkRing *)calloc(1, sizeof(struct SinkRing));
+    checkp_return(r, NULL);
+
+    struct io_uring_params p = {0};
+    if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) == -1)
+    {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_map_size = r->cq_map_size = r->sq_map_size > r->cq_map_size ? r->sq_map_size : r->cq_map_size;
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+    {
+        r->sq_map = NULL;
+        sink_ring_free(r);
+        return NULL;
+    }
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        if (r->cq_map == MAP_FAILED)
+            r->cq_map = NULL;
+        if (r->sqes == MAP_FAILED)
+            r->sqes = NULL;
+        sink_ring_free(r);
+        return NULL;
+    }
+
+    unsigned char *sq = (unsigned char *)r->sq_map, *cq = (unsigned char *)r->cq_map;
+    r->sq_head = (_Atomic unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+// Queue the rest of the op, sent to the kernel with the next io_uring_enter
+static void sink_ring_push(WallhavenSink *s, struct SinkOp *op)
+{
+    struct SinkRing *r = s->ring;
+    unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = op->file->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(op->data + op->done);
+    sqe->len = (uint32_t)(op->size - op->done);
+    sqe->off = (uint64_t)(op->offset + op->done);
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    r->sq_array[index] = index;
+    atomic_store_explicit(r->sq_tail, tail + 1, memory_order_release);
+    ++s->unsubmitted;
+}
+
+// Submit what is queued and wait for at least wait completions
+static bool sink_ring_enter(WallhavenSink *s, unsigned wait)
+{
+    for (;;)
+    {
+        int n = (int)syscall(__NR_io_uring_enter, s->ring->fd, s->unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0)
+        {
+            if (s->unsubmitted)
+                ++s->batches;
+            s->unsubmitted -= (unsigned)n < s->unsubmitted ? (unsigned)n : s->unsubmitted;
+            return true;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+    }
+}
+#endif
+
+static void sink_op_finish(WallhavenSink *s, struct SinkOp *op, int error)
+{
+    if (error && !op->file->error)
+        op->file->error = error;
+    --op->file->inflight;
+    --s->inflight;
+    ++s->writes;
+    s->bytes += op->done;
+    free(op->data);
+    free(op);
+}
+
+// Write synchronously, returns the errno or 0
+static int sink_pwrite(struct SinkOp *op)
+{
+    while (op->done < op->size)
+    {
+        ssize_t n = pwrite(op->file->fd, op->data + op->done, op->size - op->done, (off_t)(op->offset + op->done));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == -1 ? errno : EIO;
+        op->done += (size_t)n;
+    }
+    return 0;
+}
+
+#ifdef WALLHAVEN_IO_URING
+// Handle the completions the kernel has posted
+static void sink_ring_reap(WallhavenSink *s)
+{
+    struct SinkRing *r = s->ring;
+    unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+
+    while (head != atomic_load_explicit(r->cq_tail, memory_order_acquire))
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+        struct SinkOp *op = (struct SinkOp *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        atomic_store_explicit(r->cq_head, ++head, memory_order_release);
+
+        if (res == -EINTR || res == -EAGAIN)
+            sink_ring_push(s, op);
+        else if (res == -EINVAL || res == -EOPNOTSUPP)
+            sink_op_finish(s, op, sink_pwrite(op)); // Kernel without IORING_OP_WRITE
+        else if (res < 0)
+            sink_op_finish(s, op, -res);
+        else if ((op->done += (size_t)res) < op->size && res > 0)
+            sink_ring_push(s, op); // Short write
+        else
+            sink_op_finish(s, op, op->done < op->size ? EIO : 0);
+    }
+}
+
+// io_uring_enter failed, take back what the kernel has not picked up and write it here
+static void sink_ring_drain(WallhavenSink *s)
+{
+    struct SinkRing *r = s->ring;
+    unsigned head = atomic_load_explicit(r->sq_head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+
+    atomic_store_explicit(r->sq_tail, head, memory_order_release);
+    s->unsubmitted = 0;
+    for (; head != tail; ++head)
+    {
+        struct SinkOp *op = (struct SinkOp *)(uintptr_t)r->sqes[r->sq_array[head & r->sq_mask]].user_data;
+        sink_op_finish(s, op, sink_pwrite(op));
+    }
+}
+#endif
+
+static void *sink_worker(void *arg)
+{
+    WallhavenSink *s = (WallhavenSink *)arg;
+    struct SinkPool *pool = s->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;)
+    {
+        while (!pool->head && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->mutex);
+        if (!pool->head)
+            break;
+
+        struct SinkOp *op = pool->head;
+        if (!(pool->head = op->next))
+            pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->mutex);
+        int error = sink_pwrite(op);
+        pthread_mutex_lock(&pool->mutex);
+
+        sink_op_finish(s, op, error);
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void sink_pool_free(WallhavenSink *s)
+{
+    struct SinkPool *pool = s->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->thread_count; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+    s->pool = NULL;
+}
+
+static bool sink_pool_init(WallhavenSink *s, int threads)
+{
+    struct SinkPool *pool = (struct SinkPool *)calloc(1, sizeof(struct SinkPool));
+    checkp_return(pool, false);
+    if (!(pool->threads = (pthread_t *)calloc(threads, sizeof(pthread_t))))
+    {
+        free(pool);
+        return false;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    s->pool = pool;
+
+    for (; pool->thread_count < threads; ++pool->thread_count)
+        if (pthread_create(&pool->threads[pool->thread_count], NULL, sink_worker, s))
+            break;
+
+    if (!pool->thread_count)
+    {
+        sink_pool_free(s);
+        return false;
+    }
+    return true;
+}
+
+WallhavenSink *wallhaven_sink_init(const SinkOptions *o)
+{
+    SinkOptions d = {.chunk_size = 256 * 1024, .queue_depth = 64, .batch = 8, .threads = 4, .disable_io_uring = false};
+    if (!o)
+        o = &d;
+
+    WallhavenSink *s;
+    checkp_return(s = (WallhavenSink *)calloc(1, sizeof(WallhavenSink)), NULL);
+    s->chunk_size = o->chunk_size ? o->chunk_size : d.chunk_size;
+    s->queue_depth = o->queue_depth ? o->queue_depth : d.queue_depth;
+    s->batch = o->batch ? o->batch : d.batch;
+    if (s->batch > s->queue_depth)
+        s->batch = s->queue_depth;
+
+#ifdef WALLHAVEN_IO_URING
+    if (!o->disable_io_uring && (s->ring = sink_ring_init(s->queue_depth)))
+        return s;
+#endif
+
+    if (!sink_pool_init(s, o->threads > 0 ? o->threads : d.threads))
+    {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+// Wait till the file has no writes in flight, or the whole sink when f is NULL
+static void sink_wait(WallhavenSink *s, WallhavenSinkFile *f)
+{
+#ifdef WALLHAVEN_IO_URING
+    if (s->ring)
+    {
+        while (f ? f->inflight : s->inflight)
+        {
+            // The writes the kernel already has still complete, their buffers stay until reaped
+            if (!sink_ring_enter(s, 1))
+            {
+                sink_ring_drain(s);
+                sleep_ms(1);
+            }
+            sink_ring_reap(s);
+        }
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&s->pool->mutex);
+    while (f ? f->inflight : s->inflight)
+        pthread_cond_wait(&s->pool->done, &s->pool->mutex);
+    pthread_mutex_unlock(&s->pool->mutex);
+}
+
+// errno of the first failed write of the file, the threads set it under the pool mutex
+static int sink_file_error(WallhavenSinkFile *f)
+{
+    struct SinkPool *pool = f->sink->pool;
+    checkp_return(pool, f->error);
+
+    pthread_mutex_lock(&pool->mutex);
+    int error = f->error;
+    pthread_mutex_unlock(&pool->mutex);
+    return error;
+}
+
+void wallhaven_sink_free(WallhavenSink *s)
+{
+    sink_wait(s, NULL);
+#ifdef WALLHAVEN_IO_URING
+    if (s->ring)
+        sink_ring_free(s->ring);
+#endif
+    if (s->pool)
+        sink_pool_free(s);
+    free(s);
+}
+
+// Hand the buffered chunk to the disk, waits when queue_depth writes are in flight
+static bool sink_file_flush(WallhavenSinkFile *f)
+{
+    checkp_return(f->buffered, true);
+
+    WallhavenSink *s = f->sink;
+    struct SinkOp *op = (struct SinkOp *)malloc(sizeof(struct SinkOp));
+    checkp_return(op, false);
+    *op = (struct SinkOp){.file = f, .data = f->buffer, .size = f->buffered, .offset = f->buffer_offset};
+    f->buffer = NULL;
+    f->buffer_offset += f->buffered;
+    f->buffered = 0;
+
+#ifdef WALLHAVEN_IO_URING
+    if (s->ring)
+    {
+        sink_ring_reap(s);
+        if (s->inflight >= s->queue_depth)
+        {
+            ++s->stalls;
+            while (s->inflight >= s->queue_depth)
+            {
+                if (!sink_ring_enter(s, 1))
+                {
+                    free(op->data);
+                    free(op);
+                    return false;
+                }
+                sink_ring_reap(s);
+            }
+        }
+
+        ++s->inflight;
+        ++f->inflight;
+        sink_ring_push(s, op);
+        return s->unsubmitted < s->batch || sink_ring_enter(s, 0);
+    }
+#endif
+
+    struct SinkPool *pool = s->pool;
+    pthread_mutex_lock(&pool->mutex);
+    if (s->inflight >= s->queue_depth)
+    {
+        ++s->stalls;
+        while (s->inflight >= s->queue_depth)
+            pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    ++s->inflight;
+    ++f->inflight;
+    if (pool->tail)
+        pool->tail->next = op;
+    else
+        pool->head = op;
+    pool->tail = op;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+static void sink_file_rewind(WallhavenSinkFile *f, int64_t offset)
+{
+    if (offset >= f->buffer_offset)
+        f->buffered = (size_t)(offset - f->buffer_offset);
+    else
+    {
+        // Writes past offset are in flight, let them land before writing over them
+        f->buffered = 0;
+        f->buffer_offset = offset;
+        sink_wait(f->sink, f);
+    }
+    f->offset = offset;
+}
+
+static size_t write_function_tosink(void *data, size_t size, size_t nmemb, void *clientp)
+{
+    WallhavenSinkFile *f = (WallhavenSinkFile *)clientp;
+    size_t realsize = size * nmemb, copied = 0;
+    checkp_return(!sink_file_error(f), 0);
+
+    while (copied < realsize)
+    {
+        if (!f->buffer && !(f->buffer = (unsigned char *)malloc(f->sink->chunk_size)))
+            return 0;
+
+        size_t n = f->sink->chunk_size - f->buffered;
+        if (n > realsize - copied)
+            n = realsize - copied;
+        memcpy(f->buffer + f->buffered, (const unsigned char *)data + copied, n);
+        f->buffered += n;
+        f->offset += n;
+        copied += n;
+
+        if (f->buffered == f->sink->chunk_size && !sink_file_flush(f))
+            return 0;
+    }
+
+    return realsize;
+}
+
+WallhavenSinkFile *wallhaven_sink_open(WallhavenSink *s, const char *path, int64_t expected_size)
+{
+    WallhavenSinkFile *f;
+    checkp_return(f = (WallhavenSinkFile *)calloc(1, sizeof(WallhavenSinkFile)), NULL);
+    if ((f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        free(f);
+        return NULL;
+    }
+    f->sink = s;
+
+#ifdef WALLHAVEN_PLATFORM_LINUX
+    // Getting the blocks up front keeps the file in one piece, size is fixed on close
+    if (expected_size > 0 && posix_fallocate(f->fd, 0, (off_t)expected_size) == 0)
+        ++s->preallocated;
+#endif
+
+    return f;
+}
+
+WallhavenCode wallhaven_sink_close(WallhavenSinkFile *f)
+{
+    bool ok = sink_file_flush(f);
+    WallhavenSink *s = f->sink;
+
+#ifdef WALLHAVEN_IO_URING
+    if (s->ring && s->unsubmitted)
+        ok = sink_ring_enter(s, 0) && ok;
+#endif
+    sink_wait(s, f);
+
+    ok = ok && !sink_file_error(f) && ftruncate(f->fd, (off_t)f->offset) == 0;
+    ok = close(f->fd) == 0 && ok;
+    free(f->buffer);
+    free(f);
+    return ok ? WALLHAVEN_OK : WALLHAVEN_IO_FAIL;
+}
+
+bool wallhaven_sink_uses_io_uring(const WallhavenSink *s)
+{
+    return s->ring != NULL;
+}
+
+WallhavenCode wallhaven_write_to_sink(WallhavenAPI *wa, WallhavenSinkFile *f)
+{
+    check_return(reset(wa), WALLHAVEN_CURL_FAIL);
+
+    // Write curl output to the sink, the disk writes are done in the background
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEFUNCTION, write_function_tosink), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEDATA, (void *)f), WALLHAVEN_CURL_FAIL);
+    wa->sink_file = f;
+
+    return WALLHAVEN_OK;
+}
+
+#else
+
+static void sink_file_rewind(WallhavenSinkFile *f, int64_t offset)
+{
+}
+
+WallhavenSink *wallhaven_sink_init(const SinkOptions *o)
+{
+    return NULL;
+}
+
+void wallhaven_sink_free(WallhavenSink *s)
+{
+}
+
+WallhavenSinkFile *wallhaven_sink_open(WallhavenSink *s, const char *path, int64_t expected_size)
+{
+    return NULL;
+}
+
+WallhavenCode wallhaven_sink_close(WallhavenSinkFile *f)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+bool wallhaven_sink_uses_io_uring(const WallhavenSink *s)
+{
+    return false;
+}
+
+WallhavenCode wallhaven_write_to_sink(WallhavenAPI *wa, WallhavenSinkFile *f)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+#endif
+
+// Prewarm
+
+// Hosts the first calls go to, API calls and full wallpapers
+static const char *const prewarm_urls[] = {"https://wallhaven.cc/", "https://w.wallhaven.cc/"};
+#define PREWARM_HOSTS (sizeof(prewarm_urls) / sizeof(prewarm_urls[0]))
+
+// Addresses older than this are resolved again
+#define PREWARM_DNS_TTL (60 * 60)
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+struct Prewarm
+{
+    CURLSH *share; // TLS sessions and connections shared with wa->curl
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+    pthread_t thread;
+    bool started; // thread is running or was to be joined
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    PrewarmState state;
+    char *cache_path;
+};
+
+static void prewarm_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    (void)curl, (void)access;
+    pthread_mutex_lock(&((struct Prewarm *)userptr)->locks[data]);
+}
+
+static void prewarm_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+    (void)curl;
+    pthread_mutex_unlock(&((struct Prewarm *)userptr)->locks[data]);
+}
+
+static void prewarm_attach(WallhavenAPI *wa)
+{
+    if (wa->prewarm)
+        curl_easy_setopt(wa->curl, CURLOPT_SHARE, wa->prewarm->share);
+}
+
+// Whether the line is a host:port:address entry for one of the prewarm hosts
+static bool prewarm_valid_entry(const char *line)
+{
+    for (size_t i = 0; i < PREWARM_HOSTS; ++i)
+    {
+        const char *host = prewarm_urls[i] + strlen("https://");
+        size_t host_size = strcspn(host, ":/");
+        if (strncmp(line, host, host_size) || line[host_size] != ':')
+            continue;
+
+        char *end;
+        long port = strtol(line + host_size + 1, &end, 10);
+        return port > 0 && port < 65536 && *end == ':' && end[1];
+    }
+    return false;
+}
+
+// Addresses saved by the last prewarm as CURLOPT_RESOLVE entries (host:port:address)
+static struct curl_slist *prewarm_load_dns(const char *path)
+{
+    struct stat st;
+    checkp_return(path && stat(path, &st) == 0 && time(NULL) - st.st_mtime < PREWARM_DNS_TTL, NULL);
+
+    FILE *f = fopen(path, "r");
+    checkp_return(f, NULL);
+
+    struct curl_slist *list = NULL;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (prewarm_valid_entry(line))
+            list = curl_slist_append(list, line);
+    }
+    fclose(f);
+    return list;
+}
+
+static void prewarm_save_dns(const char *path, char entries[][320], size_t count)
+{
+    size_t size = strlen(path) + 5;
+    char *tmp = (char *)malloc(size);
+    checkp_return(tmp, );
+    snprintf(tmp, size, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "w");
+    if (f)
+    {
+        for (size_t i = 0; i < count; ++i)
+            if (entries[i][0])
+                fprintf(f, "%s\n", entries[i]);
+        if (fclose(f) == 0)
+            rename(tmp, path);
+        else
+            remove(tmp);
+    }
+    free(tmp);
+}
+
+static void prewarm_set_state(struct Prewarm *p, PrewarmState state)
+{
+    pthread_mutex_lock(&p->mutex);
+    p->state = state;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// Open a connection to each host at the same time, the connections stay in the shared cache.
+// The saved addresses only go into the DNS cache of this multi handle, which isn't shared, so the calls
+// never connect to them: they reuse a warmed connection (found by host name) or resolve on their own.
+static void *prewarm_run(void *arg)
+{
+    struct Prewarm *p = (struct Prewarm *)arg;
+    struct curl_slist *resolve = prewarm_load_dns(p->cache_path);
+    CURLM *multi = curl_multi_init();
+    CURL *curls[PREWARM_HOSTS] = {0};
+    char entries[PREWARM_HOSTS][320] = {{0}};
+    size_t ready = 0;
+
+    if (multi)
+    {
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        for (size_t i = 0; i < PREWARM_HOSTS; ++i)
+        {
+            if (!(curls[i] = curl_easy_init()))
+                continue;
+            curl_easy_setopt(curls[i], CURLOPT_SHARE, p->share);
+            curl_easy_setopt(curls[i], CURLOPT_URL, prewarm_urls[i]);
+            curl_easy_setopt(curls[i], CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(curls[i], CURLOPT_CONNECTTIMEOUT_MS, 10000L);
+            curl_easy_setopt(curls[i], CURLOPT_TIMEOUT_MS, 15000L);
+            if (resolve)
+                curl_easy_setopt(curls[i], CURLOPT_RESOLVE, resolve);
+            curl_multi_add_handle(multi, curls[i]);
+        }
+
+        int running = 1;
+        while (running)
+        {
+            if (curl_multi_perform(multi, &running) != CURLM_OK)
+                break;
+            if (running)
+                curl_multi_poll(multi, NULL, 0, 1000, NULL);
+        }
+
+        CURLMsg *m;
+        int left;
+        while ((m = curl_multi_info_read(multi, &left)))
+        {
+            if (m->msg != CURLMSG_DONE || m->data.result != CURLE_OK)
+                continue;
+
+            // Any response means DNS, TCP and TLS are done
+            ++ready;
+            char *ip = NULL;
+            long port = 0;
+            curl_easy_getinfo(m->easy_handle, CURLINFO_PRIMARY_IP, &ip);
+            curl_easy_getinfo(m->easy_handle, CURLINFO_PRIMARY_PORT, &port);
+            for (size_t i = 0; i < PREWARM_HOSTS; ++i)
+                if (curls[i] == m->easy_handle && ip && ip[0])
+                {
+                    const char *host = prewarm_urls[i] + strlen("https://");
+                    int host_size = (int)strcspn(host, ":/");
+                    snprintf(entries[i], sizeof(entries[i]), strchr(ip, ':') ? "%.*s:%ld:[%s]" : "%.*s:%ld:%s", host_size, host, port, ip);
+                }
+        }
+
+        for (size_t i = 0; i < PREWARM_HOSTS; ++i)
+            if (curls[i])
+            {
+                curl_multi_remove_handle(multi, curls[i]);
+                curl_easy_cleanup(curls[i]);
+            }
+        curl_multi_cleanup(multi);
+    }
+
+    if (ready && p->cache_path)
+        prewarm_save_dns(p->cache_path, entries, PREWARM_HOSTS);
+    curl_slist_free_all(resolve);
+
+    prewarm_set_state(p, ready ? PREWARM_READY : PREWARM_FAILED);
+    return NULL;
+}
+
+WallhavenCode wallhaven_prewarm(WallhavenAPI *wa, const char *cache_path)
+{
+    checkp_return(!wa->prewarm, WALLHAVEN_OK);
+
+    struct Prewarm *p = (struct Prewarm *)wa_malloc(wa, sizeof(struct Prewarm));
+    checkp_return(p, WALLHAVEN_NO_MEMORY);
+    memset(p, 0, sizeof(struct Prewarm));
+    if (!(p->share = curl_share_init()) || (cache_path && !(p->cache_path = strdup(cache_path))))
+    {
+        if (p->share)
+            curl_share_cleanup(p->share);
+        wa_free(wa, p);
+        return WALLHAVEN_CURL_FAIL;
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init(&p->locks[i], NULL);
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->changed, NULL);
+
+    curl_share_setopt(p->share, CURLSHOPT_LOCKFUNC, prewarm_lock);
+    curl_share_setopt(p->share, CURLSHOPT_UNLOCKFUNC, prewarm_unlock);
+    curl_share_setopt(p->share, CURLSHOPT_USERDATA, (void *)p);
+    curl_share_setopt(p->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(p->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    p->state = PREWARM_RUNNING;
+    wa->prewarm = p;
+    prewarm_attach(wa);
+
+    if (pthread_create(&p->thread, NULL, prewarm_run, p))
+    {
+        p->state = PREWARM_FAILED;
+        return WALLHAVEN_CURL_FAIL;
+    }
+    p->started = true;
+
+    return WALLHAVEN_OK;
+}
+
+PrewarmState wallhaven_prewarm_state(WallhavenAPI *wa)
+{
+    checkp_return(wa->prewarm, PREWARM_NONE);
+
+    pthread_mutex_lock(&wa->prewarm->mutex);
+    PrewarmState state = wa->prewarm->state;
+    pthread_mutex_unlock(&wa->prewarm->mutex);
+    return state;
+}
+
+PrewarmState wallhaven_prewarm_wait(WallhavenAPI *wa, long timeout_ms)
+{
+    struct Prewarm *p = wa->prewarm;
+    checkp_return(p, PREWARM_NONE);
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        ++until.tv_sec;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    while (p->state == PREWARM_RUNNING)
+        if (pthread_cond_timedwait(&p->changed, &p->mutex, &until) == ETIMEDOUT)
+            break;
+    PrewarmState state = p->state;
+    pthread_mutex_unlock(&p->mutex);
+    return state;
+}
+
+static void prewarm_free(WallhavenAPI *wa)
+{
+    struct Prewarm *p = wa->prewarm;
+    checkp_return(p, );
+
+    if (p->started)
+        pthread_join(p->thread, NULL);
+    curl_share_cleanup(p->share);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_destroy(&p->locks[i]);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->changed);
+    free(p->cache_path);
+    wa_free(wa, p);
+    wa->prewarm = NULL;
+}
+
+#else
+
+static void prewarm_attach(WallhavenAPI *wa)
+{
+}
+
+static void prewarm_free(WallhavenAPI *wa)
+{
+}
+
+WallhavenCode wallhaven_prewarm(WallhavenAPI *wa, const char *cache_path)
+{
+    return WALLHAVEN_CURL_FAIL;
+}
+
+PrewarmState wallhaven_prewarm_state(WallhavenAPI *wa)
+{
+    return PREWARM_NONE;
+}
+
+PrewarmState wallhaven_prewarm_wait(WallhavenAPI *wa, long timeout_ms)
+{
+    return PREWARM_NONE;
+}
+
+#endif
+
+WallhavenAPI *wallhaven_init_prewarmed(const char *cache_path)
+{
+    WallhavenAPI *wa = wallhaven_init();
+    if (wa)
+        wallhaven_prewarm(wa, cache_path);
+    return wa;
+}
+
+// Response cache
+
+#define PREFETCH_WAIT_MS 2000     // Longest a call waits for the prefetch of what it asks for before making its own
+#define PREFETCH_TIMEOUT_MS 15000 // Prefetches taking longer are given up
+
+struct CacheEntry
+{
+    char key[48];                   // Path and id
+    Response body;
+    double fetched_at;
+    CURL *curl;                     // Prefetch in flight, NULL once done
+    bool prefetched;                // Filled by wallhaven_prefetch
+    bool used;                      // Served at least once
+    struct CacheEntry *prev, *next; // LRU list, most recently used first
+    struct CacheEntry *chain;       // Hash bucket
+};
+
+static bool cacheable(Path p)
+{
+    return p == WALLPAPER_INFO || p == TAG_INFO;
+}
+
+static struct CacheEntry **cache_bucket(WallhavenCache *c, const char *key)
+{
+    return &c->buckets[hash_bytes(key, strlen(key), HASH_SEED) & (c->bucket_count - 1)];
+}
+
+static struct CacheEntry *cache_find(WallhavenCache *c, const char *key)
+{
+    for (struct CacheEntry *e = *cache_bucket(c, key); e; e = e->chain)
+        if (!strcmp(e->key, key))
+            return e;
+    return NULL;
+}
+
+static void cache_unlink(WallhavenCache *c, struct CacheEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->lru_tail = e->prev;
+}
+
+static void cache_push_front(WallhavenCache *c, struct CacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = c->lru_head;
+    if (c->lru_head)
+        c->lru_head->prev = e;
+    c->lru_head = e;
+    if (!c->lru_tail)
+        c->lru_tail = e;
+}
+
+static void cache_remove(WallhavenCache *c, struct CacheEntry *e)
+{
+    struct CacheEntry **link = cache_bucket(c, e->key);
+    while (*link != e)
+        link = &(*link)->chain;
+    *link = e->chain;
+    cache_unlink(c, e);
+
+    if (e->prefetched && !e->used)
+        ++c->prefetch_wasted;
+    if (e->curl)
+    {
+        curl_multi_remove_handle(c->multi, e->curl);
+        curl_easy_cleanup(e->curl);
+        --c->prefetching;
+    }
+    free(e->body.value);
+    free(e);
+    --c->count;
+}
+
+static struct CacheEntry *cache_insert(WallhavenCache *c, const char *key)
+{
+    // Make room, prefetches in flight are not evicted
+    for (struct CacheEntry *e = c->lru_tail; e && c->count >= c->max_entries;)
+    {
+        struct CacheEntry *prev = e->prev;
+        if (!e->curl)
+            cache_remove(c, e);
+        e = prev;
+    }
+
+    struct CacheEntry *e = (struct CacheEntry *)calloc(1, sizeof(struct CacheEntry));
+    checkp_return(e, NULL);
+    snprintf(e->key, sizeof(e->key), "%s", key);
+
+    struct CacheEntry **bucket = cache_bucket(c, key);
+    e->chain = *bucket;
+    *bucket = e;
+    cache_push_front(c, e);
+    ++c->count;
+    return e;
+}
+
+WallhavenCache *wallhaven_cache_init(size_t max_entries, int ttl_seconds)
+{
+    WallhavenCache *c;
+    checkp_return(c = (WallhavenCache *)calloc(1, sizeof(WallhavenCache)), NULL);
+
+    c->max_entries = max_entries ? max_entries : 1;
+    for (c->bucket_count = 16; c->bucket_count < c->max_entries; c->bucket_count *= 2)
+        ;
+    c->ttl_seconds = ttl_seconds;
+    c->prefetch_reserve = 10;
+
+    c->buckets = (struct CacheEntry **)calloc(c->bucket_count, sizeof(struct CacheEntry *));
+    c->multi = curl_multi_init();
+    if (!c->buckets || !c->multi)
+    {
+        wallhaven_cache_free(c);
+        return NULL;
+    }
+    curl_multi_setopt(c->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    return c;
+}
+
+void wallhaven_cache_free(WallhavenCache *c)
+{
+    while (c->lru_head)
+        cache_remove(c, c->lru_head);
+    if (c->multi)
+        curl_multi_cleanup(c->multi);
+    free(c->buckets);
+    free(c);
+}
+
+void wallhaven_set_cache(WallhavenAPI *wa, WallhavenCache *c)
+{
+    wa->cache = c;
+}
+
+// Move the prefetches along without waiting
+static void cache_pump(WallhavenAPI *wa, WallhavenCache *c)
+{
+    checkp_return(c->prefetching, );
+
+    int running;
+    curl_multi_perform(c->multi, &running);
+
+    CURLMsg *m;
+    int left;
+    while ((m = curl_multi_info_read(c->multi, &left)))
+    {
+        if (m->msg != CURLMSG_DONE)
+            continue;
+
+        struct CacheEntry *e;
+        long response_code = 0;
+        CURL *curl = m->easy_handle;
+        CURLcode result = m->data.result;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&e);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+        read_limit_headers(wa, curl);
+
+        curl_multi_remove_handle(c->multi, curl);
+        curl_easy_cleanup(curl);
+        e->curl = NULL;
+        --c->prefetching;
+
+        if (result == CURLE_OK && response_code == 200)
+        {
+            e->fetched_at = now_seconds();
+            continue;
+        }
+
+        // Server wants us to slow down, stop prefetching for a while
+        if (response_code == 429)
+        {
+            c->paused_until = now_seconds() + (wa->stats.retry_after_ms > 0 ? wa->stats.retry_after_ms / 1000.0 : 60);
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+            if (wa->shared_limit)
+                shared_limit_penalize(wa->shared_limit);
+#endif
+        }
+        ++c->prefetch_failed;
+        e->prefetched = false;
+        cache_remove(c, e);
+    }
+}
+
+static bool cache_serve(WallhavenAPI *wa, Path p, const char *id)
+{
+    WallhavenCache *c = wa->cache;
+    checkp_return(c && cacheable(p) && id && (wa->response || wa->file), false);
+
+    char key[48];
+    snprintf(key, sizeof(key), "%d/%s", p, id);
+    cache_pump(wa, c);
+
+    // Prefetch of this one is on the way, waiting a bit for it is cheaper than a new call
+    struct CacheEntry *e;
+    double give_up = now_seconds() + PREFETCH_WAIT_MS / 1000.0;
+    while ((e = cache_find(c, key)) && e->curl && now_seconds() < give_up)
+    {
+        curl_multi_poll(c->multi, NULL, 0, 100, NULL);
+        cache_pump(wa, c);
+    }
+    if (e && e->curl)
+    {
+        // Too slow, the call is made instead
+        ++c->prefetch_failed;
+        cache_remove(c, e);
+        e = NULL;
+    }
+
+    if (e && c->ttl_seconds > 0 && now_seconds() - e->fetched_at > c->ttl_seconds)
+    {
+        cache_remove(c, e);
+        e = NULL;
+    }
+    if (!e)
+    {
+        ++c->misses;
+        return false;
+    }
+
+    ++c->hits;
+    if (e->prefetched && !e->used)
+        ++c->prefetch_hits;
+    e->used = true;
+    cache_unlink(c, e);
+    cache_push_front(c, e);
+
+    if (wa->response)
+        write_function(e->body.value, 1, e->body.size, wa->response);
+    else
+        fwrite(e->body.value, 1, e->body.size, wa->file);
+    return true;
+}
+
+static void cache_put(WallhavenCache *c, Path p, const char *id, const char *body, size_t size)
+{
+    char key[48];
+    snprintf(key, sizeof(key), "%d/%s", p, id);
+    struct CacheEntry *e = cache_find(c, key);
+    if (!e)
+        checkp_return(e = cache_insert(c, key), );
+    e->body.size = 0;
+
+    write_function((void *)body, 1, size, &e->body);
+    e->fetched_at = now_seconds();
+    e->used = true;
+}
+
+static void cache_store(WallhavenAPI *wa, Path p, const char *id, size_t start_size)
+{
+    WallhavenCache *c = wa->cache;
+    checkp_return(c && cacheable(p) && id && wa->response, );
+
+    long response_code = 0;
+    curl_easy_getinfo(wa->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    checkp_return(response_code == 200, );
+
+    cache_put(c, p, id, wa->response->value + start_size, wa->response->size - start_size);
+}
+
+bool wallhaven_cache_get(WallhavenAPI *wa, Path p, const char *id, Response *out)
+{
+    // cache_serve writes where the calls of wa write
+    Response *response = wa->response;
+    FILE *file = wa->file;
+    wa->response = out;
+    wa->file = NULL;
+    bool hit = cache_serve(wa, p, id);
+    wa->response = response;
+    wa->file = file;
+    return hit;
+}
+
+void wallhaven_cache_put(WallhavenAPI *wa, Path p, const char *id, const Response *body)
+{
+    checkp_return(wa->cache && cacheable(p) && id && body->value, );
+    cache_put(wa->cache, p, id, body->value, body->size);
+}
+
+// Whether a call can be spent on a prefetch without holding up the calls asked for
+static bool prefetch_budget(WallhavenAPI *wa, WallhavenCache *c)
+{
+    double now = now_seconds();
+    checkp_return(now >= c->paused_until, false);
+
+    if (wa->stats.ratelimit_remaining >= 0)
+    {
+        checkp_return(wa->stats.ratelimit_remaining - c->prefetching > c->prefetch_reserve, false);
+    }
+    else
+    {
+        // Server didn't tell, count the calls of this minute ourselves
+        if (now - c->window_start >= 60)
+        {
+            c->window_start = now;
+            c->window_attempts = wa->stats.attempts;
+            c->window_prefetches = 0;
+        }
+        size_t used = wa->stats.attempts - c->window_attempts + c->window_prefetches;
+        checkp_return(used + c->prefetch_reserve < WALLHAVEN_CALLS_PER_MINUTE, false);
+    }
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+    if (wa->shared_limit)
+        checkp_return(shared_limit_try_acquire(wa->shared_limit), false);
+#endif
+
+    ++c->window_prefetches;
+    return true;
+}
+
+static char *info_url(WallhavenAPI *wa, const char *id)
+{
+    char *url = NULL;
+    CURLU *u = curl_url_dup(wa->url);
+    checkp_return(u, NULL);
+
+    size_t size = strlen(WALLPAPER_INFO_PATH) + strlen(id) + 1;
+    char *path = (char *)malloc(size);
+    if (path)
+    {
+        snprintf(path, size, WALLPAPER_INFO_PATH "%s", id);
+        if (curl_url_set(u, CURLUPART_PATH, path, CURLU_URLENCODE) == CURLUE_OK && curl_url_set(u, CURLUPART_QUERY, NULL, 0) == CURLUE_OK)
+        {
+            // Key lets NSFW wallpapers through, like wallhaven_wallpaper_info
+            char query[128];
+            snprintf(query, sizeof(query), "apikey=%s", wa->apikey ? wa->apikey : "");
+            if (!wa->apikey || curl_url_set(u, CURLUPART_QUERY, query, CURLU_URLENCODE) == CURLUE_OK)
+                curl_url_get(u, CURLUPART_URL, &url, 0);
+        }
+        free(path);
+    }
+
+    curl_url_cleanup(u);
+    return url;
+}
+
+WallhavenCode wallhaven_prefetch(WallhavenAPI *wa, const Response *search, int top_n)
+{
+    WallhavenCache *c = wa->cache;
+    checkp_return(c && search->value && top_n > 0, WALLHAVEN_OK);
+
+    WallhavenJson j;
+    WallhavenCode wc = wallhaven_json_parse(&j, search->value, search->size);
+    check_return(wc, wc);
+
+    size_t count = wallhaven_json_count(&j, "data");
+    if (count > (size_t)top_n)
+        count = top_n;
+
+    char id[16], path[32], key[48];
+    for (size_t i = 0; i < count; ++i)
+    {
+        snprintf(path, sizeof(path), "data[%zu].id", i);
+        if (!wallhaven_json_string(&j, path, id, sizeof(id)))
+            continue;
+        snprintf(key, sizeof(key), "%d/%s", WALLPAPER_INFO, id);
+        if (cache_find(c, key))
+            continue;
+
+        if (!prefetch_budget(wa, c))
+        {
+            c->budget_skipped += count - i;
+            break;
+        }
+
+        char *url = info_url(wa, id);
+        CURL *curl = url ? curl_easy_init() : NULL;
+        struct CacheEntry *e = curl ? cache_insert(c, key) : NULL;
+        if (!e)
+        {
+            if (curl)
+                curl_easy_cleanup(curl);
+            curl_free(url);
+            wc = WALLHAVEN_CURL_FAIL;
+            break;
+        }
+
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_function);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&e->body);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)e);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)PREFETCH_TIMEOUT_MS);
+        curl_multi_add_handle(c->multi, curl);
+        curl_free(url);
+
+        e->curl = curl;
+        e->prefetched = true;
+        ++c->prefetching;
+        ++c->prefetched;
+    }
+
+    wallhaven_json_free(&j);
+    cache_pump(wa, c);
+    return wc;
+}
+
+void wallhaven_prefetch_poll(WallhavenAPI *wa)
+{
+    if (wa->cache)
+        cache_pump(wa, wa->cache);
+}
+
+// URLs
+
+char *wallhaven_call_url(WallhavenAPI *wa, Path p, const char *id)
+{
+    char *url = NULL;
+
+    wa->api_key_set = false;
+    if (curl_url_set(wa->url, CURLUPART_QUERY, NULL, 0) == CURLUE_OK && set_path(wa, p, id) == WALLHAVEN_OK)
+        curl_url_get(wa->url, CURLUPART_URL, &url, 0);
+
+    curl_url_set(wa->url, CURLUPART_QUERY, NULL, 0);
+    arena_reset(wa);
+    return url;
+}
+
+char *wallhaven_search_url(WallhavenAPI *wa, Parameters *p)
+{
+    char *url = search_url(wa, p, p->page);
+    curl_url_set(wa->url, CURLUPART_QUERY, NULL, 0);
+    return url;
+}
+
+WallhavenCode wallhaven_call_acquire(WallhavenAPI *wa)
+{
+    if (wa->breaker_open_until && now_seconds() < wa->breaker_open_until)
+    {
+        ++wa->stats.breaker_rejected;
+        return WALLHAVEN_CIRCUIT_OPEN;
+    }
+
+    if (wa->start_time == -1 || difftime(time(NULL), wa->start_time) > 60)
+        time(&wa->start_time);
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+    if (wa->shared_limit)
+        checkp_return(shared_limit_try_acquire(wa->shared_limit), WALLHAVEN_TOO_MANY_REQUSTS_ERROR);
+#endif
+    return WALLHAVEN_OK;
+}
+
+WallhavenCode wallhaven_call_finish(WallhavenAPI *wa, CURL *curl, CURLcode result, int attempt, long *retry_ms)
+{
+    WallhavenStats *st = &wa->stats;
+    *retry_ms = -1;
+    if (!attempt)
+        ++st->calls;
+    ++st->attempts;
+
+    long response_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    read_limit_headers(wa, curl);
+    st->last_status = response_code;
+
+    // Same as perform, but the caller does the waiting
+    bool retryable;
+    long delay;
+    WallhavenCode wc = call_outcome(wa, result, response_code, &retryable);
+    if (wc == WALLHAVEN_OK || wc == WALLHAVEN_UNAUTHORIZED_ERROR || !call_retry(wa, &wc, retryable, attempt, true, false, &delay))
+        return wc;
+
+    *retry_ms = delay;
+    return wc;
+}
+
+// Record and replay
+
+#define RECORD_MAGIC 0x4c524857u // "WHRL"
+#define RECORD_VERSION 1
+#define RECORD_NO_BODY 1 // Body went to a file or a sink file, not recorded
+
+// Layout of the log: header, then for each call a record followed by the target, the id and the body,
+// padded to 8 bytes so that the next record is aligned.
+// Records are appended when the calls finish, so they are not in the order the calls were made.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved;
+} RecordHeader;
+
+typedef struct
+{
+    uint64_t offset_us;          // When the call was made, from the start of the recording
+    uint32_t duration_us;        // Time taken including the retries
+    uint32_t body_size;
+    uint16_t target_size;        // Path and query without the apikey
+    uint16_t id_size;            // 0 when the call had no id
+    uint16_t status;             // 0 if there was no response
+    uint8_t path;                // Path of wallhaven_get_result
+    uint8_t flags;
+    int16_t ratelimit_remaining; // -1 if not sent
+    int16_t ratelimit_limit;     // -1 if not sent
+    uint16_t retry_after_s;      // 0 if not sent
+    uint16_t reserved;
+} RecordEntry;
+
+_Static_assert(sizeof(RecordHeader) == 16, "RecordHeader layout changed");
+_Static_assert(sizeof(RecordEntry) == 32, "RecordEntry layout changed");
+
+#define record_size(e) ((sizeof(RecordEntry) + (e)->target_size + (e)->id_size + (e)->body_size + 7) & ~(size_t)7)
+
+// Remove the apikey parameter from the query of target (path?query), in place
+static size_t redact_target(char *target, size_t size)
+{
+    char *q = (char *)memchr(target, '?', size);
+    if (!q)
+        return size;
+
+    char *end = target + size, *out = q + 1;
+    for (char *p = q + 1; p < end;)
+    {
+        char *amp = (char *)memchr(p, '&', end - p);
+        char *stop = amp ? amp : end;
+        if (stop - p < 7 || strncmp(p, "apikey=", 7))
+        {
+            if (out != q + 1)
+                *out++ = '&';
+            memmove(out, p, stop - p);
+            out += stop - p;
+        }
+        p = stop + 1;
+    }
+    if (out == q + 1)
+        out = q;
+    *out = 0;
+    return out - target;
+}
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+static void record_call(WallhavenAPI *wa, Path p, const char *id, double started, size_t start_size)
+{
+    WallhavenRecorder *r = wa->recorder;
+    WallhavenStats *st = &wa->stats;
+    char *path = NULL, *query = NULL;
+    if (curl_url_get(wa->url, CURLUPART_PATH, &path, 0) != CURLUE_OK)
+        return;
+    if (curl_url_get(wa->url, CURLUPART_QUERY, &query, 0) != CURLUE_OK)
+        query = NULL;
+
+    char target[4096];
+    size_t target_size = (size_t)snprintf(target, sizeof(target), "%s%s%s", path, query ? "?" : "", query ? query : "");
+    curl_free(path);
+    curl_free(query);
+    if (target_size >= sizeof(target))
+        return;
+    target_size = redact_target(target, target_size);
+
+    double now = now_seconds();
+    const char *body = NULL;
+    size_t body_size = 0;
+    if (wa->response && wa->response->value)
+    {
+        body = wa->response->value + start_size;
+        body_size = wa->response->size - start_size;
+    }
+
+    size_t id_size = id ? strlen(id) : 0;
+    RecordEntry e = {
+        .offset_us = started > r->start ? (uint64_t)((started - r->start) * 1e6) : 0,
+        .duration_us = (uint32_t)((now - started) * 1e6),
+        .body_size = (uint32_t)body_size,
+        .target_size = (uint16_t)target_size,
+        .id_size = (uint16_t)(id_size < UINT16_MAX ? id_size : 0),
+        .status = (uint16_t)st->last_status,
+        .path = (uint8_t)p,
+        .flags = wa->response ? 0 : RECORD_NO_BODY,
+        .ratelimit_remaining = (int16_t)(st->ratelimit_remaining < INT16_MAX ? st->ratelimit_remaining : INT16_MAX),
+        .ratelimit_limit = (int16_t)(st->ratelimit_limit < INT16_MAX ? st->ratelimit_limit : INT16_MAX),
+        .retry_after_s = (uint16_t)((st->retry_after_ms + 999) / 1000),
+    };
+
+    static const char padding[8];
+    size_t padding_size = record_size(&e) - (sizeof(e) + target_size + e.id_size + body_size);
+
+    // Whole record is written under the lock of the file so that records of different threads don't mix
+    flockfile(r->file);
+    if (!r->failed)
+    {
+        bool ok = fwrite(&e, sizeof(e), 1, r->file) == 1 && fwrite(target, 1, target_size, r->file) == target_size &&
+                  (!e.id_size || fwrite(id, 1, e.id_size, r->file) == e.id_size) &&
+                  (!body_size || fwrite(body, 1, body_size, r->file) == body_size) &&
+                  (!padding_size || fwrite(padding, 1, padding_size, r->file) == padding_size);
+        if (ok)
+        {
+            ++r->records;
+            r->bytes += record_size(&e);
+        }
+        else
+            r->failed = true;
+    }
+    funlockfile(r->file);
+}
+
+WallhavenRecorder *wallhaven_recorder_open(const char *path)
+{
+    WallhavenRecorder *r;
+    checkp_return(r = (WallhavenRecorder *)calloc(1, sizeof(WallhavenRecorder)), NULL);
+    if (!(r->file = fopen(path, "wb")))
+    {
+        free(r);
+        return NULL;
+    }
+
+    RecordHeader h = {.magic = RECORD_MAGIC, .version = RECORD_VERSION};
+    if (fwrite(&h, sizeof(h), 1, r->file) != 1)
+    {
+        fclose(r->file);
+        free(r);
+        return NULL;
+    }
+    r->bytes = sizeof(h);
+    r->start = now_seconds();
+    return r;
+}
+
+WallhavenCode wallhaven_recorder_close(WallhavenRecorder *r)
+{
+    bool ok = !r->failed;
+    if (fclose(r->file))
+        ok = false;
+    free(r);
+    return ok ? WALLHAVEN_OK : WALLHAVEN_IO_FAIL;
+}
+
+// Recorded call as loaded, pointing into the log
+struct ReplayEntry
+{
+    const RecordEntry *record;
+    const char *target;
+    const char *id;
+    const char *body;
+};
+
+// Different path and query, with the recorded calls of it
+struct ReplayTarget
+{
+    const char *target;
+    uint16_t size;
+    uint32_t count;
+    struct ReplayEntry **entries;
+    _Atomic uint32_t next; // Next call to answer with, in the recorded order
+};
+
+struct ReplayServer
+{
+    int listen_fd;
+    double speed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int *fds;                  // Open connections, -1 when closed
+    pthread_t *threads;        // Thread of each connection
+    size_t connections;
+    size_t capacity;
+    _Atomic bool stopping;
+    _Atomic size_t served;
+};
+
+static struct ReplayTarget *replay_find(WallhavenReplay *rp, const char *target, size_t size, bool insert)
+{
+    size_t mask = rp->target_capacity - 1;
+    for (size_t i = hash_bytes(target, size, HASH_SEED) & mask;; i = (i + 1) & mask)
+    {
+        struct ReplayTarget *t = &rp->targets[i];
+        if (!t->target)
+        {
+            if (!insert)
+                return NULL;
+            t->target = target;
+            t->size = (uint16_t)size;
+            return t;
+        }
+        if (t->size == size && !memcmp(t->target, target, size))
+            return t;
+    }
+}
+
+static int compare_replay_entries(const void *a, const void *b)
+{
+    uint64_t x = ((const struct ReplayEntry *)a)->record->offset_us, y = ((const struct ReplayEntry *)b)->record->offset_us;
+    return x < y ? -1 : x > y;
+}
+
+// Split the log into entries, false if it is not a valid log
+static bool replay_index(WallhavenReplay *rp)
+{
+    const RecordHeader *h = (const RecordHeader *)rp->log;
+    checkp_return(rp->log_size >= sizeof(RecordHeader) && h->magic == RECORD_MAGIC && h->version == RECORD_VERSION, false);
+
+    size_t capacity = 0;
+    for (size_t at = sizeof(RecordHeader); at < rp->log_size;)
+    {
+        // Log of a process which died while writing ends with a partial record, ignore it
+        const RecordEntry *e = (const RecordEntry *)(rp->log + at);
+        if (rp->log_size - at < sizeof(RecordEntry) || rp->log_size - at < record_size(e))
+            break;
+
+        if (rp->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            struct ReplayEntry *entries = (struct ReplayEntry *)realloc(rp->entries, capacity * sizeof(struct ReplayEntry));
+            checkp_return(entries, false);
+            rp->entries = entries;
+        }
+
+        const char *target = (const char *)(e + 1);
+        rp->entries[rp->count++] = (struct ReplayEntry){e, target, target + e->target_size, target + e->target_size + e->id_size};
+        at += record_size(e);
+    }
+
+    qsort(rp->entries, rp->count, sizeof(struct ReplayEntry), compare_replay_entries);
+    if (rp->count)
+        rp->duration = (rp->entries[rp->count - 1].record->offset_us - rp->entries[0].record->offset_us) / 1e6;
+
+    rp->target_capacity = 16;
+    while (rp->target_capacity < rp->count * 2)
+        rp->target_capacity *= 2;
+    checkp_return(rp->targets = (struct ReplayTarget *)calloc(rp->target_capacity, sizeof(struct ReplayTarget)), false);
+
+    // Count the calls of each target, then point each target at its calls in the recorded order
+    for (size_t i = 0; i < rp->count; ++i)
+        ++replay_find(rp, rp->entries[i].target, rp->entries[i].record->target_size, true)->count;
+
+    for (size_t i = 0; i < rp->target_capacity; ++i)
+    {
+        struct ReplayTarget *t = &rp->targets[i];
+        if (t->target)
+        {
+            checkp_return(t->entries = (struct ReplayEntry **)malloc(t->count * sizeof(struct ReplayEntry *)), false);
+            t->count = 0;
+        }
+    }
+
+    for (size_t i = 0; i < rp->count; ++i)
+    {
+        struct ReplayTarget *t = replay_find(rp, rp->entries[i].target, rp->entries[i].record->target_size, false);
+        t->entries[t->count++] = &rp->entries[i];
+    }
+
+    return true;
+}
+
+WallhavenReplay *wallhaven_replay_open(const char *path)
+{
+    WallhavenReplay *rp;
+    checkp_return(rp = (WallhavenReplay *)calloc(1, sizeof(WallhavenReplay)), NULL);
+
+    FILE *f = fopen(path, "rb");
+    if (f && !fseek(f, 0, SEEK_END))
+    {
+        long size = ftell(f);
+        if (size > 0 && !fseek(f, 0, SEEK_SET) && (rp->log = (unsigned char *)malloc(size)))
+            rp->log_size = fread(rp->log, 1, size, f);
+    }
+    if (f)
+        fclose(f);
+
+    if (!rp->log || !replay_index(rp))
+    {
+        wallhaven_replay_close(rp);
+        return NULL;
+    }
+
+    return rp;
+}
+
+static bool send_all(int fd, const char *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static char *headers_end(char *data, size_t size)
+{
+    for (size_t i = 3; i < size; ++i)
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r')
+            return data + i - 3;
+    return NULL;
+}
+
+// Answer the requests of one connection till the client closes it
+static void replay_connection(WallhavenReplay *rp, int fd)
+{
+    struct ReplayServer *s = rp->server;
+    char request[8192];
+    size_t have = 0;
+
+    while (!atomic_load(&s->stopping))
+    {
+        // Read till the end of the headers, GETs have no body
+        char *end;
+        while (!(end = headers_end(request, have)))
+        {
+            if (have == sizeof(request))
+                return;
+            ssize_t n = recv(fd, request + have, sizeof(request) - have, 0);
+            if (n <= 0)
+                return;
+            have += n;
+        }
+
+        char *target = (char *)memchr(request, ' ', end - request);
+        checkp_return(target, );
+        ++target;
+        char *target_end = (char *)memchr(target, ' ', end - target);
+        checkp_return(target_end, );
+        size_t target_size = redact_target(target, target_end - target);
+
+        atomic_fetch_add(&s->served, 1);
+        struct ReplayTarget *t = replay_find(rp, target, target_size, false);
+        char head[256];
+        int head_size;
+        const RecordEntry *e = NULL;
+        struct ReplayEntry *entry = NULL;
+        if (!t)
+            head_size = snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        else
+        {
+            entry = t->entries[atomic_fetch_add(&t->next, 1) % t->count];
+            e = entry->record;
+            if (s->speed > 0)
+                usleep((useconds_t)(e->duration_us / s->speed));
+            // Recorded failure without a response, fail the same way
+            if (!e->status)
+                return;
+
+            head_size = snprintf(head, sizeof(head), "HTTP/1.1 %u Replayed\r\nContent-Type: application/json\r\nContent-Length: %u\r\n",
+                                 e->status, e->body_size);
+            if (e->ratelimit_limit >= 0)
+                head_size += snprintf(head + head_size, sizeof(head) - head_size, "X-RateLimit-Limit: %d\r\n", e->ratelimit_limit);
+            if (e->ratelimit_remaining >= 0)
+                head_size += snprintf(head + head_size, sizeof(head) - head_size, "X-RateLimit-Remaining: %d\r\n", e->ratelimit_remaining);
+            if (e->retry_after_s)
+                head_size += snprintf(head + head_size, sizeof(head) - head_size, "Retry-After: %u\r\n", e->retry_after_s);
+            head_size += snprintf(head + head_size, sizeof(head) - head_size, "\r\n");
+        }
+
+        if (!send_all(fd, head, head_size) || (e && !send_all(fd, entry->body, e->body_size)))
+            return;
+
+        // Keep what came after this request
+        have -= end + 4 - request;
+        memmove(request, end + 4, have);
+    }
+}
+
+typedef struct
+{
+    WallhavenReplay *rp;
+    int fd;
+} ReplayConnection;
+
+static void *replay_connection_run(void *arg)
+{
+    ReplayConnection c = *(ReplayConnection *)arg;
+    free(arg);
+    replay_connection(c.rp, c.fd);
+    shutdown(c.fd, SHUT_RDWR);
+    return NULL;
+}
+
+static void *replay_accept(void *arg)
+{
+    WallhavenReplay *rp = (WallhavenReplay *)arg;
+    struct ReplayServer *s = rp->server;
+
+    while (!atomic_load(&s->stopping))
+    {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        ReplayConnection *c = (ReplayConnection *)malloc(sizeof(ReplayConnection));
+        pthread_mutex_lock(&s->lock);
+        if (c && s->connections == s->capacity)
+        {
+            size_t capacity = s->capacity ? s->capacity * 2 : 16;
+            int *fds = (int *)realloc(s->fds, capacity * sizeof(int));
+            if (fds)
+                s->fds = fds;
+            pthread_t *threads = fds ? (pthread_t *)realloc(s->threads, capacity * sizeof(pthread_t)) : NULL;
+            if (threads)
+            {
+                s->threads = threads;
+                s->capacity = capacity;
+            }
+        }
+
+        bool started = false;
+        if (c && s->connections < s->capacity)
+        {
+            *c = (ReplayConnection){rp, fd};
+            started = !pthread_create(&s->threads[s->connections], NULL, replay_connection_run, c);
+            if (started)
+                s->fds[s->connections++] = fd;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (!started)
+        {
+            free(c);
+            close(fd);
+        }
+    }
+
+    return NULL;
+}
+
+static void replay_stop(WallhavenReplay *rp)
+{
+    struct ReplayServer *s = rp->server;
+    checkp_return(s, );
+
+    // Wake up the threads blocked in accept and recv
+    atomic_store(&s->stopping, true);
+    shutdown(s->listen_fd, SHUT_RDWR);
+    pthread_join(s->thread, NULL);
+    close(s->listen_fd);
+
+    for (size_t i = 0; i < s->connections; ++i)
+        shutdown(s->fds[i], SHUT_RDWR);
+    for (size_t i = 0; i < s->connections; ++i)
+    {
+        pthread_join(s->threads[i], NULL);
+        close(s->fds[i]);
+    }
+
+    pthread_mutex_destroy(&s->lock);
+    free(s->fds);
+    free(s->threads);
+    free(s);
+    rp->server = NULL;
+}
+
+WallhavenCode wallhaven_replay_serve(WallhavenReplay *rp, int port, double speed)
+{
+    struct ReplayServer *s;
+    checkp_return(!rp->server, WALLHAVEN_OK);
+    checkp_return(s = (struct ReplayServer *)calloc(1, sizeof(struct ReplayServer)), WALLHAVEN_NO_MEMORY);
+    s->speed = speed;
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t)port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_size = sizeof(addr);
+    int one = 1;
+    s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->listen_fd < 0 || setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(s->listen_fd, 128) ||
+        getsockname(s->listen_fd, (struct sockaddr *)&addr, &addr_size))
+    {
+        if (s->listen_fd >= 0)
+            close(s->listen_fd);
+        free(s);
+        return WALLHAVEN_IO_FAIL;
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    rp->server = s;
+    if (pthread_create(&s->thread, NULL, replay_accept, rp))
+    {
+        close(s->listen_fd);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        rp->server = NULL;
+        return WALLHAVEN_IO_FAIL;
+    }
+
+    rp->port = ntohs(addr.sin_port);
+    snprintf(rp->base_url, sizeof(rp->base_url), "http://127.0.0.1:%d", rp->port);
+    return WALLHAVEN_OK;
+}
+
+void wallhaven_replay_close(WallhavenReplay *rp)
+{
+    replay_stop(rp);
+    if (rp->targets)
+        for (size_t i = 0; i < rp->target_capacity; ++i)
+            free(rp->targets[i].entries);
+    free(rp->targets);
+    free(rp->entries);
+    free(rp->log);
+    free(rp);
+}
+
+// State shared by the clients of wallhaven_replay_run
+typedef struct
+{
+    WallhavenReplay *rp;
+    const ReplayOptions *o;
+    double start;
+    _Atomic size_t next;
+    _Atomic size_t made; // Calls made, clients which failed to start make none
+    double *latencies;   // Seconds taken by each call made, in the order they finished
+    _Atomic int64_t lag_max_us;
+    _Atomic size_t failed, rate_limited, retries;
+} ReplayRun;
+
+typedef struct
+{
+    ReplayRun *run;
+    int client;
+} ReplayClient;
+
+static void *replay_client(void *arg)
+{
+    ReplayClient *c = (ReplayClient *)arg;
+    ReplayRun *run = c->run;
+    WallhavenReplay *rp = run->rp;
+    uint64_t first_us = rp->count ? rp->entries[0].record->offset_us : 0;
+
+    WallhavenAPI *wa = wallhaven_init();
+    if (!wa || wallhaven_base_url(wa, rp->base_url) != WALLHAVEN_OK)
+    {
+        if (wa)
+            wallhaven_free(wa);
+        return NULL;
+    }
+    wallhaven_apikey(wa, "replay");
+    if (run->o->setup)
+        run->o->setup(wa, c->client, run->o->userdata);
+
+    Response r = {0};
+    char id[UINT16_MAX + 1];
+    for (size_t i; (i = atomic_fetch_add(&run->next, 1)) < rp->count;)
+    {
+        struct ReplayEntry *e = &rp->entries[i];
+        if (run->o->speed > 0)
+        {
+            double due = run->start + (e->record->offset_us - first_us) / 1e6 / run->o->speed;
+            double now = now_seconds();
+            if (due > now)
+                sleep_ms((long)((due - now) * 1000));
+            else
+            {
+                int64_t lag = (int64_t)((now - due) * 1e6), max = atomic_load(&run->lag_max_us);
+                while (lag > max && !atomic_compare_exchange_weak(&run->lag_max_us, &max, lag))
+                    ;
+            }
+        }
+
+        memcpy(id, e->id, e->record->id_size);
+        id[e->record->id_size] = 0;
+        const char *query = (const char *)memchr(e->target, '?', e->record->target_size);
+
+        r.size = 0;
+        double started = now_seconds();
+        WallhavenCode wc = wallhaven_write_to_response(wa, &r);
+        if (wc == WALLHAVEN_OK && query)
+        {
+            // Query is already encoded, and set_path adds the apikey after it
+            char q[4096];
+            size_t size = e->target + e->record->target_size - query - 1;
+            snprintf(q, sizeof(q), "%.*s", (int)size, query + 1);
+            if (curl_url_set(wa->url, CURLUPART_QUERY, q, 0) != CURLUE_OK)
+                wc = WALLHAVEN_CURL_FAIL;
+        }
+        if (wc == WALLHAVEN_OK)
+            wc = wallhaven_get_result(wa, (Path)e->record->path, e->record->id_size ? id : NULL);
+
+        run->latencies[atomic_fetch_add(&run->made, 1)] = now_seconds() - started;
+        if (wc != WALLHAVEN_OK)
+            atomic_fetch_add(&run->failed, 1);
+    }
+
+    atomic_fetch_add(&run->rate_limited, wa->stats.rate_limited);
+    atomic_fetch_add(&run->retries, wa->stats.retries);
+    free(r.value);
+    wallhaven_free(wa);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+WallhavenCode wallhaven_replay_run(WallhavenReplay *rp, const ReplayOptions *o, ReplayReport *report)
+{
+    ReplayOptions options = o ? *o : (ReplayOptions){.clients = 1, .speed = 1};
+    if (options.clients < 1)
+        options.clients = 1;
+
+    if (!rp->server)
+    {
+        WallhavenCode wc = wallhaven_replay_serve(rp, 0, options.speed);
+        check_return(wc, wc);
+    }
+
+    ReplayRun run = {.rp = rp, .o = &options};
+    pthread_t *threads = (pthread_t *)malloc(options.clients * sizeof(pthread_t));
+    ReplayClient *clients = (ReplayClient *)malloc(options.clients * sizeof(ReplayClient));
+    run.latencies = (double *)calloc(rp->count ? rp->count : 1, sizeof(double));
+    if (!threads || !clients || !run.latencies)
+    {
+        free(threads);
+        free(clients);
+        free(run.latencies);
+        return WALLHAVEN_NO_MEMORY;
+    }
+
+    size_t served = atomic_load(&rp->server->served);
+    run.start = now_seconds();
+    int started = 0;
+    for (; started < options.clients; ++started)
+    {
+        clients[started] = (ReplayClient){&run, started};
+        if (pthread_create(&threads[started], NULL, replay_client, &clients[started]))
+            break;
+    }
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    double seconds = now_seconds() - run.start;
+
+    if (report)
+    {
+        size_t made = atomic_load(&run.made);
+        qsort(run.latencies, made, sizeof(double), compare_doubles);
+        *report = (ReplayReport){
+            .requests = made,
+            .failed = atomic_load(&run.failed),
+            .served = atomic_load(&rp->server->served) - served,
+            .rate_limited = atomic_load(&run.rate_limited),
+            .retries = atomic_load(&run.retries),
+            .seconds = seconds,
+            .calls_per_second = seconds > 0 ? made / seconds : 0,
+            .latency_p50_ms = made ? run.latencies[made / 2] * 1000 : 0,
+            .latency_p99_ms = made ? run.latencies[(made * 99) / 100] * 1000 : 0,
+            .latency_max_ms = made ? run.latencies[made - 1] * 1000 : 0,
+            .lag_max_ms = atomic_load(&run.lag_max_us) / 1000.0,
+        };
+    }
+
+    free(threads);
+    free(clients);
+    free(run.latencies);
+    return started && (atomic_load(&run.made) || !rp->count) ? WALLHAVEN_OK : WALLHAVEN_CURL_FAIL;
+}
+
+#else
+
+static void record_call(WallhavenAPI *wa, Path p, const char *id, double started, size_t start_size)
+{
+}
+
+WallhavenRecorder *wallhaven_recorder_open(const char *path)
+{
+    return NULL;
+}
+
+WallhavenCode wallhaven_recorder_close(WallhavenRecorder *r)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+WallhavenReplay *wallhaven_replay_open(const char *path)
+{
+    return NULL;
+}
+
+void wallhaven_replay_close(WallhavenReplay *rp)
+{
+}
+
+WallhavenCode wallhaven_replay_serve(WallhavenReplay *rp, int port, double speed)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+WallhavenCode wallhaven_replay_run(WallhavenReplay *rp, const ReplayOptions *o, ReplayReport *report)
+{
+    return WALLHAVEN_CURL_FAIL;
+}
+
+#endif
+
+void wallhaven_set_recorder(WallhavenAPI *wa, WallhavenRecorder *r)
+{
+    wa->recorder = r;
+}
+
+WallhavenCode wallhaven_base_url(WallhavenAPI *wa, const char *base_url)
+{
+    check_return(curl_url_set(wa->url, CURLUPART_URL, base_url, 0), WALLHAVEN_CURL_FAIL);
+    return WALLHAVEN_OK;
+}
+
+// Watcher
+
+WallhavenWatcher *wallhaven_watcher_init(WallhavenAPI *wa, const WatcherOptions *o)
+{
+    WallhavenWatcher *w;
+    checkp_return(w = (WallhavenWatcher *)calloc(1, sizeof(WallhavenWatcher)), NULL);
+    w->wa = wa;
+    if (o)
+        w->options = *o;
+
+    WatcherOptions *opt = &w->options;
+    if (opt->min_interval <= 0)
+        opt->min_interval = 60;
+    if (opt->max_interval < opt->min_interval)
+        opt->max_interval = opt->min_interval > 3600 ? opt->min_interval : 3600;
+    if (opt->target_new <= 0)
+        opt->target_new = 12;
+    if (opt->max_pages <= 0)
+        opt->max_pages = 5;
+    if (opt->calls_per_minute <= 0)
+        opt->calls_per_minute = 10;
+    if (opt->ratelimit_reserve <= 0)
+        opt->ratelimit_reserve = 5;
+
+    w->pages = (Response *)calloc(opt->max_pages, sizeof(Response));
+    w->json = (WallhavenJson *)calloc(opt->max_pages, sizeof(WallhavenJson));
+    if (!w->pages || !w->json)
+    {
+        wallhaven_watcher_free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+void wallhaven_watcher_free(WallhavenWatcher *w)
+{
+    for (size_t i = 0; i < w->count; ++i)
+        free(w->watches[i]);
+    if (w->pages)
+        for (int i = 0; i < w->options.max_pages; ++i)
+            free(w->pages[i].value);
+    free(w->pages);
+    free(w->json);
+    free(w->watches);
+    free(w);
+}
+
+WallhavenWatch *wallhaven_watch(WallhavenWatcher *w, const Parameters *p, onNewWallpaper callback, void *userdata)
+{
+    if (w->count == w->capacity)
+    {
+        size_t capacity = w->capacity ? w->capacity * 2 : 8;
+        WallhavenWatch **watches = (WallhavenWatch **)realloc(w->watches, capacity * sizeof(WallhavenWatch *));
+        checkp_return(watches, NULL);
+        w->watches = watches;
+        w->capacity = capacity;
+    }
+
+    WallhavenWatch *watch;
+    checkp_return(watch = (WallhavenWatch *)calloc(1, sizeof(WallhavenWatch)), NULL);
+    watch->parameters = *p;
+    watch->parameters.sorting = DATE_ADDED;
+    watch->parameters.order = DESCENDING;
+    watch->callback = callback;
+    watch->userdata = userdata;
+    watch->interval = w->options.min_interval;
+
+    w->watches[w->count++] = watch;
+    return watch;
+}
+
+void wallhaven_unwatch(WallhavenWatcher *w, WallhavenWatch *watch)
+{
+    for (size_t i = 0; i < w->count; ++i)
+        if (w->watches[i] == watch)
+        {
+            w->watches[i] = w->watches[--w->count];
+            free(watch);
+            return;
+        }
+}
+
+static bool watch_is_tie(WallhavenWatch *watch, const char *id)
+{
+    for (int i = 0; i < watch->tie_count; ++i)
+        if (!strcmp(watch->ties[i], id))
+            return true;
+    return false;
+}
+
+// Whether the wallpaper is above the high-water mark
+static bool watch_is_new(WallhavenWatch *watch, const char *created_at, const char *id)
+{
+    int c = strcmp(created_at, watch->high_water);
+    return c > 0 || (c == 0 && !watch_is_tie(watch, id));
+}
+
+static void watch_read(const WallhavenJson *j, size_t i, char *id, size_t id_size, char *created_at, size_t created_at_size)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "data[%zu].id", i);
+    if (!wallhaven_json_string(j, path, id, id_size))
+        *id = 0;
+    snprintf(path, sizeof(path), "data[%zu].created_at", i);
+    if (!wallhaven_json_string(j, path, created_at, created_at_size))
+        *created_at = 0;
+}
+
+// Move the mark to the newest wallpaper of the pages read
+static void watch_raise(WallhavenWatch *watch, const WallhavenJson *json, int pages)
+{
+    char id[16], created_at[20];
+    for (int page = 0; page < pages; ++page)
+    {
+        size_t count = wallhaven_json_count(&json[page], "data");
+        for (size_t i = 0; i < count; ++i)
+        {
+            watch_read(&json[page], i, id, sizeof(id), created_at, sizeof(created_at));
+            int c = strcmp(created_at, watch->high_water);
+            if (c < 0)
+                return;
+            if (c > 0)
+            {
+                snprintf(watch->high_water, sizeof(watch->high_water), "%s", created_at);
+                watch->tie_count = 0;
+            }
+            if (!watch_is_tie(watch, id))
+            {
+                // More uploads in one second than remembered, forget the first ones (which were given already)
+                if (watch->tie_count == WATCH_TIES)
+                    memmove(watch->ties[0], watch->ties[1], sizeof(watch->ties[0]) * --watch->tie_count);
+                snprintf(watch->ties[watch->tie_count++], sizeof(watch->ties[0]), "%s", id);
+            }
+        }
+    }
+}
+
+// Read pages till the mark, then give the new ones oldest first
+static void watch_poll(WallhavenWatcher *w, WallhavenWatch *watch, double now)
+{
+    WallhavenAPI *wa = w->wa;
+    WatcherOptions *o = &w->options;
+    bool first = !watch->high_water[0], reached = false, failed = false;
+    char id[16], created_at[20];
+    int pages = 0;
+    ++watch->polls;
+
+    while (!reached && pages < o->max_pages)
+    {
+        Response *r = &w->pages[pages];
+        r->size = 0;
+        Parameters p = watch->parameters;
+        p.page = pages + 1;
+
+        ++watch->calls;
+        if (wallhaven_write_to_response(wa, r) != WALLHAVEN_OK || wallhaven_search(wa, &p) != WALLHAVEN_OK ||
+            wa->stats.last_status != 200 || !r->value || wallhaven_json_parse(&w->json[pages], r->value, r->size) != WALLHAVEN_OK)
+        {
+            failed = true;
+            break;
+        }
+
+        WallhavenJson *j = &w->json[pages++];
+        size_t count = wallhaven_json_count(j, "data");
+        for (size_t i = 0; i < count && !reached; ++i)
+        {
+            watch_read(j, i, id, sizeof(id), created_at, sizeof(created_at));
+            reached = strcmp(created_at, watch->high_water) < 0 || (!strcmp(created_at, watch->high_water) && watch_is_tie(watch, id));
+        }
+
+        long last_page = 0;
+        if (first || !count || (wallhaven_json_long(j, "meta.last_page", &last_page) && pages >= last_page))
+            reached = true;
+    }
+
+    size_t found = 0;
+    if (failed)
+        ++watch->failed;
+    else
+    {
+        if (!reached)
+            ++watch->missed;
+
+        if (!first)
+            for (int page = pages - 1; page >= 0; --page)
+                for (size_t i = wallhaven_json_count(&w->json[page], "data"); i-- > 0;)
+                {
+                    watch_read(&w->json[page], i, id, sizeof(id), created_at, sizeof(created_at));
+                    if (!*id || !watch_is_new(watch, created_at, id))
+                        continue;
+
+                    char path[32];
+                    Span wallpaper = {0};
+                    snprintf(path, sizeof(path), "data[%zu]", i);
+                    wallhaven_json_raw(&w->json[page], path, &wallpaper);
+                    watch->callback(id, wallpaper, watch->userdata);
+                    ++found;
+                }
+
+        watch_raise(watch, w->json, pages);
+        watch->delivered += found;
+    }
+
+    for (int page = 0; page < pages; ++page)
+        wallhaven_json_free(&w->json[page]);
+
+    // Poll again when about target_new wallpapers are expected
+    if (!failed && !first && watch->last_poll)
+    {
+        double rate = found / (now - watch->last_poll > 1 ? now - watch->last_poll : 1);
+        watch->upload_rate = watch->polls > 2 ? 0.3 * rate + 0.7 * watch->upload_rate : rate;
+    }
+    if (!failed)
+        watch->last_poll = now;
+
+    double interval;
+    if (failed)
+        interval = watch->interval * 2;
+    else if (first || !reached)
+        interval = o->min_interval; // No rate yet, or behind
+    else
+        interval = watch->upload_rate > 0 ? o->target_new / watch->upload_rate : o->max_interval;
+
+    // Every watch has to fit in the calls given to the watcher
+    double fair = 60.0 * w->count / o->calls_per_minute;
+    if (interval < fair)
+        interval = fair;
+    if (interval < o->min_interval)
+        interval = o->min_interval;
+    if (interval > o->max_interval)
+        interval = o->max_interval;
+    // Little of the limit left, leave it to the other calls till the window is over
+    if (wa->stats.ratelimit_remaining >= 0 && wa->stats.ratelimit_remaining < o->ratelimit_reserve && interval < 60)
+        interval = 60;
+
+    watch->interval = interval;
+    watch->next_poll = now_seconds() + interval;
+}
+
+double wallhaven_watcher_poll(WallhavenWatcher *w)
+{
+    double now = now_seconds(), next = w->options.max_interval;
+
+    for (size_t i = 0; i < w->count; ++i)
+        if (w->watches[i]->next_poll <= now)
+            watch_poll(w, w->watches[i], now);
+
+    now = now_seconds();
+    for (size_t i = 0; i < w->count; ++i)
+        if (w->watches[i]->next_poll - now < next)
+            next = w->watches[i]->next_poll - now;
+
+    return next > 0 ? next : 0;
+}
+
+void wallhaven_watcher_run(WallhavenWatcher *w, volatile bool *stop)
+{
+    while (!*stop)
+    {
+        double next = wallhaven_watcher_poll(w);
+        if (!*stop && next > 0)
+            sleep_ms((long)((next < 1 ? next : 1) * 1000));
+    }
+}
+
+// Resize
+
+#define RESIZE_BITS 14 // Weights are fixed point with this many fractional bits
+#define RESIZE_ONE (1 << RESIZE_BITS)
+
+// Taps of every output pixel along one dimension
+typedef struct
+{
+    int *start;       // First input pixel of each output pixel
+    int16_t *weights; // taps weights of each output pixel, summing to RESIZE_ONE
+    int taps;
+} ResizeKernel;
+
+static int floor_int(double x)
+{
+    int i = (int)x;
+    return i > x ? i - 1 : i;
+}
+
+static double triangle(double distance, double support)
+{
+    double w = 1 - (distance < 0 ? -distance : distance) / support;
+    return w > 0 ? w : 0;
+}
+
+// Triangle filter, stretched when shrinking so that every input pixel is covered
+static bool resize_kernel(ResizeKernel *k, int in_size, int out_size)
+{
+    double scale = (double)in_size / out_size, support = scale > 1 ? scale : 1;
+    k->taps = 2 * (int)support + 2;
+    if (k->taps > in_size)
+        k->taps = in_size;
+
+    k->start = (int *)malloc(out_size * sizeof(int));
+    k->weights = (int16_t *)malloc((size_t)out_size * k->taps * sizeof(int16_t));
+    if (!k->start || !k->weights)
+    {
+        free(k->start);
+        free(k->weights);
+        return false;
+    }
+
+    for (int o = 0; o < out_size; ++o)
+    {
+        double center = (o + 0.5) * scale - 0.5;
+        int start = floor_int(center - support) + 1;
+        if (start > in_size - k->taps)
+            start = in_size - k->taps;
+        if (start < 0)
+            start = 0;
+        k->start[o] = start;
+
+        double sum = 0;
+        for (int t = 0; t < k->taps; ++t)
+            sum += triangle(start + t - center, support);
+
+        // Rounding error goes to the biggest tap so that the sum is exact
+        int16_t *out = k->weights + (size_t)o * k->taps;
+        int total = 0, biggest = 0;
+        for (int t = 0; t < k->taps; ++t)
+        {
+            out[t] = (int16_t)floor_int(triangle(start + t - center, support) / sum * RESIZE_ONE + 0.5);
+            total += out[t];
+            if (out[t] > out[biggest])
+                biggest = t;
+        }
+        out[biggest] += RESIZE_ONE - total;
+    }
+
+    return true;
+}
+
+static unsigned char clamp_pixel(int32_t v)
+{
+    v = (v + RESIZE_ONE / 2) >> RESIZE_BITS;
+    return v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+}
+
+// One row along x, 4 channels a pixel
+static void resize_row(const unsigned char *in, unsigned char *out, int out_width, const ResizeKernel *k)
+{
+    for (int o = 0; o < out_width; ++o)
+    {
+        const unsigned char *p = in + (size_t)k->start[o] * 4;
+        const int16_t *w = k->weights + (size_t)o * k->taps;
+        int t = 0;
+#if defined(__SSE2__)
+        // Two taps at a time: channels of the two pixels interleaved, multiplied by the two weights and added pairwise
+        __m128i zero = _mm_setzero_si128(), acc = zero;
+        for (; t + 1 < k->taps; t += 2)
+        {
+            __m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + t * 4)), zero);
+            __m128i pairs = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+            __m128i wt = _mm_set1_epi32((int)(((uint32_t)(uint16_t)w[t + 1] << 16) | (uint16_t)w[t]));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(pairs, wt));
+        }
+        if (t < k->taps)
+        {
+            int32_t px32;
+            memcpy(&px32, p + t * 4, 4);
+            __m128i px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(px32), zero), zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((uint16_t)w[t])));
+        }
+        int32_t sum[4];
+        _mm_storeu_si128((__m128i *)sum, acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        int32x4_t acc = vdupq_n_s32(0);
+        for (; t < k->taps; ++t)
+        {
+            uint8x8_t px = vreinterpret_u8_u32(vld1_dup_u32((const uint32_t *)(const void *)(p + t * 4)));
+            acc = vmlal_n_s16(acc, vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(px))), w[t]);
+        }
+        int32_t sum[4];
+        vst1q_s32(sum, acc);
+#else
+        int32_t sum[4] = {0};
+        for (; t < k->taps; ++t)
+            for (int c = 0; c < 4; ++c)
+                sum[c] += p[t * 4 + c] * w[t];
+#endif
+        for (int c = 0; c < 4; ++c)
+            out[o * 4 + c] = clamp_pixel(sum[c]);
+    }
+}
+
+// One output row along y from the rows of the taps, bytes is the width of a row in bytes
+static void resize_column(const unsigned char *in, size_t in_stride, unsigned char *out, size_t bytes, const int16_t *w, int taps)
+{
+    size_t x = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= bytes; x += 8)
+    {
+        __m128i lo = zero, hi = zero;
+        int t = 0;
+        for (; t < taps; t += 2)
+        {
+            __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(in + t * in_stride + x)), zero);
+            __m128i b = t + 1 < taps ? _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(in + (t + 1) * in_stride + x)), zero) : zero;
+            __m128i wt = _mm_set1_epi32((int)(((uint32_t)(uint16_t)(t + 1 < taps ? w[t + 1] : 0) << 16) | (uint16_t)w[t]));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wt));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wt));
+        }
+        __m128i round = _mm_set1_epi32(RESIZE_ONE / 2);
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), RESIZE_BITS);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), RESIZE_BITS);
+        _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; x + 8 <= bytes; x += 8)
+    {
+        int32x4_t lo = vdupq_n_s32(0), hi = vdupq_n_s32(0);
+        for (int t = 0; t < taps; ++t)
+        {
+            int16x8_t px = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(in + t * in_stride + x)));
+            lo = vmlal_n_s16(lo, vget_low_s16(px), w[t]);
+            hi = vmlal_n_s16(hi, vget_high_s16(px), w[t]);
+        }
+        int16x8_t v = vcombine_s16(vqrshrn_n_s32(lo, RESIZE_BITS), vqrshrn_n_s32(hi, RESIZE_BITS));
+        vst1_u8(out + x, vqmovun_s16(v));
+    }
+#endif
+    for (; x < bytes; ++x)
+    {
+        int32_t sum = 0;
+        for (int t = 0; t < taps; ++t)
+            sum += in[t * in_stride + x] * w[t];
+        out[x] = clamp_pixel(sum);
+    }
+}
+
+WallhavenCode wallhaven_resize_rgba(const unsigned char *src, int src_width, int src_height, int src_stride, unsigned char *dst,
+                                    int dst_width, int dst_height)
+{
+    checkp_return(src_width > 0 && src_height > 0 && dst_width > 0 && dst_height > 0, WALLHAVEN_BAD_IMAGE);
+
+    ResizeKernel kx, ky;
+    checkp_return(resize_kernel(&kx, src_width, dst_width), WALLHAVEN_NO_MEMORY);
+    if (!resize_kernel(&ky, src_height, dst_height))
+    {
+        free(kx.start);
+        free(kx.weights);
+        return WALLHAVEN_NO_MEMORY;
+    }
+
+    // Only the source rows the output needs are resized along x
+    size_t row_bytes = (size_t)dst_width * 4;
+    unsigned char *rows = (unsigned char *)malloc(row_bytes * src_height);
+    WallhavenCode wc = WALLHAVEN_NO_MEMORY;
+    if (rows)
+    {
+        int done = 0;
+        for (int o = 0; o < dst_height; ++o)
+        {
+            int end = ky.start[o] + ky.taps;
+            for (int y = done > ky.start[o] ? done : ky.start[o]; y < end; ++y)
+                resize_row(src + (size_t)y * src_stride, rows + y * row_bytes, dst_width, &kx);
+            if (end > done)
+                done = end;
+
+            resize_column(rows + ky.start[o] * row_bytes, row_bytes, dst + o * row_bytes, row_bytes, ky.weights + (size_t)o * ky.taps,
+                          ky.taps);
+        }
+        wc = WALLHAVEN_OK;
+    }
+
+    free(rows);
+    free(kx.start);
+    free(kx.weights);
+    free(ky.start);
+    free(ky.weights);
+    return wc;
+}
+
+static size_t resize_parse(const char *list, bool ratio, ResizeTarget *targets, size_t capacity)
+{
+    size_t count = 0;
+    for (const char *p = list; p && *p && count < capacity;)
+    {
+        int a, b, n = 0;
+        if (sscanf(p, "%dx%d%n", &a, &b, &n) == 2 && a > 0 && b > 0)
+        {
+            ResizeTarget *t = &targets[count++];
+            *t = (ResizeTarget){0};
+            if (ratio)
+            {
+                t->ratio_width = a;
+                t->ratio_height = b;
+            }
+            else
+            {
+                t->width = a;
+                t->height = b;
+            }
+            snprintf(t->name, sizeof(t->name), "%dx%d", a, b);
+        }
+
+        p = strchr(p + n, ',');
+        if (p)
+            ++p;
+    }
+    return count;
+}
+
+size_t wallhaven_resize_targets(const char *resolutions, const char *ratios, ResizeTarget *targets, size_t capacity)
+{
+    size_t count = resize_parse(resolutions, false, targets, capacity);
+    return count + resize_parse(ratios, true, targets + count, capacity - count);
+}
+
+// Crop around the center to the ratio of the target and the size of the variant, false if the variant can't be made
+static bool resize_plan(const ResizeTarget *t, int width, int height, int *x, int *y, int *crop_w, int *crop_h, int *out_w,
+                        int *out_h)
+{
+    int rw = t->ratio_width, rh = t->ratio_height;
+    if (!rw || !rh)
+    {
+        rw = t->width;
+        rh = t->height;
+    }
+
+    *crop_w = width;
+    *crop_h = height;
+    if (rw > 0 && rh > 0)
+    {
+        if ((int64_t)width * rh > (int64_t)height * rw)
+            *crop_w = (int)((int64_t)height * rw / rh);
+        else
+            *crop_h = (int)((int64_t)width * rh / rw);
+    }
+    *x = (width - *crop_w) / 2;
+    *y = (height - *crop_h) / 2;
+
+    *out_w = t->width;
+    *out_h = t->height;
+    if (!*out_w && !*out_h)
+    {
+        *out_w = *crop_w;
+        *out_h = *crop_h;
+    }
+    else if (!*out_w)
+        *out_w = (int)((int64_t)*out_h * *crop_w / *crop_h);
+    else if (!*out_h)
+        *out_h = (int)((int64_t)*out_w * *crop_h / *crop_w);
+
+    return *crop_w > 0 && *crop_h > 0 && *out_w > 0 && *out_h > 0;
+}
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+// Image queued, decoded once and then shared by the variants
+struct ResizeJob
+{
+    char id[32];
+    unsigned char *data; // Encoded, freed once decoded
+    size_t size;
+    unsigned char *rgba;
+    int width, height;
+    bool decoding, decoded;
+    size_t next; // Next target to take
+    size_t done; // Targets finished
+    struct ResizeJob *next_job;
+};
+
+struct ResizePool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // Something to do or stopping
+    pthread_cond_t changed; // An image finished
+    pthread_t *threads;
+    int thread_count;
+    struct ResizeJob *head, *tail;
+    int jobs;
+    bool stopping;
+};
+
+// Oldest image with something to do, taking the decode or the next target
+static struct ResizeJob *resize_take(WallhavenResizer *r, size_t *target)
+{
+    for (struct ResizeJob *j = r->pool->head; j; j = j->next_job)
+    {
+        if (!j->decoded && !j->decoding)
+        {
+            j->decoding = true;
+            *target = SIZE_MAX;
+            return j;
+        }
+        if (j->decoded && j->next < r->target_count)
+        {
+            *target = j->next++;
+            return j;
+        }
+    }
+    return NULL;
+}
+
+// Called with the lock held, when every target of the job is done
+static void resize_finish(WallhavenResizer *r, struct ResizeJob *j)
+{
+    struct ResizePool *p = r->pool;
+    struct ResizeJob **link = &p->head, *prev = NULL;
+    while (*link != j)
+    {
+        prev = *link;
+        link = &(*link)->next_job;
+    }
+    *link = j->next_job;
+    if (p->tail == j)
+        p->tail = prev;
+
+    free(j->data);
+    free(j->rgba);
+    free(j);
+    --p->jobs;
+    pthread_cond_broadcast(&p->changed);
+}
+
+static void resize_variant(WallhavenResizer *r, struct ResizeJob *j, const ResizeTarget *t, size_t *made, size_t *skipped,
+                           size_t *failed)
+{
+    int x, y, crop_w, crop_h, out_w, out_h;
+    if (!resize_plan(t, j->width, j->height, &x, &y, &crop_w, &crop_h, &out_w, &out_h) ||
+        (!r->options.upscale && (out_w > crop_w || out_h > crop_h)))
+    {
+        ++*skipped;
+        return;
+    }
+
+    unsigned char *out = (unsigned char *)malloc((size_t)out_w * out_h * 4);
+    const unsigned char *crop = j->rgba + ((size_t)y * j->width + x) * 4;
+    if (out && wallhaven_resize_rgba(crop, crop_w, crop_h, j->width * 4, out, out_w, out_h) == WALLHAVEN_OK &&
+        r->options.encode(out, out_w, out_h, j->id, t, r->options.userdata))
+        ++*made;
+    else
+        ++*failed;
+    free(out);
+}
+
+static void *resize_worker(void *arg)
+{
+    WallhavenResizer *r = (WallhavenResizer *)arg;
+    struct ResizePool *p = r->pool;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        size_t target;
+        struct ResizeJob *j = resize_take(r, &target);
+        if (!j)
+        {
+            if (p->stopping && !p->head)
+                break;
+            pthread_cond_wait(&p->work, &p->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        size_t made = 0, skipped = 0, failed = 0;
+        if (target == SIZE_MAX)
+        {
+            j->rgba = r->options.decode(j->data, j->size, &j->width, &j->height, r->options.userdata);
+            free(j->data);
+            j->data = NULL;
+        }
+        else
+            resize_variant(r, j, &r->targets[target], &made, &skipped, &failed);
+
+        pthread_mutex_lock(&p->lock);
+        r->variants += made;
+        r->skipped += skipped;
+        r->encode_failed += failed;
+        if (target == SIZE_MAX)
+        {
+            j->decoded = true;
+            if (j->rgba && j->width > 0 && j->height > 0)
+                ++r->images;
+            else
+            {
+                ++r->decode_failed;
+                j->next = j->done = r->target_count;
+            }
+            // Targets of this image are there to take now
+            pthread_cond_broadcast(&p->work);
+        }
+        else
+            ++j->done;
+
+        if (j->decoded && j->done == r->target_count)
+            resize_finish(r, j);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+WallhavenResizer *wallhaven_resizer_init(const ResizeOptions *o, const ResizeTarget *targets, size_t count)
+{
+    checkp_return(o && o->decode && o->encode, NULL);
+
+    WallhavenResizer *r;
+    checkp_return(r = (WallhavenResizer *)calloc(1, sizeof(WallhavenResizer)), NULL);
+    r->options = *o;
+    if (r->options.threads <= 0)
+        r->options.threads = 4;
+    if (r->options.max_images <= 0)
+        r->options.max_images = 2 * r->options.threads;
+
+    r->target_count = count;
+    r->targets = (ResizeTarget *)malloc((count ? count : 1) * sizeof(ResizeTarget));
+    r->pool = (struct ResizePool *)calloc(1, sizeof(struct ResizePool));
+    if (!r->targets || !r->pool || !(r->pool->threads = (pthread_t *)malloc(r->options.threads * sizeof(pthread_t))))
+    {
+        if (r->pool)
+            free(r->pool->threads);
+        free(r->pool);
+        free(r->targets);
+        free(r);
+        return NULL;
+    }
+    if (count)
+        memcpy(r->targets, targets, count * sizeof(ResizeTarget));
+
+    struct ResizePool *p = r->pool;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    for (; p->thread_count < r->options.threads; ++p->thread_count)
+        if (pthread_create(&p->threads[p->thread_count], NULL, resize_worker, r))
+            break;
+
+    if (!p->thread_count)
+    {
+        wallhaven_resizer_free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+void wallhaven_resizer_free(WallhavenResizer *r)
+{
+    struct ResizePool *p = r->pool;
+
+    pthread_mutex_lock(&p->lock);
+    p->stopping = true;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->thread_count; ++i)
+        pthread_join(p->threads[i], NULL);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->changed);
+    free(p->threads);
+    free(p);
+    free(r->targets);
+    free(r);
+}
+
+WallhavenCode wallhaven_resize(WallhavenResizer *r, const char *id, unsigned char *data, size_t size)
+{
+    struct ResizePool *p = r->pool;
+    struct ResizeJob *j = (struct ResizeJob *)calloc(1, sizeof(struct ResizeJob));
+    if (!j)
+    {
+        free(data);
+        return WALLHAVEN_NO_MEMORY;
+    }
+    snprintf(j->id, sizeof(j->id), "%s", id);
+    j->data = data;
+    j->size = size;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->jobs >= r->options.max_images)
+        pthread_cond_wait(&p->changed, &p->lock);
+
+    if (p->tail)
+        p->tail->next_job = j;
+    else
+        p->head = j;
+    p->tail = j;
+    ++p->jobs;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    return WALLHAVEN_OK;
+}
+
+void wallhaven_resizer_wait(WallhavenResizer *r)
+{
+    struct ResizePool *p = r->pool;
+    pthread_mutex_lock(&p->lock);
+    while (p->jobs)
+        pthread_cond_wait(&p->changed, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Keep the download in memory for decoding and give it to the sink file too
+static size_t write_function_toresize(void *data, size_t size, size_t nmemb, void *clientp)
+{
+    WallhavenAPI *wa = (WallhavenAPI *)clientp;
+    size_t realsize = write_function(data, size, nmemb, wa->response);
+    if (realsize && wa->sink_file)
+        return write_function_tosink(data, size, nmemb, wa->sink_file);
+    return realsize;
+}
+
+WallhavenCode wallhaven_download_resized(WallhavenResizer *r, WallhavenAPI *wa, const char *id, const char *url, WallhavenSinkFile *original)
+{
+    Response image = {0};
+    check_return(reset(wa), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEFUNCTION, write_function_toresize), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_WRITEDATA, (void *)wa), WALLHAVEN_CURL_FAIL);
+    wa->response = &image;
+    wa->sink_file = original;
+
+    WallhavenCode wc = wallhaven_download(wa, url);
+    wa->response = NULL;
+    wa->sink_file = NULL;
+    if (wc != WALLHAVEN_OK || wa->stats.last_status != 200 || !image.value)
+    {
+        free(image.value);
+        return wc != WALLHAVEN_OK ? wc : WALLHAVEN_CURL_FAIL;
+    }
+
+    return wallhaven_resize(r, id, (unsigned char *)image.value, image.size);
+}
+
+#else
+
+WallhavenResizer *wallhaven_resizer_init(const ResizeOptions *o, const ResizeTarget *targets, size_t count)
+{
+    return NULL;
+}
+
+void wallhaven_resizer_free(WallhavenResizer *r)
+{
+}
+
+WallhavenCode wallhaven_resize(WallhavenResizer *r, const char *id, unsigned char *data, size_t size)
+{
+    free(data);
+    return WALLHAVEN_CURL_FAIL;
+}
+
+void wallhaven_resizer_wait(WallhavenResizer *r)
+{
+}
+
+WallhavenCode wallhaven_download_resized(WallhavenResizer *r, WallhavenAPI *wa, const char *id, const char *url, WallhavenSinkFile *original)
+{
+    return WALLHAVEN_CURL_FAIL;
+}
+
+#endif
+
+// Random pool
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+struct PoolRefill
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t low;    // Went below the watermark or stopping
+    pthread_cond_t filled; // Wallpapers were added
+    bool stopping;
+    bool filling; // Refilling till full
+    uint64_t rng;
+    char seed[7];
+    int page;      // Next page of the seed
+    int page_size; // Wallpapers in the last page read
+};
+
+// Absolute time timeout_ms from now for pthread_cond_timedwait
+static struct timespec pool_deadline(long timeout_ms)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        ++until.tv_sec;
+        until.tv_nsec -= 1000000000;
+    }
+    return until;
+}
+
+static void pool_new_seed(struct PoolRefill *r)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    for (int i = 0; i < 6; ++i)
+    {
+        // xorshift64
+        r->rng ^= r->rng << 13;
+        r->rng ^= r->rng >> 7;
+        r->rng ^= r->rng << 17;
+        r->seed[i] = chars[r->rng % (sizeof(chars) - 1)];
+    }
+    r->seed[6] = 0;
+    r->page = 1;
+}
+
+// Read the next page of the seed into the pool, called without the lock
+static bool pool_fetch(WallhavenPool *pool, WallhavenAPI *wa, Response *page)
+{
+    struct PoolRefill *r = pool->refill;
+    Parameters p = pool->parameters;
+    memcpy(p.seed, r->seed, sizeof(p.seed));
+    p.page = r->page;
+
+    page->size = 0;
+    WallhavenJson j;
+    ++pool->calls;
+    if (wallhaven_write_to_response(wa, page) != WALLHAVEN_OK || wallhaven_search(wa, &p) != WALLHAVEN_OK ||
+        wa->stats.last_status != 200 || !page->value || wallhaven_json_parse(&j, page->value, page->size) != WALLHAVEN_OK)
+        return false;
+
+    size_t count = wallhaven_json_count(&j, "data");
+    long last_page = 0;
+    if (!count || ++r->page > pool->options.max_pages ||
+        (wallhaven_json_long(&j, "meta.last_page", &last_page) && r->page > last_page))
+        pool_new_seed(r);
+    if (count)
+        r->page_size = (int)count;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        char path[32];
+        PooledWallpaper w = {0};
+        Span raw;
+        snprintf(path, sizeof(path), "data[%zu].id", i);
+        wallhaven_json_string(&j, path, w.id, sizeof(w.id));
+        snprintf(path, sizeof(path), "data[%zu]", i);
+        if (!*w.id || !wallhaven_json_raw(&j, path, &raw) || !(w.json = (char *)malloc(raw.size + 1)))
+            continue;
+        memcpy(w.json, raw.data, raw.size);
+        w.json[raw.size] = 0;
+        w.size = raw.size;
+
+        pthread_mutex_lock(&r->mutex);
+        if (pool->count < (size_t)pool->options.capacity)
+        {
+            pool->ring[(pool->head + pool->count++) % pool->options.capacity] = w;
+            ++pool->fetched;
+            w.json = NULL;
+        }
+        pthread_cond_broadcast(&r->filled);
+        pthread_mutex_unlock(&r->mutex);
+        free(w.json);
+    }
+
+    wallhaven_json_free(&j);
+    return true;
+}
+
+static void *pool_run(void *arg)
+{
+    WallhavenPool *pool = (WallhavenPool *)arg;
+    struct PoolRefill *r = pool->refill;
+    Response page = {0};
+    WallhavenAPI *wa = wallhaven_init();
+    if (wa)
+    {
+        wallhaven_apikey(wa, pool->options.apikey);
+        if (pool->options.base_url && wallhaven_base_url(wa, pool->options.base_url) != WALLHAVEN_OK)
+        {
+            wallhaven_free(wa);
+            wa = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&r->mutex);
+    while (!r->stopping)
+    {
+        // Refill till full, a page at a time while a whole page fits so that nothing fetched is thrown away
+        bool fits = pool->options.capacity - pool->count >= (size_t)r->page_size || !pool->count;
+        if (!wa || !fits || (pool->count >= (size_t)pool->options.low_watermark && !r->filling))
+        {
+            r->filling = false;
+            pthread_cond_wait(&r->low, &r->mutex);
+            continue;
+        }
+
+        r->filling = true;
+        pthread_mutex_unlock(&r->mutex);
+        bool ok = pool_fetch(pool, wa, &page);
+        pthread_mutex_lock(&r->mutex);
+
+        if (!ok)
+        {
+            // Try again a bit later, waking up early only to stop
+            ++pool->failed;
+            struct timespec until = pool_deadline(5000);
+            while (!r->stopping && pthread_cond_timedwait(&r->low, &r->mutex, &until) != ETIMEDOUT)
+                ;
+        }
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    free(page.value);
+    if (wa)
+        wallhaven_free(wa);
+    return NULL;
+}
+
+WallhavenPool *wallhaven_pool_init(const Parameters *p, const PoolOptions *o)
+{
+    WallhavenPool *pool;
+    checkp_return(pool = (WallhavenPool *)calloc(1, sizeof(WallhavenPool)), NULL);
+    pool->parameters = *p;
+    pool->parameters.sorting = RANDOM;
+    if (o)
+        pool->options = *o;
+    if (pool->options.capacity <= 0)
+        pool->options.capacity = 96;
+    if (pool->options.low_watermark <= 0 || pool->options.low_watermark > pool->options.capacity)
+        pool->options.low_watermark = pool->options.capacity / 4 ? pool->options.capacity / 4 : 1;
+    if (pool->options.max_pages <= 0)
+        pool->options.max_pages = 10;
+
+    pool->ring = (PooledWallpaper *)calloc(pool->options.capacity, sizeof(PooledWallpaper));
+    pool->refill = (struct PoolRefill *)calloc(1, sizeof(struct PoolRefill));
+    if (!pool->ring || !pool->refill)
+    {
+        free(pool->ring);
+        free(pool->refill);
+        free(pool);
+        return NULL;
+    }
+
+    struct PoolRefill *r = pool->refill;
+    r->rng = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ull ^ (uint64_t)(uintptr_t)pool ^ (uint64_t)(now_seconds() * 1e9);
+    if (!r->rng)
+        r->rng = 1;
+    r->page_size = 24;
+    pool_new_seed(r);
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->low, NULL);
+    pthread_cond_init(&r->filled, NULL);
+    if (pthread_create(&r->thread, NULL, pool_run, pool))
+    {
+        pthread_mutex_destroy(&r->mutex);
+        pthread_cond_destroy(&r->low);
+        pthread_cond_destroy(&r->filled);
+        free(pool->ring);
+        free(r);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void wallhaven_pool_free(WallhavenPool *pool)
+{
+    struct PoolRefill *r = pool->refill;
+    pthread_mutex_lock(&r->mutex);
+    r->stopping = true;
+    pthread_cond_broadcast(&r->low);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->thread, NULL);
+
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->low);
+    pthread_cond_destroy(&r->filled);
+    for (size_t i = 0; i < pool->count; ++i)
+        free(pool->ring[(pool->head + i) % pool->options.capacity].json);
+    free(pool->ring);
+    free(r);
+    free(pool);
+}
+
+bool wallhaven_pool_pop(WallhavenPool *pool, PooledWallpaper *out, long timeout_ms)
+{
+    struct PoolRefill *r = pool->refill;
+    pthread_mutex_lock(&r->mutex);
+
+    if (!pool->count && timeout_ms > 0)
+    {
+        struct timespec until = pool_deadline(timeout_ms);
+        while (!pool->count && pthread_cond_timedwait(&r->filled, &r->mutex, &until) != ETIMEDOUT)
+            ;
+    }
+
+    bool taken = pool->count > 0;
+    if (taken)
+    {
+        *out = pool->ring[pool->head];
+        pool->head = (pool->head + 1) % pool->options.capacity;
+        --pool->count;
+        ++pool->pops;
+    }
+    else
+        ++pool->misses;
+
+    if (pool->count < (size_t)pool->options.low_watermark)
+        pthread_cond_signal(&r->low);
+    pthread_mutex_unlock(&r->mutex);
+
+    return taken;
+}
+
+size_t wallhaven_pool_size(WallhavenPool *pool)
+{
+    pthread_mutex_lock(&pool->refill->mutex);
+    size_t count = pool->count;
+    pthread_mutex_unlock(&pool->refill->mutex);
+    return count;
+}
+
+#else
+
+WallhavenPool *wallhaven_pool_init(const Parameters *p, const PoolOptions *o)
+{
+    return NULL;
+}
+
+void wallhaven_pool_free(WallhavenPool *pool)
+{
+}
+
+bool wallhaven_pool_pop(WallhavenPool *pool, PooledWallpaper *out, long timeout_ms)
+{
+    return false;
+}
+
+size_t wallhaven_pool_size(WallhavenPool *pool)
+{
+    return 0;
+}
+
+#endif
+
+// View history
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+#define HISTORY_MAGIC 0x53544857u // "WHTS"
+#define HISTORY_VERSION 1
+
+// Records of the log
+#define HISTORY_ID 1     // Length byte and the id, which gets the next series number
+#define HISTORY_TIME 2   // Change of the time of the samples which follow
+#define HISTORY_SAMPLE 3 // Series number, change of views and change of favorites
+
+// Samples of one wallpaper, each is the change of time, views and favorites since the one before as zigzag varints
+typedef struct HistorySeries
+{
+    char id[16];
+    HistorySample first, last;
+    unsigned char *data;
+    uint32_t size, capacity, count;
+} HistorySeries;
+
+static size_t put_varint(unsigned char *out, int64_t value)
+{
+    uint64_t v = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); // Zigzag, small negative numbers stay small
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7)
+        out[n++] = (unsigned char)(v | 0x80);
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+// Returns the bytes read, 0 if the varint runs past end
+static size_t get_varint(const unsigned char *p, const unsigned char *end, int64_t *value)
+{
+    uint64_t v = 0;
+    for (size_t n = 0; n < 10 && p + n < end; ++n)
+    {
+        v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80))
+        {
+            *value = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+// Returns the index of the series + 1 in the table slot of the id, 0 if it isn't there
+static uint32_t *history_slot(const WallhavenHistory *h, const char *id)
+{
+    size_t mask = h->table_size - 1;
+    for (size_t i = hash_bytes(id, strlen(id), HASH_SEED) & mask;; i = (i + 1) & mask)
+        if (!h->table[i] || !strcmp(h->series[h->table[i] - 1].id, id))
+            return &h->table[i];
+}
+
+static HistorySeries *history_new_series(WallhavenHistory *h, const char *id)
+{
+    if ((h->count + 1) * 2 > h->table_size)
+    {
+        size_t size = h->table_size ? h->table_size * 2 : 1024;
+        uint32_t *table;
+        checkp_return(table = (uint32_t *)calloc(size, sizeof(uint32_t)), NULL);
+        free(h->table);
+        h->table = table;
+        h->table_size = size;
+        for (size_t i = 0; i < h->count; ++i)
+            *history_slot(h, h->series[i].id) = (uint32_t)i + 1;
+    }
+    if (h->count == h->capacity)
+    {
+        size_t capacity = h->capacity ? h->capacity * 2 : 256;
+        HistorySeries *series;
+        checkp_return(series = (HistorySeries *)realloc(h->series, capacity * sizeof(HistorySeries)), NULL);
+        h->series = series;
+        h->capacity = capacity;
+    }
+
+    HistorySeries *s = &h->series[h->count];
+    memset(s, 0, sizeof(HistorySeries));
+    strncpy(s->id, id, sizeof(s->id) - 1);
+    *history_slot(h, s->id) = (uint32_t)++h->count;
+    return s;
+}
+
+// Take the last series out again, it can be cleared from the table as no id was probed past it yet
+static void history_drop_last_series(WallhavenHistory *h)
+{
+    HistorySeries *s = &h->series[h->count - 1];
+    *history_slot(h, s->id) = 0;
+    free(s->data);
+    --h->count;
+}
+
+// Make room for one more sample, so that history_push can't fail
+static bool history_reserve(HistorySeries *s)
+{
+    if (s->capacity - s->size < 30)
+    {
+        uint32_t capacity = s->capacity ? s->capacity * 2 : 32;
+        unsigned char *data;
+        checkp_return(data = (unsigned char *)realloc(s->data, capacity), false);
+        s->data = data;
+        s->capacity = capacity;
+    }
+    return true;
+}
+
+// Append the sample to the series in memory
+static bool history_push(HistorySeries *s, const HistorySample *sample)
+{
+    checkp_return(history_reserve(s), false);
+
+    s->size += (uint32_t)put_varint(s->data + s->size, sample->time - s->last.time);
+    s->size += (uint32_t)put_varint(s->data + s->size, sample->views - s->last.views);
+    s->size += (uint32_t)put_varint(s->data + s->size, sample->favorites - s->last.favorites);
+    if (!s->count++)
+        s->first = *sample;
+    s->last = *sample;
+    return true;
+}
+
+// Read the log into memory, returns the length of the part which could be read
+static size_t history_load(WallhavenHistory *h, const unsigned char *log, size_t size)
+{
+    const unsigned char *p = log + 8, *end = log + size, *good = p;
+    int64_t time = 0;
+    while (p < end)
+    {
+        size_t n;
+        if (*p == HISTORY_ID)
+        {
+            char id[16] = {0};
+            if (end - p < 2 || p[1] >= sizeof(id) || end - p < 2 + p[1])
+                break;
+            memcpy(id, p + 2, p[1]);
+            checkp_return(history_new_series(h, id), 0);
+            p += 2 + p[1];
+        }
+        else if (*p == HISTORY_TIME)
+        {
+            int64_t delta;
+            if (!(n = get_varint(p + 1, end, &delta)))
+                break;
+            time += delta;
+            p += 1 + n;
+        }
+        else if (*p == HISTORY_SAMPLE)
+        {
+            int64_t index, views, favorites;
+            const unsigned char *q = p + 1;
+            if (!(n = get_varint(q, end, &index)) || !(n = get_varint(q += n, end, &views)) ||
+                !(n = get_varint(q += n, end, &favorites)) || index < 0 || (size_t)index >= h->count)
+                break;
+            HistorySeries *s = &h->series[index];
+            HistorySample sample = {time, s->last.views + views, s->last.favorites + favorites};
+            checkp_return(history_push(s, &sample), 0);
+            ++h->samples;
+            p = q + n;
+        }
+        else
+            break;
+        good = p;
+    }
+    h->time = time;
+    return good - log;
+}
+
+WallhavenHistory *wallhaven_history_open(const char *path)
+{
+    WallhavenHistory *h;
+    checkp_return(h = (WallhavenHistory *)calloc(1, sizeof(WallhavenHistory)), NULL);
+
+    FILE *f = fopen(path, "rb");
+    if (f)
+    {
+        Response log = {0};
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) && write_function(chunk, 1, n, &log) == n)
+            ;
+        bool failed = ferror(f) || n;
+        fclose(f);
+
+        uint32_t header[2] = {0};
+        if (log.size >= sizeof(header))
+            memcpy(header, log.value, sizeof(header));
+        if (!failed && log.size && (header[0] != HISTORY_MAGIC || header[1] != HISTORY_VERSION))
+            failed = true;
+        if (!failed && log.size)
+        {
+            // Drop a record cut short by a crash, so that appending goes on from a whole record
+            h->bytes = history_load(h, (unsigned char *)log.value, log.size);
+            failed = !h->bytes || (h->bytes < log.size && truncate(path, h->bytes));
+        }
+        free(log.value);
+        if (failed)
+        {
+            wallhaven_history_close(h);
+            return NULL;
+        }
+    }
+
+    if (!(h->file = fopen(path, "ab")))
+    {
+        wallhaven_history_close(h);
+        return NULL;
+    }
+    if (!h->bytes)
+    {
+        uint32_t header[2] = {HISTORY_MAGIC, HISTORY_VERSION};
+        if (fwrite(header, sizeof(header), 1, h->file) != 1)
+        {
+            wallhaven_history_close(h);
+            return NULL;
+        }
+        h->bytes = sizeof(header);
+    }
+
+    return h;
+}
+
+void wallhaven_history_close(WallhavenHistory *h)
+{
+    if (h->file)
+        fclose(h->file);
+    for (size_t i = 0; i < h->count; ++i)
+        free(h->series[i].data);
+    free(h->series);
+    free(h->table);
+    free(h);
+}
+
+WallhavenCode wallhaven_history_flush(WallhavenHistory *h)
+{
+    check_return(fflush(h->file), WALLHAVEN_IO_FAIL);
+    return WALLHAVEN_OK;
+}
+
+WallhavenCode wallhaven_history_add(WallhavenHistory *h, const char *id, const HistorySample *sample)
+{
+    size_t length = strlen(id);
+    checkp_return(length && length < sizeof(((HistorySeries *)0)->id), WALLHAVEN_IO_FAIL);
+
+    unsigned char record[64];
+    size_t size = 0;
+    uint32_t index = h->table_size ? *history_slot(h, id) : 0;
+    bool added = !index;
+    HistorySeries *s;
+    if (index)
+    {
+        s = &h->series[--index];
+        if (sample->time < s->last.time)
+        {
+            ++h->stale;
+            return WALLHAVEN_OK;
+        }
+    }
+    else
+    {
+        checkp_return(s = history_new_series(h, id), WALLHAVEN_NO_MEMORY);
+        index = (uint32_t)(h->count - 1);
+        record[size++] = HISTORY_ID;
+        record[size++] = (unsigned char)length;
+        memcpy(record + size, id, length);
+        size += length;
+    }
+
+    if (sample->time != h->time)
+    {
+        record[size++] = HISTORY_TIME;
+        size += put_varint(record + size, sample->time - h->time);
+    }
+    record[size++] = HISTORY_SAMPLE;
+    size += put_varint(record + size, index);
+    size += put_varint(record + size, sample->views - s->last.views);
+    size += put_varint(record + size, sample->favorites - s->last.favorites);
+
+    // Memory only takes the sample once it is in the log, so the two never disagree
+    WallhavenCode wc = history_reserve(s) ? WALLHAVEN_OK : WALLHAVEN_NO_MEMORY;
+    if (wc == WALLHAVEN_OK && fwrite(record, 1, size, h->file) != size)
+        wc = WALLHAVEN_IO_FAIL;
+    if (wc != WALLHAVEN_OK)
+    {
+        if (added)
+            history_drop_last_series(h);
+        return wc;
+    }
+    history_push(s, sample);
+    h->time = sample->time;
+    h->bytes += size;
+    ++h->samples;
+
+    return WALLHAVEN_OK;
+}
+
+WallhavenCode wallhaven_history_ingest(WallhavenHistory *h, const WallhavenJson *page, int64_t time, size_t *added)
+{
+    size_t count = wallhaven_json_count(page, "data"), stored = h->samples;
+    for (size_t i = 0; i < count; ++i)
+    {
+        char path[48], id[16];
+        long views, favorites;
+        snprintf(path, sizeof(path), "data[%zu].id", i);
+        if (!wallhaven_json_string(page, path, id, sizeof(id)))
+            continue;
+        snprintf(path, sizeof(path), "data[%zu].views", i);
+        if (!wallhaven_json_long(page, path, &views))
+            continue;
+        snprintf(path, sizeof(path), "data[%zu].favorites", i);
+        if (!wallhaven_json_long(page, path, &favorites))
+            continue;
+
+        HistorySample sample = {time, views, favorites};
+        WallhavenCode code = wallhaven_history_add(h, id, &sample);
+        if (code != WALLHAVEN_OK)
+            return code;
+    }
+
+    if (added)
+        *added = h->samples - stored;
+    return wallhaven_history_flush(h);
+}
+
+// Step to the next sample of the series, p is advanced past it. Returns false if the sample runs past end
+static bool history_next(const unsigned char **p, const unsigned char *end, HistorySample *sample)
+{
+    int64_t d[3] = {0};
+    for (int i = 0; i < 3; ++i)
+    {
+        size_t n;
+        checkp_return(n = get_varint(*p, end, &d[i]), false);
+        *p += n;
+    }
+    sample->time += d[0];
+    sample->views += d[1];
+    sample->favorites += d[2];
+    return true;
+}
+
+size_t wallhaven_history_range(const WallhavenHistory *h, const char *id, int64_t from, int64_t to, HistorySample *out, size_t max)
+{
+    uint32_t index = h->table_size ? *history_slot(h, id) : 0;
+    if (!index)
+        return 0;
+    const HistorySeries *s = &h->series[index - 1];
+    if (s->last.time < from || s->first.time > to)
+        return 0;
+
+    const unsigned char *p = s->data, *end = s->data + s->size;
+    HistorySample sample = {0};
+    size_t count = 0;
+    while (p < end && history_next(&p, end, &sample))
+    {
+        if (sample.time > to)
+            break;
+        if (sample.time >= from && count++ < max)
+            out[count - 1] = sample;
+    }
+    return count;
+}
+
+static int64_t history_value(const HistorySample *s, HistoryField field)
+{
+    return field == HISTORY_FAVORITES ? s->favorites : s->views;
+}
+
+static int history_compare_growth(const void *a, const void *b)
+{
+    int64_t x = ((const HistoryGrowth *)a)->growth, y = ((const HistoryGrowth *)b)->growth;
+    return (x < y) - (x > y);
+}
+
+// Move the smallest growth of the heap of k to the top
+static void history_sift_down(HistoryGrowth *heap, size_t k, size_t i)
+{
+    for (size_t c; (c = 2 * i + 1) < k; i = c)
+    {
+        if (c + 1 < k && heap[c + 1].growth < heap[c].growth)
+            ++c;
+        if (heap[i].growth <= heap[c].growth)
+            break;
+        HistoryGrowth t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+    }
+}
+
+size_t wallhaven_history_top(const WallhavenHistory *h, HistoryField field, int64_t from, int64_t to, HistoryGrowth *out, size_t k)
+{
+    size_t n = 0;
+    if (!k)
+        return 0;
+
+    for (size_t i = 0; i < h->count; ++i)
+    {
+        const HistorySeries *s = &h->series[i];
+        if (s->last.time < from || s->first.time > to)
+            continue;
+
+        // Last sample at or before from, and last one at or before to
+        const unsigned char *p = s->data, *end = s->data + s->size;
+        HistorySample sample = {0}, start, last;
+        bool before = false, inside = false;
+        while (p < end && history_next(&p, end, &sample))
+        {
+            if (sample.time > to)
+                break;
+            if (sample.time <= from)
+                start = sample, before = true;
+            else if (!before && !inside)
+                start = sample;
+            if (sample.time >= from)
+                inside = true;
+            last = sample;
+        }
+        if (!inside)
+            continue;
+
+        HistoryGrowth g = {.from = history_value(&start, field), .to = history_value(&last, field)};
+        g.growth = g.to - g.from;
+        if (n == k && g.growth <= out[0].growth)
+            continue;
+        memcpy(g.id, s->id, sizeof(g.id));
+
+        // out is a min heap of the k biggest while scanning
+        if (n < k)
+        {
+            out[n] = g;
+            for (size_t c = n++; c && out[(c - 1) / 2].growth > out[c].growth; c = (c - 1) / 2)
+            {
+                HistoryGrowth t = out[c];
+                out[c] = out[(c - 1) / 2];
+                out[(c - 1) / 2] = t;
+            }
+        }
+        else
+        {
+            out[0] = g;
+            history_sift_down(out, k, 0);
+        }
+    }
+
+    qsort(out, n, sizeof(HistoryGrowth), history_compare_growth);
+    return n;
+}
+
+#else
+
+WallhavenHistory *wallhaven_history_open(const char *path)
+{
+    return NULL;
+}
+
+void wallhaven_history_close(WallhavenHistory *h)
+{
+}
+
+WallhavenCode wallhaven_history_flush(WallhavenHistory *h)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+WallhavenCode wallhaven_history_add(WallhavenHistory *h, const char *id, const HistorySample *sample)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+WallhavenCode wallhaven_history_ingest(WallhavenHistory *h, const WallhavenJson *page, int64_t time, size_t *added)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+size_t wallhaven_history_range(const WallhavenHistory *h, const char *id, int64_t from, int64_t to, HistorySample *out, size_t max)
+{
+    return 0;
+}
+
+size_t wallhaven_history_top(const WallhavenHistory *h, HistoryField field, int64_t from, int64_t to, HistoryGrowth *out, size_t k)
+{
+    return 0;
+}
+
+#endif
+
+// Bandwidth
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+struct BandwidthState
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t api_idle; // No API call in flight
+    int api_active;
+    double last; // When the buckets were last filled
+    double tokens;
+    double class_tokens[TRAFFIC_CLASSES];
+};
+
+static void bandwidth_fill(WallhavenBandwidth *bw, double now)
+{
+    struct BandwidthState *st = bw->state;
+    BandwidthOptions *o = &bw->options;
+    double elapsed = now - st->last;
+    st->last = now;
+
+    if (o->bytes_per_second > 0)
+    {
+        st->tokens += elapsed * o->bytes_per_second;
+        if (st->tokens > o->bytes_per_second * o->burst_seconds)
+            st->tokens = o->bytes_per_second * o->burst_seconds;
+    }
+    for (int c = 0; c < TRAFFIC_CLASSES; ++c)
+    {
+        double rate = o->class_bytes_per_second[c];
+        if (rate <= 0)
+            continue;
+        st->class_tokens[c] += elapsed * rate;
+        if (st->class_tokens[c] > rate * o->burst_seconds)
+            st->class_tokens[c] = rate * o->burst_seconds;
+    }
+}
+
+// Progress callback of the paced transfers, sleeps when the transfer is ahead of the caps
+static int bandwidth_progress(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    (void)dltotal, (void)ultotal, (void)ulnow;
+    WallhavenAPI *wa = (WallhavenAPI *)userdata;
+    WallhavenBandwidth *bw = wa->bandwidth;
+    struct BandwidthState *st = bw->state;
+    TrafficClass c = wa->bandwidth_api ? TRAFFIC_API : TRAFFIC_DOWNLOAD;
+    int64_t bytes = dlnow > wa->bandwidth_seen ? dlnow - wa->bandwidth_seen : 0;
+    wa->bandwidth_seen += bytes;
+
+    pthread_mutex_lock(&st->mutex);
+    if (c == TRAFFIC_DOWNLOAD && st->api_active)
+    {
+        // Leave the link to the API calls
+        ++bw->api_holds;
+        double start = now_seconds();
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += bw->options.api_hold_ms / 1000;
+        until.tv_nsec += (bw->options.api_hold_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L)
+        {
+            ++until.tv_sec;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (st->api_active && pthread_cond_timedwait(&st->api_idle, &st->mutex, &until) != ETIMEDOUT)
+            ;
+        bw->paced_seconds[c] += now_seconds() - start;
+    }
+
+    bandwidth_fill(bw, now_seconds());
+    bw->bytes[c] += bytes;
+    st->tokens -= bytes;
+    st->class_tokens[c] -= bytes;
+
+    // API calls only wait for their own cap, the downloads make up for what they took of the overall one
+    double wait = 0, rate = bw->options.class_bytes_per_second[c];
+    if (rate > 0 && st->class_tokens[c] < 0)
+        wait = -st->class_tokens[c] / rate;
+    rate = bw->options.bytes_per_second;
+    if (c == TRAFFIC_DOWNLOAD && rate > 0 && st->tokens < 0 && -st->tokens / rate > wait)
+        wait = -st->tokens / rate;
+    if (wait > 1)
+        wait = 1; // Called again soon anyway, stay responsive to aborts
+    bw->paced_seconds[c] += wait;
+    pthread_mutex_unlock(&st->mutex);
+
+    if (wait > 0)
+        sleep_ms((long)(wait * 1000));
+    return 0;
+}
+
+static void bandwidth_begin(WallhavenAPI *wa, bool api_call)
+{
+    WallhavenBandwidth *bw = wa->bandwidth;
+    wa->bandwidth_seen = 0;
+    wa->bandwidth_api = api_call;
+    double rate = bw->options.class_bytes_per_second[api_call ? TRAFFIC_API : TRAFFIC_DOWNLOAD];
+
+    // Set for every transfer as writing to a Response or a file resets the options
+    curl_easy_setopt(wa->curl, CURLOPT_XFERINFOFUNCTION, bandwidth_progress);
+    curl_easy_setopt(wa->curl, CURLOPT_XFERINFODATA, (void *)wa);
+    curl_easy_setopt(wa->curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(wa->curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)(rate > 0 ? rate : 0));
+
+    if (api_call)
+    {
+        pthread_mutex_lock(&bw->state->mutex);
+        ++bw->state->api_active;
+        pthread_mutex_unlock(&bw->state->mutex);
+    }
+}
+
+static void bandwidth_end(WallhavenAPI *wa)
+{
+    if (!wa->bandwidth_api)
+        return;
+    struct BandwidthState *st = wa->bandwidth->state;
+    pthread_mutex_lock(&st->mutex);
+    if (!--st->api_active)
+        pthread_cond_broadcast(&st->api_idle);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+WallhavenBandwidth *wallhaven_bandwidth_init(const BandwidthOptions *o)
+{
+    WallhavenBandwidth *bw;
+    checkp_return(bw = (WallhavenBandwidth *)calloc(1, sizeof(WallhavenBandwidth)), NULL);
+    if (!(bw->state = (struct BandwidthState *)calloc(1, sizeof(struct BandwidthState))))
+    {
+        free(bw);
+        return NULL;
+    }
+    if (o)
+        bw->options = *o;
+    if (bw->options.burst_seconds <= 0)
+        bw->options.burst_seconds = 0.25;
+    if (bw->options.api_hold_ms <= 0)
+        bw->options.api_hold_ms = 250;
+
+    pthread_mutex_init(&bw->state->mutex, NULL);
+    pthread_cond_init(&bw->state->api_idle, NULL);
+    // Start with full buckets
+    bw->state->last = now_seconds() - bw->options.burst_seconds;
+    bandwidth_fill(bw, bw->state->last + bw->options.burst_seconds);
+    return bw;
+}
+
+void wallhaven_bandwidth_free(WallhavenBandwidth *bw)
+{
+    pthread_mutex_destroy(&bw->state->mutex);
+    pthread_cond_destroy(&bw->state->api_idle);
+    free(bw->state);
+    free(bw);
+}
+
+WallhavenCode wallhaven_set_bandwidth(WallhavenAPI *wa, WallhavenBandwidth *bw)
+{
+    wa->bandwidth = bw;
+    if (bw)
+        return WALLHAVEN_OK;
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_NOPROGRESS, 1L), WALLHAVEN_CURL_FAIL);
+    check_return(curl_easy_setopt(wa->curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)0), WALLHAVEN_CURL_FAIL);
+    return WALLHAVEN_OK;
+}
+
+typedef struct
+{
+    char *url;
+    char *path;
+    int64_t size;   // INT64_MAX when not known
+    uint64_t order; // Keeps the downloads of the same size in the order they were added
+} DownloadJob;
+
+struct DownloadsState
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t work; // A job was added or stopping
+    pthread_cond_t idle; // Nothing queued or in flight
+    DownloadJob *heap;   // Min heap by size then order
+    size_t count, capacity;
+    uint64_t next_order;
+    int busy;
+    bool stopping;
+    pthread_t *threads;
+    int started;
+};
+
+static bool download_before(const DownloadJob *a, const DownloadJob *b)
+{
+    return a->size != b->size ? a->size < b->size : a->order < b->order;
+}
+
+static void *downloads_run(void *arg)
+{
+    WallhavenDownloads *d = (WallhavenDownloads *)arg;
+    struct DownloadsState *st = d->state;
+    WallhavenAPI *wa = wallhaven_init();
+    if (wa && d->options.bandwidth)
+        wallhaven_set_bandwidth(wa, d->options.bandwidth);
+
+    pthread_mutex_lock(&st->mutex);
+    while (true)
+    {
+        while (!st->count && !st->stopping)
+            pthread_cond_wait(&st->work, &st->mutex);
+        if (!st->count)
+            break;
+
+        // Take the smallest
+        DownloadJob job = st->heap[0];
+        st->heap[0] = st->heap[--st->count];
+        for (size_t i = 0, c; (c = 2 * i + 1) < st->count; i = c)
+        {
+            if (c + 1 < st->count && download_before(&st->heap[c + 1], &st->heap[c]))
+                ++c;
+            if (!download_before(&st->heap[c], &st->heap[i]))
+                break;
+            DownloadJob t = st->heap[i];
+            st->heap[i] = st->heap[c];
+            st->heap[c] = t;
+        }
+        ++st->busy;
+        pthread_mutex_unlock(&st->mutex);
+
+        // Written next to the file and renamed when complete, so a file at path is always whole
+        WallhavenCode code = WALLHAVEN_NO_MEMORY;
+        size_t size = strlen(job.path) + 6;
+        char *part = (char *)malloc(size);
+        FILE *f = NULL;
+        long written = 0;
+        if (wa && part)
+        {
+            snprintf(part, size, "%s.part", job.path);
+            code = (f = fopen(part, "wb")) ? wallhaven_write_to_file(wa, f) : WALLHAVEN_IO_FAIL;
+        }
+        if (code == WALLHAVEN_OK && (code = wallhaven_download(wa, job.url)) == WALLHAVEN_OK && wa->stats.last_status != 200)
+            code = WALLHAVEN_CURL_FAIL;
+        if (f)
+        {
+            written = ftell(f);
+            if (fclose(f) && code == WALLHAVEN_OK)
+                code = WALLHAVEN_IO_FAIL;
+            if (code == WALLHAVEN_OK && rename(part, job.path))
+                code = WALLHAVEN_IO_FAIL;
+            if (code != WALLHAVEN_OK)
+                remove(part);
+        }
+        free(part);
+
+        if (d->options.done)
+            d->options.done(job.url, job.path, code, d->options.userdata);
+        free(job.url);
+        free(job.path);
+
+        pthread_mutex_lock(&st->mutex);
+        if (code == WALLHAVEN_OK)
+        {
+            ++d->done;
+            d->bytes += written;
+        }
+        else
+            ++d->failed;
+        if (!--st->busy && !st->count)
+            pthread_cond_broadcast(&st->idle);
+    }
+    pthread_mutex_unlock(&st->mutex);
+
+    if (wa)
+        wallhaven_free(wa);
+    return NULL;
+}
+
+WallhavenDownloads *wallhaven_downloads_init(const DownloadsOptions *o)
+{
+    WallhavenDownloads *d;
+    checkp_return(d = (WallhavenDownloads *)calloc(1, sizeof(WallhavenDownloads)), NULL);
+    if (o)
+        d->options = *o;
+    if (d->options.workers <= 0)
+        d->options.workers = 4;
+
+    struct DownloadsState *st = d->state = (struct DownloadsState *)calloc(1, sizeof(struct DownloadsState));
+    if (!st || !(st->threads = (pthread_t *)calloc(d->options.workers, sizeof(pthread_t))))
+    {
+        free(st);
+        free(d);
+        return NULL;
+    }
+    pthread_mutex_init(&st->mutex, NULL);
+    pthread_cond_init(&st->work, NULL);
+    pthread_cond_init(&st->idle, NULL);
+    for (; st->started < d->options.workers; ++st->started)
+        if (pthread_create(&st->threads[st->started], NULL, downloads_run, d))
+            break;
+    if (!st->started)
+    {
+        wallhaven_downloads_free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+void wallhaven_downloads_free(WallhavenDownloads *d)
+{
+    struct DownloadsState *st = d->state;
+    pthread_mutex_lock(&st->mutex);
+    st->stopping = true; // Workers go on till the queue is empty
+    pthread_cond_broadcast(&st->work);
+    pthread_mutex_unlock(&st->mutex);
+    for (int i = 0; i < st->started; ++i)
+        pthread_join(st->threads[i], NULL);
+
+    pthread_mutex_destroy(&st->mutex);
+    pthread_cond_destroy(&st->work);
+    pthread_cond_destroy(&st->idle);
+    free(st->heap);
+    free(st->threads);
+    free(st);
+    free(d);
+}
+
+WallhavenCode wallhaven_downloads_add(WallhavenDownloads *d, const char *url, int64_t file_size, const char *path)
+{
+    struct DownloadsState *st = d->state;
+    DownloadJob job = {strdup(url), strdup(path), file_size >= 0 ? file_size : INT64_MAX, 0};
+    if (!job.url || !job.path)
+    {
+        free(job.url);
+        free(job.path);
+        return WALLHAVEN_NO_MEMORY;
+    }
+
+    pthread_mutex_lock(&st->mutex);
+    if (st->count == st->capacity)
+    {
+        size_t capacity = st->capacity ? st->capacity * 2 : 64;
+        DownloadJob *heap = (DownloadJob *)realloc(st->heap, capacity * sizeof(DownloadJob));
+        if (!heap)
+        {
+            pthread_mutex_unlock(&st->mutex);
+            free(job.url);
+            free(job.path);
+            return WALLHAVEN_NO_MEMORY;
+        }
+        st->heap = heap;
+        st->capacity = capacity;
+    }
+
+    job.order = st->next_order++;
+    size_t i = st->count++;
+    for (; i && download_before(&job, &st->heap[(i - 1) / 2]); i = (i - 1) / 2)
+        st->heap[i] = st->heap[(i - 1) / 2];
+    st->heap[i] = job;
+    pthread_cond_signal(&st->work);
+    pthread_mutex_unlock(&st->mutex);
+
+    return WALLHAVEN_OK;
+}
+
+WallhavenCode wallhaven_downloads_add_page(WallhavenDownloads *d, const Response *page, const char *dir, size_t *added)
+{
+    WallhavenJson j;
+    WallhavenCode code = wallhaven_json_parse(&j, page->value, page->size);
+    check_return(code, code);
+
+    size_t count = wallhaven_json_count(&j, "data"), queued = 0;
+    for (size_t i = 0; i < count && code == WALLHAVEN_OK; ++i)
+    {
+        char key[48], url[512], path[1024];
+        long file_size = -1;
+        snprintf(key, sizeof(key), "data[%zu].path", i);
+        if (!wallhaven_json_string(&j, key, url, sizeof(url)))
+            continue;
+        snprintf(key, sizeof(key), "data[%zu].file_size", i);
+        wallhaven_json_long(&j, key, &file_size);
+
+        const char *name = strrchr(url, '/');
+        snprintf(path, sizeof(path), "%s/%s", dir, name ? name + 1 : url);
+        if ((code = wallhaven_downloads_add(d, url, file_size, path)) == WALLHAVEN_OK)
+            ++queued;
+    }
+    wallhaven_json_free(&j);
+
+    if (added)
+        *added = queued;
+    return code;
+}
+
+void wallhaven_downloads_wait(WallhavenDownloads *d)
+{
+    struct DownloadsState *st = d->state;
+    pthread_mutex_lock(&st->mutex);
+    while (st->count || st->busy)
+        pthread_cond_wait(&st->idle, &st->mutex);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+#else
+
+static void bandwidth_begin(WallhavenAPI *wa, bool api_call)
+{
+}
+
+static void bandwidth_end(WallhavenAPI *wa)
+{
+}
+
+WallhavenBandwidth *wallhaven_bandwidth_init(const BandwidthOptions *o)
+{
+    return NULL;
+}
+
+void wallhaven_bandwidth_free(WallhavenBandwidth *bw)
+{
+}
+
+WallhavenCode wallhaven_set_bandwidth(WallhavenAPI *wa, WallhavenBandwidth *bw)
+{
+    return WALLHAVEN_CURL_FAIL;
+}
+
+WallhavenDownloads *wallhaven_downloads_init(const DownloadsOptions *o)
+{
+    return NULL;
+}
+
+void wallhaven_downloads_free(WallhavenDownloads *d)
+{
+}
+
+WallhavenCode wallhaven_downloads_add(WallhavenDownloads *d, const char *url, int64_t file_size, const char *path)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+WallhavenCode wallhaven_downloads_add_page(WallhavenDownloads *d, const Response *page, const char *dir, size_t *added)
+{
+    return WALLHAVEN_IO_FAIL;
+}
+
+void wallhaven_downloads_wait(WallhavenDownloads *d)
+{
+}
+
+#endif
+
+// Query planner
+
+// A search to make after folding and sharing, the leaves of the query point to these
+typedef struct
+{
+    Parameters p;
+    Query q;
+    char *tags; // Joined tags of a folded intersection
+    char *url;  // Of the first page, searches with the same one are shared
+    int pages;
+    size_t *found; // Wallpapers found, may repeat
+    size_t count, capacity;
+} PlanSearch;
+
+// The query after folding
+typedef struct PlanTerm
+{
+    PlanOp op;
+    size_t search;
+    struct PlanTerm *children;
+    size_t count;
+} PlanTerm;
+
+typedef struct
+{
+    PageState state;
+    size_t search;
+    int page;
+    int attempts;
+    double retry_at;
+    CURL *curl;
+    Response body;
+} PlanPage;
+
+typedef struct
+{
+    WallhavenAPI *wa;
+    PlanResult *result;
+    PlanSearch *searches;
+    size_t search_count, search_capacity;
+    PlanPage **pages; // Not moved while running, curl writes into them
+    size_t page_count, page_capacity;
+    PlannedWallpaper *wallpapers;
+    size_t *rank; // Best position of each wallpaper in a search
+    size_t wallpaper_count, wallpaper_capacity;
+    size_t *table; // Id -> index of the wallpaper + 1
+    size_t table_size;
+} Planner;
+
+typedef struct
+{
+    PlannedWallpaper *w;
+    size_t rank;
+} PlanEntry;
+
+static bool same_string(const char *a, const char *b)
+{
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+// Whether the intersection with other such searches can be made as one search by joining the tags
+static bool plan_foldable(const PlanNode *n)
+{
+    checkp_return(n->op == PLAN_SEARCH && n->parameters->q, false);
+    const Query *q = n->parameters->q;
+    checkp_return(q->tags && *q->tags && !q->id && !q->user_name && !q->like, false);
+
+    // Only +tag and -tag terms, fuzzy terms don't mean the same thing when joined
+    for (const char *t = q->tags; *t; ++t)
+        if (*t != ' ' && (t == q->tags || t[-1] == ' ') && *t != '+' && *t != '-')
+            return false;
+    return true;
+}
+
+static bool plan_same_filters(const Parameters *a, const Parameters *b)
+{
+    return a->q->type == b->q->type && a->categories == b->categories && a->purity == b->purity && a->sorting == b->sorting &&
+           a->order == b->order && a->toprange == b->toprange && same_string(a->atleast, b->atleast) &&
+           same_string(a->resolutions, b->resolutions) && same_string(a->ratios, b->ratios) && same_string(a->colors, b->colors) &&
+           !strcmp(a->seed, b->seed);
+}
+
+// Index of the search, shared with an earlier one with the same URL
+static bool plan_add_search(Planner *pl, const Parameters *p, char *tags, int pages, size_t *index)
+{
+    if (pl->search_count == pl->search_capacity)
+    {
+        size_t capacity = pl->search_capacity ? pl->search_capacity * 2 : 8;
+        PlanSearch *searches = (PlanSearch *)realloc(pl->searches, capacity * sizeof(PlanSearch));
+        if (!searches)
+        {
+            free(tags);
+            return false;
+        }
+        pl->searches = searches;
+        pl->search_capacity = capacity;
+    }
+
+    PlanSearch *s = &pl->searches[pl->search_count];
+    memset(s, 0, sizeof(PlanSearch));
+    s->p = *p;
+    s->q = *p->q;
+    s->p.q = &s->q;
+    if ((s->tags = tags))
+        s->q.tags = tags;
+    s->pages = pages > 0 ? pages : 1;
+    if (!(s->url = search_url(pl->wa, &s->p, 1)))
+    {
+        free(tags);
+        return false;
+    }
+
+    for (size_t i = 0; i < pl->search_count; ++i)
+    {
+        if (strcmp(pl->searches[i].url, s->url))
+            continue;
+        if (pl->searches[i].pages < s->pages)
+            pl->searches[i].pages = s->pages;
+        ++pl->result->shared;
+        curl_free(s->url);
+        free(tags);
+        *index = i;
+        return true;
+    }
+
+    *index = pl->search_count++;
+    return true;
+}
+
+static void plan_free_term(PlanTerm *t)
+{
+    for (size_t i = 0; i < t->count; ++i)
+        plan_free_term(&t->children[i]);
+    free(t->children);
+}
+
+static bool plan_build(Planner *pl, const PlanNode *n, PlanTerm *t)
+{
+    memset(t, 0, sizeof(PlanTerm));
+    t->op = n->op;
+    if (n->op == PLAN_SEARCH)
+    {
+        ++pl->result->searches;
+        checkp_return(n->parameters && n->parameters->q, false);
+        return plan_add_search(pl, n->parameters, NULL, n->pages, &t->search);
+    }
+
+    checkp_return(t->children = (PlanTerm *)calloc(n->count ? n->count : 1, sizeof(PlanTerm)), false);
+
+    // Join the foldable searches of an intersection which have the same filters as the first of them
+    const PlanNode *first = NULL;
+    size_t size = 0;
+    int pages = 0;
+    bool *folded = NULL;
+    if (n->op == PLAN_ALL && n->count > 1)
+        checkp_return(folded = (bool *)calloc(n->count, sizeof(bool)), false);
+    for (size_t i = 0; folded && i < n->count; ++i)
+    {
+        const PlanNode *c = n->children[i];
+        if (!plan_foldable(c) || (first && !plan_same_filters(first->parameters, c->parameters)))
+            continue;
+        if (!first)
+            first = c;
+        folded[i] = true;
+        size += strlen(c->parameters->q->tags) + 1;
+        if (c->pages > pages)
+            pages = c->pages;
+        ++pl->result->searches;
+    }
+
+    size_t joined = 0;
+    for (size_t i = 0; folded && i < n->count; ++i)
+        joined += folded[i];
+    if (joined > 1)
+    {
+        char *tags = (char *)malloc(size);
+        if (!tags)
+        {
+            free(folded);
+            return false;
+        }
+        *tags = 0;
+        for (size_t i = 0; i < n->count; ++i)
+            if (folded[i])
+                strcat(strcat(tags, *tags ? " " : ""), n->children[i]->parameters->q->tags);
+
+        PlanTerm *c = &t->children[t->count++];
+        c->op = PLAN_SEARCH;
+        pl->result->folded += joined - 1;
+        if (!plan_add_search(pl, first->parameters, tags, pages, &c->search))
+        {
+            free(folded);
+            return false;
+        }
+    }
+    else if (folded)
+    {
+        pl->result->searches -= joined;
+        memset(folded, 0, n->count * sizeof(bool));
+    }
+
+    for (size_t i = 0; i < n->count; ++i)
+    {
+        if (folded && folded[i])
+            continue;
+        if (!plan_build(pl, n->children[i], &t->children[t->count++]))
+        {
+            free(folded);
+            return false;
+        }
+    }
+    free(folded);
+    return true;
+}
+
+static bool plan_add_page(Planner *pl, size_t search, int page)
+{
+    if (pl->page_count == pl->page_capacity)
+    {
+        size_t capacity = pl->page_capacity ? pl->page_capacity * 2 : 16;
+        PlanPage **pages = (PlanPage **)realloc(pl->pages, capacity * sizeof(PlanPage *));
+        checkp_return(pages, false);
+        pl->pages = pages;
+        pl->page_capacity = capacity;
+    }
+    PlanPage *p = (PlanPage *)calloc(1, sizeof(PlanPage));
+    checkp_return(p, false);
+    pl->pages[pl->page_count++] = p;
+    p->state = PAGE_EMPTY;
+    p->search = search;
+    p->page = page;
+    return true;
+}
+
+static size_t *plan_slot(Planner *pl, const char *id)
+{
+    size_t mask = pl->table_size - 1;
+    for (size_t i = hash_bytes(id, strlen(id), HASH_SEED) & mask;; i = (i + 1) & mask)
+        if (!pl->table[i] || !strcmp(pl->wallpapers[pl->table[i] - 1].id, id))
+            return &pl->table[i];
+}
+
+// Index of the wallpaper, added if it's new
+static bool plan_wallpaper(Planner *pl, const WallhavenJson *j, size_t i, size_t *index)
+{
+    char path[48], id[16];
+    snprintf(path, sizeof(path), "data[%zu].id", i);
+    checkp_return(wallhaven_json_string(j, path, id, sizeof(id)) && *id, false);
+
+    if ((pl->wallpaper_count + 1) * 2 > pl->table_size)
+    {
+        size_t size = pl->table_size ? pl->table_size * 2 : 256;
+        size_t *table = (size_t *)calloc(size, sizeof(size_t));
+        checkp_return(table, false);
+        free(pl->table);
+        pl->table = table;
+        pl->table_size = size;
+        for (size_t w = 0; w < pl->wallpaper_count; ++w)
+            *plan_slot(pl, pl->wallpapers[w].id) = w + 1;
+    }
+
+    size_t *slot = plan_slot(pl, id);
+    if (*slot)
+    {
+        ++pl->result->duplicates;
+        *index = *slot - 1;
+        return true;
+    }
+
+    if (pl->wallpaper_count == pl->wallpaper_capacity)
+    {
+        size_t capacity = pl->wallpaper_capacity ? pl->wallpaper_capacity * 2 : 64;
+        PlannedWallpaper *wallpapers = (PlannedWallpaper *)realloc(pl->wallpapers, capacity * sizeof(PlannedWallpaper));
+        checkp_return(wallpapers, false);
+        pl->wallpapers = wallpapers;
+        size_t *rank = (size_t *)realloc(pl->rank, capacity * sizeof(size_t));
+        checkp_return(rank, false);
+        pl->rank = rank;
+        pl->wallpaper_capacity = capacity;
+    }
+
+    PlannedWallpaper *w = &pl->wallpapers[pl->wallpaper_count];
+    memset(w, 0, sizeof(PlannedWallpaper));
+    memcpy(w->id, id, sizeof(w->id));
+    Span raw;
+    snprintf(path, sizeof(path), "data[%zu]", i);
+    checkp_return(wallhaven_json_raw(j, path, &raw) && (w->json = (char *)malloc(raw.size + 1)), false);
+    memcpy(w->json, raw.data, raw.size);
+    w->json[raw.size] = 0;
+    w->size = raw.size;
+    snprintf(path, sizeof(path), "data[%zu].views", i);
+    wallhaven_json_long(j, path, &w->views);
+    snprintf(path, sizeof(path), "data[%zu].favorites", i);
+    wallhaven_json_long(j, path, &w->favorites);
+    snprintf(path, sizeof(path), "data[%zu].created_at", i);
+    wallhaven_json_string(j, path, w->created_at, sizeof(w->created_at));
+
+    pl->rank[pl->wallpaper_count] = SIZE_MAX;
+    *slot = ++pl->wallpaper_count;
+    *index = pl->wallpaper_count - 1;
+    return true;
+}
+
+// Take the wallpapers of a page, the first page of a search also queues the rest of its pages
+static WallhavenCode plan_take_page(Planner *pl, size_t index)
+{
+    PlanPage *page = pl->pages[index];
+    Response body = page->body;
+    size_t search = page->search;
+    int number = page->page;
+    page->body = (Response){0};
+    page->state = PAGE_DONE;
+
+    WallhavenJson j;
+    WallhavenCode wc = wallhaven_json_parse(&j, body.value, body.size);
+    if (wc != WALLHAVEN_OK)
+    {
+        free(body.value);
+        return wc;
+    }
+
+    PlanSearch *s = &pl->searches[search];
+    size_t count = wallhaven_json_count(&j, "data");
+    for (size_t i = 0; i < count && wc == WALLHAVEN_OK; ++i)
+    {
+        size_t w;
+        if (!plan_wallpaper(pl, &j, i, &w))
+            continue;
+        if (s->count == s->capacity)
+        {
+            size_t capacity = s->capacity ? s->capacity * 2 : 64;
+            size_t *found = (size_t *)realloc(s->found, capacity * sizeof(size_t));
+            if (!found)
+            {
+                wc = WALLHAVEN_NO_MEMORY;
+                break;
+            }
+            s->found = found;
+            s->capacity = capacity;
+        }
+        s->found[s->count++] = w;
+
+        size_t rank = (size_t)(number - 1) * 1024 + i;
+        if (rank < pl->rank[w])
+            pl->rank[w] = rank;
+    }
+
+    long last_page = 1;
+    if (number == 1 && wc == WALLHAVEN_OK)
+    {
+        wallhaven_json_long(&j, "meta.last_page", &last_page);
+        for (int p = 2; p <= s->pages && p <= last_page; ++p)
+            if (!plan_add_page(pl, search, p))
+                wc = WALLHAVEN_NO_MEMORY;
+    }
+    wallhaven_json_free(&j);
+    free(body.value);
+    return wc;
+}
+
+// Answer the page from the cache of wa if it's there and fresh
+static bool plan_from_cache(Planner *pl, PlanPage *page, const char *key)
+{
+    WallhavenCache *c = pl->wa->cache;
+    checkp_return(c, false);
+    struct CacheEntry *e = cache_find(c, key);
+    checkp_return(e && !e->curl, false);
+    if (c->ttl_seconds > 0 && now_seconds() - e->fetched_at > c->ttl_seconds)
+    {
+        cache_remove(c, e);
+        return false;
+    }
+
+    ++c->hits;
+    e->used = true;
+    cache_unlink(c, e);
+    cache_push_front(c, e);
+    return write_function(e->body.value, 1, e->body.size, &page->body) == e->body.size;
+}
+
+static void plan_store(Planner *pl, const PlanPage *page, const char *key)
+{
+    WallhavenCache *c = pl->wa->cache;
+    checkp_return(c, );
+    struct CacheEntry *e = cache_find(c, key);
+    if (!e)
+        checkp_return(e = cache_insert(c, key), );
+    e->body.size = 0;
+    write_function(page->body.value, 1, page->body.size, &e->body);
+    e->fetched_at = now_seconds();
+    e->used = true;
+}
+
+static void plan_cache_key(const Planner *pl, const PlanPage *page, char *key, size_t size)
+{
+    PlanSearch *s = &pl->searches[page->search];
+    snprintf(key, size, "%d/%016llx/%d", SEARCH, (unsigned long long)hash_bytes(s->url, strlen(s->url), HASH_SEED), page->page);
+}
+
+static WallhavenCode plan_fetch(Planner *pl, int concurrency)
+{
+    WallhavenAPI *wa = pl->wa;
+    if (wa->breaker_open_until && now_seconds() < wa->breaker_open_until)
+    {
+        ++wa->stats.breaker_rejected;
+        return WALLHAVEN_CIRCUIT_OPEN;
+    }
+
+    CURLM *m = curl_multi_init();
+    checkp_return(m, WALLHAVEN_CURL_FAIL);
+
+    WallhavenCode wc = WALLHAVEN_OK;
+    int running = 0;
+    for (;;)
+    {
+        double now = now_seconds(), next_retry = 0;
+        for (size_t i = 0; wc == WALLHAVEN_OK && i < pl->page_count && running < concurrency; ++i)
+        {
+            PlanPage *page = pl->pages[i];
+            if (page->state != PAGE_EMPTY)
+                continue;
+            if (page->retry_at > now)
+            {
+                if (!next_retry || page->retry_at < next_retry)
+                    next_retry = page->retry_at;
+                continue;
+            }
+
+            char key[48];
+            plan_cache_key(pl, page, key, sizeof(key));
+            if (!page->attempts && plan_from_cache(pl, page, key))
+            {
+                ++pl->result->cache_hits;
+                wc = plan_take_page(pl, i);
+                continue;
+            }
+            if (wa->cache && !page->attempts)
+                ++wa->cache->misses;
+
+            PlanSearch *s = &pl->searches[page->search];
+            s->p.q = &s->q;
+            char *url = search_url(wa, &s->p, page->page);
+            if (!url || (!page->curl && !(page->curl = curl_easy_init())))
+            {
+                curl_free(url);
+                wc = WALLHAVEN_CURL_FAIL;
+                break;
+            }
+
+            // Same minute window as the calls made by perform
+            if (wa->start_time == -1 || difftime(time(NULL), wa->start_time) > 60)
+                time(&wa->start_time);
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+            if (wa->shared_limit)
+                shared_limit_acquire(wa->shared_limit);
+#endif
+            page->body.size = 0;
+            curl_easy_reset(page->curl);
+            curl_easy_setopt(page->curl, CURLOPT_URL, url);
+            curl_easy_setopt(page->curl, CURLOPT_WRITEFUNCTION, write_function);
+            curl_easy_setopt(page->curl, CURLOPT_WRITEDATA, (void *)&page->body);
+            curl_easy_setopt(page->curl, CURLOPT_PRIVATE, (void *)i);
+            curl_multi_add_handle(m, page->curl);
+            curl_free(url);
+
+            page->state = PAGE_RUNNING;
+            ++page->attempts;
+            ++wa->stats.attempts;
+            if (page->attempts == 1)
+                ++wa->stats.calls;
+            ++running;
+        }
+
+        if (!running)
+        {
+            // Only retries waiting are left
+            if (wc != WALLHAVEN_OK || !next_retry)
+                break;
+            sleep_ms((long)((next_retry - now_seconds()) * 1000) + 1);
+            continue;
+        }
+
+        int still_running;
+        curl_multi_perform(m, &still_running);
+        curl_multi_poll(m, NULL, 0, 100, NULL);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(m, &queued)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            char *private;
+            long code = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            read_limit_headers(wa, msg->easy_handle);
+            curl_multi_remove_handle(m, msg->easy_handle);
+            CURLcode c = msg->data.result;
+            size_t i = (size_t)private;
+            PlanPage *page = pl->pages[i];
+            --running;
+            wa->stats.last_status = code;
+
+            bool retryable;
+            WallhavenCode failed = call_outcome(wa, c, code, &retryable);
+            if (failed == WALLHAVEN_OK && code == 200)
+            {
+                ++pl->result->fetched;
+                char key[48];
+                plan_cache_key(pl, page, key, sizeof(key));
+                plan_store(pl, page, key);
+                WallhavenCode taken = plan_take_page(pl, i);
+                if (wc == WALLHAVEN_OK)
+                    wc = taken;
+                continue;
+            }
+
+            // Other pages keep going on while this one waits, same retry rules as every other call
+            long delay;
+            if (failed == WALLHAVEN_OK)
+                failed = WALLHAVEN_CURL_FAIL; // Answered, but not with a page
+            if (wc != WALLHAVEN_OK || !call_retry(wa, &failed, retryable, page->attempts - 1, true, false, &delay))
+            {
+                if (wc != WALLHAVEN_OK)
+                    ++wa->stats.failures;
+                page->state = PAGE_DONE;
+                if (wc == WALLHAVEN_OK)
+                    wc = failed;
+                continue;
+            }
+            page->retry_at = now_seconds() + delay / 1000.0;
+            page->state = PAGE_EMPTY;
+        }
+    }
+
+    for (size_t i = 0; i < pl->page_count; ++i)
+    {
+        if (pl->pages[i]->curl)
+        {
+            curl_multi_remove_handle(m, pl->pages[i]->curl);
+            curl_easy_cleanup(pl->pages[i]->curl);
+        }
+        free(pl->pages[i]->body.value);
+    }
+    curl_multi_cleanup(m);
+    return wc;
+}
+
+// Mark the wallpapers the term matches
+static bool plan_eval(const Planner *pl, const PlanTerm *t, unsigned char *in)
+{
+    size_t n = pl->wallpaper_count;
+    if (t->op == PLAN_SEARCH)
+    {
+        memset(in, 0, n);
+        const PlanSearch *s = &pl->searches[t->search];
+        for (size_t i = 0; i < s->count; ++i)
+            in[s->found[i]] = 1;
+        return true;
+    }
+
+    memset(in, t->op == PLAN_ALL && t->count, n);
+    unsigned char *child = (unsigned char *)malloc(n ? n : 1);
+    checkp_return(child, false);
+    for (size_t c = 0; c < t->count; ++c)
+    {
+        if (!plan_eval(pl, &t->children[c], child))
+        {
+            free(child);
+            return false;
+        }
+        for (size_t i = 0; i < n; ++i)
+            in[i] = t->op == PLAN_ALL ? in[i] & child[i] : in[i] | child[i];
+    }
+    free(child);
+    return true;
+}
+
+// Ties are broken by the rank and then the id so that the result doesn't depend on which search answered first
+static int plan_tie(const PlanEntry *a, const PlanEntry *b)
+{
+    if (a->rank != b->rank)
+        return a->rank < b->rank ? -1 : 1;
+    return strcmp(a->w->id, b->w->id);
+}
+
+static int plan_by_rank(const void *x, const void *y)
+{
+    return plan_tie((const PlanEntry *)x, (const PlanEntry *)y);
+}
+
+static int plan_by_views(const void *x, const void *y)
+{
+    const PlanEntry *a = (const PlanEntry *)x, *b = (const PlanEntry *)y;
+    return a->w->views != b->w->views ? (a->w->views < b->w->views ? 1 : -1) : plan_tie(a, b);
+}
+
+static int plan_by_favorites(const void *x, const void *y)
+{
+    const PlanEntry *a = (const PlanEntry *)x, *b = (const PlanEntry *)y;
+    return a->w->favorites != b->w->favorites ? (a->w->favorites < b->w->favorites ? 1 : -1) : plan_tie(a, b);
+}
+
+static int plan_by_date(const void *x, const void *y)
+{
+    const PlanEntry *a = (const PlanEntry *)x, *b = (const PlanEntry *)y;
+    int c = strcmp(b->w->created_at, a->w->created_at);
+    return c ? c : plan_tie(a, b);
+}
+
+WallhavenCode wallhaven_plan_run(WallhavenAPI *wa, const PlanNode *query, const PlanOptions *o, PlanResult *result)
+{
+    PlanOptions options = o ? *o : (PlanOptions){0};
+    Planner pl = {.wa = wa, .result = result};
+    PlanTerm root;
+    unsigned char *in = NULL;
+    PlanEntry *entries = NULL;
+    memset(result, 0, sizeof(PlanResult));
+
+    WallhavenCode wc = plan_build(&pl, query, &root) ? WALLHAVEN_OK : WALLHAVEN_NO_MEMORY;
+    for (size_t i = 0; wc == WALLHAVEN_OK && i < pl.search_count; ++i)
+        if (!plan_add_page(&pl, i, 1))
+            wc = WALLHAVEN_NO_MEMORY;
+    if (wc == WALLHAVEN_OK)
+        wc = plan_fetch(&pl, options.concurrency > 0 ? options.concurrency : 4);
+
+    if (wc == WALLHAVEN_OK && !((in = (unsigned char *)malloc(pl.wallpaper_count + 1)) &&
+                                (entries = (PlanEntry *)malloc((pl.wallpaper_count + 1) * sizeof(PlanEntry))) && plan_eval(&pl, &root, in)))
+        wc = WALLHAVEN_NO_MEMORY;
+
+    if (wc == WALLHAVEN_OK)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < pl.wallpaper_count; ++i)
+            if (in[i])
+                entries[count++] = (PlanEntry){&pl.wallpapers[i], pl.rank[i]};
+
+        int (*compare)(const void *, const void *) = options.sorting == VIEWS ? plan_by_views
+                                                     : options.sorting == FAVORITES ? plan_by_favorites
+                                                     : options.sorting == DATE_ADDED ? plan_by_date
+                                                                                     : plan_by_rank;
+        qsort(entries, count, sizeof(PlanEntry), compare);
+        if (options.order == ASCENDING && compare != plan_by_rank)
+            for (size_t i = 0; i < count / 2; ++i)
+            {
+                PlanEntry t = entries[i];
+                entries[i] = entries[count - 1 - i];
+                entries[count - 1 - i] = t;
+            }
+        if (options.limit && count > options.limit)
+            count = options.limit;
+
+        if ((result->wallpapers = (PlannedWallpaper *)malloc((count ? count : 1) * sizeof(PlannedWallpaper))))
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                result->wallpapers[i] = *entries[i].w;
+                entries[i].w->json = NULL; // Owned by the result now
+            }
+            result->count = count;
+        }
+        else
+            wc = WALLHAVEN_NO_MEMORY;
+    }
+
+    for (size_t i = 0; i < pl.wallpaper_count; ++i)
+        free(pl.wallpapers[i].json);
+    for (size_t i = 0; i < pl.search_count; ++i)
+    {
+        free(pl.searches[i].tags);
+        curl_free(pl.searches[i].url);
+        free(pl.searches[i].found);
+    }
+    plan_free_term(&root);
+    free(in);
+    free(entries);
+    free(pl.wallpapers);
+    free(pl.rank);
+    free(pl.table);
+    free(pl.searches);
+    for (size_t i = 0; i < pl.page_count; ++i)
+        free(pl.pages[i]);
+    free(pl.pages);
+    return wc;
+}
+
+void wallhaven_plan_result_free(PlanResult *result)
+{
+    for (size_t i = 0; i < result->count; ++i)
+        free(result->wallpapers[i].json);
+    free(result->wallpapers);
+    result->wallpapers = NULL;
+    result->count = 0;
+}
+
+// Streaming
+
+#ifndef WALLHAVEN_PLATFORM_WINDOWS
+
+struct WallhavenStream
+{
+    WallhavenStreams *streams;
+    struct WallhavenStream *next;
+    CURL *curl;
+    pthread_cond_t readable;
+    unsigned char *buffer; // Freed when drained so that idle streams hold nothing
+    size_t capacity;
+    size_t head;   // Start of the unread data
+    size_t size;   // Unread bytes
+    bool added;    // To the multi handle
+    bool paused;
+    bool done;
+    bool closed;   // Freed by the thread
+    CURLcode result;
+    long status;
+};
+
+struct StreamsState
+{
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    CURLM *multi;
+    WallhavenStream *streams; // In the order they were opened
+    int running;
+    size_t paused;
+    bool stopping;
+};
+
+// A paused stream goes on once its reader caught up
+static bool stream_resumable(const WallhavenStream *st)
+{
+    const WallhavenStreams *s = st->streams;
+    return !st->size || (st->size <= s->options.buffer_size / 2 && s->buffered <= s->options.memory_budget / 4 * 3);
+}
+
+static size_t stream_write(char *data, size_t size, size_t nmemb, void *userdata)
+{
+    WallhavenStream *st = (WallhavenStream *)userdata;
+    WallhavenStreams *s = st->streams;
+    size_t n = size * nmemb;
+
+    pthread_mutex_lock(&s->state->mutex);
+    bool full = st->size && st->size + n > s->options.buffer_size;
+    bool over = st->size && s->buffered + n > s->options.memory_budget;
+    if (full || over)
+    {
+        // curl gives the same data again once unpaused
+        st->paused = true;
+        ++s->state->paused;
+        ++s->pauses;
+        if (!full)
+            ++s->budget_pauses;
+        pthread_mutex_unlock(&s->state->mutex);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    if (st->head + st->size + n > st->capacity)
+    {
+        if (st->size)
+            memmove(st->buffer, st->buffer + st->head, st->size);
+        st->head = 0;
+    }
+    if (st->size + n > st->capacity)
+    {
+        size_t capacity = st->capacity ? st->capacity * 2 : 16384;
+        while (capacity < st->size + n)
+            capacity *= 2;
+        unsigned char *buffer = (unsigned char *)realloc(st->buffer, capacity);
+        if (!buffer)
+        {
+            pthread_mutex_unlock(&s->state->mutex);
+            return 0;
+        }
+        st->buffer = buffer;
+        st->capacity = capacity;
+    }
+
+    memcpy(st->buffer + st->head + st->size, data, n);
+    st->size += n;
+    s->buffered += n;
+    if (s->buffered > s->peak)
+        s->peak = s->buffered;
+    pthread_cond_signal(&st->readable);
+    pthread_mutex_unlock(&s->state->mutex);
+    return n;
+}
+
+static void stream_free(WallhavenStream *st)
+{
+    st->streams->buffered -= st->size;
+    curl_easy_cleanup(st->curl);
+    pthread_cond_destroy(&st->readable);
+    free(st->buffer);
+    free(st);
+}
+
+static void *streams_run(void *userdata)
+{
+    WallhavenStreams *s = (WallhavenStreams *)userdata;
+    struct StreamsState *ss = s->state;
+    CURL **resume = NULL;
+    size_t resume_capacity = 0;
+
+    pthread_mutex_lock(&ss->mutex);
+    while (!ss->stopping)
+    {
+        size_t resume_count = 0;
+        for (WallhavenStream **link = &ss->streams, *st; (st = *link);)
+        {
+            if (st->closed)
+            {
+                if (st->added && !st->done)
+                {
+                    curl_multi_remove_handle(ss->multi, st->curl);
+                    --ss->running;
+                }
+                if (st->paused)
+                    --ss->paused;
+                *link = st->next;
+                stream_free(st);
+                continue;
+            }
+
+            // Paused transfers wait for their readers, so they don't hold a slot, any stream can be read first
+            if (!st->added && ss->running - (int)ss->paused < s->options.concurrency)
+            {
+                curl_multi_add_handle(ss->multi, st->curl);
+                st->added = true;
+                ++ss->running;
+            }
+            else if (st->paused && stream_resumable(st))
+            {
+                if (resume_count == resume_capacity)
+                {
+                    size_t capacity = resume_capacity ? resume_capacity * 2 : 16;
+                    CURL **r = (CURL **)realloc(resume, capacity * sizeof(CURL *));
+                    if (!r)
+                        break;
+                    resume = r;
+                    resume_capacity = capacity;
+                }
+                st->paused = false;
+                --ss->paused;
+                resume[resume_count++] = st->curl;
+            }
+            link = &st->next;
+        }
+        pthread_mutex_unlock(&ss->mutex);
+
+        // Unpausing can call stream_write right away, so not with the mutex held
+        for (size_t i = 0; i < resume_count; ++i)
+            curl_easy_pause(resume[i], CURLPAUSE_CONT);
+
+        int still_running;
+        curl_multi_perform(ss->multi, &still_running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(ss->multi, &queued)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            char *private;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+            WallhavenStream *st = (WallhavenStream *)private;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(ss->multi, msg->easy_handle);
+
+            pthread_mutex_lock(&ss->mutex);
+            st->done = true;
+            st->result = result;
+            curl_easy_getinfo(st->curl, CURLINFO_RESPONSE_CODE, &st->status);
+            --ss->running;
+            pthread_cond_signal(&st->readable);
+            pthread_mutex_unlock(&ss->mutex);
+        }
+
+        curl_multi_poll(ss->multi, NULL, 0, 1000, NULL);
+        pthread_mutex_lock(&ss->mutex);
+    }
+
+    while (ss->streams)
+    {
+        WallhavenStream *st = ss->streams;
+        ss->streams = st->next;
+        if (st->added && !st->done)
+            curl_multi_remove_handle(ss->multi, st->curl);
+        stream_free(st);
+    }
+    pthread_mutex_unlock(&ss->mutex);
+    free(resume);
+    return NULL;
+}
+
+WallhavenStreams *wallhaven_streams_init(const StreamOptions *o)
+{
+    WallhavenStreams *s = (WallhavenStreams *)calloc(1, sizeof(WallhavenStreams));
+    checkp_return(s, NULL);
+    if (o)
+        s->options = *o;
+    if (!s->options.buffer_size)
+        s->options.buffer_size = 64 * 1024;
+    if (!s->options.memory_budget)
+        s->options.memory_budget = 1024 * 1024;
+    if (s->options.concurrency <= 0)
+        s->options.concurrency = 8;
+
+    struct StreamsState *ss = (struct StreamsState *)calloc(1, sizeof(struct StreamsState));
+    if (!ss || !(ss->multi = curl_multi_init()))
+    {
+        free(ss);
+        free(s);
+        return NULL;
+    }
+    s->state = ss;
+    pthread_mutex_init(&ss->mutex, NULL);
+
+    if (pthread_create(&ss->thread, NULL, streams_run, s))
+    {
+        pthread_mutex_destroy(&ss->mutex);
+        curl_multi_cleanup(ss->multi);
+        free(ss);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+bool wallhaven_streams_free(WallhavenStreams *s)
+{
+    checkp_return(s, true);
+    struct StreamsState *ss = s->state;
+    pthread_mutex_lock(&ss->mutex);
+    for (WallhavenStream *st = ss->streams; st; st = st->next)
+    {
+        if (!st->closed)
+        {
+            // The caller still holds it
+            pthread_mutex_unlock(&ss->mutex);
+            return false;
+        }
+    }
+    ss->stopping = true;
+    pthread_mutex_unlock(&ss->mutex);
+    curl_multi_wakeup(ss->multi);
+    pthread_join(ss->thread, NULL);
+
+    pthread_mutex_destroy(&ss->mutex);
+    curl_multi_cleanup(ss->multi);
+    free(ss);
+    free(s);
+    return true;
+}
+
+WallhavenStream *wallhaven_stream_open(WallhavenStreams *s, const char *url)
+{
+    WallhavenStream *st = (WallhavenStream *)calloc(1, sizeof(WallhavenStream));
+    checkp_return(st, NULL);
+    if (!(st->curl = curl_easy_init()))
+    {
+        free(st);
+        return NULL;
+    }
+    st->streams = s;
+    pthread_cond_init(&st->readable, NULL);
+
+    curl_easy_setopt(st->curl, CURLOPT_URL, url);
+    curl_easy_setopt(st->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(st->curl, CURLOPT_WRITEFUNCTION, stream_write);
+    curl_easy_setopt(st->curl, CURLOPT_WRITEDATA, (void *)st);
+    curl_easy_setopt(st->curl, CURLOPT_PRIVATE, (void *)st);
+
+    struct StreamsState *ss = s->state;
+    pthread_mutex_lock(&ss->mutex);
+    WallhavenStream **link = &ss->streams;
+    while (*link)
+        link = &(*link)->next;
+    *link = st;
+    pthread_mutex_unlock(&ss->mutex);
+    curl_multi_wakeup(ss->multi);
+    return st;
+}
+
+size_t wallhaven_stream_read(WallhavenStream *st, void *buffer, size_t size)
+{
+    WallhavenStreams *s = st->streams;
+    struct StreamsState *ss = s->state;
+    pthread_mutex_lock(&ss->mutex);
+    while (!st->size && !st->done)
+        pthread_cond_wait(&st->readable, &ss->mutex);
+
+    size_t n = st->size < size ? st->size : size, low = s->options.memory_budget / 4 * 3;
+    bool was_over = s->buffered > low;
+    if (n)
+        memcpy(buffer, st->buffer + st->head, n);
+    st->head += n;
+    st->size -= n;
+    s->buffered -= n;
+    s->bytes += n;
+    if (!st->size)
+    {
+        free(st->buffer);
+        st->buffer = NULL;
+        st->capacity = st->head = 0;
+    }
+
+    // Wake the thread only when a paused stream can go on, not on every read
+    bool wake = ss->paused && ((st->paused && stream_resumable(st)) || (was_over && s->buffered <= low));
+    pthread_mutex_unlock(&ss->mutex);
+    if (wake)
+        curl_multi_wakeup(ss->multi);
+    return n;
+}
+
+WallhavenCode wallhaven_stream_close(WallhavenStream *st, long *status)
+{
+    struct StreamsState *ss = st->streams->state;
+    pthread_mutex_lock(&ss->mutex);
+    WallhavenCode wc = st->done && st->result == CURLE_OK && st->status == 200 ? WALLHAVEN_OK : WALLHAVEN_CURL_FAIL;
+    if (status)
+        *status = st->status;
+    st->closed = true;
+    pthread_mutex_unlock(&ss->mutex);
+    curl_multi_wakeup(ss->multi);
+    return wc;
+}
+
+#else
+
+WallhavenStreams *wallhaven_streams_init(const StreamOptions *o)
+{
+    return NULL;
+}
+
+bool wallhaven_streams_free(WallhavenStreams *s)
+{
+    return true;
+}
+
+WallhavenStream *wallhaven_stream_open(WallhavenStreams *s, const char *url)
+{
+    return NULL;
+}
+
+size_t wallhaven_stream_read(WallhavenStream *st, void *buffer, size_t size)
+{
+    return 0;
+}
+
+WallhavenCode wallhaven_stream_close(WallhavenStream *st, long *status)
+{
+    return WALLHAVEN_CURL_FAIL;
+}
+
+#endif
@@ -53,15 +53,33 @@ SOFTWARE.
  *
  */
 
+/**
+ * @example json_benchmark.c
+ * @brief Reading a few fields of a search page with WallhavenJson compared with building the whole tree
+ *
+ */
+
+/**
+ * @example coroutines.cpp
+ * @brief Fetching the info of every wallpaper of a search page at the same time from one thread with wallhavenapi.hpp
+ *
+ */
+
 #ifndef WALLHAVEN_API_H
 #define WALLHAVEN_API_H
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #include <curl/curl.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 /**
  * @defgroup colors Color macros
  * @brief Defining the hex values for the colors
@@ -174,6 +192,12 @@ SOFTWARE.
 #define wallhaven_collections_of(wallhaven_api, user_name) \
     wallhaven_get_result(wallhaven_api, COLLECTIONS, user_name)
 
+/**
+ * @brief Number of API calls allowed per minute ([documentation](https://wallhaven.cc/help/api#limits))
+ *
+ */
+#define WALLHAVEN_CALLS_PER_MINUTE 45
+
 /**
  * @brief Type of function to call when hit maximum API call limit
  *
@@ -208,6 +232,12 @@ typedef enum
     WALLHAVEN_SORTING_SHOULD_BE_TOPLIST, /**< To use Top Range, sorting must be TOPLIST (look at the [documentation](https://wallhaven.cc/help/api#search)) */
     WALLHAVEN_TOO_MANY_REQUSTS_ERROR,    /**< Returned when Maximum API call limit is hit and didn't retried to get the content */
     WALLHAVEN_UNAUTHORIZED_ERROR,        /**< Returned when API key is not correct or trying to access nsfw wallpapers without API key ([documentation](https://wallhaven.cc/help/api#limits)) */
+    WALLHAVEN_SHARED_LIMIT_FAIL,         /**< Couldn't create or attach to the shared memory segment of the shared rate limit (always returned on Windows) */
+    WALLHAVEN_CIRCUIT_OPEN,              /**< Too many calls failed one after another, calls are not made till the cooldown of the RetryPolicy is over */
+    WALLHAVEN_IO_FAIL,                   /**< Something went wrong with reading or writing the local files */
+    WALLHAVEN_JSON_ERROR,                /**< Response is not a valid JSON */
+    WALLHAVEN_NO_MEMORY,                 /**< Allocation failed or would go over the memory limit of WallhavenMemory */
+    WALLHAVEN_BAD_IMAGE,                 /**< Image has no pixels or could not be decoded */
 } WallhavenCode;
 
 /**
@@ -351,6 +381,86 @@ typedef enum
     COLLECTIONS,    /**< If searching through collections use this */
 } Path;
 
+/**
+ * @brief How the failed calls are retried
+ *
+ * Applies to both API calls and downloads.
+ * Calls are retried on maximum API call limit hit, server errors (5xx) and network failures.
+ * If the server sends Retry-After, it's waited for, else on maximum API call limit hit the onMaxAPICallLimitError function decides
+ * and for others exponential backoff with jitter is used.
+ * Look at wallhaven_set_retry_policy for the default values.
+ *
+ */
+typedef struct
+{
+    int max_retries;           /**< @brief Maximum retries of a single call */
+    int base_delay_ms;         /**< @brief Wait before the first retry, doubled for every next retry */
+    int max_delay_ms;          /**< @brief Maximum wait before a retry */
+    double jitter;             /**< @brief Fraction of the wait randomly cut off (0 to 1) */
+    double retry_budget;       /**< @brief Maximum retries that can be saved up. Every retry takes one, so failures can't multiply the load */
+    double retry_budget_ratio; /**< @brief Retries gained by every successful call */
+    int breaker_threshold;     /**< @brief Failures in a row after which calls are not made for a while (0 to disable) */
+    int breaker_cooldown_ms;   /**< @brief How long the calls are not made after breaker_threshold failures in a row */
+    int hedge_after_ms;        /**< @brief Start a duplicate transfer if the response doesn't come in this time, first one to finish is used (0 to disable). Only when writing to a Response, API calls only when the shared limit has a slot free */
+} RetryPolicy;
+
+/**
+ * @brief Counters of what happened to the calls made with a WallhavenAPI
+ *
+ */
+typedef struct
+{
+    size_t calls;             /**< @brief API calls and downloads made */
+    size_t attempts;          /**< @brief Transfers made including the retries */
+    size_t retries;           /**< @brief Retries made */
+    size_t failures;          /**< @brief Calls which failed after the retries */
+    size_t rate_limited;      /**< @brief Times the maximum API call limit was hit */
+    size_t retry_after_waits; /**< @brief Retries which waited as told by the Retry-After header */
+    size_t budget_exhausted;  /**< @brief Retries not made because retry budget was empty */
+    size_t breaker_opened;    /**< @brief Times too many failures in a row stopped the calls */
+    size_t breaker_rejected;  /**< @brief Calls not made because of the failures in a row */
+    size_t hedged;            /**< @brief Duplicate transfers started */
+    size_t hedge_wins;        /**< @brief Duplicate transfers which finished first */
+    long backoff_ms;          /**< @brief Total time waited before retries (not including the wait of onMaxAPICallLimitError) */
+    long retry_after_ms;      /**< @brief Retry-After of the last response, 0 if not sent */
+    long ratelimit_remaining; /**< @brief X-RateLimit-Remaining of the last response, -1 if never sent */
+    long ratelimit_limit;     /**< @brief X-RateLimit-Limit of the last response, -1 if never sent */
+    long last_status;         /**< @brief HTTP status code of the last response, 0 if there was no response */
+} WallhavenStats;
+
+/**
+ * @brief Functions the WallhavenAPI gets its memory from
+ *
+ * Used for what the WallhavenAPI keeps to itself: the scratch memory of the requests, the body of a hedged transfer,
+ * the shared limit and the prewarm.
+ *
+ * @note Memory given to the user (like the value of Response) is from malloc so that the user can free it
+ * @note Objects with their own init (like WallhavenCache, WallhavenStore, WallhavenThumbs or WallhavenSink) use malloc
+ *
+ */
+typedef struct
+{
+    void *(*malloc)(size_t size, void *userdata); /**< @brief Allocate size bytes, NULL on failure */
+    void (*free)(void *ptr, void *userdata);      /**< @brief Free what malloc gave */
+    void *userdata;                               /**< @brief Passed to malloc and free */
+} WallhavenAllocator;
+
+/**
+ * @brief Memory used by a WallhavenAPI
+ *
+ * The scratch memory of a request (query, path) comes from an arena which is reset after each request,
+ * so once the arena has grown to fit the requests no more allocations are made.
+ *
+ */
+typedef struct
+{
+    size_t in_use;      /**< @brief Bytes allocated now (not including the WallhavenAPI itself) */
+    size_t peak;        /**< @brief Highest in_use so far */
+    size_t allocations; /**< @brief Number of allocations made */
+    size_t limit;       /**< @brief Allocations going over this fail with WALLHAVEN_NO_MEMORY (0 for no limit) */
+    size_t refused;     /**< @brief Allocations refused because of limit */
+} WallhavenMemory;
+
 /**
  * @brief Struct for storing the stuffs for doing the API related things
  *
@@ -368,6 +478,25 @@ typedef struct WallhavenAPI
     bool api_key_set;                            /**< @brief Used for internal logic */
     onMaxAPICallLimitError api_call_limit_error; /**< @brief Funciton to call when maximum api call limit is hit */
     time_t start_time;                           /**< @brief To keep track of when we started to make api calls. Passed to the api_call_limit_error function */
+    struct SharedRateLimit *shared_limit;        /**< @brief Rate limit shared with other processes, NULL if not attached */
+    Response *response;                          /**< @brief Response being written to, NULL if not writing to a Response */
+    FILE *file;                                  /**< @brief File being written to, NULL if not writing to a file */
+    struct WallhavenSinkFile *sink_file;         /**< @brief Sink file being written to, NULL if not writing to a sink file */
+    struct Prewarm *prewarm;                     /**< @brief Connections opened by wallhaven_prewarm, NULL if not prewarmed */
+    struct WallhavenCache *cache;                /**< @brief Cache of the info calls, NULL if not caching */
+    struct WallhavenRecorder *recorder;          /**< @brief Log the calls are recorded to, NULL if not recording */
+    struct WallhavenBandwidth *bandwidth;        /**< @brief Byte rate caps the transfers are paced by, NULL if not shaping */
+    int64_t bandwidth_seen;                      /**< @brief Used for internal logic */
+    bool bandwidth_api;                          /**< @brief Used for internal logic */
+    WallhavenAllocator allocator;                /**< @brief Where the memory comes from */
+    WallhavenMemory memory;                      /**< @brief Memory used, set limit to cap it */
+    struct ArenaBlock *arena;                    /**< @brief Scratch memory of the request */
+    RetryPolicy retry;                           /**< @brief How the failed calls are retried */
+    WallhavenStats stats;                        /**< @brief What happened to the calls so far */
+    double retry_tokens;                         /**< @brief Retries left in the retry budget */
+    int consecutive_failures;                    /**< @brief Used for internal logic */
+    double breaker_open_until;                   /**< @brief Used for internal logic */
+    long hedge_response_code;                    /**< @brief Used for internal logic */
 } WallhavenAPI;
 
 // Wallhaven api functions
@@ -379,6 +508,14 @@ typedef struct WallhavenAPI
  */
 WallhavenAPI *wallhaven_init();
 
+/**
+ * @brief initialize WallhavenAPI taking memory from the given functions
+ *
+ * @param allocator Functions to use (NULL for malloc and free)
+ * @return Returns pointer to the WallhavenAPI if successful else returns NULL
+ */
+WallhavenAPI *wallhaven_init_with_allocator(const WallhavenAllocator *allocator);
+
 /**
  * @brief Free allocated memory of WallhavenAPI
  *
@@ -428,6 +565,18 @@ WallhavenCode wallhaven_write_to_file(WallhavenAPI *wa, FILE *file);
  */
 WallhavenCode wallhaven_get_result(WallhavenAPI *wa, Path p, const char *id);
 
+/**
+ * @brief Download a file like the full wallpaper (path) or the thumbnails of the wallpaper
+ *
+ * Writes to what is set by wallhaven_write_to_response or wallhaven_write_to_file like the API calls.
+ * Doesn't count towards the API call limit.
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param url Full URL of the file (like https://w.wallhaven.cc/full/94/wallhaven-94x38z.jpg)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_download(WallhavenAPI *wa, const char *url);
+
 /**
  * @brief Search for wallpaper
  *
@@ -458,4 +607,2316 @@ WallhavenCode wallhaven_wallpapers_of_collections(WallhavenAPI *wa, const char *
  */
 void wallhaven_set_on_api_call_limit_error(WallhavenAPI *wa, onMaxAPICallLimitError func);
 
+/**
+ * @brief Set how the failed calls are retried
+ *
+ * Default policy retries 3 times with backoff starting at 500 ms up to 30 seconds and 0.5 jitter,
+ * retry budget of 10 gaining 0.1 per successful call, no circuit breaker and no hedging.
+ *
+ * @param wa Pointer to WallhavenAPI
+ * @param policy Policy to use (copied), NULL to use the default policy
+ */
+void wallhaven_set_retry_policy(WallhavenAPI *wa, const RetryPolicy *policy);
+
+/**
+ * @brief Share the API call budget with all the processes on this host
+ *
+ * Attaches to the POSIX shared memory segment with the given name, creating it if it doesn't exist.
+ * Every API call then takes a slot from the shared budget and waits if there is none left,
+ * so that all the attached WallhavenAPIs together stay under the limit.
+ * Only a few calls can be made back to back, the rest are spread over the minute so that no minute gets more than the budget.
+ * On hitting the maximum API call limit anyway, all the attached processes are held back by a minute.
+ *
+ * @note Budget of the segment is decided by the process which creates it, calls_per_minute is ignored by others
+ * @note Not supported on Windows
+ *
+ * @param wa Pointer to WallhavenAPI
+ * @param name Name of the shared memory segment (like "/wallhaven")
+ * @param calls_per_minute Budget of all the processes together, 0 to use WALLHAVEN_CALLS_PER_MINUTE
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_shared_limit_attach(WallhavenAPI *wa, const char *name, int calls_per_minute);
+
+/**
+ * @brief Stop using the shared rate limit
+ *
+ * Called by wallhaven_free.
+ *
+ * @param wa Pointer to WallhavenAPI
+ */
+void wallhaven_shared_limit_detach(WallhavenAPI *wa);
+
+/**
+ * @brief Remove the shared memory segment
+ *
+ * Processes already attached keep using it, processes attaching later create a new one.
+ *
+ * @param name Name of the shared memory segment
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_shared_limit_remove(const char *name);
+
+// Scheduler
+
+/**
+ * @brief Priority classes of the scheduled requests
+ *
+ * Requests of a higher priority class are dispatched first, lower classes still get their share of the dispatches.
+ * Look at wallhaven_scheduler_set_weight.
+ *
+ */
+typedef enum
+{
+    INTERACTIVE,   /**< User facing lookups like wallpaper info or tag info */
+    BULK,          /**< Background jobs like crawls */
+    PRIORITY_COUNT /**< Number of priority classes, not a priority */
+} Priority;
+
+/**
+ * @brief Token bucket used to keep track of the API call budget of a key
+ *
+ */
+typedef struct
+{
+    double tokens;   /**< @brief Calls that can be made right now */
+    double capacity; /**< @brief Maximum number of calls that can be saved up */
+    double rate;     /**< @brief Calls regained per second */
+    double last;     /**< @brief Time at which tokens was last updated (in seconds of monotonic clock) */
+} RateBudget;
+
+/**
+ * @brief Set up a budget of calls_per_minute, used by the scheduler and the C++ Executor
+ *
+ * @param b Pointer to the RateBudget
+ * @param calls_per_minute API calls allowed per minute (WALLHAVEN_CALLS_PER_MINUTE if 0 or less)
+ */
+void wallhaven_budget_init(RateBudget *b, int calls_per_minute);
+
+/**
+ * @brief Time till the budget has a call
+ *
+ * @param b Pointer to the RateBudget
+ * @return Seconds to wait, 0 if a call can be made right now
+ */
+double wallhaven_budget_wait(RateBudget *b);
+
+/**
+ * @brief Spend a call of the budget
+ *
+ * @param b Pointer to the RateBudget
+ * @return true if the budget had a call, false if nothing was spent
+ */
+bool wallhaven_budget_take(RateBudget *b);
+
+struct ScheduledRequest;
+
+/**
+ * @brief Type of function called when a scheduled request is completed
+ *
+ * @param request The request which is completed, request->code has the result
+ * @param userdata The userdata given in the request
+ */
+typedef void (*onScheduledRequestDone)(struct ScheduledRequest *request, void *userdata);
+
+/**
+ * @brief A request queued in the WallhavenScheduler
+ *
+ * Memory of the request is owned by the caller and must be valid till the request is done.
+ * If neither response nor file is given, response is written to stdout.
+ *
+ */
+typedef struct ScheduledRequest
+{
+    Path path;                     /**< @brief Path to call */
+    const char *id;                /**< @brief Id passed to wallhaven_get_result */
+    Parameters *parameters;        /**< @brief Parameters to use when path is SEARCH */
+    Response *response;            /**< @brief Response to write to */
+    FILE *file;                    /**< @brief File to write to (used if response is NULL) */
+    Priority priority;             /**< @brief Priority class of the request */
+    onScheduledRequestDone done;   /**< @brief Function to call when request is done (can be NULL) */
+    void *userdata;                /**< @brief Passed to the done function */
+    WallhavenCode code;            /**< @brief Result of the request, set before calling done */
+    struct ScheduledRequest *next; /**< @brief Used for internal logic */
+} ScheduledRequest;
+
+/**
+ * @brief An API key along with it's own WallhavenAPI and RateBudget
+ *
+ */
+typedef struct
+{
+    WallhavenAPI *wa;    /**< @brief WallhavenAPI used for the calls made with this key */
+    RateBudget budget;   /**< @brief Call budget of this key */
+    size_t dispatched;   /**< @brief Number of calls made with this key */
+    size_t rate_limited; /**< @brief Number of times this key hit the maximum API call limit */
+} SchedulerKey;
+
+/**
+ * @brief Dispatches queued requests over multiple API keys
+ *
+ * Every key has it's own call budget. Requests are queued by priority class and the classes share
+ * the dispatches by weighted round robin, so bulk jobs can't starve the interactive lookups.
+ * Requests are made one at a time on the calling thread, so an interactive request submitted while a
+ * bulk request is being made still waits for that call to finish.
+ * Use the wallhaven_scheduler_init to get the pointer to this struct.
+ * @note Not supposed to used directly.
+ *
+ */
+typedef struct WallhavenScheduler
+{
+    SchedulerKey *keys;                     /**< @brief Keys added to the scheduler */
+    size_t key_count;                       /**< @brief Number of keys */
+    size_t next_key;                        /**< @brief Key to start looking from for the next dispatch */
+    ScheduledRequest *head[PRIORITY_COUNT]; /**< @brief First request of each priority class */
+    ScheduledRequest *tail[PRIORITY_COUNT]; /**< @brief Last request of each priority class */
+    int weights[PRIORITY_COUNT];            /**< @brief Dispatches given to each class per round */
+    int credits[PRIORITY_COUNT];            /**< @brief Dispatches left for each class in this round */
+} WallhavenScheduler;
+
+/**
+ * @brief Initialize WallhavenScheduler
+ *
+ * By default INTERACTIVE requests get 8 dispatches for every BULK dispatch.
+ *
+ * @return Returns pointer to the WallhavenScheduler if successful else returns NULL
+ */
+WallhavenScheduler *wallhaven_scheduler_init();
+
+/**
+ * @brief Free the WallhavenScheduler and WallhavenAPIs of all the keys
+ *
+ * @note Requests still in the queue are not called back
+ *
+ * @param s Pointer to the WallhavenScheduler
+ */
+void wallhaven_scheduler_free(WallhavenScheduler *s);
+
+/**
+ * @brief Add an API key to the scheduler
+ *
+ * Only a few calls can be made back to back, the rest are spread over the minute.
+ *
+ * @param s Pointer to the WallhavenScheduler
+ * @param apikey API key, NULL to add an anonymous identity (can't be used for requests which need API key)
+ * @param calls_per_minute Budget of the key, 0 to use WALLHAVEN_CALLS_PER_MINUTE
+ * @return WALLHAVEN_OK on success, WALLHAVEN_NO_MEMORY if allocation failed
+ */
+WallhavenCode wallhaven_scheduler_add_key(WallhavenScheduler *s, const char *apikey, int calls_per_minute);
+
+/**
+ * @brief Set how many dispatches a priority class gets in each round
+ *
+ * @param s Pointer to the WallhavenScheduler
+ * @param priority Priority class
+ * @param weight Number of dispatches (minimum 1)
+ */
+void wallhaven_scheduler_set_weight(WallhavenScheduler *s, Priority priority, int weight);
+
+/**
+ * @brief Queue the request
+ *
+ * @param s Pointer to the WallhavenScheduler
+ * @param request Request to queue
+ */
+void wallhaven_scheduler_submit(WallhavenScheduler *s, ScheduledRequest *request);
+
+/**
+ * @brief Dispatch one queued request
+ *
+ * Waits if none of the keys have budget left.
+ * If a key hits the maximum API call limit, it's budget is emptied and the request is queued again.
+ *
+ * @param s Pointer to the WallhavenScheduler
+ * @return Returns true if a request was dispatched, false if nothing could be dispatched
+ */
+bool wallhaven_scheduler_dispatch(WallhavenScheduler *s);
+
+/**
+ * @brief Dispatch the queued requests until nothing can be dispatched
+ *
+ * @param s Pointer to the WallhavenScheduler
+ */
+void wallhaven_scheduler_run(WallhavenScheduler *s);
+
+// Content addressed store
+
+/**
+ * @brief Local store of the downloaded wallpapers
+ *
+ * Wallpapers are stored once by the hash of their content under dir/objects, so the same wallpaper
+ * (or a re-upload with the same content under another id) is never downloaded or written twice.
+ * Which ids are stored is kept in dir/index which is memory mapped, so checking is just a lookup in memory.
+ * Stored wallpapers are made to appear in the job directories with hard links (or reflinks / copies when that fails).
+ * Use the wallhaven_store_open to get the pointer to this struct.
+ *
+ * @note Not supposed to used directly.
+ * @note A store should be used by only one WallhavenStore at a time
+ * @note Not available on Windows
+ *
+ */
+typedef struct WallhavenStore
+{
+    char *dir;         /**< @brief Directory of the store */
+    int index_fd;      /**< @brief Used for internal logic */
+    void *index;       /**< @brief Memory mapped index */
+    size_t index_size; /**< @brief Size of the memory mapped index */
+    size_t max_bytes;  /**< @brief Least recently used wallpapers are removed when the store grows beyond this (0 for no limit) */
+    size_t hits;       /**< @brief Requests served without downloading */
+    size_t downloads;  /**< @brief Wallpapers downloaded */
+    size_t dedup_hits; /**< @brief Downloads which had the same content as a stored wallpaper, so were not stored again */
+    size_t evictions;  /**< @brief Wallpapers removed to stay under max_bytes */
+    size_t deleted;    /**< @brief Used for internal logic */
+} WallhavenStore;
+
+/**
+ * @brief Open the store, creating it if it doesn't exist
+ *
+ * @param dir Directory of the store
+ * @param max_bytes Maximum size of the stored wallpapers, 0 for no limit
+ * @return Returns pointer to the WallhavenStore if successful else returns NULL
+ */
+WallhavenStore *wallhaven_store_open(const char *dir, size_t max_bytes);
+
+/**
+ * @brief Close the store and free the WallhavenStore
+ *
+ * @param s Pointer to the WallhavenStore
+ */
+void wallhaven_store_close(WallhavenStore *s);
+
+/**
+ * @brief Check whether the wallpaper is stored
+ *
+ * @param s Pointer to the WallhavenStore
+ * @param id Id of the wallpaper
+ * @return Returns true if the wallpaper is stored
+ */
+bool wallhaven_store_has(WallhavenStore *s, const char *id);
+
+/**
+ * @brief Get the wallpaper, downloading it only if it's not stored
+ *
+ * @note Resets what wa writes to (look at wallhaven_write_to_response and wallhaven_write_to_file)
+ *
+ * @param s Pointer to the WallhavenStore
+ * @param wa Pointer to the WallhavenAPI used for downloading
+ * @param id Id of the wallpaper (at most 15 characters)
+ * @param url URL to download the wallpaper from (path of the wallpaper)
+ * @param dest Path at which the wallpaper should appear, NULL to just store it
+ * @return WALLHAVEN_OK on success, WALLHAVEN_CURL_FAIL if the server answered with something other than 200 (nothing is stored)
+ */
+WallhavenCode wallhaven_store_get(WallhavenStore *s, WallhavenAPI *wa, const char *id, const char *url, const char *dest);
+
+// Thumbnails
+
+/**
+ * @brief Which thumbnail of the wallpaper
+ *
+ */
+typedef enum
+{
+    SMALL_THUMB,   /**< thumbs.small of the wallpaper */
+    LARGE_THUMB,   /**< thumbs.large of the wallpaper */
+    ORIGINAL_THUMB /**< thumbs.original of the wallpaper */
+} ThumbSize;
+
+/**
+ * @brief Bytes owned by someone else
+ *
+ */
+typedef struct
+{
+    const unsigned char *data; /**< @brief Pointer to the first byte */
+    size_t size;               /**< @brief Number of bytes */
+} Span;
+
+struct ThumbEntry;
+
+/**
+ * @brief Fetches the thumbnails of the search results and keeps them in memory
+ *
+ * All the thumbnails of a page are fetched at once, over a single HTTP/2 connection when the server allows it.
+ * Connections are kept open for the next pages.
+ * Thumbnails are kept as they were downloaded (encoded) and the least recently used ones are removed when max_bytes is crossed.
+ * Use the wallhaven_thumbs_init to get the pointer to this struct.
+ * @note Not supposed to used directly.
+ *
+ */
+typedef struct WallhavenThumbs
+{
+    CURLM *multi;                /**< @brief The curl multi handle used for fetching */
+    struct ThumbEntry **buckets; /**< @brief Used for internal logic */
+    struct ThumbEntry *lru_head; /**< @brief Used for internal logic */
+    struct ThumbEntry *lru_tail; /**< @brief Used for internal logic */
+    size_t max_bytes;            /**< @brief Maximum bytes of thumbnails to keep */
+    size_t bytes;                /**< @brief Bytes of thumbnails kept now */
+    size_t hits;                 /**< @brief Thumbnails which were already in memory */
+    size_t misses;               /**< @brief Thumbnails which had to be fetched */
+    size_t fetched;              /**< @brief Thumbnails fetched successfully */
+    size_t failed;               /**< @brief Thumbnails which couldn't be fetched */
+    size_t evictions;            /**< @brief Thumbnails removed to stay under max_bytes */
+} WallhavenThumbs;
+
+/**
+ * @brief Initialize WallhavenThumbs
+ *
+ * @param max_bytes Maximum bytes of thumbnails to keep in memory
+ * @return Returns pointer to the WallhavenThumbs if successful else returns NULL
+ */
+WallhavenThumbs *wallhaven_thumbs_init(size_t max_bytes);
+
+/**
+ * @brief Free the WallhavenThumbs along with the thumbnails
+ *
+ * @param t Pointer to the WallhavenThumbs
+ */
+void wallhaven_thumbs_free(WallhavenThumbs *t);
+
+/**
+ * @brief Fetch the thumbnails of all the wallpapers in the search result, which are not already in memory
+ *
+ * Returns after all the thumbnails are fetched.
+ * @note Spans got from wallhaven_thumbs_get before this call are not valid anymore
+ *
+ * @param t Pointer to the WallhavenThumbs
+ * @param page Response of wallhaven_search (or any response having the wallpapers in it)
+ * @param size Which thumbnail to fetch
+ * @return WALLHAVEN_OK if all the thumbnails are in memory
+ */
+WallhavenCode wallhaven_thumbs_fetch_page(WallhavenThumbs *t, const Response *page, ThumbSize size);
+
+/**
+ * @brief Get the thumbnail from memory
+ *
+ * @param t Pointer to the WallhavenThumbs
+ * @param id Id of the wallpaper
+ * @param size Which thumbnail
+ * @param span Set to the bytes of the thumbnail, valid till the next wallhaven_thumbs_fetch_page or wallhaven_thumbs_free
+ * @return Returns true if the thumbnail is in memory
+ */
+bool wallhaven_thumbs_get(WallhavenThumbs *t, const char *id, ThumbSize size, Span *span);
+
+// JSON
+
+/**
+ * @brief Index of a JSON document for reading only the needed values
+ *
+ * wallhaven_json_parse finds the positions of all the brackets, colons, commas and quotes outside the strings
+ * (64 bytes at a time using SSE2 or NEON when available) and matches the brackets.
+ * Nothing else is decoded, values are found by following a path like "data[3].id" or "meta.last_page"
+ * and skipping over the values in between.
+ * The text is not copied, it must be valid as long as the index is used.
+ * @note Doesn't validate the JSON fully
+ *
+ */
+typedef struct
+{
+    const char *text;    /**< @brief Text of the JSON */
+    size_t size;         /**< @brief Size of the text */
+    uint32_t *positions; /**< @brief Offsets of the structural characters */
+    uint32_t *matches;   /**< @brief For every opening bracket, index of the matching closing bracket in positions */
+    size_t count;        /**< @brief Number of the structural characters */
+    size_t capacity;     /**< @brief Used for internal logic */
+} WallhavenJson;
+
+/**
+ * @brief Build the index of the JSON text
+ *
+ * @param j Pointer to the WallhavenJson to fill
+ * @param text JSON text (like value of the Response)
+ * @param size Size of the text
+ * @return WALLHAVEN_OK on success, WALLHAVEN_JSON_ERROR if the strings or brackets are not closed properly
+ */
+WallhavenCode wallhaven_json_parse(WallhavenJson *j, const char *text, size_t size);
+
+/**
+ * @brief Free the index
+ *
+ * @param j Pointer to the WallhavenJson
+ */
+void wallhaven_json_free(WallhavenJson *j);
+
+/**
+ * @brief Get the text of the value without copying
+ *
+ * Strings are given without the quotes and with the escapes as they are, objects and arrays along with the brackets.
+ *
+ * @param j Pointer to the WallhavenJson
+ * @param path Path to the value like "data[0].thumbs.small", "" for the whole document
+ * @param value Set to the text of the value
+ * @return Returns true if the value is found
+ */
+bool wallhaven_json_raw(const WallhavenJson *j, const char *path, Span *value);
+
+/**
+ * @brief Copy the string value with the escapes decoded
+ *
+ * @param j Pointer to the WallhavenJson
+ * @param path Path to the value like "data[0].id"
+ * @param out Buffer to copy to, always null terminated when size is not 0
+ * @param size Size of the buffer
+ * @return Length of the decoded string (can be more than size), 0 if not found or not a string (like null)
+ */
+size_t wallhaven_json_string(const WallhavenJson *j, const char *path, char *out, size_t size);
+
+/**
+ * @brief Get the integer value
+ *
+ * @param j Pointer to the WallhavenJson
+ * @param path Path to the value like "meta.last_page"
+ * @param value Set to the value
+ * @return Returns true if the value is found and is a number
+ */
+bool wallhaven_json_long(const WallhavenJson *j, const char *path, long *value);
+
+/**
+ * @brief Number of elements of the array or members of the object
+ *
+ * @param j Pointer to the WallhavenJson
+ * @param path Path to the array or object like "data"
+ * @return Number of elements, 0 if not found
+ */
+size_t wallhaven_json_count(const WallhavenJson *j, const char *path);
+
+// Binary encoding
+
+/**
+ * @brief What the records of the binary encoding are
+ *
+ */
+typedef enum
+{
+    BINARY_WALLPAPERS = 1, /**< Wallpapers from search, wallpaper info or wallpapers of a collection */
+    BINARY_TAGS,           /**< Tag from tag info */
+    BINARY_COLLECTIONS     /**< Collections of a user */
+} BinaryKind;
+
+/**
+ * @brief Flags of the binary encoding
+ *
+ */
+typedef enum
+{
+    BINARY_OBJECT = 1 /**< data of the response was one object (info calls) instead of an array */
+} BinaryFlags;
+
+/**
+ * @brief String in the string table of the binary encoding
+ *
+ * Use wallhaven_binary_string to get the string, which is null terminated.
+ *
+ */
+typedef struct
+{
+    uint32_t offset; /**< @brief Offset from the start of the string table */
+    uint32_t size;   /**< @brief Length of the string */
+} BinaryString;
+
+/**
+ * @brief Start of the binary encoding
+ *
+ * Layout is the header, then count records of record_size bytes, then the string table.
+ * Everything is in little endian and aligned to 8 bytes, so the encoding can be read in place
+ * (from a mmaped file or a socket buffer aligned to 8 bytes) without any parsing.
+ * Newer versions only add fields at the end of the records, so records are always stepped by record_size.
+ *
+ */
+typedef struct
+{
+    uint32_t magic;          /**< @brief "WHVB" */
+    uint8_t version;         /**< @brief Version of the layout */
+    uint8_t flags;           /**< @brief BinaryFlags */
+    uint16_t kind;           /**< @brief BinaryKind of the records */
+    uint32_t count;          /**< @brief Number of records */
+    uint32_t record_size;    /**< @brief Size of each record */
+    uint64_t strings_offset; /**< @brief Offset of the string table from the start of the header */
+    uint64_t strings_size;   /**< @brief Size of the string table */
+} BinaryHeader;
+
+/**
+ * @brief Wallpaper record of the binary encoding
+ *
+ */
+typedef struct
+{
+    BinaryString id;             /**< @brief Id of the wallpaper */
+    BinaryString url;            /**< @brief Link to the wallpaper page */
+    BinaryString short_url;      /**< @brief Short link to the wallpaper page */
+    int64_t views;               /**< @brief Number of views */
+    int64_t favorites;           /**< @brief Number of favorites */
+    BinaryString source;         /**< @brief Source of the wallpaper */
+    BinaryString purity;         /**< @brief sfw, sketchy or nsfw */
+    BinaryString category;       /**< @brief general, anime or people */
+    int64_t dimension_x;         /**< @brief Width */
+    int64_t dimension_y;         /**< @brief Height */
+    BinaryString resolution;     /**< @brief Like 1920x1080 */
+    BinaryString ratio;          /**< @brief Like 1.78 */
+    int64_t file_size;           /**< @brief Size of the wallpaper in bytes */
+    BinaryString file_type;      /**< @brief Like image/jpeg */
+    BinaryString created_at;     /**< @brief Upload time */
+    BinaryString colors;         /**< @brief Colors joined by ',' */
+    BinaryString path;           /**< @brief Link to the full wallpaper */
+    BinaryString thumb_large;    /**< @brief thumbs.large */
+    BinaryString thumb_original; /**< @brief thumbs.original */
+    BinaryString thumb_small;    /**< @brief thumbs.small */
+} BinaryWallpaper;
+
+/**
+ * @brief Tag record of the binary encoding
+ *
+ */
+typedef struct
+{
+    int64_t id;              /**< @brief Id of the tag */
+    BinaryString name;       /**< @brief Name of the tag */
+    BinaryString alias;      /**< @brief Other names of the tag */
+    int64_t category_id;     /**< @brief Id of the category of the tag */
+    BinaryString category;   /**< @brief Category of the tag */
+    BinaryString purity;     /**< @brief Purity of the tag */
+    BinaryString created_at; /**< @brief When the tag was created */
+} BinaryTag;
+
+/**
+ * @brief Collection record of the binary encoding
+ *
+ */
+typedef struct
+{
+    int64_t id;         /**< @brief Id of the collection */
+    BinaryString label; /**< @brief Name of the collection */
+    int64_t views;      /**< @brief Number of views */
+    int64_t public_;    /**< @brief 1 if public */
+    int64_t count;      /**< @brief Number of wallpapers in the collection */
+} BinaryCollection;
+
+/**
+ * @brief Encode the API response to the binary encoding
+ *
+ * @param json Response of the API call
+ * @param kind What the response has
+ * @param out Response to append the encoding to (start of value should be aligned to 8 bytes for reading in place, which malloc does)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_binary_encode(const Response *json, BinaryKind kind, Response *out);
+
+/**
+ * @brief Check the binary encoding before reading it
+ *
+ * All the offsets are checked here, so the records and strings can be read without any more checks.
+ *
+ * @param data Start of the encoding (aligned to 8 bytes)
+ * @param size Bytes available from data
+ * @return Returns pointer to the header if the encoding is valid else returns NULL
+ */
+const BinaryHeader *wallhaven_binary_open(const void *data, size_t size);
+
+/**
+ * @brief Get the wallpaper record
+ *
+ * @param h Header from wallhaven_binary_open
+ * @param i Index of the record
+ * @return Pointer to the record, NULL if out of range or records are not wallpapers
+ */
+const BinaryWallpaper *wallhaven_binary_wallpaper(const BinaryHeader *h, size_t i);
+
+/**
+ * @brief Get the tag record
+ *
+ * @param h Header from wallhaven_binary_open
+ * @param i Index of the record
+ * @return Pointer to the record, NULL if out of range or records are not tags
+ */
+const BinaryTag *wallhaven_binary_tag(const BinaryHeader *h, size_t i);
+
+/**
+ * @brief Get the collection record
+ *
+ * @param h Header from wallhaven_binary_open
+ * @param i Index of the record
+ * @return Pointer to the record, NULL if out of range or records are not collections
+ */
+const BinaryCollection *wallhaven_binary_collection(const BinaryHeader *h, size_t i);
+
+/**
+ * @brief Get the string from the string table
+ *
+ * @param h Header from wallhaven_binary_open
+ * @param s String field of a record
+ * @return Null terminated string (s.size is it's length)
+ */
+const char *wallhaven_binary_string(const BinaryHeader *h, BinaryString s);
+
+/**
+ * @brief Convert the binary encoding back to JSON
+ *
+ * Output has the same shape as the API response ({"data":[...]}, or {"data":{...}} for info calls) with the encoded fields.
+ *
+ * @param h Header from wallhaven_binary_open
+ * @param out Response to append the JSON to
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_binary_to_json(const BinaryHeader *h, Response *out);
+
+// Export
+
+/**
+ * @brief Format of the exported rows
+ *
+ */
+typedef enum
+{
+    NDJSON, /**< One JSON object per line, nested fields flattened (thumbs.small as thumbs_small) */
+    CSV     /**< Comma separated values with a header line, colors separated by spaces */
+} ExportFormat;
+
+/**
+ * @brief Options of wallhaven_export
+ *
+ */
+typedef struct
+{
+    ExportFormat format; /**< @brief Format of the rows */
+    int first_page;      /**< @brief Page to start from (0 for the first page) */
+    int last_page;       /**< @brief Page to stop at (0 for the last page of the search) */
+    int concurrency;     /**< @brief Pages fetched at the same time (0 for one at a time) */
+} ExportOptions;
+
+/**
+ * @brief Search and write every wallpaper of the results as a row
+ *
+ * Pages are fetched concurrently and each page is written as soon as all the pages before it are written,
+ * so rows are in the order of the search results and at most concurrency pages are kept in memory.
+ * Failed pages are retried as told by the RetryPolicy of wa.
+ *
+ * @note page of the Parameters is not used
+ * @note Calls count towards the API call limit, use a shared rate limit (wallhaven_shared_limit_attach) or a small concurrency
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param p Parameters of the search
+ * @param o Options of the export
+ * @param out File to write the rows to, rows of a page are written with a single write
+ * @param rows Set to the number of rows written (can be NULL)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_export(WallhavenAPI *wa, Parameters *p, const ExportOptions *o, FILE *out, size_t *rows);
+
+// Tag autocompletion
+
+/**
+ * @brief Completion of a tag name
+ *
+ */
+typedef struct
+{
+    const char *name; /**< @brief Name of the tag, valid till the index is rebuilt or freed */
+    int64_t id;       /**< @brief Id of the tag (0 if not known) */
+    uint32_t weight;  /**< @brief Popularity of the tag */
+} TagCompletion;
+
+/**
+ * @brief Local dictionary of tag names for prefix completion
+ *
+ * Tags are collected with wallhaven_tags_add and wallhaven_tags_add_response, then wallhaven_tags_build
+ * packs them into a radix trie where every node knows the highest weight below it,
+ * so the top completions are found without looking at every tag having the prefix.
+ * The packed index is a single block which wallhaven_tags_save writes as is and wallhaven_tags_load maps back.
+ * Matching ignores the case of ASCII letters.
+ *
+ */
+typedef struct
+{
+    struct TagSlot *slots; /**< @brief Tags collected (hash table) */
+    size_t slot_capacity;  /**< @brief Capacity of slots */
+    size_t tag_count;      /**< @brief Number of tags collected */
+    void *index;           /**< @brief Packed index, NULL if not built */
+    size_t index_size;     /**< @brief Size of index */
+    bool mapped;           /**< @brief Whether index is a mapped file */
+} WallhavenTags;
+
+/**
+ * @brief Create an empty tag dictionary
+ *
+ * @return Pointer to WallhavenTags, NULL on failure
+ */
+WallhavenTags *wallhaven_tags_init();
+
+/**
+ * @brief Free the tag dictionary
+ *
+ * @param t Pointer to WallhavenTags
+ */
+void wallhaven_tags_free(WallhavenTags *t);
+
+/**
+ * @brief Add a tag, weight of a tag seen before is added to its weight
+ *
+ * @param t Pointer to WallhavenTags
+ * @param name Name of the tag
+ * @param id Id of the tag (0 if not known)
+ * @param weight Popularity to add
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_tags_add(WallhavenTags *t, const char *name, int64_t id, uint32_t weight);
+
+/**
+ * @brief Add the tags of a response, each tag seen adds 1 to its weight
+ *
+ * Takes the tag of TAG_INFO, the tags of WALLPAPER_INFO and the tag of the query of a search by tag id.
+ *
+ * @param t Pointer to WallhavenTags
+ * @param response Response of the API call
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_tags_add_response(WallhavenTags *t, const Response *response);
+
+/**
+ * @brief Add the tags of the current index back, to keep them when rebuilding a loaded index
+ *
+ * @param t Pointer to WallhavenTags
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_tags_merge_index(WallhavenTags *t);
+
+/**
+ * @brief Build the index from the tags collected
+ *
+ * @note Replaces the current index, names from wallhaven_tags_complete are no longer valid
+ *
+ * @param t Pointer to WallhavenTags
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_tags_build(WallhavenTags *t);
+
+/**
+ * @brief Write the index to a file, building it first if not built
+ *
+ * @param t Pointer to WallhavenTags
+ * @param path Path of the file
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_tags_save(WallhavenTags *t, const char *path);
+
+/**
+ * @brief Map the index written by wallhaven_tags_save
+ *
+ * @param path Path of the file
+ * @return Pointer to WallhavenTags, NULL if the file can't be read or is not a valid index
+ */
+WallhavenTags *wallhaven_tags_load(const char *path);
+
+/**
+ * @brief Find the most popular tags starting with the prefix
+ *
+ * @param t Pointer to WallhavenTags
+ * @param prefix Prefix of the name
+ * @param out Array to put the completions in, most popular first
+ * @param k Size of out
+ * @return Number of completions found
+ */
+size_t wallhaven_tags_complete(WallhavenTags *t, const char *prefix, TagCompletion *out, size_t k);
+
+// Near duplicates
+
+/**
+ * @brief Decode an image to 8 bit grayscale
+ *
+ * @param data Encoded image (jpg or png from wallhaven)
+ * @param size Size of data
+ * @param width Set to the width of the image
+ * @param height Set to the height of the image
+ * @param userdata Userdata given to wallhaven_dedup_init
+ * @return width * height pixels allocated with malloc (freed by the library), NULL on failure
+ */
+typedef unsigned char *(*DecodeGray)(const unsigned char *data, size_t size, int *width, int *height, void *userdata);
+
+/**
+ * @brief Finds wallpapers looking the same as ones seen before
+ *
+ * Keeps 64 bit perceptual hashes split into 4 chunks of 16 bits with a table for each chunk,
+ * two hashes within radius bits have a chunk within radius / 4 bits, so a lookup only walks a few short lists.
+ * The library has no image decoder, give one (libjpeg, stb_image, ...) to hash thumbnails.
+ *
+ */
+typedef struct
+{
+    struct DedupEntry *entries; /**< @brief Hashes added */
+    size_t count;               /**< @brief Number of entries */
+    size_t capacity;            /**< @brief Capacity of entries */
+    uint32_t *heads;            /**< @brief First entry of each chunk value of each chunk */
+    int radius;                 /**< @brief Highest Hamming distance of a duplicate */
+    DecodeGray decode;          /**< @brief Image decoder */
+    void *userdata;             /**< @brief Userdata for decode */
+    size_t hashed;              /**< @brief Images hashed */
+    size_t undecodable;         /**< @brief Images decode failed on */
+    size_t duplicates;          /**< @brief Wallpapers filtered out */
+} WallhavenDedup;
+
+/**
+ * @brief Difference hash, each bit tells whether a cell of a 9x8 grid is brighter than the cell on its left
+ *
+ * @param gray 8 bit grayscale pixels
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param stride Bytes from a row to the next
+ * @return The hash
+ */
+uint64_t wallhaven_dhash(const unsigned char *gray, int width, int height, int stride);
+
+/**
+ * @brief Perceptual hash, signs of the lowest 8x8 DCT frequencies of the image shrunk to 32x32 against their median
+ *
+ * Holds up better than wallhaven_dhash against recompression and small crops.
+ *
+ * @param gray 8 bit grayscale pixels
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param stride Bytes from a row to the next
+ * @return The hash
+ */
+uint64_t wallhaven_phash(const unsigned char *gray, int width, int height, int stride);
+
+/**
+ * @brief Highest radius accepted by wallhaven_dedup_init
+ *
+ * The hash is split into 4 chunks of 16 bits and only chunks differing by 0 or 1 bits are looked up,
+ * so two hashes more than 7 bits apart could be missed
+ *
+ */
+#define WALLHAVEN_DEDUP_MAX_RADIUS 7
+
+/**
+ * @brief Create a WallhavenDedup
+ *
+ * @param radius Highest number of differing bits for two images to be the same (0 to WALLHAVEN_DEDUP_MAX_RADIUS, 4 works well with wallhaven_phash)
+ * @param decode Image decoder (NULL if only wallhaven_dedup_add and wallhaven_dedup_find are used)
+ * @param userdata Userdata for decode
+ * @return Pointer to WallhavenDedup, NULL on failure or if radius is out of range
+ */
+WallhavenDedup *wallhaven_dedup_init(int radius, DecodeGray decode, void *userdata);
+
+/**
+ * @brief Free the WallhavenDedup
+ *
+ * @param d Pointer to WallhavenDedup
+ */
+void wallhaven_dedup_free(WallhavenDedup *d);
+
+/**
+ * @brief Add the hash of a wallpaper
+ *
+ * @param d Pointer to WallhavenDedup
+ * @param id Id of the wallpaper
+ * @param hash Hash of the wallpaper
+ * @return WALLHAVEN_OK on success, WALLHAVEN_NO_MEMORY if the entries couldn't grow
+ */
+WallhavenCode wallhaven_dedup_add(WallhavenDedup *d, const char *id, uint64_t hash);
+
+/**
+ * @brief Find the closest wallpaper within the radius
+ *
+ * @param d Pointer to WallhavenDedup
+ * @param hash Hash to look for
+ * @param distance Set to the number of differing bits (can be NULL)
+ * @return Id of the wallpaper, NULL if none
+ */
+const char *wallhaven_dedup_find(WallhavenDedup *d, uint64_t hash, int *distance);
+
+/**
+ * @brief Decode an image and take its wallhaven_phash
+ *
+ * @param d Pointer to WallhavenDedup
+ * @param data Encoded image
+ * @param size Size of data
+ * @param hash Set to the hash
+ * @return WALLHAVEN_OK on success, WALLHAVEN_IO_FAIL if there's no decoder or decode failed
+ */
+WallhavenCode wallhaven_dedup_hash_image(WallhavenDedup *d, const unsigned char *data, size_t size, uint64_t *hash);
+
+/**
+ * @brief Tell which wallpapers of a search page are not duplicates
+ *
+ * Hashes the thumbnails already in t (wallhaven_thumbs_fetch_page), so originals of duplicates are never downloaded.
+ * Wallpapers not seen before are added, ones without a thumbnail in t are kept.
+ *
+ * @param d Pointer to WallhavenDedup
+ * @param t Thumbnails of the page
+ * @param page Response of wallhaven_search
+ * @param size Size of the thumbnails to use
+ * @param keep Set to whether to keep each wallpaper of the page, in order
+ * @param capacity Size of keep
+ * @param count Set to the number of wallpapers looked at (can be NULL)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_dedup_filter_page(WallhavenDedup *d, WallhavenThumbs *t, const Response *page, ThumbSize size, bool *keep, size_t capacity, size_t *count);
+
+// File sink
+
+/**
+ * @brief Options of wallhaven_sink_init, fields left 0 take the default
+ *
+ */
+typedef struct
+{
+    size_t chunk_size;     /**< @brief Bytes gathered before a write (default 256 KiB) */
+    unsigned queue_depth;  /**< @brief Writes in flight before the network waits for the disk (default 64) */
+    unsigned batch;        /**< @brief Writes handed to io_uring with one system call (default 8) */
+    int threads;           /**< @brief Threads doing pwrite when io_uring is not used (default 4) */
+    bool disable_io_uring; /**< @brief Always use the threads */
+} SinkOptions;
+
+/**
+ * @brief Writes downloads to disk in the background
+ *
+ * Received data is gathered into chunks which are written with io_uring on Linux,
+ * or by a small pool of threads doing pwrite when io_uring is not there (older kernels, seccomp, macOS).
+ * The transfer goes on while the chunks are being written, memory is bounded by chunk_size * queue_depth.
+ *
+ * @note A WallhavenSink and its files are to be used from one thread
+ *
+ */
+typedef struct
+{
+    struct SinkRing *ring; /**< @brief io_uring, NULL if using the threads */
+    struct SinkPool *pool; /**< @brief Threads, NULL if using io_uring */
+    size_t chunk_size;     /**< @brief Bytes gathered before a write */
+    unsigned queue_depth;  /**< @brief Highest number of writes in flight */
+    unsigned batch;        /**< @brief Writes handed over together */
+    unsigned inflight;     /**< @brief Writes in flight */
+    unsigned unsubmitted;  /**< @brief Writes queued but not yet handed to the kernel */
+    size_t writes;         /**< @brief Writes done */
+    size_t bytes;          /**< @brief Bytes written */
+    size_t batches;        /**< @brief System calls submitting writes */
+    size_t stalls;         /**< @brief Times the network had to wait for the disk */
+    size_t preallocated;   /**< @brief Files preallocated */
+} WallhavenSink;
+
+/**
+ * @brief A file being written through a WallhavenSink
+ *
+ */
+typedef struct WallhavenSinkFile
+{
+    WallhavenSink *sink;   /**< @brief Sink of the file */
+    int fd;                /**< @brief File descriptor */
+    int64_t offset;        /**< @brief Bytes received */
+    unsigned char *buffer; /**< @brief Chunk being gathered */
+    size_t buffered;       /**< @brief Bytes in buffer */
+    int64_t buffer_offset; /**< @brief Offset of buffer in the file */
+    unsigned inflight;     /**< @brief Writes of the file in flight */
+    int error;             /**< @brief errno of the first failed write, 0 if none */
+} WallhavenSinkFile;
+
+/**
+ * @brief Create a WallhavenSink
+ *
+ * @param o Options (NULL for the defaults)
+ * @return Pointer to WallhavenSink, NULL on failure (always NULL on Windows)
+ */
+WallhavenSink *wallhaven_sink_init(const SinkOptions *o);
+
+/**
+ * @brief Wait for the writes in flight and free the WallhavenSink
+ *
+ * @note Close the files before
+ *
+ * @param s Pointer to WallhavenSink
+ */
+void wallhaven_sink_free(WallhavenSink *s);
+
+/**
+ * @brief Open (create or truncate) a file to write through the sink
+ *
+ * @param s Pointer to WallhavenSink
+ * @param path Path of the file
+ * @param expected_size Size to preallocate, like file_size of the wallpaper (0 if not known)
+ * @return Pointer to WallhavenSinkFile, NULL on failure
+ */
+WallhavenSinkFile *wallhaven_sink_open(WallhavenSink *s, const char *path, int64_t expected_size);
+
+/**
+ * @brief Write what is left, wait for the writes of the file and close it
+ *
+ * @param f Pointer to WallhavenSinkFile, freed
+ * @return WALLHAVEN_OK if every write succeeded
+ */
+WallhavenCode wallhaven_sink_close(WallhavenSinkFile *f);
+
+/**
+ * @brief Tell whether the sink writes with io_uring
+ *
+ * @param s Pointer to WallhavenSink
+ * @return true if using io_uring, false if using the threads
+ */
+bool wallhaven_sink_uses_io_uring(const WallhavenSink *s);
+
+/**
+ * @brief Write the response of API call or download to a sink file
+ *
+ * Like wallhaven_write_to_file but the disk writes don't hold up the transfer.
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param f File to write to
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_write_to_sink(WallhavenAPI *wa, WallhavenSinkFile *f);
+
+// Prewarm
+
+/**
+ * @brief How far wallhaven_prewarm has got
+ *
+ */
+typedef enum
+{
+    PREWARM_NONE,    /**< wallhaven_prewarm was not called */
+    PREWARM_RUNNING, /**< Connections are being opened */
+    PREWARM_READY,   /**< At least one connection is open, the calls to its host skip DNS, TCP and TLS */
+    PREWARM_FAILED   /**< No connection could be opened, calls open their own like without prewarm */
+} PrewarmState;
+
+/**
+ * @brief Open the connections to wallhaven.cc and w.wallhaven.cc in the background
+ *
+ * The connections and TLS sessions are shared with wa, so the first call reuses a ready connection.
+ * When cache_path is given the addresses found are saved there and used by the next prewarm for an hour,
+ * which saves the DNS lookup of short lived processes. Saved addresses are only used to open these connections,
+ * calls which need a new connection look the host up themselves.
+ *
+ * @note The TLS session itself is not saved to disk as libcurl has no stable way to export it
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param cache_path File to keep the addresses in (can be NULL)
+ * @return WALLHAVEN_OK if started (always WALLHAVEN_CURL_FAIL on Windows)
+ */
+WallhavenCode wallhaven_prewarm(WallhavenAPI *wa, const char *cache_path);
+
+/**
+ * @brief initialize WallhavenAPI and call wallhaven_prewarm
+ *
+ * @param cache_path Passed to wallhaven_prewarm (can be NULL)
+ * @return Returns pointer to the WallhavenAPI if successful else returns NULL
+ */
+WallhavenAPI *wallhaven_init_prewarmed(const char *cache_path);
+
+/**
+ * @brief Get the state of the prewarm without waiting
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @return State of the prewarm
+ */
+PrewarmState wallhaven_prewarm_state(WallhavenAPI *wa);
+
+/**
+ * @brief Wait for the prewarm to finish
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param timeout_ms Longest time to wait
+ * @return State of the prewarm, PREWARM_RUNNING if timed out
+ */
+PrewarmState wallhaven_prewarm_wait(WallhavenAPI *wa, long timeout_ms);
+
+// Response cache
+
+/**
+ * @brief Cache of wallhaven_wallpaper_info and wallhaven_tag_info, with speculative prefetch
+ *
+ * Set with wallhaven_set_cache, the calls are then answered from the cache when they can be
+ * (only when writing to a Response or a file). wallhaven_prefetch fetches the info of the top results of a search
+ * in the background so that opening one of them needs no call.
+ *
+ */
+typedef struct WallhavenCache
+{
+    struct CacheEntry **buckets;  /**< @brief Hash table of the entries */
+    size_t bucket_count;          /**< @brief Number of buckets (power of 2) */
+    struct CacheEntry *lru_head;  /**< @brief Most recently used entry */
+    struct CacheEntry *lru_tail;  /**< @brief Least recently used entry */
+    size_t count;                 /**< @brief Number of entries */
+    size_t max_entries;           /**< @brief Entries kept before evicting the least recently used */
+    int ttl_seconds;              /**< @brief Age after which an entry is fetched again (0 for never) */
+    CURLM *multi;                 /**< @brief Prefetches in flight */
+    int prefetching;              /**< @brief Number of prefetches in flight */
+    int prefetch_reserve;         /**< @brief Calls of the rate limit kept for the calls asked for (default 10) */
+    double paused_until;          /**< @brief No prefetch till then, set when a prefetch got 429 */
+    double window_start;          /**< @brief Used for internal logic */
+    size_t window_attempts;       /**< @brief Used for internal logic */
+    size_t window_prefetches;     /**< @brief Used for internal logic */
+    size_t hits;                  /**< @brief Calls answered from the cache */
+    size_t misses;                /**< @brief Calls not in the cache */
+    size_t prefetched;            /**< @brief Prefetches started */
+    size_t prefetch_failed;       /**< @brief Prefetches which failed */
+    size_t prefetch_hits;         /**< @brief Prefetched entries which were asked for */
+    size_t prefetch_wasted;       /**< @brief Prefetched entries evicted or expired without being asked for */
+    size_t budget_skipped;        /**< @brief Prefetches not made for lack of spare rate limit */
+} WallhavenCache;
+
+/**
+ * @brief Create a WallhavenCache
+ *
+ * @param max_entries Highest number of entries
+ * @param ttl_seconds Age after which an entry is fetched again (0 for never)
+ * @return Pointer to WallhavenCache, NULL on failure
+ */
+WallhavenCache *wallhaven_cache_init(size_t max_entries, int ttl_seconds);
+
+/**
+ * @brief Free the WallhavenCache, cancelling the prefetches in flight
+ *
+ * @param c Pointer to WallhavenCache
+ */
+void wallhaven_cache_free(WallhavenCache *c);
+
+/**
+ * @brief Use a cache for the info calls of wa
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param c Pointer to WallhavenCache (NULL to stop caching)
+ */
+void wallhaven_set_cache(WallhavenAPI *wa, WallhavenCache *c);
+
+/**
+ * @brief Append the cached response of the info call to out, for calls made some other way
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param p WALLPAPER_INFO or TAG_INFO
+ * @param id Id of the wallpaper or tag
+ * @param out Response to append to
+ * @return Returns true if the response was in the cache of wa
+ */
+bool wallhaven_cache_get(WallhavenAPI *wa, Path p, const char *id, Response *out);
+
+/**
+ * @brief Add the response of an info call made some other way to the cache of wa
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param p WALLPAPER_INFO or TAG_INFO
+ * @param id Id of the wallpaper or tag
+ * @param body Body of the 200 response
+ */
+void wallhaven_cache_put(WallhavenAPI *wa, Path p, const char *id, const Response *body);
+
+/**
+ * @brief Start fetching the info of the top results of a search into the cache
+ *
+ * Only spends spare rate limit: prefetches stop when fewer than prefetch_reserve calls are left
+ * (from the X-RateLimit-Remaining of the last response, or counted locally), when the shared rate limit has no free slot,
+ * or for a while after a 429. Returns without waiting.
+ *
+ * There is no background thread: the prefetches only move on while wa makes a call or wallhaven_prefetch_poll is called,
+ * so call wallhaven_prefetch_poll from the event loop (like every 100 ms) while wa is otherwise idle.
+ * Asking for a wallpaper being prefetched waits up to 2 seconds for the prefetch, then makes its own call.
+ * Prefetches taking more than 15 seconds are given up.
+ *
+ * Tune top_n with the prefetch_hits, prefetch_wasted and budget_skipped of the cache.
+ *
+ * @param wa Pointer to the WallhavenAPI, cache should be set
+ * @param search Response of wallhaven_search
+ * @param top_n Number of results from the top to prefetch
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_prefetch(WallhavenAPI *wa, const Response *search, int top_n);
+
+/**
+ * @brief Move the prefetches along without waiting
+ *
+ * Needs to be called regularly while wa makes no calls, else the prefetches don't progress.
+ *
+ * @param wa Pointer to the WallhavenAPI
+ */
+void wallhaven_prefetch_poll(WallhavenAPI *wa);
+
+// Tracing
+
+/**
+ * @brief Start recording spans of the calls
+ *
+ * Every thread records into its own ring buffer, no locks are taken and the oldest events are overwritten.
+ * The ring of a thread which exited is taken over by the next thread which traces, so the memory used
+ * follows the number of threads tracing at once, not the number of threads ever made.
+ * Spans cover the whole call (request, download, cache_hit), query building (format), waits for the rate limit
+ * (rate_limit_wait, backoff), each attempt along with its dns, tcp, tls, wait and transfer phases, and the callbacks.
+ * When not tracing each span costs one atomic load.
+ *
+ * @param events_per_thread Size of the ring buffers created from now on (rounded up to a power of 2)
+ */
+void wallhaven_trace_start(size_t events_per_thread);
+
+/**
+ * @brief Stop recording, the events recorded are kept
+ *
+ */
+void wallhaven_trace_stop();
+
+/**
+ * @brief Drop the events recorded, threads can keep making calls
+ *
+ */
+void wallhaven_trace_clear();
+
+/**
+ * @brief Write the events recorded in the Chrome trace event format
+ *
+ * Open the file with chrome://tracing or https://ui.perfetto.dev
+ *
+ * @note Call when no thread is making calls, events being written are not waited for
+ *
+ * @param out File to write to
+ * @return WALLHAVEN_OK on success (always WALLHAVEN_IO_FAIL on Windows)
+ */
+WallhavenCode wallhaven_trace_dump(FILE *out);
+
+// URLs
+
+/**
+ * @brief Get the URL wallhaven_get_result would call, to make the call some other way (like wallhavenapi.hpp does)
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param p Path to set
+ * @param id Wallpaper id or tag id or similar things to append after the path
+ * @return The URL, free with curl_free, NULL on failure
+ */
+char *wallhaven_call_url(WallhavenAPI *wa, Path p, const char *id);
+
+/**
+ * @brief Get the URL wallhaven_search would call
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param p Parameters of the search
+ * @return The URL, free with curl_free, NULL on failure
+ */
+char *wallhaven_search_url(WallhavenAPI *wa, Parameters *p);
+
+/**
+ * @brief Take a slot for a call made with the URL some other way, without waiting
+ *
+ * Checks the circuit breaker and takes a slot from the shared limit of wa, like the calls of wa do.
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @return WALLHAVEN_OK if the call can be made now, WALLHAVEN_CIRCUIT_OPEN if the circuit breaker is open,
+ * WALLHAVEN_TOO_MANY_REQUSTS_ERROR if the shared limit has no slot free right now (try again a bit later)
+ */
+WallhavenCode wallhaven_call_acquire(WallhavenAPI *wa);
+
+/**
+ * @brief Account for a call made with the URL some other way and decide on a retry, like the calls of wa
+ *
+ * Updates the stats, retry budget and circuit breaker of wa, and holds back the shared limit on a 429.
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param curl Handle of the finished transfer
+ * @param result Result of the transfer
+ * @param attempt Retries made so far
+ * @param retry_ms Set to the time to wait before making the call again, -1 if it isn't to be retried
+ * @return What the call of wa would have returned for this attempt
+ */
+WallhavenCode wallhaven_call_finish(WallhavenAPI *wa, CURL *curl, CURLcode result, int attempt, long *retry_ms);
+
+// Record and replay
+
+/**
+ * @brief Log the API calls are recorded to
+ *
+ * Every call of wallhaven_get_result (and the functions using it) which goes to the network is appended
+ * with the path and query (apikey removed), when it was made, how long it took, the status code, the rate limit headers
+ * and the body (only when writing to a Response). Calls answered by a cache and downloads are not recorded.
+ * A recorder can be shared by WallhavenAPIs of different threads.
+ *
+ */
+typedef struct WallhavenRecorder
+{
+    FILE *file;     /**< @brief Log file */
+    double start;   /**< @brief When the recording started, times in the log are from here */
+    size_t records; /**< @brief Calls recorded */
+    size_t bytes;   /**< @brief Size of the log */
+    bool failed;    /**< @brief A write to the log failed, the log ends at the last complete record */
+} WallhavenRecorder;
+
+/**
+ * @brief Start recording to a new log
+ *
+ * @param path Path of the log, overwritten if exists
+ * @return Pointer to WallhavenRecorder, NULL on failure
+ */
+WallhavenRecorder *wallhaven_recorder_open(const char *path);
+
+/**
+ * @brief Finish the log and free the WallhavenRecorder
+ *
+ * @param r Pointer to WallhavenRecorder, no WallhavenAPI should be recording to it
+ * @return WALLHAVEN_OK if the whole log was written
+ */
+WallhavenCode wallhaven_recorder_close(WallhavenRecorder *r);
+
+/**
+ * @brief Record the calls of wa
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param r Pointer to WallhavenRecorder (NULL to stop recording)
+ */
+void wallhaven_set_recorder(WallhavenAPI *wa, WallhavenRecorder *r);
+
+/**
+ * @brief Send the calls somewhere other than https://wallhaven.cc, like the stand-in of wallhaven_replay_serve
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param base_url Scheme, host and port (like http://127.0.0.1:8080)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_base_url(WallhavenAPI *wa, const char *base_url);
+
+/**
+ * @brief Recorded log loaded for replaying
+ *
+ */
+typedef struct WallhavenReplay
+{
+    unsigned char *log;           /**< @brief Content of the log */
+    size_t log_size;              /**< @brief Size of the log */
+    struct ReplayEntry *entries;  /**< @brief Recorded calls sorted by when they were made */
+    size_t count;                 /**< @brief Number of recorded calls */
+    struct ReplayTarget *targets; /**< @brief Hash table of the different paths and queries */
+    size_t target_capacity;       /**< @brief Number of slots of targets (power of 2) */
+    double duration;              /**< @brief Seconds from the first call to the last call of the recording */
+    struct ReplayServer *server;  /**< @brief Stand-in serving the log, NULL if not serving */
+    int port;                     /**< @brief Port of the stand-in */
+    char base_url[32];            /**< @brief Base URL of the stand-in, to give to wallhaven_base_url */
+} WallhavenReplay;
+
+/**
+ * @brief Options of wallhaven_replay_run
+ *
+ */
+typedef struct
+{
+    int clients;                                                 /**< @brief Threads making the calls, each with its own WallhavenAPI (default 1) */
+    double speed;                                                /**< @brief 1 for the recorded timing, 10 for ten times faster, 0 for as fast as possible */
+    void (*setup)(WallhavenAPI *wa, int client, void *userdata); /**< @brief Called for each client before the calls to set cache, retry policy, shared limit... (can be NULL) */
+    void *userdata;                                              /**< @brief Passed to setup */
+} ReplayOptions;
+
+/**
+ * @brief What happened in wallhaven_replay_run
+ *
+ */
+typedef struct
+{
+    size_t requests;         /**< @brief Calls made */
+    size_t failed;           /**< @brief Calls which didn't give WALLHAVEN_OK */
+    size_t served;           /**< @brief Requests which reached the stand-in, calls answered by a cache don't */
+    size_t rate_limited;     /**< @brief 429s seen by the clients */
+    size_t retries;          /**< @brief Retries made by the clients */
+    double seconds;          /**< @brief Time taken */
+    double calls_per_second; /**< @brief Calls made per second */
+    double latency_p50_ms;   /**< @brief Median time taken by a call */
+    double latency_p99_ms;   /**< @brief 99th percentile of the time taken by a call */
+    double latency_max_ms;   /**< @brief Longest time taken by a call */
+    double lag_max_ms;       /**< @brief Most a call started behind its schedule, grows when the clients can't keep up */
+} ReplayReport;
+
+/**
+ * @brief Load a log written by a WallhavenRecorder
+ *
+ * @param path Path of the log
+ * @return Pointer to WallhavenReplay, NULL on failure or if the log is not valid
+ */
+WallhavenReplay *wallhaven_replay_open(const char *path);
+
+/**
+ * @brief Stop the stand-in if serving and free the WallhavenReplay
+ *
+ * @param rp Pointer to WallhavenReplay
+ */
+void wallhaven_replay_close(WallhavenReplay *rp);
+
+/**
+ * @brief Serve the log over HTTP on 127.0.0.1 from background threads
+ *
+ * A request is answered with the recorded response of the same path and query (apikey ignored),
+ * in the recorded order when the same call was recorded more than once (starting over after the last one).
+ * Each response is sent after the recorded duration divided by speed. Recorded failures close the connection.
+ *
+ * @param rp Pointer to WallhavenReplay
+ * @param port Port to listen on, 0 for any free port (look at port and base_url)
+ * @param speed Divides the recorded durations, 0 to answer right away
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_replay_serve(WallhavenReplay *rp, int port, double speed);
+
+/**
+ * @brief Make the recorded calls again against the stand-in with concurrent clients
+ *
+ * Starts the stand-in on a free port with the speed of the options if not serving already. The calls are spread over the clients
+ * and each call is started at its recorded time divided by speed. Calls go through wallhaven_get_result
+ * so that the cache, rate limits and retry policy set up by setup are measured.
+ * Clients are given the apikey "replay" before setup so that the calls needing a key can be made.
+ *
+ * @param rp Pointer to WallhavenReplay
+ * @param o Options (NULL for one client at the recorded speed)
+ * @param report Filled with what happened (can be NULL)
+ * @return WALLHAVEN_OK if the clients could be run and made the calls, WALLHAVEN_CURL_FAIL if no call could be made
+ */
+WallhavenCode wallhaven_replay_run(WallhavenReplay *rp, const ReplayOptions *o, ReplayReport *report);
+
+// Watcher
+
+/**
+ * @brief Type of function called for each new wallpaper found by a WallhavenWatch
+ *
+ * @param id Id of the wallpaper
+ * @param wallpaper JSON object of the wallpaper as in the search response, valid only during the call
+ * @param userdata The userdata given to wallhaven_watch
+ */
+typedef void (*onNewWallpaper)(const char *id, Span wallpaper, void *userdata);
+
+/**
+ * @brief Options of a WallhavenWatcher
+ *
+ */
+typedef struct
+{
+    double min_interval;   /**< @brief Shortest time between two polls of a watch in seconds (default 60) */
+    double max_interval;   /**< @brief Longest time between two polls of a watch in seconds (default 3600) */
+    double target_new;     /**< @brief New wallpapers a poll should find, less than a page so that a poll is one call (default 12) */
+    int max_pages;         /**< @brief Pages read in a poll at most, older new wallpapers are missed (default 5) */
+    int calls_per_minute;  /**< @brief Part of the API call limit the watcher can use (default 10) */
+    int ratelimit_reserve; /**< @brief Polls wait for the next minute when fewer calls than this are left (default 5) */
+} WatcherOptions;
+
+#define WATCH_TIES 24 /**< @brief Ids remembered at the high-water mark, for uploads made in the same second */
+
+/**
+ * @brief A saved search followed by a WallhavenWatcher
+ *
+ * The search is made sorted by DATE_ADDED newest first. The high-water mark is the upload time of the newest wallpaper seen
+ * (with the ids uploaded in that second). A poll reads pages till it reaches the mark, so usually a poll is a single call,
+ * and the wallpapers above the mark are given to the callback oldest first.
+ * The first poll only sets the mark, set high_water (and the ties) from a saved watch to pick up from there.
+ *
+ */
+typedef struct WallhavenWatch
+{
+    Parameters parameters;     /**< @brief Copy of the search, page, sorting and order are set by the watcher */
+    onNewWallpaper callback;   /**< @brief Called for the new wallpapers */
+    void *userdata;            /**< @brief Passed to callback */
+    char high_water[20];       /**< @brief created_at of the newest wallpaper seen (like 2024-05-18 10:00:00), empty before the first poll */
+    char ties[WATCH_TIES][16]; /**< @brief Ids seen which were created at high_water */
+    int tie_count;             /**< @brief Number of ties */
+    double interval;           /**< @brief Seconds till the next poll after a poll */
+    double next_poll;          /**< @brief When the next poll is due (in seconds of monotonic clock) */
+    double last_poll;          /**< @brief When the last poll was made, 0 if never */
+    double upload_rate;        /**< @brief Average new wallpapers per second seen by the polls */
+    size_t polls;              /**< @brief Polls made */
+    size_t calls;              /**< @brief Search calls made */
+    size_t delivered;          /**< @brief Wallpapers given to the callback */
+    size_t missed;             /**< @brief Polls which stopped at max_pages before reaching the mark */
+    size_t failed;             /**< @brief Polls which failed, tried again at the next poll */
+} WallhavenWatch;
+
+/**
+ * @brief Polls saved searches for new uploads with a shared WallhavenAPI
+ *
+ */
+typedef struct WallhavenWatcher
+{
+    WallhavenAPI *wa;         /**< @brief WallhavenAPI to make the calls with */
+    WatcherOptions options;   /**< @brief Options */
+    WallhavenWatch **watches; /**< @brief Watches */
+    size_t count;             /**< @brief Number of watches */
+    size_t capacity;          /**< @brief Number of watches there is space for */
+    Response *pages;          /**< @brief Used for internal logic */
+    WallhavenJson *json;      /**< @brief Used for internal logic */
+} WallhavenWatcher;
+
+/**
+ * @brief Create a WallhavenWatcher
+ *
+ * @param wa WallhavenAPI to make the calls with (the watcher sets what it writes to before each call)
+ * @param o Options (NULL for the defaults, 0 in a field for its default)
+ * @return Pointer to WallhavenWatcher, NULL on failure
+ */
+WallhavenWatcher *wallhaven_watcher_init(WallhavenAPI *wa, const WatcherOptions *o);
+
+/**
+ * @brief Free the WallhavenWatcher and its watches
+ *
+ * @param w Pointer to WallhavenWatcher
+ */
+void wallhaven_watcher_free(WallhavenWatcher *w);
+
+/**
+ * @brief Start watching a search for new uploads
+ *
+ * @param w Pointer to WallhavenWatcher
+ * @param p Parameters of the search (copied, the Query and the strings must stay valid while watching)
+ * @param callback Called for each new wallpaper
+ * @param userdata Passed to callback
+ * @return The watch, owned by the watcher. NULL on failure
+ */
+WallhavenWatch *wallhaven_watch(WallhavenWatcher *w, const Parameters *p, onNewWallpaper callback, void *userdata);
+
+/**
+ * @brief Stop watching and free the watch
+ *
+ * @note Not from a callback of the watcher
+ *
+ * @param w Pointer to WallhavenWatcher
+ * @param watch Watch returned by wallhaven_watch
+ */
+void wallhaven_unwatch(WallhavenWatcher *w, WallhavenWatch *watch);
+
+/**
+ * @brief Poll the watches which are due
+ *
+ * After each poll the interval of the watch is set from the upload rate seen so that the next poll finds about target_new wallpapers,
+ * kept between min_interval and max_interval and long enough for all the watches to fit in calls_per_minute.
+ *
+ * @param w Pointer to WallhavenWatcher
+ * @return Seconds till the next watch is due
+ */
+double wallhaven_watcher_poll(WallhavenWatcher *w);
+
+/**
+ * @brief Poll the watches as they become due till stop is set
+ *
+ * @param w Pointer to WallhavenWatcher
+ * @param stop Checked at least every second, set it (from a callback, another thread or a signal handler) to return
+ */
+void wallhaven_watcher_run(WallhavenWatcher *w, volatile bool *stop);
+
+// Resize
+
+/**
+ * @brief Decode an image to 8 bit RGBA
+ *
+ * @param data Encoded image (jpg or png from wallhaven)
+ * @param size Size of data
+ * @param width Set to the width of the image
+ * @param height Set to the height of the image
+ * @param userdata Userdata given in ResizeOptions
+ * @return width * height * 4 bytes allocated with malloc (freed by the library), NULL on failure
+ */
+typedef unsigned char *(*DecodeRGBA)(const unsigned char *data, size_t size, int *width, int *height, void *userdata);
+
+struct ResizeTarget;
+
+/**
+ * @brief Encode and store a variant
+ *
+ * Called from the worker threads, at the same time for different variants.
+ *
+ * @param rgba 8 bit RGBA pixels of the variant
+ * @param width Width of the variant
+ * @param height Height of the variant
+ * @param id Id given to wallhaven_resize
+ * @param target Target the variant is made for
+ * @param userdata Userdata given in ResizeOptions
+ * @return true on success
+ */
+typedef bool (*EncodeRGBA)(const unsigned char *rgba, int width, int height, const char *id, const struct ResizeTarget *target,
+                           void *userdata);
+
+/**
+ * @brief Variant to make of every image
+ *
+ * The image is cropped around the center to the ratio, then resized to width x height.
+ * With only the ratio the crop is kept at its size, with only width and height the ratio is width:height.
+ *
+ */
+typedef struct ResizeTarget
+{
+    int width;        /**< @brief Width of the variant, 0 to take it from height and the ratio */
+    int height;       /**< @brief Height of the variant, 0 to take it from width and the ratio */
+    int ratio_width;  /**< @brief Ratio to crop to (16 of 16x9), 0 for width:height */
+    int ratio_height; /**< @brief Ratio to crop to (9 of 16x9), 0 for width:height */
+    char name[24];    /**< @brief Name of the variant like 1920x1080 or 16x9, for the encoder to name the file */
+} ResizeTarget;
+
+/**
+ * @brief Options of a WallhavenResizer
+ *
+ */
+typedef struct
+{
+    DecodeRGBA decode; /**< @brief Image decoder */
+    EncodeRGBA encode; /**< @brief Variant encoder */
+    void *userdata;    /**< @brief Passed to decode and encode */
+    int threads;       /**< @brief Worker threads (default 4) */
+    int max_images;    /**< @brief Images waiting or being worked on at most, wallhaven_resize waits when reached (default 2 * threads) */
+    bool upscale;      /**< @brief Make variants bigger than the crop too, by default they are skipped (like atleast) */
+} ResizeOptions;
+
+/**
+ * @brief Makes the variants of the downloaded images with a pool of worker threads
+ *
+ * Each image is decoded once and its variants are made in parallel. Variants of the images taken first are made first,
+ * so at most max_images decoded images are in memory.
+ *
+ */
+typedef struct WallhavenResizer
+{
+    ResizeOptions options;   /**< @brief Options */
+    ResizeTarget *targets;   /**< @brief Variants to make */
+    size_t target_count;     /**< @brief Number of targets */
+    struct ResizePool *pool; /**< @brief Workers and the images being worked on */
+    size_t images;           /**< @brief Images decoded */
+    size_t variants;         /**< @brief Variants made */
+    size_t skipped;          /**< @brief Variants not made as the image was too small */
+    size_t decode_failed;    /**< @brief Images which could not be decoded */
+    size_t encode_failed;    /**< @brief Variants the encoder failed on */
+} WallhavenResizer;
+
+/**
+ * @brief Make targets from the resolutions and ratios of Parameters
+ *
+ * Every resolution (like "1920x1080,2560x1440") becomes a variant of that size and every ratio (like "16x9,9x16")
+ * a crop to that ratio.
+ *
+ * @param resolutions Resolutions separated by ',' (can be NULL)
+ * @param ratios Ratios separated by ',' (can be NULL)
+ * @param targets Targets to fill
+ * @param capacity Number of targets there is space for
+ * @return Number of targets filled
+ */
+size_t wallhaven_resize_targets(const char *resolutions, const char *ratios, ResizeTarget *targets, size_t capacity);
+
+/**
+ * @brief Resize an 8 bit RGBA image, with a triangle filter wide enough to average every source pixel when shrinking
+ *
+ * @param src Pixels of the source
+ * @param src_width Width of the source
+ * @param src_height Height of the source
+ * @param src_stride Bytes from a row to the next of the source
+ * @param dst Pixels of the result (dst_width * dst_height * 4 bytes)
+ * @param dst_width Width of the result
+ * @param dst_height Height of the result
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_resize_rgba(const unsigned char *src, int src_width, int src_height, int src_stride, unsigned char *dst,
+                                    int dst_width, int dst_height);
+
+/**
+ * @brief Create a WallhavenResizer and start its workers
+ *
+ * @param o Options, decode and encode are needed
+ * @param targets Variants to make (copied)
+ * @param count Number of targets
+ * @return Pointer to WallhavenResizer, NULL on failure
+ */
+WallhavenResizer *wallhaven_resizer_init(const ResizeOptions *o, const ResizeTarget *targets, size_t count);
+
+/**
+ * @brief Finish the images taken, stop the workers and free the WallhavenResizer
+ *
+ * @param r Pointer to WallhavenResizer
+ */
+void wallhaven_resizer_free(WallhavenResizer *r);
+
+/**
+ * @brief Queue an image to make the variants of
+ *
+ * Waits while max_images images are being worked on.
+ *
+ * @param r Pointer to WallhavenResizer
+ * @param id Id of the wallpaper, passed to the encoder (copied)
+ * @param data Encoded image allocated with malloc, the resizer frees it
+ * @param size Size of data
+ * @return WALLHAVEN_OK if queued, data is freed on failure too
+ */
+WallhavenCode wallhaven_resize(WallhavenResizer *r, const char *id, unsigned char *data, size_t size);
+
+/**
+ * @brief Download a wallpaper into memory and queue it to make the variants of
+ *
+ * @param r Pointer to WallhavenResizer
+ * @param wa WallhavenAPI to download with (what it writes to is set by this function)
+ * @param id Id of the wallpaper, passed to the encoder
+ * @param url URL of the wallpaper (path of the wallpaper info)
+ * @param original Sink file to save the original to while downloading, NULL to not save it
+ * @return WALLHAVEN_OK if downloaded and queued
+ */
+WallhavenCode wallhaven_download_resized(WallhavenResizer *r, WallhavenAPI *wa, const char *id, const char *url, WallhavenSinkFile *original);
+
+/**
+ * @brief Wait till every image queued is done
+ *
+ * @param r Pointer to WallhavenResizer
+ */
+void wallhaven_resizer_wait(WallhavenResizer *r);
+
+// Random pool
+
+/**
+ * @brief Options of a WallhavenPool
+ *
+ */
+typedef struct
+{
+    int capacity;         /**< @brief Wallpapers kept at most (default 96, 4 pages) */
+    int low_watermark;    /**< @brief Refill starts when fewer are left (default capacity / 4) */
+    const char *apikey;   /**< @brief API key of the refill calls, must stay valid (can be NULL) */
+    int max_pages;        /**< @brief Pages read with one seed before taking a new one (default 10) */
+    const char *base_url; /**< @brief Given to wallhaven_base_url for the refill calls, like a replay stand-in (NULL for wallhaven.cc) */
+} PoolOptions;
+
+/**
+ * @brief Wallpaper taken from a WallhavenPool
+ *
+ */
+typedef struct
+{
+    char id[16]; /**< @brief Id of the wallpaper */
+    char *json;  /**< @brief JSON object of the wallpaper as in the search response, free with free */
+    size_t size; /**< @brief Length of json */
+} PooledWallpaper;
+
+/**
+ * @brief Random search results kept ready so that taking one needs no call
+ *
+ * A background thread with its own WallhavenAPI fills the pool when it goes below low_watermark,
+ * reading the pages of a RANDOM search with one seed (so that the results don't repeat) till the pool is full,
+ * then going on from the next page at the next refill. A new seed is taken after max_pages or the last page.
+ *
+ */
+typedef struct WallhavenPool
+{
+    Parameters parameters;     /**< @brief Copy of the search, sorting, seed and page are set by the pool */
+    PoolOptions options;       /**< @brief Options */
+    PooledWallpaper *ring;     /**< @brief Wallpapers, capacity of them */
+    size_t head;               /**< @brief Index of the next wallpaper to take */
+    size_t count;              /**< @brief Wallpapers in the pool */
+    struct PoolRefill *refill; /**< @brief The background thread */
+    size_t pops;               /**< @brief Wallpapers taken */
+    size_t misses;             /**< @brief Takes which found the pool empty */
+    size_t calls;              /**< @brief Search calls made by the refills */
+    size_t fetched;            /**< @brief Wallpapers added */
+    size_t failed;             /**< @brief Refill calls which failed */
+} WallhavenPool;
+
+/**
+ * @brief Create a WallhavenPool and start filling it
+ *
+ * @param p Parameters of the search (copied, the Query and the strings must stay valid while the pool is used)
+ * @param o Options (NULL for the defaults, 0 in a field for its default)
+ * @return Pointer to WallhavenPool, NULL on failure
+ */
+WallhavenPool *wallhaven_pool_init(const Parameters *p, const PoolOptions *o);
+
+/**
+ * @brief Stop the refill and free the WallhavenPool with the wallpapers in it
+ *
+ * @param pool Pointer to WallhavenPool
+ */
+void wallhaven_pool_free(WallhavenPool *pool);
+
+/**
+ * @brief Take a random wallpaper
+ *
+ * Can be called from any number of threads.
+ *
+ * @param pool Pointer to WallhavenPool
+ * @param out Filled with the wallpaper, free out->json
+ * @param timeout_ms How long to wait for a refill if the pool is empty (0 to not wait)
+ * @return true if a wallpaper was taken
+ */
+bool wallhaven_pool_pop(WallhavenPool *pool, PooledWallpaper *out, long timeout_ms);
+
+/**
+ * @brief Number of wallpapers in the pool
+ *
+ * @param pool Pointer to WallhavenPool
+ */
+size_t wallhaven_pool_size(WallhavenPool *pool);
+
+// View history
+
+/**
+ * @brief One sample of the views and favorites of a wallpaper
+ *
+ */
+typedef struct
+{
+    int64_t time;      /**< @brief When the sample was taken (seconds, like time()) */
+    int64_t views;     /**< @brief Number of views */
+    int64_t favorites; /**< @brief Number of favorites */
+} HistorySample;
+
+/**
+ * @brief Which count wallhaven_history_top ranks by
+ *
+ */
+typedef enum
+{
+    HISTORY_VIEWS,    /**< Growth of the views */
+    HISTORY_FAVORITES /**< Growth of the favorites */
+} HistoryField;
+
+/**
+ * @brief Growth of a wallpaper over a window, result of wallhaven_history_top
+ *
+ */
+typedef struct
+{
+    char id[16];    /**< @brief Id of the wallpaper */
+    int64_t from;   /**< @brief Count at the start of the window */
+    int64_t to;     /**< @brief Count at the end of the window */
+    int64_t growth; /**< @brief to - from */
+} HistoryGrowth;
+
+/**
+ * @brief Append only store of the views and favorites of wallpapers over time
+ *
+ * Only the counts are kept instead of the whole JSON. The file is a log of records: a wallpaper id is written once
+ * and given a number, a time is written when it changes, and each sample is the number of the wallpaper and the change
+ * of its counts since its last sample as zigzag varints, so a daily sample usually takes 4 to 6 bytes.
+ * The log is read into memory by wallhaven_history_open, where each wallpaper keeps its samples delta encoded the same way,
+ * so scans decode only the wallpapers they look at. A record cut short by a crash is dropped on open.
+ * Use the wallhaven_history_open to get the pointer to this struct.
+ *
+ * @note Not supposed to used directly.
+ * @note Not thread safe
+ * @note Not available on Windows
+ *
+ */
+typedef struct WallhavenHistory
+{
+    FILE *file;                   /**< @brief Log being appended to */
+    struct HistorySeries *series; /**< @brief Samples of each wallpaper, in the order they were first seen */
+    size_t count;                 /**< @brief Number of wallpapers */
+    size_t capacity;              /**< @brief Used for internal logic */
+    uint32_t *table;              /**< @brief Id -> index of series + 1, open addressing */
+    size_t table_size;            /**< @brief Used for internal logic */
+    int64_t time;                 /**< @brief Time of the samples being written */
+    size_t samples;               /**< @brief Number of samples stored */
+    size_t stale;                 /**< @brief Samples not stored for being older than the last sample of the wallpaper */
+    size_t bytes;                 /**< @brief Size of the log */
+} WallhavenHistory;
+
+/**
+ * @brief Open the history, creating the file if it doesn't exist
+ *
+ * @param path Path of the log
+ * @return Returns pointer to the WallhavenHistory if successful else returns NULL
+ */
+WallhavenHistory *wallhaven_history_open(const char *path);
+
+/**
+ * @brief Write what is buffered, close the log and free the WallhavenHistory
+ *
+ * @param h Pointer to the WallhavenHistory
+ */
+void wallhaven_history_close(WallhavenHistory *h);
+
+/**
+ * @brief Write what is buffered to the log
+ *
+ * @param h Pointer to the WallhavenHistory
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_history_flush(WallhavenHistory *h);
+
+/**
+ * @brief Add a sample of a wallpaper
+ *
+ * Samples of a wallpaper have to come in the order of time, older ones are counted in stale and not stored.
+ *
+ * @param h Pointer to the WallhavenHistory
+ * @param id Id of the wallpaper (at most 15 characters)
+ * @param sample The sample
+ * @return WALLHAVEN_OK on success, WALLHAVEN_IO_FAIL if the id is too long or writing failed
+ */
+WallhavenCode wallhaven_history_add(WallhavenHistory *h, const char *id, const HistorySample *sample);
+
+/**
+ * @brief Add a sample of every wallpaper of a search page (or the wallpapers of a collection) and flush
+ *
+ * @param h Pointer to the WallhavenHistory
+ * @param page Parsed response
+ * @param time Time of the samples
+ * @param added Set to the number of samples stored (can be NULL)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_history_ingest(WallhavenHistory *h, const WallhavenJson *page, int64_t time, size_t *added);
+
+/**
+ * @brief Get the samples of a wallpaper taken in [from, to]
+ *
+ * @param h Pointer to the WallhavenHistory
+ * @param id Id of the wallpaper
+ * @param from Start of the range
+ * @param to End of the range (inclusive)
+ * @param out Filled with the samples, oldest first
+ * @param max Size of out
+ * @return Number of samples in the range, more than max if out was too small
+ */
+size_t wallhaven_history_range(const WallhavenHistory *h, const char *id, int64_t from, int64_t to, HistorySample *out, size_t max);
+
+/**
+ * @brief Find the wallpapers whose count grew the most in the window [from, to]
+ *
+ * The growth is the count of the last sample at or before to minus the count of the last sample at or before from
+ * (or the first sample in the window when there is none before it). Wallpapers with no sample in the window are left out.
+ *
+ * @param h Pointer to the WallhavenHistory
+ * @param field Count to rank by
+ * @param from Start of the window
+ * @param to End of the window
+ * @param out Filled with the wallpapers, biggest growth first
+ * @param k Size of out
+ * @return Number of wallpapers written to out
+ */
+size_t wallhaven_history_top(const WallhavenHistory *h, HistoryField field, int64_t from, int64_t to, HistoryGrowth *out, size_t k);
+
+// Bandwidth
+
+/**
+ * @brief Classes of the traffic shaped by a WallhavenBandwidth
+ *
+ */
+typedef enum
+{
+    TRAFFIC_API,      /**< API calls made with wallhaven_get_result (and the functions using it) */
+    TRAFFIC_DOWNLOAD, /**< Files downloaded with wallhaven_download */
+    TRAFFIC_CLASSES   /**< Number of classes, not a class */
+} TrafficClass;
+
+/**
+ * @brief Caps of a WallhavenBandwidth, 0 in a field for its default
+ *
+ */
+typedef struct
+{
+    double bytes_per_second;                        /**< @brief Cap of all the traffic together (default no cap) */
+    double class_bytes_per_second[TRAFFIC_CLASSES]; /**< @brief Cap of each class (default no cap) */
+    double burst_seconds;                           /**< @brief Traffic saved up when idle, in seconds of the cap (default 0.25) */
+    int api_hold_ms;                                /**< @brief Longest a download is held back while API calls are in flight (default 250) */
+} BandwidthOptions;
+
+/**
+ * @brief Byte rate caps shared by any number of WallhavenAPIs, on any number of threads
+ *
+ * The received bytes are counted from the progress callback of curl, which sleeps when the transfer is ahead of the caps.
+ * Not reading makes the TCP window close, so the sender slows down and the link is left to the other transfers.
+ * Each transfer is also capped by CURLOPT_MAX_RECV_SPEED_LARGE to the cap of its class.
+ *
+ * API calls get priority over downloads: they are counted against the overall cap but never wait for it, so the
+ * downloads make up for them, and downloads stop reading while API calls are in flight (for at most api_hold_ms at a time).
+ * Set the caps a bit below the capacity of the link so that there is room left for the API calls to go through.
+ *
+ * @note Hedged duplicate transfers (look at RetryPolicy) are not paced
+ * @note Not available on Windows
+ *
+ */
+typedef struct WallhavenBandwidth
+{
+    BandwidthOptions options;              /**< @brief Caps */
+    struct BandwidthState *state;          /**< @brief Used for internal logic */
+    size_t bytes[TRAFFIC_CLASSES];         /**< @brief Bytes received by each class */
+    double paced_seconds[TRAFFIC_CLASSES]; /**< @brief Time each class slept to stay under the caps */
+    size_t api_holds;                      /**< @brief Times a download was held back for API calls */
+} WallhavenBandwidth;
+
+/**
+ * @brief Create a WallhavenBandwidth
+ *
+ * @param o Caps (copied)
+ * @return Pointer to WallhavenBandwidth, NULL on failure
+ */
+WallhavenBandwidth *wallhaven_bandwidth_init(const BandwidthOptions *o);
+
+/**
+ * @brief Free the WallhavenBandwidth, no WallhavenAPI should be using it
+ *
+ * @param bw Pointer to WallhavenBandwidth
+ */
+void wallhaven_bandwidth_free(WallhavenBandwidth *bw);
+
+/**
+ * @brief Pace the transfers of wa
+ *
+ * @param wa Pointer to the WallhavenAPI
+ * @param bw Pointer to WallhavenBandwidth (NULL to stop pacing)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_set_bandwidth(WallhavenAPI *wa, WallhavenBandwidth *bw);
+
+/**
+ * @brief Type of function called when a download of a WallhavenDownloads is done
+ *
+ * @param url URL of the download
+ * @param path Where it was written
+ * @param code Result of the download
+ * @param userdata The userdata given in DownloadsOptions
+ */
+typedef void (*onDownloadDone)(const char *url, const char *path, WallhavenCode code, void *userdata);
+
+/**
+ * @brief Options of a WallhavenDownloads
+ *
+ */
+typedef struct
+{
+    int workers;                   /**< @brief Downloads made at the same time (default 4) */
+    WallhavenBandwidth *bandwidth; /**< @brief Caps the downloads are paced by (can be NULL) */
+    onDownloadDone done;           /**< @brief Called from the workers when a download is done (can be NULL) */
+    void *userdata;                /**< @brief Passed to done */
+} DownloadsOptions;
+
+/**
+ * @brief Queue of downloads made by a few workers, smallest file first
+ *
+ * Taking the smallest known file_size first finishes the most files in a given time and keeps a few big
+ * originals from holding up everything behind them. Downloads of the same size go in the order they were added.
+ *
+ * @note Not available on Windows
+ *
+ */
+typedef struct WallhavenDownloads
+{
+    DownloadsOptions options;     /**< @brief Options */
+    struct DownloadsState *state; /**< @brief Used for internal logic */
+    size_t done;                  /**< @brief Downloads done */
+    size_t failed;                /**< @brief Downloads which failed */
+    size_t bytes;                 /**< @brief Bytes written */
+} WallhavenDownloads;
+
+/**
+ * @brief Start the workers of a WallhavenDownloads
+ *
+ * @param o Options (NULL for the defaults)
+ * @return Pointer to WallhavenDownloads, NULL on failure
+ */
+WallhavenDownloads *wallhaven_downloads_init(const DownloadsOptions *o);
+
+/**
+ * @brief Wait for the queued downloads and free the WallhavenDownloads
+ *
+ * @param d Pointer to WallhavenDownloads
+ */
+void wallhaven_downloads_free(WallhavenDownloads *d);
+
+/**
+ * @brief Queue a download
+ *
+ * @param d Pointer to WallhavenDownloads
+ * @param url URL of the file (copied)
+ * @param file_size Size of the file if known (like file_size of the wallpaper), -1 if not (downloaded last)
+ * @param path Where to write the file (copied)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_downloads_add(WallhavenDownloads *d, const char *url, int64_t file_size, const char *path);
+
+/**
+ * @brief Queue the original of every wallpaper of a search page (or the wallpapers of a collection)
+ *
+ * @param d Pointer to WallhavenDownloads
+ * @param page Response of the search
+ * @param dir Directory the files are written to, named like the end of their path
+ * @param added Set to the number of downloads queued (can be NULL)
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_downloads_add_page(WallhavenDownloads *d, const Response *page, const char *dir, size_t *added);
+
+/**
+ * @brief Wait till every queued download is done
+ *
+ * @param d Pointer to WallhavenDownloads
+ */
+void wallhaven_downloads_wait(WallhavenDownloads *d);
+
+// Query planner
+
+/**
+ * @brief What a PlanNode is
+ *
+ */
+typedef enum
+{
+    PLAN_SEARCH, /**< A search, leaf of the query */
+    PLAN_ANY,    /**< Wallpapers found by any of the children (union) */
+    PLAN_ALL     /**< Wallpapers found by all of the children (intersection) */
+} PlanOp;
+
+/**
+ * @brief Node of a compound query
+ *
+ */
+typedef struct PlanNode
+{
+    PlanOp op;                  /**< @brief What the node is */
+    Parameters *parameters;     /**< @brief Search of a PLAN_SEARCH node, page is not used */
+    int pages;                  /**< @brief Pages of the search to read from the first (0 for 1) */
+    struct PlanNode **children; /**< @brief Terms of a PLAN_ANY or PLAN_ALL node */
+    size_t count;               /**< @brief Number of children */
+} PlanNode;
+
+/**
+ * @brief Options of wallhaven_plan_run
+ *
+ */
+typedef struct
+{
+    Sorting sorting; /**< @brief DATE_ADDED, VIEWS or FAVORITES sort by that field, anything else interleaves the results of the searches by rank */
+    Order order;     /**< @brief Order of the sort (0 for DESCENDING) */
+    int concurrency; /**< @brief Pages fetched at the same time (0 for 4) */
+    size_t limit;    /**< @brief Most wallpapers returned (0 for all) */
+} PlanOptions;
+
+/**
+ * @brief Wallpaper in the result of wallhaven_plan_run
+ *
+ */
+typedef struct
+{
+    char id[16];         /**< @brief Id of the wallpaper */
+    char *json;          /**< @brief JSON object of the wallpaper as in the search response */
+    size_t size;         /**< @brief Length of json */
+    long views;          /**< @brief Number of views */
+    long favorites;      /**< @brief Number of favorites */
+    char created_at[20]; /**< @brief Upload time */
+} PlannedWallpaper;
+
+/**
+ * @brief Result of wallhaven_plan_run, free with wallhaven_plan_result_free
+ *
+ */
+typedef struct
+{
+    PlannedWallpaper *wallpapers; /**< @brief Wallpapers of the query in the order asked for */
+    size_t count;                 /**< @brief Number of wallpapers */
+    size_t searches;              /**< @brief PLAN_SEARCH nodes in the query */
+    size_t folded;                /**< @brief Searches joined into another by combining +tag / -tag terms */
+    size_t shared;                /**< @brief Searches which were the same as another one */
+    size_t cache_hits;            /**< @brief Pages answered from the cache of wa */
+    size_t fetched;               /**< @brief Pages fetched */
+    size_t duplicates;            /**< @brief Wallpapers found again by another search or page */
+} PlanResult;
+
+/**
+ * @brief Run a compound query with as few search calls as possible
+ *
+ * The server takes one Query per search, so unions and intersections are done here:
+ * - An intersection of searches which differ only in tags made of +tag / -tag terms is one search with the tags joined
+ * - Searches with the same URL are made once, reading the most pages any of them asks for
+ * - Pages in the cache of wa (look at wallhaven_set_cache) are not fetched, fetched pages are added to it
+ * - Pages are fetched concurrently, pages after the first only up to the last_page the first one told
+ *
+ * Results are merged by wallpaper id. Intersections are of the pages read, not of the whole search results,
+ * so read enough pages or use +tag terms that can be joined.
+ *
+ * @note Calls count towards the API call limit, use a shared rate limit (wallhaven_shared_limit_attach) or a small concurrency
+ *
+ * @param wa Pointer to the WallhavenAPI (api key, base URL, cache, shared limit and retry policy are used)
+ * @param query Root of the query
+ * @param o Options (NULL for the defaults)
+ * @param result Filled with the result
+ * @return WALLHAVEN_OK on success
+ */
+WallhavenCode wallhaven_plan_run(WallhavenAPI *wa, const PlanNode *query, const PlanOptions *o, PlanResult *result);
+
+/**
+ * @brief Free the wallpapers of a PlanResult
+ *
+ * @param result Result of wallhaven_plan_run
+ */
+void wallhaven_plan_result_free(PlanResult *result);
+
+// Streaming
+
+/**
+ * @brief Options of wallhaven_streams_init, fields left 0 take the default
+ *
+ */
+typedef struct
+{
+    size_t buffer_size;   /**< @brief Bytes held for one transfer before it is paused (default 64 KiB) */
+    size_t memory_budget; /**< @brief Bytes held for all the transfers together before they are paused (default 1 MiB) */
+    int concurrency;      /**< @brief Transfers receiving at the same time, the others wait for their turn (default 8). Paused transfers don't count, so the streams can be read in any order */
+} StreamOptions;
+
+/**
+ * @brief Transfers read as they arrive, with the memory they hold bounded whatever the speed of the readers
+ *
+ * A thread runs the transfers on one multi handle. The received data is held till it is read with wallhaven_stream_read,
+ * and a transfer is paused (CURL_WRITEFUNC_PAUSE) when its buffer is full or when the buffers of all the transfers together
+ * are over the memory budget. Not reading makes the TCP window close, so the server waits instead of us buffering.
+ * A paused transfer is resumed once its buffer is drained to half and the budget is used to at most three quarters.
+ *
+ * A transfer with nothing held can always take the next piece curl has for it (at most CURL_MAX_WRITE_SIZE),
+ * and a transfer paused for its reader gives its slot to the next one waiting, so the stream being read never waits
+ * for streams nobody reads. The memory held is at most memory_budget + CURL_MAX_WRITE_SIZE for each started stream,
+ * and as many connections are open as streams are paused plus concurrency.
+ *
+ * @note Each stream is to be read from one thread, different streams can be read from different threads
+ * @note The calls are not counted against the limits of any WallhavenAPI, get the URLs with wallhaven_search_url or
+ * wallhaven_call_url
+ * @note Not available on Windows
+ *
+ */
+typedef struct WallhavenStreams
+{
+    StreamOptions options;      /**< @brief Options */
+    struct StreamsState *state; /**< @brief Used for internal logic */
+    size_t buffered;            /**< @brief Bytes held now */
+    size_t peak;                /**< @brief Most bytes held at once */
+    size_t pauses;              /**< @brief Times a transfer was paused */
+    size_t budget_pauses;       /**< @brief Times a transfer was paused because of the memory budget, not its own buffer */
+    size_t bytes;               /**< @brief Bytes read */
+} WallhavenStreams;
+
+/**
+ * @brief A transfer of a WallhavenStreams
+ *
+ */
+typedef struct WallhavenStream WallhavenStream;
+
+/**
+ * @brief Start the thread of a WallhavenStreams
+ *
+ * @param o Options (NULL for the defaults)
+ * @return Pointer to WallhavenStreams, NULL on failure (always NULL on Windows)
+ */
+WallhavenStreams *wallhaven_streams_init(const StreamOptions *o);
+
+/**
+ * @brief Stop the thread and free the WallhavenStreams
+ *
+ * Every stream has to be closed with wallhaven_stream_close first, if one is still open nothing is freed.
+ *
+ * @param s Pointer to WallhavenStreams
+ * @return true if freed, false if a stream is still open
+ */
+bool wallhaven_streams_free(WallhavenStreams *s);
+
+/**
+ * @brief Start a transfer
+ *
+ * @param s Pointer to WallhavenStreams
+ * @param url URL to get (copied)
+ * @return Pointer to WallhavenStream, NULL on failure
+ */
+WallhavenStream *wallhaven_stream_open(WallhavenStreams *s, const char *url);
+
+/**
+ * @brief Read the data received so far, waiting for some if there is none yet
+ *
+ * @param st Pointer to WallhavenStream
+ * @param buffer Where to put the data
+ * @param size Size of buffer
+ * @return Bytes read, 0 once the transfer is over
+ */
+size_t wallhaven_stream_read(WallhavenStream *st, void *buffer, size_t size);
+
+/**
+ * @brief Close a stream, stopping the transfer if it is not over
+ *
+ * @param st Pointer to WallhavenStream, freed
+ * @param status Set to the HTTP status (can be NULL)
+ * @return WALLHAVEN_OK if the transfer was over and got 200, WALLHAVEN_CURL_FAIL if it was stopped or failed
+ */
+WallhavenCode wallhaven_stream_close(WallhavenStream *st, long *status);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
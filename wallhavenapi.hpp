@@ -0,0 +1,635 @@
+/**
+ * @file wallhavenapi.hpp
+ * @author kshku
+ * @brief C++20 coroutine layer over the WallhavenAPI C implementation
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright MIT License
+
+Copyright (c) 2024 K Shreekrishna Upadhyaya
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ *
+ */
+
+#ifndef WALLHAVEN_API_HPP
+#define WALLHAVEN_API_HPP
+
+#include "wallhavenapi.h"
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace wallhaven
+{
+
+/**
+ * @brief Owns a Response, the value is freed when destroyed
+ *
+ */
+class Response
+{
+public:
+    Response() = default;
+    Response(const Response &) = delete;
+    Response &operator=(const Response &) = delete;
+    Response(Response &&o) noexcept : r(std::exchange(o.r, ::Response{})) {}
+    Response &operator=(Response &&o) noexcept
+    {
+        std::swap(r, o.r);
+        return *this;
+    }
+    ~Response() { std::free(r.value); }
+
+    /**
+     * @brief Body of the response
+     *
+     */
+    std::string_view view() const { return r.value ? std::string_view(r.value, r.size) : std::string_view(); }
+
+    /**
+     * @brief The C Response, to pass to the C functions (wallhaven_json_parse, wallhaven_prefetch, ...)
+     *
+     */
+    ::Response *get() { return &r; }
+    const ::Response *get() const { return &r; }
+
+    // Same growth as write_function of wallhavenapi.c, the value stays freeable with free
+    static size_t write(char *data, size_t size, size_t nmemb, void *userdata)
+    {
+        ::Response *r = static_cast<::Response *>(userdata);
+        size_t realsize = size * nmemb;
+        char *ptr = static_cast<char *>(std::realloc(r->value, r->size + realsize + 1));
+        if (!ptr)
+            return 0;
+
+        r->value = ptr;
+        std::memcpy(r->value + r->size, data, realsize);
+        r->size += realsize;
+        r->value[r->size] = 0;
+        return realsize;
+    }
+
+private:
+    ::Response r{};
+};
+
+/**
+ * @brief Owns a WallhavenAPI, freed when destroyed
+ *
+ */
+class Api
+{
+public:
+    /**
+     * @brief Create the WallhavenAPI
+     *
+     * @param apikey API key (can be nullptr), must outlive the Api like with wallhaven_apikey
+     */
+    explicit Api(const char *apikey = nullptr) : wa(wallhaven_init())
+    {
+        if (wa && apikey)
+            wallhaven_apikey(wa, apikey);
+    }
+    Api(const Api &) = delete;
+    Api &operator=(const Api &) = delete;
+    Api(Api &&o) noexcept : wa(std::exchange(o.wa, nullptr)) {}
+    Api &operator=(Api &&o) noexcept
+    {
+        std::swap(wa, o.wa);
+        return *this;
+    }
+    ~Api()
+    {
+        if (wa)
+            wallhaven_free(wa);
+    }
+
+    explicit operator bool() const { return wa != nullptr; }
+
+    /**
+     * @brief The C WallhavenAPI, to use the blocking C functions
+     *
+     */
+    WallhavenAPI *get() const { return wa; }
+
+private:
+    WallhavenAPI *wa;
+};
+
+/**
+ * @brief Result of an awaited call
+ *
+ */
+struct Result
+{
+    WallhavenCode code = WALLHAVEN_OK; /**< @brief Like what the C function would return */
+    long status = 0;                   /**< @brief HTTP status code, 0 if no response */
+    Response body;                     /**< @brief Body of the response */
+
+    explicit operator bool() const { return code == WALLHAVEN_OK && status / 100 == 2; }
+};
+
+template <typename T = void>
+class Task;
+
+namespace detail
+{
+
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+    bool detached = false;
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            PromiseBase &p = h.promise();
+            if (!p.detached)
+                return p.continuation;
+
+            // Nobody is there to see the exception of a spawned task, like an exception leaving a std::thread
+            if (p.error)
+                std::terminate();
+            h.destroy();
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase
+{
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T take()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+    void take()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+} // namespace detail
+
+/**
+ * @brief Lazy coroutine, starts when awaited or spawned on an Executor
+ *
+ */
+template <typename T>
+class [[nodiscard]] Task
+{
+public:
+    using promise_type = detail::Promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit Task(handle_type h) : h(h) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    Task(Task &&o) noexcept : h(std::exchange(o.h, nullptr)) {}
+    Task &operator=(Task &&o) noexcept
+    {
+        std::swap(h, o.h);
+        return *this;
+    }
+    ~Task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        h.promise().continuation = awaiting;
+        return h;
+    }
+
+    T await_resume() { return h.promise().take(); }
+
+    // Give up the ownership, used by Executor::spawn
+    handle_type release() { return std::exchange(h, nullptr); }
+
+private:
+    handle_type h;
+};
+
+namespace detail
+{
+
+template <typename T>
+Task<T> Promise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/**
+ * @brief Runs the transfers of the awaited calls on one curl multi handle
+ *
+ * Coroutines spawned on the executor and the calls they await all run on the thread calling run.
+ * API calls are started as the rate limit allows (a RateBudget of calls_per_minute as set up by wallhaven_budget_init, and a slot of the
+ * shared limit of the Api if it has one), downloads are started right away. At most max_transfers transfers are in flight at a time.
+ * API calls follow the retry policy and circuit breaker of their Api (a 429 is retried after Retry-After or the minute window)
+ * and info calls are answered from the cache of the Api when it has one.
+ *
+ * @note Like the C functions the executor isn't thread safe, keep it on one thread
+ *
+ */
+class Executor
+{
+public:
+    class Transfer;
+
+    /**
+     * @brief Create the executor
+     *
+     * @param calls_per_minute API calls allowed per minute (WALLHAVEN_CALLS_PER_MINUTE of wallhaven)
+     * @param max_transfers Transfers in flight at most
+     */
+    explicit Executor(int calls_per_minute = WALLHAVEN_CALLS_PER_MINUTE, int max_transfers = 256)
+        : multi(curl_multi_init()), max_transfers(max_transfers)
+    {
+        wallhaven_budget_init(&budget, calls_per_minute);
+        if (multi)
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+    ~Executor()
+    {
+        for (Transfer *t : active)
+        {
+            curl_multi_remove_handle(multi, t->curl);
+            curl_easy_cleanup(t->curl);
+            t->curl = nullptr;
+        }
+        if (multi)
+            curl_multi_cleanup(multi);
+    }
+
+    /**
+     * @brief Awaitable transfer, resumes the awaiting coroutine with the Result
+     *
+     */
+    class Transfer
+    {
+    public:
+        Transfer(Executor &ex, std::string url, WallhavenAPI *wa, Path path = SEARCH, const char *id = nullptr)
+            : ex(ex), url(std::move(url)), wa(wa), path(path), id(id ? id : "")
+        {
+            if (this->url.empty())
+            {
+                result.code = WALLHAVEN_CURL_FAIL;
+                done = true;
+            }
+            else if (wa && id && wallhaven_cache_get(wa, path, id, result.body.get()))
+            {
+                result.status = 200;
+                done = true;
+            }
+        }
+        Transfer(const Transfer &) = delete;
+        Transfer &operator=(const Transfer &) = delete;
+
+        bool await_ready() const noexcept { return done; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            waiting = h;
+            ex.enqueue(this);
+        }
+
+        Result await_resume() { return std::move(result); }
+
+    private:
+        friend class Executor;
+
+        Executor &ex;
+        std::string url;
+        WallhavenAPI *wa; // Whose limits, retry policy and cache an API call goes by, nullptr for downloads
+        Path path;
+        std::string id;
+        bool done = false;
+        int attempt = 0;
+        double retry_at = 0;
+        CURL *curl = nullptr;
+        Result result;
+        std::coroutine_handle<> waiting;
+    };
+
+    /**
+     * @brief Search, like wallhaven_search
+     *
+     */
+    Transfer search(Api &api, Parameters &p) { return Transfer(*this, take(wallhaven_search_url(api.get(), &p)), api.get()); }
+
+    /**
+     * @brief Get wallpaper information, like wallhaven_wallpaper_info
+     *
+     */
+    Transfer info(Api &api, const char *id)
+    {
+        return Transfer(*this, take(wallhaven_call_url(api.get(), WALLPAPER_INFO, id)), api.get(), WALLPAPER_INFO, id);
+    }
+
+    /**
+     * @brief Get tag information, like wallhaven_tag_info
+     *
+     */
+    Transfer tag(Api &api, const char *id) { return Transfer(*this, take(wallhaven_call_url(api.get(), TAG_INFO, id)), api.get(), TAG_INFO, id); }
+
+    /**
+     * @brief Get the collections of a user, like wallhaven_collections_of (nullptr for your own collections)
+     *
+     */
+    Transfer collections(Api &api, const char *user_name = nullptr)
+    {
+        return Transfer(*this, take(wallhaven_call_url(api.get(), COLLECTIONS, user_name)), api.get());
+    }
+
+    /**
+     * @brief Download a file, like wallhaven_download (doesn't count towards the API call limit)
+     *
+     */
+    Transfer download(const char *url) { return Transfer(*this, url ? url : "", nullptr); }
+
+    /**
+     * @brief Start a coroutine, the executor owns it from now on
+     *
+     * @note An exception leaving a spawned coroutine calls std::terminate
+     *
+     */
+    void spawn(Task<void> task)
+    {
+        auto h = task.release();
+        h.promise().detached = true;
+        ready.push_back(h);
+    }
+
+    /**
+     * @brief Run till every spawned coroutine has finished
+     *
+     */
+    void run()
+    {
+        while (!ready.empty() || !waiting_api.empty() || !retrying.empty() || running)
+        {
+            while (!ready.empty())
+            {
+                auto h = ready.front();
+                ready.pop_front();
+                h.resume();
+            }
+
+            start_transfers();
+            if (!running)
+            {
+                if (ready.empty())
+                    curl_multi_poll(multi, nullptr, 0, ms_to_wake(), nullptr);
+                continue;
+            }
+
+            int still_running;
+            curl_multi_perform(multi, &still_running);
+            finish_transfers();
+            if (ready.empty())
+                curl_multi_poll(multi, nullptr, 0, ms_to_wake(), nullptr);
+        }
+    }
+
+    /**
+     * @brief Number of transfers in flight
+     *
+     */
+    int in_flight() const { return running; }
+
+private:
+    // URL from wallhaven_call_url or wallhaven_search_url, empty on failure
+    static std::string take(char *url)
+    {
+        if (!url)
+            return {};
+        std::string s(url);
+        curl_free(url);
+        return s;
+    }
+
+    void enqueue(Transfer *t)
+    {
+        if (t->wa)
+            waiting_api.push_back(t);
+        else
+            waiting_downloads.push_back(t);
+    }
+
+    // Time to sleep at most, till the budget has a call or a retry is due
+    int ms_to_wake()
+    {
+        int ms = 1000;
+        if (!waiting_api.empty())
+        {
+            double wait = wallhaven_budget_wait(&budget);
+            ms = wait == 0 ? shared_wait_ms : static_cast<int>(wait * 1000) + 1;
+        }
+        double t = now();
+        for (Transfer *r : retrying)
+            ms = std::min(ms, std::max(0, static_cast<int>((r->retry_at - t) * 1000) + 1));
+        return ms;
+    }
+
+    static double now()
+    {
+        timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    void start_transfers()
+    {
+        // Retries which are due go first
+        double t = now();
+        for (auto it = retrying.begin(); it != retrying.end();)
+        {
+            if ((*it)->retry_at > t)
+            {
+                ++it;
+                continue;
+            }
+            waiting_api.push_front(*it);
+            it = retrying.erase(it);
+        }
+
+        while (running < max_transfers && !waiting_downloads.empty())
+        {
+            start(waiting_downloads.front());
+            waiting_downloads.pop_front();
+        }
+        while (running < max_transfers && !waiting_api.empty() && wallhaven_budget_wait(&budget) == 0)
+        {
+            Transfer *next = waiting_api.front();
+            WallhavenCode wc = wallhaven_call_acquire(next->wa);
+            if (wc == WALLHAVEN_TOO_MANY_REQUSTS_ERROR)
+                break; // Shared limit has no slot free, try again in a bit
+
+            waiting_api.pop_front();
+            if (wc != WALLHAVEN_OK)
+            {
+                next->result.code = wc;
+                ready.push_back(next->waiting);
+                continue;
+            }
+            wallhaven_budget_take(&budget);
+            start(next);
+        }
+    }
+
+    void start(Transfer *t)
+    {
+        if (!(t->curl = curl_easy_init()))
+        {
+            t->result.code = WALLHAVEN_CURL_FAIL;
+            ready.push_back(t->waiting);
+            return;
+        }
+
+        curl_easy_setopt(t->curl, CURLOPT_URL, t->url.c_str());
+        curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, &Response::write);
+        curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, static_cast<void *>(t->result.body.get()));
+        curl_easy_setopt(t->curl, CURLOPT_PRIVATE, static_cast<void *>(t));
+        curl_easy_setopt(t->curl, CURLOPT_PIPEWAIT, 1L);
+        if (!t->wa)
+            curl_easy_setopt(t->curl, CURLOPT_FOLLOWLOCATION, 1L);
+
+        if (curl_multi_add_handle(multi, t->curl) != CURLM_OK)
+        {
+            curl_easy_cleanup(t->curl);
+            t->curl = nullptr;
+            t->result.code = WALLHAVEN_CURL_FAIL;
+            ready.push_back(t->waiting);
+            return;
+        }
+        active.push_back(t);
+        ++running;
+    }
+
+    void finish_transfers()
+    {
+        CURLMsg *m;
+        int left;
+        while ((m = curl_multi_info_read(multi, &left)))
+        {
+            if (m->msg != CURLMSG_DONE)
+                continue;
+
+            Transfer *t;
+            CURLcode result = m->data.result;
+            curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char **>(&t));
+            curl_easy_getinfo(m->easy_handle, CURLINFO_RESPONSE_CODE, &t->result.status);
+
+            long retry_ms = -1;
+            if (t->wa)
+                t->result.code = wallhaven_call_finish(t->wa, t->curl, result, t->attempt, &retry_ms);
+            // Same mapping as the C functions
+            else if (result != CURLE_OK || t->result.status >= 500)
+                t->result.code = WALLHAVEN_CURL_FAIL;
+            else if (t->result.status == 429)
+                t->result.code = WALLHAVEN_TOO_MANY_REQUSTS_ERROR;
+            else if (t->result.status == 401)
+                t->result.code = WALLHAVEN_UNAUTHORIZED_ERROR;
+
+            curl_multi_remove_handle(multi, t->curl);
+            curl_easy_cleanup(t->curl);
+            t->curl = nullptr;
+            active.erase(std::find(active.begin(), active.end(), t));
+            --running;
+
+            if (retry_ms >= 0)
+            {
+                // Made again once it's due, the body of this attempt is dropped
+                t->result = Result{};
+                ++t->attempt;
+                t->retry_at = now() + retry_ms / 1000.0;
+                retrying.push_back(t);
+                continue;
+            }
+            if (t->wa && t->result.code == WALLHAVEN_OK && t->result.status == 200 && !t->id.empty())
+                wallhaven_cache_put(t->wa, t->path, t->id.c_str(), t->result.body.get());
+            ready.push_back(t->waiting);
+        }
+    }
+
+    static constexpr int shared_wait_ms = 50; // Time to wait for a slot of the shared limit
+
+    CURLM *multi;
+    RateBudget budget;
+    int max_transfers;
+    int running = 0;
+    std::deque<std::coroutine_handle<>> ready;
+    std::deque<Transfer *> waiting_api, waiting_downloads;
+    std::vector<Transfer *> retrying, active;
+};
+
+} // namespace wallhaven
+
+#endif